@@ -13,13 +13,6 @@ GiB = 2**30
 CLEANUP_TASKS = []
 
 
-def reset_database(db_dir: str, temp_db_dir: str):
-    # rsync -avpl --delete /mydata/leveldb_db_orig/ /mydata/leveldb_db/
-    if not db_dir.endswith("/"):
-        db_dir += "/"
-    run(["rsync", "-avpl", "--delete", db_dir, temp_db_dir])
-
-
 def parse_leveldb_bench_results(stdout: str) -> Dict:
     # Uniform: calculating overall performance metrics... (might take a while)
     # Uniform overall: UPDATE throughput 0.00 ops/sec, INSERT throughput 0.00 ops/sec, READ throughput 9038.24 ops/sec, SCAN throughput 0.00 ops/sec, READ_MODIFY_WRITE throughput 0.00 ops/sec, total throughput 9038.24 ops/sec
@@ -128,6 +121,7 @@ class LevelDBBenchmark(BenchmarkFramework):
             default=None,
             help="Specify the temporary directory for LevelDB benchmarking. Default is <leveldb-db>_temp",
         )
+        add_db_reset_arguments(parser)
         parser.add_argument(
             "--policy-loader",
             type=str,
@@ -194,15 +188,16 @@ class LevelDBBenchmark(BenchmarkFramework):
         return configs
 
     def benchmark_prepare(self, config):
-        reset_database(self.args.leveldb_db, self.args.leveldb_temp_db)
-        drop_page_cache()
+        reset_database(
+            self.args.leveldb_db, self.args.leveldb_temp_db, self.args.db_reset
+        )
         disable_swap()
         disable_smt()
         if config["cgroup_name"] == DEFAULT_CACHE_EXT_CGROUP:
             recreate_cache_ext_cgroup(limit_in_bytes=config["cgroup_size"])
 
             policy_loader_name = os.path.basename(self.cache_ext_policy.loader_path)
-            if policy_loader_name == "cache_ext_s3fifo.out":
+            if policy_loader_name in ("cache_ext_s3fifo.out", "cache_ext_tinylfu.out"):
                 self.cache_ext_policy.start(cgroup_size=config["cgroup_size"])
             else:
                 self.cache_ext_policy.start()
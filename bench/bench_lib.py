@@ -1,16 +1,21 @@
 import argparse
+import ctypes
 import json
 import logging
+import mmap
 import os
+import re
 import resource
 import select
+import shutil
 import subprocess
 import sys
+import tempfile
 from abc import ABC, abstractmethod
 from contextlib import contextmanager, suppress
 from subprocess import CalledProcessError
-from time import sleep
-from typing import Dict, List, Union
+from time import monotonic, sleep
+from typing import Dict, List, Optional, Tuple, Union
 
 from ruamel.yaml import YAML
 
@@ -19,6 +24,8 @@ log = logging.getLogger(__name__)
 
 DEFAULT_CACHE_EXT_CGROUP = "cache_ext_test"
 DEFAULT_BASELINE_CGROUP = "baseline_test"
+# Seconds to wait for a loader to report on --ready_pipe
+POLICY_READY_TIMEOUT = 60
 
 
 class CacheExtPolicy:
@@ -34,37 +41,107 @@ class CacheExtPolicy:
         self.has_started = False
         self._policy_thread = None
 
-    def start(self, cgroup_size: int = 0):
-        if self.has_started:
-            raise Exception("Policy already started")
-
-        self.has_started = True
+    def _launch(self, loader_path: str, extra_args: List[str]) -> subprocess.Popen:
+        """Start a loader and wait until it reports that the policy is attached."""
         cmd = [
             "sudo",
-            self.loader_path,
+            loader_path,
             "--watch_dir",
             self.watch_dir,
             "--cgroup_path",
             self.cgroup_path,
-        ]
+        ] + extra_args
 
-        if cgroup_size:
-            cmd += ["--cgroup_size", str(cgroup_size)]
+        ready_dir = tempfile.mkdtemp(prefix="cache_ext_ready_")
+        ready_pipe = os.path.join(ready_dir, "ready")
+        os.mkfifo(ready_pipe, 0o600)
+        # Opened before the loader starts so its non-blocking open finds a reader
+        ready_fd = os.open(ready_pipe, os.O_RDONLY | os.O_NONBLOCK)
+        cmd += ["--ready_pipe", ready_pipe]
 
         log.info("Starting policy thread: %s", cmd)
-        self._policy_thread = subprocess.Popen(
-            cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE
-        )
-        sleep(10)
+        proc = subprocess.Popen(cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        try:
+            ready = self._wait_ready(proc, ready_fd)
+        finally:
+            os.close(ready_fd)
+            shutil.rmtree(ready_dir, ignore_errors=True)
 
         # For some reason, running a command with `sudo` messes up the terminal.
         # This is a workaround to fix it.
         # run(["stty", "sane"])
-        if self._policy_thread.poll() is not None:
+        if proc.poll() is not None:
             raise Exception(
                 "Policy thread exited unexpectedly: %s"
-                % self._policy_thread.stderr.read().decode("utf-8")
+                % proc.stderr.read().decode("utf-8")
             )
+        if not ready:
+            log.warning(
+                "Policy did not report readiness within %d s, continuing",
+                POLICY_READY_TIMEOUT,
+            )
+        return proc
+
+    @staticmethod
+    def _wait_ready(proc: subprocess.Popen, ready_fd: int) -> bool:
+        deadline = monotonic() + POLICY_READY_TIMEOUT
+        buf = b""
+        while monotonic() < deadline and proc.poll() is None:
+            readable, _, _ = select.select([ready_fd], [], [], 0.1)
+            if not readable:
+                continue
+            buf += os.read(ready_fd, 64)
+            if b"ready" in buf:
+                return True
+        return False
+
+    def start(
+        self,
+        cgroup_size: int = 0,
+        swappable: bool = False,
+        extra_args: Optional[List[str]] = None,
+    ):
+        """
+        Start the policy. With swappable, the loader pins its link so that a
+        later swap() can replace the policy without detaching from the cgroup.
+        extra_args are passed on to the loader, e.g. ["--mrc"].
+        """
+        if self.has_started:
+            raise Exception("Policy already started")
+
+        self.has_started = True
+        self._extra_args = []
+        if cgroup_size:
+            self._extra_args += ["--cgroup_size", str(cgroup_size)]
+        if swappable:
+            self._extra_args += ["--swappable"]
+        if extra_args:
+            self._extra_args += extra_args
+        try:
+            self._policy_thread = self._launch(self.loader_path, self._extra_args)
+        except Exception:
+            self.has_started = False
+            raise
+
+    def swap(self, loader_path: str):
+        """
+        Replace the running policy with the one loaded by loader_path while
+        keeping the page cache warm. The policy must have been started with
+        swappable=True. The outgoing loader is stopped by the incoming one.
+        """
+        if not self.has_started:
+            raise Exception("Policy not started")
+        new_thread = self._launch(loader_path, ["--swap"] + self._extra_args)
+        try:
+            out, err = self._policy_thread.communicate(timeout=POLICY_READY_TIMEOUT)
+        except subprocess.TimeoutExpired:
+            log.warning("Replaced policy did not exit, stopping it")
+            run(["sudo", "kill", "-2", str(self._policy_thread.pid)])
+            out, err = self._policy_thread.communicate()
+        log.info("Replaced policy stdout: %s", out.decode("utf-8"))
+        log.info("Replaced policy stderr: %s", err.decode("utf-8"))
+        self.loader_path = loader_path
+        self._policy_thread = new_thread
 
     def stop(self):
         if not self.has_started:
@@ -263,9 +340,29 @@ def recreate_baseline_cgroup(cgroup=DEFAULT_BASELINE_CGROUP, limit_in_bytes=2 *
     )
 
 
-def drop_page_cache():
-    run(["sudo", "sync"])
-    run(["sudo", "sh", "-c", "echo 1 > /proc/sys/vm/drop_caches"])
+def drop_page_cache(verify_dir: str = None):
+    """Drop the page cache. With verify_dir, also check that no more than
+    COLD_MAX_RESIDENT_FRACTION of the files under it is still cached, retrying
+    the drop once before giving up."""
+    for _ in range(2):
+        run(["sudo", "sync"])
+        run(["sudo", "sh", "-c", "echo 1 > /proc/sys/vm/drop_caches"])
+        if verify_dir is None:
+            return
+
+        resident, total = page_cache_residency(verify_dir)
+        log.info(
+            "Page cache after drop: %s of %s under %s resident",
+            format_bytes_str(resident),
+            format_bytes_str(total),
+            verify_dir,
+        )
+        if resident <= total * COLD_MAX_RESIDENT_FRACTION:
+            return
+    raise Exception(
+        "%s is not cold after dropping the page cache: %s of %s resident"
+        % (verify_dir, format_bytes_str(resident), format_bytes_str(total))
+    )
 
 
 def set_sysctl(key: str, value: Union[int, str]):
@@ -291,6 +388,425 @@ def rsync_folder(source_dir: str, dest_dir: str):
     run(["rsync", "-avpl", "--delete", source_dir, dest_dir])
 
 
+##################
+# Database reset #
+##################
+
+# Cached pages left behind by drop_page_cache() that still count as cold
+# (e.g. pages pinned by a leftover mapping)
+COLD_MAX_RESIDENT_FRACTION = 0.001
+
+_libc = ctypes.CDLL(None, use_errno=True)
+_libc.mmap.restype = ctypes.c_void_p
+_libc.mmap.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_size_t,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.c_long,
+]
+_libc.munmap.argtypes = [ctypes.c_void_p, ctypes.c_size_t]
+_libc.mincore.argtypes = [ctypes.c_void_p, ctypes.c_size_t, ctypes.c_char_p]
+
+_MAP_FAILED = ctypes.c_void_p(-1).value
+_MINCORE_WINDOW = 1 * GiB
+
+
+def _file_residency(path: str) -> Tuple[int, int]:
+    """Return (resident bytes, size) of a single file in the page cache."""
+    page_size = os.sysconf("SC_PAGE_SIZE")
+    fd = os.open(path, os.O_RDONLY)
+    try:
+        size = os.fstat(fd).st_size
+        resident_pages = 0
+        for off in range(0, size, _MINCORE_WINDOW):
+            length = min(_MINCORE_WINDOW, size - off)
+            addr = _libc.mmap(None, length, mmap.PROT_READ, mmap.MAP_SHARED, fd, off)
+            if addr == _MAP_FAILED:
+                raise OSError(ctypes.get_errno(), "mmap failed on %s" % path)
+            try:
+                vec = ctypes.create_string_buffer((length + page_size - 1) // page_size)
+                if _libc.mincore(addr, length, vec) != 0:
+                    raise OSError(ctypes.get_errno(), "mincore failed on %s" % path)
+                # Only the low bit is defined, the rest are reserved and zero
+                resident_pages += len(vec.raw) - vec.raw.count(0)
+            finally:
+                _libc.munmap(addr, length)
+        return min(resident_pages * page_size, size), size
+    finally:
+        os.close(fd)
+
+
+def page_cache_residency(path: str) -> Tuple[int, int]:
+    """Return (resident bytes, total bytes) of the regular files under path.
+
+    mincore() only reports page cache state for files the caller owns or may
+    write to, for others it sees just its own mapping. Those are skipped."""
+    resident = total = 0
+    skipped = 0
+    euid = os.geteuid()
+    for root, _, files in os.walk(path):
+        for name in files:
+            file_path = os.path.join(root, name)
+            st = os.lstat(file_path)
+            if not os.path.isfile(file_path) or os.path.islink(file_path):
+                continue
+            if st.st_size == 0:
+                continue
+            if euid != 0 and st.st_uid != euid and not os.access(file_path, os.W_OK):
+                skipped += 1
+                continue
+            file_resident, file_size = _file_residency(file_path)
+            resident += file_resident
+            total += file_size
+    if skipped:
+        log.warning(
+            "Could not check page cache state of %d files under %s", skipped, path
+        )
+    return resident, total
+
+
+def _unescape_mountinfo(field: str) -> str:
+    # Spaces, tabs, newlines and backslashes are octal escaped
+    return re.sub(r"\\([0-7]{3})", lambda m: chr(int(m.group(1), 8)), field)
+
+
+def _find_mount(path: str) -> Optional[Dict]:
+    """Return the /proc/self/mountinfo entry of the mount containing path."""
+    path = os.path.realpath(path)
+    best = None
+    with open("/proc/self/mountinfo", "r") as f:
+        for line in f:
+            fields = line.split()
+            sep = fields.index("-")
+            mount = {
+                "mount_point": _unescape_mountinfo(fields[4]),
+                "fstype": fields[sep + 1],
+                "source": _unescape_mountinfo(fields[sep + 2]),
+                "super_options": fields[sep + 3] if len(fields) > sep + 3 else "",
+            }
+            mp = mount["mount_point"]
+            if path != mp and not path.startswith(mp.rstrip("/") + "/"):
+                continue
+            # Later entries shadow earlier ones on the same mount point
+            if best is None or len(mp) >= len(best["mount_point"]):
+                best = mount
+    return best
+
+
+def _mount_options(super_options: str) -> Dict[str, str]:
+    options = {}
+    for opt in super_options.split(","):
+        key, _, value = opt.partition("=")
+        options[key] = value
+    return options
+
+
+class DbResetBackend(ABC):
+    """Restores a scratch copy of a database from its pristine source.
+
+    Subclasses implement one way of doing it. usable() must be cheap and
+    side-effect free, it runs once per (source, dest) pair to pick the
+    backend."""
+
+    name: str
+
+    def __init__(self, source_dir: str, dest_dir: str):
+        self.source_dir = os.path.realpath(source_dir)
+        self.dest_dir = os.path.abspath(dest_dir)
+
+    @classmethod
+    @abstractmethod
+    def usable(cls, source_dir: str, dest_dir: str) -> bool:
+        raise NotImplementedError
+
+    @abstractmethod
+    def reset(self):
+        raise NotImplementedError
+
+
+class OverlayReset(DbResetBackend):
+    """dest_dir is an overlayfs mount with source_dir as its lower layer.
+
+    All writes land in the upper dir, so a reset is a remount over an empty
+    one. Set it up once with:
+
+        mount -t overlay overlay -o lowerdir=DB,upperdir=U,workdir=W DB_temp
+    """
+
+    name = "overlay"
+
+    @classmethod
+    def _overlay_options(cls, source_dir: str, dest_dir: str) -> Optional[Dict]:
+        mount = _find_mount(dest_dir)
+        if mount is None or mount["fstype"] != "overlay":
+            return None
+        if mount["mount_point"] != os.path.realpath(dest_dir):
+            return None
+        options = _mount_options(mount["super_options"])
+        lower = [os.path.realpath(d) for d in options.get("lowerdir", "").split(":")]
+        if os.path.realpath(source_dir) not in lower:
+            return None
+        if not options.get("upperdir") or not options.get("workdir"):
+            return None
+        return options
+
+    @classmethod
+    def usable(cls, source_dir: str, dest_dir: str) -> bool:
+        return cls._overlay_options(source_dir, dest_dir) is not None
+
+    def reset(self):
+        options = self._overlay_options(self.source_dir, self.dest_dir)
+        upper, work = options["upperdir"], options["workdir"]
+        st = os.stat(upper)
+
+        run(["sudo", "umount", self.dest_dir])
+        run(["sudo", "rm", "-rf", upper, work])
+        # The upper dir is the overlay root, keep its owner so the benchmark
+        # can still create files in it
+        run(
+            [
+                "sudo",
+                "install",
+                "-d",
+                "-o",
+                str(st.st_uid),
+                "-g",
+                str(st.st_gid),
+                "-m",
+                "%o" % (st.st_mode & 0o7777),
+                upper,
+            ]
+        )
+        run(["sudo", "mkdir", "-p", work])
+        run(
+            [
+                "sudo",
+                "mount",
+                "-t",
+                "overlay",
+                "overlay",
+                "-o",
+                "lowerdir=%s,upperdir=%s,workdir=%s"
+                % (options["lowerdir"], upper, work),
+                self.dest_dir,
+            ]
+        )
+
+
+class LvmThinReset(DbResetBackend):
+    """dest_dir lives on a mounted LVM thin snapshot of the volume holding
+    source_dir, at the same path relative to the mount. A reset drops the
+    snapshot and takes a new one, which is constant time. Set it up once with:
+
+        lvcreate -s -kn -n db_temp vg/db && mount /dev/vg/db_temp /mnt/db_temp
+    """
+
+    name = "lvm"
+
+    @classmethod
+    def _lv_info(cls, device: str) -> Optional[Dict]:
+        try:
+            out = check_output(
+                [
+                    "sudo",
+                    "lvs",
+                    "--noheadings",
+                    "--separator",
+                    ",",
+                    "-o",
+                    "vg_name,lv_name,origin,pool_lv,lv_path",
+                    device,
+                ],
+                encoding="utf-8",
+                stderr=subprocess.DEVNULL,
+            )
+        except (CalledProcessError, FileNotFoundError):
+            return None
+        fields = [f.strip() for f in out.strip().split(",")]
+        if len(fields) != 5:
+            return None
+        return dict(zip(["vg", "lv", "origin", "pool", "path"], fields))
+
+    @classmethod
+    def _layout(cls, source_dir: str, dest_dir: str) -> Optional[Dict]:
+        if shutil.which("lvs") is None and not os.path.exists("/sbin/lvs"):
+            return None
+        dest_mount = _find_mount(dest_dir)
+        source_mount = _find_mount(source_dir)
+        if dest_mount is None or source_mount is None:
+            return None
+        if not dest_mount["source"].startswith("/dev/"):
+            return None
+
+        snap = cls._lv_info(dest_mount["source"])
+        if snap is None or not snap["origin"] or not snap["pool"]:
+            return None
+        origin = cls._lv_info("%s/%s" % (snap["vg"], snap["origin"]))
+        if origin is None:
+            return None
+        origin_dev = os.path.realpath(origin["path"])
+        if os.path.realpath(source_mount["source"]) != origin_dev:
+            return None
+
+        source_rel = os.path.relpath(
+            os.path.realpath(source_dir), source_mount["mount_point"]
+        )
+        dest_rel = os.path.relpath(
+            os.path.realpath(dest_dir), dest_mount["mount_point"]
+        )
+        if source_rel != dest_rel:
+            return None
+        return {"snap": snap, "mount": dest_mount}
+
+    @classmethod
+    def usable(cls, source_dir: str, dest_dir: str) -> bool:
+        return cls._layout(source_dir, dest_dir) is not None
+
+    def reset(self):
+        layout = self._layout(self.source_dir, self.dest_dir)
+        snap, mount = layout["snap"], layout["mount"]
+        snap_name = "%s/%s" % (snap["vg"], snap["lv"])
+
+        # Make sure the snapshot sees everything written to the origin
+        run(["sudo", "sync"])
+        run(["sudo", "umount", mount["mount_point"]])
+        run(["sudo", "lvremove", "-y", snap_name])
+        run(
+            [
+                "sudo",
+                "lvcreate",
+                "-s",
+                "-kn",
+                "-n",
+                snap["lv"],
+                "%s/%s" % (snap["vg"], snap["origin"]),
+            ]
+        )
+        cmd = ["sudo", "mount"]
+        # The snapshot has the same filesystem UUID as its origin
+        if mount["fstype"] == "xfs":
+            cmd += ["-o", "nouuid"]
+        run(cmd + [snap["path"], mount["mount_point"]])
+
+
+class ReflinkReset(DbResetBackend):
+    """Copy by cloning extents on filesystems that support it (btrfs, XFS
+    with reflink=1). source_dir and dest_dir must be on the same filesystem.
+    A reset costs metadata updates only, whatever the size of the data."""
+
+    name = "reflink"
+
+    @classmethod
+    def usable(cls, source_dir: str, dest_dir: str) -> bool:
+        dest_parent = os.path.dirname(os.path.abspath(dest_dir).rstrip("/"))
+        if not os.path.isdir(source_dir) or not os.path.isdir(dest_parent):
+            return False
+        if os.stat(source_dir).st_dev != os.stat(dest_parent).st_dev:
+            return False
+
+        probe_src = None
+        for root, _, files in os.walk(source_dir):
+            for name in files:
+                path = os.path.join(root, name)
+                if os.path.isfile(path) and not os.path.islink(path):
+                    probe_src = path
+                    break
+            if probe_src:
+                break
+        if probe_src is None:
+            return False
+
+        probe_dst = os.path.join(dest_parent, ".reflink_probe.%d" % os.getpid())
+        try:
+            res = subprocess.run(
+                ["cp", "--reflink=always", probe_src, probe_dst],
+                stdout=subprocess.DEVNULL,
+                stderr=subprocess.DEVNULL,
+            )
+            return res.returncode == 0
+        finally:
+            with suppress(FileNotFoundError):
+                os.unlink(probe_dst)
+
+    def reset(self):
+        if os.path.lexists(self.dest_dir):
+            run(["rm", "-rf", self.dest_dir])
+        run(["cp", "-a", "--reflink=always", self.source_dir, self.dest_dir])
+
+
+class RsyncReset(DbResetBackend):
+    """Full copy, works everywhere. Cost is proportional to the amount of
+    data the previous run changed, plus a full scan of both trees."""
+
+    name = "rsync"
+
+    @classmethod
+    def usable(cls, source_dir: str, dest_dir: str) -> bool:
+        return True
+
+    def reset(self):
+        rsync_folder(self.source_dir, self.dest_dir)
+
+
+# In order of preference for --db-reset auto. The setup-based backends come
+# first: if the user created the overlay or snapshot, they want it used.
+DB_RESET_BACKENDS = [OverlayReset, LvmThinReset, ReflinkReset, RsyncReset]
+
+_db_reset_backends: Dict[Tuple[str, str], DbResetBackend] = {}
+
+
+def add_db_reset_arguments(parser: argparse.ArgumentParser):
+    parser.add_argument(
+        "--db-reset",
+        type=str,
+        choices=["auto"] + [b.name for b in DB_RESET_BACKENDS],
+        default="auto",
+        help="How to restore the temporary DB before each run. auto picks the"
+        " first usable of %s" % ", ".join(b.name for b in DB_RESET_BACKENDS),
+    )
+
+
+def get_db_reset_backend(
+    source_dir: str, dest_dir: str, backend: str = "auto"
+) -> DbResetBackend:
+    key = (os.path.realpath(source_dir), os.path.abspath(dest_dir))
+    if key in _db_reset_backends and backend in ("auto", _db_reset_backends[key].name):
+        return _db_reset_backends[key]
+
+    candidates = [
+        b for b in DB_RESET_BACKENDS if backend == "auto" or b.name == backend
+    ]
+    if not candidates:
+        raise ValueError("Unknown DB reset backend: %s" % backend)
+    for cls in candidates:
+        if cls.usable(source_dir, dest_dir):
+            _db_reset_backends[key] = cls(source_dir, dest_dir)
+            log.info(
+                "Using %s to reset %s from %s", cls.name, dest_dir, source_dir
+            )
+            return _db_reset_backends[key]
+    raise Exception(
+        "DB reset backend %s cannot reset %s from %s"
+        % (backend, dest_dir, source_dir)
+    )
+
+
+def reset_database(db_dir: str, temp_db_dir: str, backend: str = "auto"):
+    """Restore temp_db_dir to the contents of db_dir and leave it uncached."""
+    reset_backend = get_db_reset_backend(db_dir, temp_db_dir, backend)
+    start = monotonic()
+    reset_backend.reset()
+    log.info(
+        "Reset %s with %s in %.1f s",
+        temp_db_dir,
+        reset_backend.name,
+        monotonic() - start,
+    )
+    drop_page_cache(verify_dir=temp_db_dir)
+
+
 def load_json(path: str):
     with open(path, "r") as f:
         return json.load(f)
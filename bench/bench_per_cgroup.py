@@ -2,6 +2,7 @@ import argparse
 import logging
 import os
 import re
+import subprocess
 from time import sleep
 from typing import Dict, List
 
@@ -15,13 +16,6 @@ GiB = 2**30
 CLEANUP_TASKS = []
 
 
-def reset_database(db_dir: str, temp_db_dir: str):
-    # rsync -avpl --delete /mydata/leveldb_db_orig/ /mydata/leveldb_db/
-    if not db_dir.endswith("/"):
-        db_dir += "/"
-    run(["rsync", "-avpl", "--delete", db_dir, temp_db_dir])
-
-
 def parse_leveldb_bench_results(stdout: str) -> Dict:
     # Uniform: calculating overall performance metrics... (might take a while)
     # Uniform overall: UPDATE throughput 0.00 ops/sec, INSERT throughput 0.00 ops/sec, READ throughput 9038.24 ops/sec, SCAN throughput 0.00 ops/sec, READ_MODIFY_WRITE throughput 0.00 ops/sec, total throughput 9038.24 ops/sec
@@ -109,7 +103,14 @@ def parse_leveldb_bench_results(stdout: str) -> Dict:
 
 class CgroupConfig(dict):
     def __init__(
-        self, name, cache_ext, policy1_size, policy2_size, split_cgroups, which_policy=1
+        self,
+        name,
+        cache_ext,
+        policy1_size,
+        policy2_size,
+        split_cgroups,
+        which_policy=1,
+        balanced=False,
     ):
         self.name = name
         self.cache_ext = cache_ext
@@ -117,6 +118,8 @@ class CgroupConfig(dict):
         self.policy2_size = policy2_size
         self.split_cgroups = split_cgroups
         self.which_policy = which_policy
+        # Start from the static split, then let cache_ext_balancer move memory
+        self.balanced = balanced
         dict.__init__(
             self,
             name=name,
@@ -125,6 +128,7 @@ class CgroupConfig(dict):
             policy2_size=policy2_size,
             split_cgroups=split_cgroups,
             which_policy=which_policy,
+            balanced=balanced,
         )
 
 
@@ -173,6 +177,23 @@ cache_ext_cgroup_configs: List[CgroupConfig] = [
 ]
 
 
+# Same budget as cache_ext_split_cgroups, shifted between the cgroups at runtime
+balanced_cgroup_configs: List[CgroupConfig] = [
+    CgroupConfig(
+        name="cache_ext_balanced_cgroups",
+        cache_ext=True,
+        policy1_size=10 * GiB,
+        policy2_size=1 * GiB,
+        split_cgroups=True,
+        balanced=True,
+    ),
+]
+
+
+def balancer_stats_file(which: int) -> str:
+    return f"/tmp/cache_ext_percgroup_stats_{which}.json"
+
+
 def cgroup_name_from_config(config: CgroupConfig, which: int) -> str:
     if config.cache_ext:
         if config.split_cgroups:
@@ -225,6 +246,12 @@ class PerCgroupBenchmark(BenchmarkFramework):
             self.cache_ext_policy = None
             self.second_cache_ext_policy = None
 
+        if self.args.balancer and self.args.default:
+            raise ValueError("--balancer needs cache_ext, drop --default")
+        self._balancer_proc = None
+        self._final_limits = {}
+        CLEANUP_TASKS.append(lambda: self.stop_balancer())
+
     def add_arguments(self, parser: argparse.ArgumentParser):
         parser.add_argument(
             "--default",
@@ -265,6 +292,7 @@ class PerCgroupBenchmark(BenchmarkFramework):
             default=None,
             help="Specify the temporary directory for LevelDB benchmarking. Default is <leveldb-db>_temp",
         )
+        add_db_reset_arguments(parser)
         parser.add_argument(
             "--bench-binary-dir",
             type=str,
@@ -276,6 +304,25 @@ class PerCgroupBenchmark(BenchmarkFramework):
             type=str,
             default="ycsb_c",
         )
+        parser.add_argument(
+            "--balancer",
+            type=str,
+            default=None,
+            help="Path to cache_ext_balancer.out; also run a config where it "
+            "rebalances the static split at runtime",
+        )
+        parser.add_argument(
+            "--balancer-mrc",
+            action="store_true",
+            help="Run the loaders with --mrc so the balancer uses miss ratio "
+            "curves, not just refaults (S3-FIFO, W-TinyLFU, MGLRU loaders)",
+        )
+        parser.add_argument(
+            "--balancer-interval",
+            type=int,
+            default=5000,
+            help="Balancer interval in ms",
+        )
 
     def generate_configs(self, configs: List[Dict]) -> List[Dict]:
         configs = add_config_option("runtime_seconds", [180], configs)
@@ -287,6 +334,8 @@ class PerCgroupBenchmark(BenchmarkFramework):
         cgroup_configs = (
             baseline_cgroup_configs if self.args.default else cache_ext_cgroup_configs
         )
+        if self.args.balancer:
+            cgroup_configs = cgroup_configs + balanced_cgroup_configs
         configs = add_config_option("cgroup_config", cgroup_configs, configs)
         configs = add_config_option(
             "iteration", list(range(1, self.args.iterations + 1)), configs
@@ -294,8 +343,9 @@ class PerCgroupBenchmark(BenchmarkFramework):
         return configs
 
     def before_benchmark(self, config):
-        reset_database(self.args.leveldb_db, self.args.leveldb_temp_db)
-        drop_page_cache()
+        reset_database(
+            self.args.leveldb_db, self.args.leveldb_temp_db, self.args.db_reset
+        )
         disable_swap()
         disable_smt()
 
@@ -312,8 +362,15 @@ class PerCgroupBenchmark(BenchmarkFramework):
                 self.cache_ext_policy.set_cgroup(f"{DEFAULT_CACHE_EXT_CGROUP}_1")
                 self.second_cache_ext_policy.set_cgroup(f"{DEFAULT_CACHE_EXT_CGROUP}_2")
 
-                self.cache_ext_policy.start()
-                self.second_cache_ext_policy.start()
+                if config["cgroup_config"].balanced:
+                    self.cache_ext_policy.start(extra_args=self.policy_stats_args(1))
+                    self.second_cache_ext_policy.start(
+                        extra_args=self.policy_stats_args(2)
+                    )
+                    self.start_balancer()
+                else:
+                    self.cache_ext_policy.start()
+                    self.second_cache_ext_policy.start()
             else:
                 size = (
                     config["cgroup_config"].policy1_size
@@ -398,7 +455,58 @@ class PerCgroupBenchmark(BenchmarkFramework):
         ]
         return cmd
 
+    def policy_stats_args(self, which: int) -> List[str]:
+        if not self.args.balancer_mrc:
+            return []
+        return [
+            "--mrc",
+            "--stats_format",
+            "json",
+            "--stats_interval",
+            str(self.args.balancer_interval),
+            "--stats_file",
+            balancer_stats_file(which),
+        ]
+
+    def start_balancer(self):
+        tenants = []
+        for which in (1, 2):
+            tenant = f"/sys/fs/cgroup/{DEFAULT_CACHE_EXT_CGROUP}_{which}"
+            if self.args.balancer_mrc:
+                tenant += ":" + balancer_stats_file(which)
+            tenants.append(tenant)
+        cmd = [
+            "sudo",
+            self.args.balancer,
+            "--interval",
+            str(self.args.balancer_interval),
+        ] + tenants
+        log.info("Starting balancer: %s", cmd)
+        self._balancer_proc = subprocess.Popen(
+            cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE
+        )
+
+    def stop_balancer(self):
+        if self._balancer_proc is None:
+            return
+        run(["sudo", "kill", "-2", str(self._balancer_proc.pid)])
+        out, err = self._balancer_proc.communicate()
+        log.info("Balancer stdout: %s", out.decode("utf-8"))
+        log.info("Balancer stderr: %s", err.decode("utf-8"))
+        self._balancer_proc = None
+
+    def read_final_limits(self, config):
+        self._final_limits = {}
+        if not config["cgroup_config"].split_cgroups:
+            return
+        for which in (1, 2):
+            cgroup = cgroup_name_from_config(config["cgroup_config"], which)
+            with open(f"/sys/fs/cgroup/{cgroup}/memory.max") as f:
+                self._final_limits[f"memory_max_{which}"] = f.read().strip()
+
     def after_benchmark(self, config):
+        self.stop_balancer()
+        self.read_final_limits(config)
         if config["cgroup_config"].cache_ext:
             if config["cgroup_config"].split_cgroups:
                 self.cache_ext_policy.stop()
@@ -414,6 +522,8 @@ class PerCgroupBenchmark(BenchmarkFramework):
     def parse_results(self, stdout: str, second_output: str = None) -> BenchResults:
         results = parse_leveldb_bench_results(stdout)
         results.update({"rg_iters": int(second_output)})
+        # memory.max at the end of the run, where the balancer left it
+        results.update(self._final_limits)
         return BenchResults(results)
 
 
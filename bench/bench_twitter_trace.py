@@ -15,16 +15,17 @@ from bench_lib import (
     DEFAULT_BASELINE_CGROUP,
     DEFAULT_CACHE_EXT_CGROUP,
     add_config_option,
+    add_db_reset_arguments,
     check_output,
     disable_smt,
     disable_swap,
-    drop_page_cache,
     edit_yaml_file,
     enable_smt,
     format_bytes_str,
     parse_strings_string,
     recreate_baseline_cgroup,
     recreate_cache_ext_cgroup,
+    reset_database,
     run,
     set_sysctl,
 )
@@ -38,13 +39,6 @@ MiB = 2**20
 CLEANUP_TASKS = []
 
 
-def reset_database(db_dir: str, temp_db_dir: str):
-    # rsync -avpl --delete /mydata/leveldb_db_orig/ /mydata/leveldb_db/
-    if not db_dir.endswith("/"):
-        db_dir += "/"
-    run(["rsync", "-avpl", "--delete", db_dir, temp_db_dir])
-
-
 def dir_size(path: str) -> int:
     # Check that path exists and is a directory
     if not os.path.exists(path):
@@ -173,6 +167,7 @@ class LevelDBTwitterTraceBenchmark(BenchmarkFramework):
             default=None,
             help="Specify the temporary directory for LevelDB benchmarking. Default is <leveldb-db>_temp",
         )
+        add_db_reset_arguments(parser)
         parser.add_argument(
             "--policy-loader",
             type=str,
@@ -228,8 +223,9 @@ class LevelDBTwitterTraceBenchmark(BenchmarkFramework):
         return configs
 
     def benchmark_prepare(self, config):
-        reset_database(self.args.leveldb_db, self.args.leveldb_temp_db)
-        drop_page_cache()
+        reset_database(
+            self.args.leveldb_db, self.args.leveldb_temp_db, self.args.db_reset
+        )
         disable_swap()
         disable_smt()
         db_size = dir_size(self.args.leveldb_temp_db)
@@ -270,7 +266,7 @@ class LevelDBTwitterTraceBenchmark(BenchmarkFramework):
 
         if config["cgroup_name"] == DEFAULT_CACHE_EXT_CGROUP:
             recreate_cache_ext_cgroup(limit_in_bytes=cgroup_size)
-            if config["policy_loader"] == "cache_ext_s3fifo.out":
+            if config["policy_loader"] in ("cache_ext_s3fifo.out", "cache_ext_tinylfu.out"):
                 self.cache_ext_policy.start(cgroup_size=cgroup_size)
             else:
                 self.cache_ext_policy.start()
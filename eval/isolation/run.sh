@@ -89,4 +89,20 @@ python3 "$BENCH_PATH/bench_per_cgroup.py" \
 	--iterations "$ITERATIONS" \
 	--benchmark ycsb_c
 
+# Same split, next to a run where cache_ext_balancer moves memory between the
+# cgroups on their refaults
+python3 "$BENCH_PATH/bench_per_cgroup.py" \
+	--cpu 8 \
+	--search-path "$SEARCH_PATH" \
+	--data-dir "$FILES_PATH" \
+	--policy-loader "$POLICY_PATH/cache_ext_sampling.out" \
+	--second-policy-loader "$POLICY_PATH/cache_ext_mru.out" \
+	--balancer "$POLICY_PATH/cache_ext_balancer.out" \
+	--results-file "$RESULTS_PATH/per_cgroup_balanced_results.json" \
+	--leveldb-db "$DB_PATH" \
+	--leveldb-temp-db "$TEMP_DB_PATH" \
+	--bench-binary-dir "$YCSB_PATH/build" \
+	--iterations "$ITERATIONS" \
+	--benchmark ycsb_c
+
 echo "Isolation benchmark completed. Results saved to $RESULTS_PATH."
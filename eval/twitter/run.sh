@@ -22,6 +22,7 @@ POLICIES=(
 	"cache_ext_lhd"
 	"cache_ext_s3fifo"
 	"cache_ext_sampling"
+	"cache_ext_tinylfu"
 )
 
 CLUSTERS=(17 18 24 34 52)
@@ -5,6 +5,10 @@
 
 #include "cache_ext_lib.bpf.h"
 #include "dir_watcher.bpf.h"
+#include "cache_ext_stats.bpf.h"
+#include "cache_ext_prof.bpf.h"
+#include "cache_ext_trace.bpf.h"
+#include "cache_ext_readahead.bpf.h"
 
 char _license[] SEC("license") = "GPL";
 
@@ -338,6 +342,7 @@ static void check_and_switch_policy(void)
 	current_policy = new_policy;
 	last_policy_switch_time = timestamp;
 	policy_switch_count++;
+	cache_ext_stat_inc(CACHE_EXT_STAT_POLICY_SWITCHES);
 
 	// 9. 새 정책 통계 시작
 	switch (new_policy) {
@@ -371,6 +376,8 @@ static void mru_handle_accessed(struct folio *folio)
 
 static int mru_iterate_fn(int idx, struct cache_ext_list_node *node)
 {
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+
 	if ((idx < 200) && (!folio_test_uptodate(node->folio) ||
 			    !folio_test_lru(node->folio)))
 		return CACHE_EXT_CONTINUE_ITER;
@@ -384,6 +391,8 @@ static void fifo_handle_added(struct folio *folio)
 
 static int fifo_iterate_fn(int idx, struct cache_ext_list_node *node)
 {
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+
 	if (!folio_test_uptodate(node->folio) || !folio_test_lru(node->folio))
 		return CACHE_EXT_CONTINUE_ITER;
 	return CACHE_EXT_EVICT_NODE;
@@ -401,11 +410,34 @@ static void lru_handle_accessed(struct folio *folio)
 
 static int lru_iterate_fn(int idx, struct cache_ext_list_node *node)
 {
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+
 	if (!folio_test_uptodate(node->folio) || !folio_test_lru(node->folio))
 		return CACHE_EXT_CONTINUE_ITER;
 	return CACHE_EXT_EVICT_NODE;
 }
 
+// Promoted readahead joins the active policy's list as if it had just been added
+static void ra_handle_promoted(struct folio *folio)
+{
+	int ret = 0;
+
+	switch (current_policy) {
+	case POLICY_MRU:
+		ret = bpf_cache_ext_list_move(mru_list, folio, false);
+		break;
+	case POLICY_FIFO:
+		ret = bpf_cache_ext_list_move(fifo_list, folio, true);
+		break;
+	case POLICY_LRU:
+		ret = bpf_cache_ext_list_move(lru_list, folio, true);
+		break;
+	}
+
+	if (ret)
+		bpf_printk("Failed to move promoted folio\n");
+}
+
 // ===== cache_ext_ops 훅 구현 =====
 
 s32 BPF_STRUCT_OPS_SLEEPABLE(adaptive_v2_init, struct mem_cgroup *memcg)
@@ -430,6 +462,9 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(adaptive_v2_init, struct mem_cgroup *memcg)
 		return -1;
 	}
 
+	if (ra_probation_init(memcg))
+		return -1;
+
 	current_policy = POLICY_MRU;
 	last_policy_switch_time = 0;
 
@@ -442,9 +477,13 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(adaptive_v2_init, struct mem_cgroup *memcg)
 
 void BPF_STRUCT_OPS(adaptive_v2_folio_added, struct folio *folio)
 {
+	PROF_SCOPE(PROF_FOLIO_ADDED);
+	cache_ext_trace(CACHE_EXT_TRACE_ADD, folio);
 	if (!is_folio_relevant(folio))
 		return;
 
+	cache_ext_stat_inc(CACHE_EXT_STAT_MISSES);
+
 	u64 key = (u64)folio;
 	struct folio_metadata meta = {
 		.added_time = timestamp,
@@ -468,17 +507,20 @@ void BPF_STRUCT_OPS(adaptive_v2_folio_added, struct folio *folio)
 
 	bpf_map_update_elem(&folio_metadata_map, &key, &meta, BPF_ANY);
 
-	// 현재 활성 정책에 따라 처리
-	switch (current_policy) {
-	case POLICY_MRU:
-		mru_handle_added(folio);
-		break;
-	case POLICY_FIFO:
-		fifo_handle_added(folio);
-		break;
-	case POLICY_LRU:
-		lru_handle_added(folio);
-		break;
+	// Prefetched folios wait on probation instead, see cache_ext_readahead.bpf.h
+	if (!ra_probation_admit(folio)) {
+		// 현재 활성 정책에 따라 처리
+		switch (current_policy) {
+		case POLICY_MRU:
+			mru_handle_added(folio);
+			break;
+		case POLICY_FIFO:
+			fifo_handle_added(folio);
+			break;
+		case POLICY_LRU:
+			lru_handle_added(folio);
+			break;
+		}
 	}
 
 	// 통계 업데이트
@@ -490,9 +532,16 @@ void BPF_STRUCT_OPS(adaptive_v2_folio_added, struct folio *folio)
 
 void BPF_STRUCT_OPS(adaptive_v2_folio_accessed, struct folio *folio)
 {
+	PROF_SCOPE(PROF_FOLIO_ACCESSED);
+	cache_ext_trace(CACHE_EXT_TRACE_ACCESS, folio);
 	if (!is_folio_relevant(folio))
 		return;
 
+	cache_ext_stat_inc(CACHE_EXT_STAT_HITS);
+
+	if (ra_probation_promote(folio))
+		ra_handle_promoted(folio);
+
 	struct folio_metadata *meta = get_folio_metadata(folio);
 	if (!meta)
 		return;
@@ -529,6 +578,8 @@ void BPF_STRUCT_OPS(adaptive_v2_folio_accessed, struct folio *folio)
 
 void BPF_STRUCT_OPS(adaptive_v2_folio_evicted, struct folio *folio)
 {
+	PROF_SCOPE(PROF_FOLIO_EVICTED);
+	cache_ext_trace(CACHE_EXT_TRACE_EVICT, folio);
 	u64 key = (u64)folio;
 	struct folio_metadata *meta = get_folio_metadata(folio);
 
@@ -563,6 +614,8 @@ void BPF_STRUCT_OPS(adaptive_v2_folio_evicted, struct folio *folio)
 	bpf_map_delete_elem(&folio_metadata_map, &key);
 
 	__sync_fetch_and_add(&total_evictions, 1);
+	cache_ext_stat_inc(CACHE_EXT_STAT_EVICTIONS);
+	ra_probation_evicted(folio);
 
 	// Per-policy eviction count
 	switch (current_policy) {
@@ -582,6 +635,8 @@ void BPF_STRUCT_OPS(adaptive_v2_evict_folios,
 		    struct cache_ext_eviction_ctx *eviction_ctx,
 		    struct mem_cgroup *memcg)
 {
+	PROF_EVICT_SCOPE(eviction_ctx);
+	EVICTION_TARGET_SCOPE(eviction_ctx);
 	int ret = 0;
 
 	// 주기적으로 정책 전환 체크
@@ -589,6 +644,12 @@ void BPF_STRUCT_OPS(adaptive_v2_evict_folios,
 		check_and_switch_policy();
 	}
 
+	if (ra_probation_over_budget(memcg)) {
+		ra_probation_evict(eviction_ctx, memcg);
+		if (eviction_ctx_done(eviction_ctx))
+			return;
+	}
+
 	// 현재 활성 정책으로 eviction 수행
 	switch (current_policy) {
 	case POLICY_MRU:
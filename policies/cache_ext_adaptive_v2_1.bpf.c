@@ -5,6 +5,10 @@
 
 #include "cache_ext_lib.bpf.h"
 #include "dir_watcher.bpf.h"
+#include "cache_ext_stats.bpf.h"
+#include "cache_ext_prof.bpf.h"
+#include "cache_ext_trace.bpf.h"
+#include "cache_ext_readahead.bpf.h"
 
 char _license[] SEC("license") = "GPL";
 
@@ -379,6 +383,7 @@ static void check_and_switch_policy(void)
 	current_policy = new_policy;
 	last_policy_switch_time = timestamp;
 	policy_switch_count++;
+	cache_ext_stat_inc(CACHE_EXT_STAT_POLICY_SWITCHES);
 
 	// 9. 새 정책 통계 시작
 	switch (new_policy) {
@@ -412,6 +417,8 @@ static void mru_handle_accessed(struct folio *folio)
 
 static int mru_iterate_fn(int idx, struct cache_ext_list_node *node)
 {
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+
 	if ((idx < 200) && (!folio_test_uptodate(node->folio) ||
 			    !folio_test_lru(node->folio)))
 		return CACHE_EXT_CONTINUE_ITER;
@@ -425,6 +432,8 @@ static void fifo_handle_added(struct folio *folio)
 
 static int fifo_iterate_fn(int idx, struct cache_ext_list_node *node)
 {
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+
 	if (!folio_test_uptodate(node->folio) || !folio_test_lru(node->folio))
 		return CACHE_EXT_CONTINUE_ITER;
 	return CACHE_EXT_EVICT_NODE;
@@ -442,11 +451,32 @@ static void lru_handle_accessed(struct folio *folio)
 
 static int lru_iterate_fn(int idx, struct cache_ext_list_node *node)
 {
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+
 	if (!folio_test_uptodate(node->folio) || !folio_test_lru(node->folio))
 		return CACHE_EXT_CONTINUE_ITER;
 	return CACHE_EXT_EVICT_NODE;
 }
 
+// Promoted readahead joins the active policy's list as if it had just been added
+static void ra_handle_promoted(struct folio *folio)
+{
+	int ret = 0;
+
+	switch (current_policy) {
+	case POLICY_MRU:
+		ret = bpf_cache_ext_list_move(main_list, folio, false);
+		break;
+	case POLICY_FIFO:
+	case POLICY_LRU:
+		ret = bpf_cache_ext_list_move(main_list, folio, true);
+		break;
+	}
+
+	if (ret)
+		bpf_printk("Failed to move promoted folio\n");
+}
+
 // ===== cache_ext_ops 훅 구현 =====
 
 s32 BPF_STRUCT_OPS_SLEEPABLE(adaptive_v2_1_init, struct mem_cgroup *memcg)
@@ -460,6 +490,9 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(adaptive_v2_1_init, struct mem_cgroup *memcg)
 		return -1;
 	}
 
+	if (ra_probation_init(memcg))
+		return -1;
+
 	current_policy = POLICY_MRU;
 	last_policy_switch_time = 0;
 
@@ -472,9 +505,13 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(adaptive_v2_1_init, struct mem_cgroup *memcg)
 
 void BPF_STRUCT_OPS(adaptive_v2_1_folio_added, struct folio *folio)
 {
+	PROF_SCOPE(PROF_FOLIO_ADDED);
+	cache_ext_trace(CACHE_EXT_TRACE_ADD, folio);
 	if (!is_folio_relevant(folio))
 		return;
 
+	cache_ext_stat_inc(CACHE_EXT_STAT_MISSES);
+
 	u64 key = (u64)folio;
 	struct folio_metadata meta = {
 		.added_time = timestamp,
@@ -511,17 +548,20 @@ void BPF_STRUCT_OPS(adaptive_v2_1_folio_added, struct folio *folio)
 
 	bpf_map_update_elem(&folio_metadata_map, &key, &meta, BPF_ANY);
 
-	// 🔧 v2_1: 현재 정책에 따라 main_list에 추가
-	switch (current_policy) {
-	case POLICY_MRU:
-		mru_handle_added(folio);
-		break;
-	case POLICY_FIFO:
-		fifo_handle_added(folio);
-		break;
-	case POLICY_LRU:
-		lru_handle_added(folio);
-		break;
+	// Prefetched folios wait on probation instead, see cache_ext_readahead.bpf.h
+	if (!ra_probation_admit(folio)) {
+		// 🔧 v2_1: 현재 정책에 따라 main_list에 추가
+		switch (current_policy) {
+		case POLICY_MRU:
+			mru_handle_added(folio);
+			break;
+		case POLICY_FIFO:
+			fifo_handle_added(folio);
+			break;
+		case POLICY_LRU:
+			lru_handle_added(folio);
+			break;
+		}
 	}
 
 	// 통계 업데이트
@@ -533,9 +573,16 @@ void BPF_STRUCT_OPS(adaptive_v2_1_folio_added, struct folio *folio)
 
 void BPF_STRUCT_OPS(adaptive_v2_1_folio_accessed, struct folio *folio)
 {
+	PROF_SCOPE(PROF_FOLIO_ACCESSED);
+	cache_ext_trace(CACHE_EXT_TRACE_ACCESS, folio);
 	if (!is_folio_relevant(folio))
 		return;
 
+	cache_ext_stat_inc(CACHE_EXT_STAT_HITS);
+
+	if (ra_probation_promote(folio))
+		ra_handle_promoted(folio);
+
 	u64 key = (u64)folio;
 	struct folio_metadata *meta = get_folio_metadata(folio);
 	if (!meta)
@@ -576,6 +623,8 @@ void BPF_STRUCT_OPS(adaptive_v2_1_folio_accessed, struct folio *folio)
 
 void BPF_STRUCT_OPS(adaptive_v2_1_folio_evicted, struct folio *folio)
 {
+	PROF_SCOPE(PROF_FOLIO_EVICTED);
+	cache_ext_trace(CACHE_EXT_TRACE_EVICT, folio);
 	u64 key = (u64)folio;
 	struct folio_metadata *meta = get_folio_metadata(folio);
 
@@ -610,6 +659,8 @@ void BPF_STRUCT_OPS(adaptive_v2_1_folio_evicted, struct folio *folio)
 	bpf_map_delete_elem(&folio_metadata_map, &key);
 
 	__sync_fetch_and_add(&total_evictions, 1);
+	cache_ext_stat_inc(CACHE_EXT_STAT_EVICTIONS);
+	ra_probation_evicted(folio);
 
 	// Per-policy eviction count
 	switch (current_policy) {
@@ -629,6 +680,8 @@ void BPF_STRUCT_OPS(adaptive_v2_1_evict_folios,
 		    struct cache_ext_eviction_ctx *eviction_ctx,
 		    struct mem_cgroup *memcg)
 {
+	PROF_EVICT_SCOPE(eviction_ctx);
+	EVICTION_TARGET_SCOPE(eviction_ctx);
 	int ret = 0;
 
 
@@ -655,6 +708,12 @@ void BPF_STRUCT_OPS(adaptive_v2_1_evict_folios,
 		check_and_switch_policy();
 	}
 
+	if (ra_probation_over_budget(memcg)) {
+		ra_probation_evict(eviction_ctx, memcg);
+		if (eviction_ctx_done(eviction_ctx))
+			return;
+	}
+
 	// 🔧 v2_1 수정: 현재 정책에 맞는 iterate 함수로 main_list 순회
 	switch (current_policy) {
 	case POLICY_MRU:
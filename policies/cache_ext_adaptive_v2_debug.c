@@ -11,6 +11,8 @@
 
 #include "cache_ext_adaptive_v2_debug.skel.h"
 #include "dir_watcher.h"
+#include "cache_ext_stats.h"
+#include "cache_ext_readahead.h"
 
 static volatile bool exiting = false;
 
@@ -166,13 +168,18 @@ int main(int argc, char **argv)
 	int ret = 1;
 	struct cache_ext_adaptive_v2_debug_bpf *skel = NULL;
 	struct bpf_link *link = NULL;
+	struct cache_ext_swap swap = { 0 };
+	struct cache_ext_exporter exporter = { 0 };
+	struct cache_ext_profiler prof = { 0 };
+	struct cache_ext_recorder rec = { 0 };
+	struct cache_ext_readahead ra = { 0 };
 	struct ring_buffer *rb = NULL;
 	int cgroup_fd = -1;
 
 	libbpf_set_strict_mode(LIBBPF_STRICT_ALL);
 
 	struct cmdline_args args = { 0 };
-	struct argp argp = { options, parse_opt, 0, 0 };
+	struct argp argp = { options, parse_opt, 0, 0, cache_ext_readahead_argp_children };
 	argp_parse(&argp, argc, argv, 0, 0, &args);
 
 	if (args.watch_dir == NULL) {
@@ -199,11 +206,6 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	if (strlen(watch_dir_full_path) > 128) {
-		fprintf(stderr, "watch_dir path too long\n");
-		return 1;
-	}
-
 	cgroup_fd = open(args.cgroup_path, O_RDONLY);
 	if (cgroup_fd < 0) {
 		perror("Failed to open cgroup path");
@@ -219,6 +221,34 @@ int main(int argc, char **argv)
 		goto cleanup;
 	}
 
+	// Set watch_dir
+	ret = set_watch_dir_root(watch_dir_full_path, &watch_dir_ino_map(skel), &watch_dir_dev_map(skel));
+	if (ret)
+		goto cleanup;
+
+	// Size inode_watchlist for the watch dir
+	ret = resize_watch_dir_map(inode_watchlist_map(skel), watch_dir_full_path, true);
+	if (ret)
+		goto cleanup;
+
+	// Hook profiling, if enabled
+	cache_ext_prof_setup(skel);
+
+	// Page access recording, if enabled
+	ret = cache_ext_recorder_setup(skel);
+	if (ret)
+		goto cleanup;
+
+	// One stats slot per CPU
+	ret = cache_ext_stats_resize(cache_ext_stats_map(skel));
+	if (ret)
+		goto cleanup;
+
+	// Readahead probes and probation map
+	ret = cache_ext_readahead_setup(skel, args.cgroup_path);
+	if (ret)
+		goto cleanup;
+
 	ret = cache_ext_adaptive_v2_debug_bpf__load(skel);
 	if (ret) {
 		perror("Failed to load BPF skeleton");
@@ -240,13 +270,31 @@ int main(int argc, char **argv)
 		goto cleanup;
 	}
 
-	link = bpf_map__attach_cache_ext_ops(skel->maps.adaptive_v2_debug_ops,
-					     cgroup_fd);
+	link = cache_ext_swap_attach(&swap, skel->obj, skel->maps.adaptive_v2_debug_ops, cgroup_fd);
 	if (link == NULL) {
 		perror("Failed to attach cache_ext_ops to cgroup");
 		goto cleanup;
 	}
 
+	ret = cache_ext_readahead_attach(&ra, skel);
+	if (ret)
+		goto cleanup;
+
+	// Map the stats region and start the exporter, if enabled
+	ret = cache_ext_exporter_start(&exporter, cache_ext_stats_map(skel), "adaptive_v2_debug");
+	if (ret)
+		goto cleanup;
+
+	// Dump hook profiles on SIGUSR1 and at exit, if enabled
+	ret = cache_ext_prof_start(&prof, cache_ext_prof_map(skel), "adaptive_v2_debug");
+	if (ret)
+		goto cleanup;
+
+	// Stream page accesses to the --record file, if enabled
+	ret = cache_ext_recorder_start(&rec, cache_ext_trace_ring(skel));
+	if (ret)
+		goto cleanup;
+
 	printf("========================================\n");
 	printf("DEBUG VERSION: Adaptive Policy v2 Started\n");
 	printf("========================================\n");
@@ -276,6 +324,9 @@ int main(int argc, char **argv)
 	printf("========================================\n");
 	printf("\n");
 
+	// Tell whoever started us that the policy is live
+	cache_ext_ready();
+
 	while (!exiting) {
 		ret = ring_buffer__poll(rb, 100);
 		if (ret == -EINTR) {
@@ -292,6 +343,11 @@ int main(int argc, char **argv)
 
 cleanup:
 	ring_buffer__free(rb);
+	cache_ext_recorder_stop(&rec);
+	cache_ext_prof_stop(&prof);
+	cache_ext_exporter_stop(&exporter);
+	cache_ext_readahead_detach(&ra);
+	cache_ext_swap_release(&swap, link);
 	bpf_link__destroy(link);
 	cache_ext_adaptive_v2_debug_bpf__destroy(skel);
 	if (cgroup_fd >= 0)
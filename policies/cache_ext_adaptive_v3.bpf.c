@@ -5,6 +5,13 @@
 
 #include "cache_ext_lib.bpf.h"
 #include "dir_watcher.bpf.h"
+#include "cache_ext_stats.bpf.h"
+#include "cache_ext_prof.bpf.h"
+#include "cache_ext_trace.bpf.h"
+#include "cache_ext_events.bpf.h"
+#include "cache_ext_state.bpf.h"
+#include "cache_ext_mrc.bpf.h"
+#include "cache_ext_readahead.bpf.h"
 
 char _license[] SEC("license") = "GPL";
 
@@ -24,54 +31,96 @@ enum policy_type {
 #define MIN_SAMPLES 1000
 #define MIN_TIME_IN_POLICY 10000
 #define CHECK_INTERVAL 1000
+#define MIGRATE_BATCH 64  // Folios moved to the new policy's list per eviction
+
+// Shadow cache 파라미터 (cache_ext_shadow.bpf.h)
+#define SHADOW_MIN_SAMPLES 20000  // Sampled references before trusting the verdict
+#define SHADOW_SWITCH_MARGIN 200  // Required simulated gain, in 1/10000
 
 // S3-FIFO 파라미터
-#define CACHE_SIZE_ESTIMATE 50000  // ~200MB / 4KB
+#define CACHE_SIZE_FALLBACK 50000  // ~200MB / 4KB, used while memory.max is unlimited
+
+#define NR_POLICIES 5
 
 // ===== 전역 통계 =====
-static u64 timestamp = 0;
-
-// 기본 성능
-static u64 total_accesses = 0;
-static u64 cache_hits = 0;
-static u64 cache_misses = 0;
-static u64 total_evictions = 0;
-
-// 접근 패턴
-static u64 one_time_accesses = 0;
-static u64 multi_accesses = 0;
-static u64 last_inode = 0;
-static u64 last_offset = 0;
-static u64 sequential_accesses = 0;
-static u64 random_accesses = 0;
-
-// 페이지 통계
-static u64 total_hits_sum = 0;
-static u64 pages_evicted = 0;
-static u64 reuse_distance_sum = 0;
-static u64 reuse_distance_count = 0;
-static u64 total_lifetime_sum = 0;
-static u64 total_idle_time_sum = 0;
-static u64 dirty_evictions = 0;
-
-// 🆕 Working set size 추적
-static u64 working_set_size = 0;  // 근사치
-
-// Per-policy 통계
+static u64 timestamp __model = 0;
+
+/*
+ * Access/eviction counters. These are bumped from every hook on every CPU, so
+ * they live in a per-CPU array and are only summed up (aggregate_stats())
+ * when the controller runs, or by the loader. Fields must all be u64, the
+ * aggregation treats the struct as an array.
+ */
+struct adaptive_stats {
+	// 기본 성능
+	u64 total_accesses;
+	u64 cache_hits;
+	u64 cache_misses;
+	u64 total_evictions;
+
+	// 접근 패턴
+	u64 one_time_accesses;
+	u64 multi_accesses;
+	u64 sequential_accesses;
+	u64 random_accesses;
+
+	// 페이지 통계
+	u64 total_hits_sum;
+	u64 pages_evicted;
+	u64 reuse_distance_sum;
+	u64 reuse_distance_count;
+	u64 total_lifetime_sum;
+	u64 total_idle_time_sum;
+	u64 dirty_evictions;
+
+	// 🆕 Working set size 추적 (근사치), replaced by the MRC estimate with --mrc
+	u64 working_set_size;
+
+	// Per-policy 통계
+	u64 policy_hits[NR_POLICIES];
+	u64 policy_misses[NR_POLICIES];
+	u64 policy_evictions[NR_POLICIES];
+};
+
+#define NR_STAT_WORDS (sizeof(struct adaptive_stats) / sizeof(u64))
+
+struct adaptive_pcpu {
+	struct adaptive_stats stats;
+
+	// Sequential 감지 (per-CPU, not summed)
+	u64 last_inode;
+	u64 last_offset;
+	u64 last_check_accesses;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, u32);
+	__type(value, struct adaptive_pcpu);
+	__uint(max_entries, 1);
+} adaptive_pcpu_map SEC(".maps");
+
+/*
+ * Totals at the start of the current measurement window. Window counters
+ * (hit rate, accesses since the last switch) are aggregate - window_base.
+ * Only written by the controller. This and the controller state below are
+ * __model state: with --state a restart resumes in the policy it had
+ * picked, with its statistics.
+ */
+static struct adaptive_stats window_base __model;
+
+// Per-policy 시간 통계
 struct policy_stats {
-	u64 hits;
-	u64 misses;
-	u64 evictions;
 	u64 time_started;
 	u64 time_active;
 };
 
-static struct policy_stats stats[5] = {0};  // 5개 정책
+static struct policy_stats stats[NR_POLICIES] __model = {0};  // 5개 정책
 
 // 정책 전환
-static u32 current_policy = POLICY_MRU;
-static u64 last_policy_switch_time = 0;
-static u32 policy_switch_count = 0;
+static u32 current_policy __model = POLICY_MRU;
+static u64 last_policy_switch_time __model = 0;
+static u32 policy_switch_count __model = 0;
 
 // 각 정책별 리스트
 static u64 mru_list = 0;
@@ -81,55 +130,67 @@ static u64 s3fifo_small_list = 0;
 static u64 s3fifo_main_list = 0;
 static u64 lhd_list = 0;
 
-// S3-FIFO 상태
+/*
+ * Lists that still hold folios queued by an earlier policy, one bit per list.
+ * After a switch, evict_folios drains them into the new policy's list
+ * MIGRATE_BATCH folios at a time, see migrate_step().
+ */
+enum adaptive_list {
+	LIST_MRU = 0,
+	LIST_FIFO,
+	LIST_LRU,
+	LIST_S3FIFO_SMALL,
+	LIST_S3FIFO_MAIN,
+	LIST_LHD,
+	NR_LISTS,
+};
+
+static u32 migrate_pending = 0;
+
+// S3-FIFO 상태: exact list sizes, see s3fifo_account()
 static s64 s3fifo_small_size = 0;
 static s64 s3fifo_main_size = 0;
 
+// Cgroup size in pages, refreshed from the live memory.max on every eviction
+static u64 cache_size_pages = CACHE_SIZE_FALLBACK;
+
 // ===== Per-folio 메타데이터 =====
 struct folio_metadata {
 	u64 added_time;
 	u64 last_access_time;
 	u64 access_count;
 	u32 current_policy;
+	u32 nr_pages;	// Pages counted in the S3-FIFO sizes and the working set
 
 	// S3-FIFO용
 	s64 freq;
 	bool in_main;
+	bool s3fifo_queued;  // Counted in s3fifo_small_size/s3fifo_main_size
 
 	// LHD용 (간소화)
 	u64 last_hit_age;
 };
 
-struct {
-	__uint(type, BPF_MAP_TYPE_HASH);
-	__type(key, u64);
-	__type(value, struct folio_metadata);
-	__uint(max_entries, 4000000);
-} folio_metadata_map SEC(".maps");
-
-// 🆕 Working set 추적 (최근 접근 inodes)
-struct {
-	__uint(type, BPF_MAP_TYPE_LRU_HASH);
-	__type(key, u64);  // inode
-	__type(value, u8);
-	__uint(max_entries, 100000);
-} working_set_map SEC(".maps");
+#include "cache_ext_folio_store.bpf.h"
+#include "cache_ext_shadow.bpf.h"
 
 // ===== 이벤트 =====
+// Compact fixed-size record (48 bytes): ratios in %, averages saturate at U32_MAX
 struct policy_switch_event {
-	u32 old_policy;
-	u32 new_policy;
 	u64 timestamp;
-	u64 hit_rate;
 	u64 total_accesses;
-	u64 one_time_ratio;
-	u64 sequential_ratio;
-	u64 avg_hits_per_page;
-	u64 avg_reuse_distance;
-	u64 dirty_ratio;
-	u64 old_policy_hit_rate;
-	u64 working_set_size;        // 🆕
-	u64 working_set_ratio;       // 🆕 (WS / Cache) * 100
+	u64 working_set_size;
+	u32 avg_hits_per_page;
+	u32 avg_reuse_distance;
+	u32 working_set_ratio;       // (WS / Cache) * 100
+	u8 old_policy;
+	u8 new_policy;
+	u8 hit_rate;
+	u8 old_policy_hit_rate;
+	u8 one_time_ratio;
+	u8 sequential_ratio;
+	u8 dirty_ratio;
+	u8 __pad[5];
 };
 
 struct {
@@ -147,91 +208,127 @@ static inline bool is_folio_relevant(struct folio *folio)
 
 static inline struct folio_metadata *get_folio_metadata(struct folio *folio)
 {
-	u64 key = (u64)folio;
-	return bpf_map_lookup_elem(&folio_metadata_map, &key);
+	return folio_store_lookup(folio);
+}
+
+static inline struct adaptive_pcpu *get_pcpu(void)
+{
+	u32 key = 0;
+	return bpf_map_lookup_elem(&adaptive_pcpu_map, &key);
+}
+
+// Sum the per-CPU counters into *out.
+static void aggregate_stats(struct adaptive_stats *out)
+{
+	u64 *dst = (u64 *)out;
+	u32 key = 0;
+	int cpu;
+
+	__builtin_memset(out, 0, sizeof(*out));
+
+	bpf_for(cpu, 0, MAX_CPUS) {
+		struct adaptive_pcpu *pcpu =
+			bpf_map_lookup_percpu_elem(&adaptive_pcpu_map, &key, cpu);
+		if (!pcpu)
+			break;
+
+		u64 *src = (u64 *)&pcpu->stats;
+		for (int i = 0; i < NR_STAT_WORDS; i++)
+			dst[i] += src[i];
+	}
 }
 
 // ===== 메트릭 계산 =====
-static inline u64 calculate_hit_rate(void)
+// Window hit rate: hits/accesses since the last policy switch.
+static inline u64 calculate_hit_rate(struct adaptive_stats *t)
 {
-	if (total_accesses == 0)
+	u64 accesses = t->total_accesses - window_base.total_accesses;
+	u64 hits = t->cache_hits - window_base.cache_hits;
+
+	if (accesses == 0)
 		return 0;
-	return (cache_hits * 100) / total_accesses;
+	return (hits * 100) / accesses;
 }
 
-static inline u64 calculate_one_time_ratio(void)
+static inline u64 calculate_one_time_ratio(struct adaptive_stats *t)
 {
-	u64 total = one_time_accesses + multi_accesses;
+	u64 total = t->one_time_accesses + t->multi_accesses;
 	if (total == 0)
 		return 0;
-	return (one_time_accesses * 100) / total;
+	return (t->one_time_accesses * 100) / total;
 }
 
-static inline u64 calculate_sequential_ratio(void)
+static inline u64 calculate_sequential_ratio(struct adaptive_stats *t)
 {
-	u64 total = sequential_accesses + random_accesses;
+	u64 total = t->sequential_accesses + t->random_accesses;
 	if (total == 0)
 		return 0;
-	return (sequential_accesses * 100) / total;
+	return (t->sequential_accesses * 100) / total;
 }
 
-static inline u64 calculate_avg_hits_per_page(void)
+static inline u64 calculate_avg_hits_per_page(struct adaptive_stats *t)
 {
-	if (pages_evicted == 0)
+	if (t->pages_evicted == 0)
 		return 0;
-	return total_hits_sum / pages_evicted;
+	return t->total_hits_sum / t->pages_evicted;
 }
 
-static inline u64 calculate_avg_reuse_distance(void)
+static inline u64 calculate_avg_reuse_distance(struct adaptive_stats *t)
 {
-	if (reuse_distance_count == 0)
+	if (t->reuse_distance_count == 0)
 		return 0;
-	return reuse_distance_sum / reuse_distance_count;
+	return t->reuse_distance_sum / t->reuse_distance_count;
 }
 
-static inline u64 calculate_dirty_ratio(void)
+static inline u64 calculate_dirty_ratio(struct adaptive_stats *t)
 {
-	if (total_evictions == 0)
+	if (t->total_evictions == 0)
 		return 0;
-	return (dirty_evictions * 100) / total_evictions;
+	return (t->dirty_evictions * 100) / t->total_evictions;
 }
 
-static inline u64 calculate_policy_hit_rate(struct policy_stats *st)
+static inline u64 calculate_policy_hit_rate(struct adaptive_stats *t, u32 policy)
 {
-	u64 total = st->hits + st->misses;
+	if (policy >= NR_POLICIES)
+		return 0;
+
+	u64 total = t->policy_hits[policy] + t->policy_misses[policy];
 	if (total == 0)
 		return 0;
-	return (st->hits * 100) / total;
+	return (t->policy_hits[policy] * 100) / total;
 }
 
 // 🆕 Working set ratio 계산
-static inline u64 calculate_working_set_ratio(void)
+static inline u64 calculate_working_set_ratio(struct adaptive_stats *t)
 {
-	if (CACHE_SIZE_ESTIMATE == 0)
+	u64 cache_pages = READ_ONCE(cache_size_pages);
+
+	if (cache_pages == 0)
 		return 0;
-	return (working_set_size * 100) / CACHE_SIZE_ESTIMATE;
+	return (t->working_set_size * 100) / cache_pages;
 }
 
 // ===== Per-policy 통계 업데이트 =====
-static inline void update_policy_stats(u32 policy, bool is_hit)
+static inline void update_policy_stats(struct adaptive_stats *st, u32 policy,
+				       bool is_hit)
 {
-	if (policy >= 5)
+	if (policy >= NR_POLICIES)
 		return;
 
 	if (is_hit)
-		__sync_fetch_and_add(&stats[policy].hits, 1);
+		st->policy_hits[policy]++;
 	else
-		__sync_fetch_and_add(&stats[policy].misses, 1);
+		st->policy_misses[policy]++;
 }
 
 // ===== 정책 선택 로직 =====
-static u32 decide_best_policy(void)
+static u32 decide_best_policy(struct adaptive_stats *t)
 {
-	u64 one_time_ratio = calculate_one_time_ratio();
-	u64 sequential_ratio = calculate_sequential_ratio();
-	u64 avg_hits = calculate_avg_hits_per_page();
-	u64 avg_reuse_dist = calculate_avg_reuse_distance();
-	u64 ws_ratio = calculate_working_set_ratio();
+	u64 one_time_ratio = calculate_one_time_ratio(t);
+	u64 sequential_ratio = calculate_sequential_ratio(t);
+	u64 avg_hits = calculate_avg_hits_per_page(t);
+	u64 avg_reuse_dist = calculate_avg_reuse_distance(t);
+	u64 ws_ratio = calculate_working_set_ratio(t);
 
 	// 🆕 Working set 기반 판단
 	if (ws_ratio > 300) {
@@ -280,8 +377,8 @@ static u32 decide_best_policy(void)
 	u64 best_perf = 0;
 	u32 best_policy = POLICY_LRU;
 
-	for (int i = 0; i < 5; i++) {
-		u64 perf = calculate_policy_hit_rate(&stats[i]);
+	for (int i = 0; i < NR_POLICIES; i++) {
+		u64 perf = calculate_policy_hit_rate(t, i);
 		if (perf > best_perf) {
 			best_perf = perf;
 			best_policy = i;
@@ -293,77 +390,130 @@ static u32 decide_best_policy(void)
 	return best_policy;
 }
 
+/*
+ * Pick the policy the shadow caches say wins, if the simulations have seen
+ * enough samples. Only moves away from the current policy if the winner is
+ * ahead by SHADOW_SWITCH_MARGIN, so near-ties don't cause flapping.
+ * Returns -1 if no verdict is available yet.
+ */
+static inline int decide_shadow_policy(void)
+{
+	struct shadow_verdict *v = shadow_get_verdict();
+	u32 cur = current_policy;
+
+	if (!v || !v->generation || v->nr_samples < SHADOW_MIN_SAMPLES)
+		return -1;
+
+	u32 best = v->best_policy;
+	if (best >= NR_POLICIES || cur >= NR_POLICIES)
+		return -1;
+
+	if (v->hit_rate[best] < v->hit_rate[cur] + SHADOW_SWITCH_MARGIN)
+		return cur;
+
+	bpf_printk("Decision: Policy %d (shadow hit rate %u vs %u)\n",
+		   best, v->hit_rate[best], v->hit_rate[cur]);
+	return best;
+}
+
 // ===== 정책 전환 체크 =====
-static void check_and_switch_policy(void)
+// Bitmask of the adaptive_list entries a policy queues folios on
+static inline u32 policy_lists(u32 policy)
+{
+	switch (policy) {
+	case POLICY_MRU:
+		return 1 << LIST_MRU;
+	case POLICY_FIFO:
+		return 1 << LIST_FIFO;
+	case POLICY_LRU:
+		return 1 << LIST_LRU;
+	case POLICY_S3FIFO:
+		return (1 << LIST_S3FIFO_SMALL) | (1 << LIST_S3FIFO_MAIN);
+	case POLICY_LHD_SIMPLE:
+		return 1 << LIST_LHD;
+	}
+	return 0;
+}
+
+static void check_and_switch_policy(struct adaptive_stats *t)
 {
 	u64 hit_rate;
 	u32 new_policy;
 	struct policy_switch_event *event;
+	u64 window_accesses = t->total_accesses - window_base.total_accesses;
 
-	if (total_accesses < MIN_SAMPLES)
+	if (window_accesses < MIN_SAMPLES)
 		return;
 
 	u64 time_since_switch = timestamp - last_policy_switch_time;
 	if (time_since_switch < MIN_TIME_IN_POLICY)
 		return;
 
-	hit_rate = calculate_hit_rate();
+	hit_rate = calculate_hit_rate(t);
 
-	if (hit_rate >= HIT_RATE_THRESHOLD)
-		return;
+	/*
+	 * Prefer the shadow caches' counterfactual estimates. Fall back to
+	 * heuristics and trial and error until they have enough samples.
+	 */
+	int shadow_policy = decide_shadow_policy();
+	if (shadow_policy >= 0) {
+		new_policy = shadow_policy;
+	} else {
+		if (hit_rate >= HIT_RATE_THRESHOLD)
+			return;
 
-	new_policy = decide_best_policy();
+		new_policy = decide_best_policy(t);
+	}
 
 	if (new_policy == current_policy)
 		return;
 
 	// Bounds check for verifier
 	u32 old_policy = current_policy;
-	if (old_policy < 5) {
+	if (old_policy < NR_POLICIES) {
 		stats[old_policy].time_active = timestamp - stats[old_policy].time_started;
 	}
 
-	event = bpf_ringbuf_reserve(&events, sizeof(*event), 0);
+	event = events_reserve(&events, sizeof(*event));
 	if (event) {
 		event->old_policy = current_policy;
 		event->new_policy = new_policy;
 		event->timestamp = timestamp;
 		event->hit_rate = hit_rate;
-		event->total_accesses = total_accesses;
-		event->one_time_ratio = calculate_one_time_ratio();
-		event->sequential_ratio = calculate_sequential_ratio();
-		event->avg_hits_per_page = calculate_avg_hits_per_page();
-		event->avg_reuse_distance = calculate_avg_reuse_distance();
-		event->dirty_ratio = calculate_dirty_ratio();
-
-		// Bounds check for verifier
-		if (old_policy < 5) {
-			event->old_policy_hit_rate = calculate_policy_hit_rate(&stats[old_policy]);
-		} else {
-			event->old_policy_hit_rate = 0;
-		}
-
-		event->working_set_size = working_set_size;
-		event->working_set_ratio = calculate_working_set_ratio();
-
-		bpf_ringbuf_submit(event, 0);
+		event->total_accesses = window_accesses;
+		event->one_time_ratio = calculate_one_time_ratio(t);
+		event->sequential_ratio = calculate_sequential_ratio(t);
+		event->avg_hits_per_page = min(calculate_avg_hits_per_page(t), U32_MAX);
+		event->avg_reuse_distance = min(calculate_avg_reuse_distance(t), U32_MAX);
+		event->dirty_ratio = calculate_dirty_ratio(t);
+		event->old_policy_hit_rate = calculate_policy_hit_rate(t, old_policy);
+		event->working_set_size = t->working_set_size;
+		event->working_set_ratio = min(calculate_working_set_ratio(t), U32_MAX);
+		__builtin_memset(event->__pad, 0, sizeof(event->__pad));
+
+		events_submit(&events, event);
 	}
 
+
 	bpf_printk("Policy switch: %d -> %d (hit_rate=%llu%%, ws_ratio=%llu%%)\n",
-		   current_policy, new_policy, hit_rate, calculate_working_set_ratio());
+		   current_policy, new_policy, hit_rate, calculate_working_set_ratio(t));
+
+	// Old lists drain lazily; a list we switch back to needs no migration
+	__sync_fetch_and_or(&migrate_pending, policy_lists(old_policy));
+	__sync_fetch_and_and(&migrate_pending, ~policy_lists(new_policy));
 
 	current_policy = new_policy;
 	last_policy_switch_time = timestamp;
 	policy_switch_count++;
+	cache_ext_stat_inc(CACHE_EXT_STAT_POLICY_SWITCHES);
 
 	// Bounds check for verifier
-	if (new_policy < 5) {
+	if (new_policy < NR_POLICIES) {
 		stats[new_policy].time_started = timestamp;
 	}
 
-	total_accesses = 0;
-	cache_hits = 0;
-	cache_misses = 0;
+	// Start a new measurement window
+	window_base = *t;
 }
 
 // ===== 개별 정책 구현 =====
@@ -381,6 +531,8 @@ static void mru_handle_accessed(struct folio *folio)
 
 static int mru_iterate_fn(int idx, struct cache_ext_list_node *node)
 {
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+
 	if ((idx < 200) && (!folio_test_uptodate(node->folio) ||
 			    !folio_test_lru(node->folio)))
 		return CACHE_EXT_CONTINUE_ITER;
@@ -395,6 +547,8 @@ static void fifo_handle_added(struct folio *folio)
 
 static int fifo_iterate_fn(int idx, struct cache_ext_list_node *node)
 {
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+
 	if (!folio_test_uptodate(node->folio) || !folio_test_lru(node->folio))
 		return CACHE_EXT_CONTINUE_ITER;
 	return CACHE_EXT_EVICT_NODE;
@@ -413,18 +567,52 @@ static void lru_handle_accessed(struct folio *folio)
 
 static int lru_iterate_fn(int idx, struct cache_ext_list_node *node)
 {
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+
 	if (!folio_test_uptodate(node->folio) || !folio_test_lru(node->folio))
 		return CACHE_EXT_CONTINUE_ITER;
 	return CACHE_EXT_EVICT_NODE;
 }
 
 // S3-FIFO
+static inline void s3fifo_unaccount(struct folio_metadata *meta)
+{
+	if (!meta->s3fifo_queued)
+		return;
+	meta->s3fifo_queued = false;
+	if (meta->in_main)
+		__sync_fetch_and_sub(&s3fifo_main_size, meta->nr_pages);
+	else
+		__sync_fetch_and_sub(&s3fifo_small_size, meta->nr_pages);
+}
+
+// Account a folio continued from the small list, which moves it to main
+static inline void s3fifo_promote(struct folio_metadata *meta)
+{
+	if (meta->in_main)
+		return;
+	meta->in_main = true;
+	if (meta->s3fifo_queued) {
+		__sync_fetch_and_sub(&s3fifo_small_size, meta->nr_pages);
+		__sync_fetch_and_add(&s3fifo_main_size, meta->nr_pages);
+	}
+}
+
+// Without metadata the folio is queued but not counted in the queue sizes
 static void s3fifo_handle_added(struct folio *folio, struct folio_metadata *meta)
 {
-	meta->freq = 0;
-	meta->in_main = false;
-	bpf_cache_ext_list_add_tail(s3fifo_small_list, folio);
-	__sync_fetch_and_add(&s3fifo_small_size, 1);
+	if (meta) {
+		meta->freq = 0;
+		meta->in_main = false;
+	}
+	if (bpf_cache_ext_list_add_tail(s3fifo_small_list, folio)) {
+		bpf_printk("Failed to add folio to s3fifo_small_list\n");
+		return;
+	}
+	if (!meta)
+		return;
+	meta->s3fifo_queued = true;
+	__sync_fetch_and_add(&s3fifo_small_size, meta->nr_pages);
 }
 
 static void s3fifo_handle_accessed(struct folio *folio, struct folio_metadata *meta)
@@ -433,18 +621,25 @@ static void s3fifo_handle_accessed(struct folio *folio, struct folio_metadata *m
 		meta->freq++;
 }
 
+// Every folio we continue on goes to s3fifo_main_list (continue_list)
 static int s3fifo_small_iterate_fn(int idx, struct cache_ext_list_node *node)
 {
-	if (!folio_test_uptodate(node->folio) || !folio_test_lru(node->folio))
+	struct folio_metadata *meta = get_folio_metadata(node->folio);
+
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+	if (!folio_test_uptodate(node->folio) || !folio_test_lru(node->folio)) {
+		if (meta)
+			s3fifo_promote(meta);
 		return CACHE_EXT_CONTINUE_ITER;
+	}
 
-	struct folio_metadata *meta = get_folio_metadata(node->folio);
+	// No metadata (the store was full): treat it as never hit
 	if (!meta)
-		return CACHE_EXT_CONTINUE_ITER;
+		return CACHE_EXT_EVICT_NODE;
 
 	if (meta->freq > 1) {
 		// Main으로 이동
-		meta->in_main = true;
+		s3fifo_promote(meta);
 		return CACHE_EXT_CONTINUE_ITER;
 	}
 
@@ -453,14 +648,13 @@ static int s3fifo_small_iterate_fn(int idx, struct cache_ext_list_node *node)
 
 static int s3fifo_main_iterate_fn(int idx, struct cache_ext_list_node *node)
 {
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+
 	if (!folio_test_uptodate(node->folio) || !folio_test_lru(node->folio))
 		return CACHE_EXT_CONTINUE_ITER;
 
 	struct folio_metadata *meta = get_folio_metadata(node->folio);
-	if (!meta)
-		return CACHE_EXT_CONTINUE_ITER;
-
-	if (meta->freq > 0) {
+	if (meta && meta->freq > 0) {
 		meta->freq--;
 		return CACHE_EXT_CONTINUE_ITER;
 	}
@@ -471,7 +665,8 @@ static int s3fifo_main_iterate_fn(int idx, struct cache_ext_list_node *node)
 // LHD (간소화 버전 - hit age 기반)
 static void lhd_handle_added(struct folio *folio, struct folio_metadata *meta)
 {
-	meta->last_hit_age = 0;
+	if (meta)
+		meta->last_hit_age = 0;
 	bpf_cache_ext_list_add_tail(lhd_list, folio);
 }
 
@@ -483,11 +678,9 @@ static void lhd_handle_accessed(struct folio *folio, struct folio_metadata *meta
 
 static int lhd_iterate_fn(int idx, struct cache_ext_list_node *node)
 {
-	if (!folio_test_uptodate(node->folio) || !folio_test_lru(node->folio))
-		return CACHE_EXT_CONTINUE_ITER;
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
 
-	struct folio_metadata *meta = get_folio_metadata(node->folio);
-	if (!meta)
+	if (!folio_test_uptodate(node->folio) || !folio_test_lru(node->folio))
 		return CACHE_EXT_CONTINUE_ITER;
 
 	// Hit age가 큰 것 (오래 전에 hit) 우선 evict
@@ -495,6 +688,197 @@ static int lhd_iterate_fn(int idx, struct cache_ext_list_node *node)
 	return CACHE_EXT_EVICT_NODE;
 }
 
+// ===== 정책 전환 시 migration =====
+
+static inline u64 adaptive_list_id(u32 list)
+{
+	switch (list) {
+	case LIST_MRU:
+		return mru_list;
+	case LIST_FIFO:
+		return fifo_list;
+	case LIST_LRU:
+		return lru_list;
+	case LIST_S3FIFO_SMALL:
+		return s3fifo_small_list;
+	case LIST_S3FIFO_MAIN:
+		return s3fifo_main_list;
+	case LIST_LHD:
+		return lhd_list;
+	}
+	return 0;
+}
+
+/*
+ * Hand a folio over to the policy now active. Migrated folios enter S3-FIFO
+ * straight in main, with their access history as the initial frequency.
+ */
+static inline void migrate_folio_meta(struct folio_metadata *meta, u32 policy)
+{
+	s3fifo_unaccount(meta);
+	meta->current_policy = policy;
+
+	switch (policy) {
+	case POLICY_S3FIFO:
+		meta->freq = min(meta->access_count, 3);
+		meta->in_main = true;
+		meta->s3fifo_queued = true;
+		__sync_fetch_and_add(&s3fifo_main_size, meta->nr_pages);
+		break;
+	case POLICY_LHD_SIMPLE:
+		meta->last_hit_age = 0;
+		break;
+	}
+}
+
+/*
+ * Continued folios are moved to the new policy's list (continue_list). Once
+ * the batch is full, evict from the old list as the old policy would, which
+ * ends the walk as soon as the eviction request is met.
+ */
+static int migrate_iterate_fn(int idx, struct cache_ext_list_node *node)
+{
+	struct folio_metadata *meta;
+
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+	if (idx >= MIGRATE_BATCH && folio_test_uptodate(node->folio) &&
+	    folio_test_lru(node->folio) && !folio_test_dirty(node->folio) &&
+	    !folio_test_writeback(node->folio))
+		return CACHE_EXT_EVICT_NODE;
+
+	meta = get_folio_metadata(node->folio);
+	if (meta)
+		migrate_folio_meta(meta, current_policy);
+	return CACHE_EXT_CONTINUE_ITER;
+}
+
+/*
+ * Move up to MIGRATE_BATCH folios from one pending list into the current
+ * policy's list, so a switch never walks the whole cache at once. Folios
+ * left behind are still evicted and deleted normally.
+ */
+static void migrate_step(struct cache_ext_eviction_ctx *eviction_ctx,
+			 struct mem_cgroup *memcg)
+{
+	u32 pending = READ_ONCE(migrate_pending);
+	u32 policy = current_policy;
+	u32 list = NR_LISTS;
+	int ret;
+
+	if (!pending)
+		return;
+
+	for (u32 i = 0; i < NR_LISTS; i++) {
+		if (pending & (1 << i)) {
+			list = i;
+			break;
+		}
+	}
+	if (list >= NR_LISTS)
+		return;
+
+	struct cache_ext_iterate_opts opts = {
+		.evict_list = CACHE_EXT_ITERATE_SELF,
+		.evict_mode = CACHE_EXT_ITERATE_TAIL,
+	};
+
+	/*
+	 * Migrated folios are older than anything added since the switch, so
+	 * they go to the eviction end: the head for FIFO-ordered lists, the
+	 * tail for MRU (which evicts from the head).
+	 */
+	switch (policy) {
+	case POLICY_MRU:
+		opts.continue_list = mru_list;
+		opts.continue_mode = CACHE_EXT_ITERATE_TAIL;
+		break;
+	case POLICY_FIFO:
+		opts.continue_list = fifo_list;
+		opts.continue_mode = CACHE_EXT_ITERATE_HEAD;
+		break;
+	case POLICY_LRU:
+		opts.continue_list = lru_list;
+		opts.continue_mode = CACHE_EXT_ITERATE_HEAD;
+		break;
+	case POLICY_S3FIFO:
+		opts.continue_list = s3fifo_main_list;
+		opts.continue_mode = CACHE_EXT_ITERATE_HEAD;
+		break;
+	case POLICY_LHD_SIMPLE:
+		opts.continue_list = lhd_list;
+		opts.continue_mode = CACHE_EXT_ITERATE_HEAD;
+		break;
+	default:
+		return;
+	}
+
+	ret = bpf_cache_ext_list_iterate_extended(memcg, adaptive_list_id(list),
+						  migrate_iterate_fn, &opts,
+						  eviction_ctx);
+	if (ret < 0) {
+		bpf_printk("Migration from list %u failed: %d\n", list, ret);
+		return;
+	}
+
+	// A short batch means the list has been drained
+	if (opts.nr_folios_continue < MIGRATE_BATCH)
+		__sync_fetch_and_and(&migrate_pending, ~(1 << list));
+}
+
+/*
+ * Promoted readahead enters the policy now active as if it had just been
+ * added, moved off ra_probation_list rather than inserted. meta is NULL if
+ * the folio store was full when it was added.
+ */
+static void ra_handle_promoted(struct folio *folio, struct folio_metadata *meta)
+{
+	u32 policy = current_policy;
+	bool tail = true;
+	u64 list;
+
+	if (meta) {
+		s3fifo_unaccount(meta);
+		meta->current_policy = policy;
+	}
+
+	switch (policy) {
+	case POLICY_MRU:
+		list = mru_list;
+		tail = false;
+		break;
+	case POLICY_FIFO:
+		list = fifo_list;
+		break;
+	case POLICY_LRU:
+		list = lru_list;
+		break;
+	case POLICY_S3FIFO:
+		if (meta) {
+			meta->freq = 0;
+			meta->in_main = false;
+		}
+		list = s3fifo_small_list;
+		break;
+	case POLICY_LHD_SIMPLE:
+		if (meta)
+			meta->last_hit_age = 0;
+		list = lhd_list;
+		break;
+	default:
+		return;
+	}
+
+	if (bpf_cache_ext_list_move(list, folio, tail)) {
+		bpf_printk("Failed to move promoted folio\n");
+		return;
+	}
+
+	if (meta && policy == POLICY_S3FIFO) {
+		meta->s3fifo_queued = true;
+		__sync_fetch_and_add(&s3fifo_small_size, meta->nr_pages);
+	}
+}
+
 // ===== cache_ext_ops 훅 =====
 
 s32 BPF_STRUCT_OPS_SLEEPABLE(adaptive_v3_init, struct mem_cgroup *memcg)
@@ -514,13 +898,26 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(adaptive_v3_init, struct mem_cgroup *memcg)
 		return -1;
 	}
 
+	if (ra_probation_init(memcg))
+		return -1;
+
+	if (mrc_init(memcg))
+		bpf_printk("Failed to create MRC state\n");
+
+	// A restored model resumes with the policy it had picked
+	if (model_valid) {
+		bpf_printk("Adaptive v3 resumed in policy %u\n", current_policy);
+		return 0;
+	}
+
 	current_policy = POLICY_MRU;
 	last_policy_switch_time = 0;
 
 	// Initialize stats for first policy
-	if (POLICY_MRU < 5) {
+	if (POLICY_MRU < NR_POLICIES) {
 		stats[POLICY_MRU].time_started = 0;
 	}
+	model_valid = 1;
 
 	bpf_printk("Adaptive v3 initialized: MRU, FIFO, LRU, S3-FIFO, LHD\n");
 	return 0;
@@ -528,15 +925,27 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(adaptive_v3_init, struct mem_cgroup *memcg)
 
 void BPF_STRUCT_OPS(adaptive_v3_folio_added, struct folio *folio)
 {
+	PROF_SCOPE(PROF_FOLIO_ADDED);
+	cache_ext_trace(CACHE_EXT_TRACE_ADD, folio);
 	if (!is_folio_relevant(folio))
 		return;
 
-	u64 key = (u64)folio;
+	cache_ext_stat_inc(CACHE_EXT_STAT_MISSES);
+
+	shadow_sample_access(folio);
+	mrc_access(folio);
+
+	struct adaptive_pcpu *pcpu = get_pcpu();
+	if (!pcpu)
+		return;
+
+	struct folio_metadata *new_meta;
 	struct folio_metadata meta = {
 		.added_time = timestamp,
 		.last_access_time = timestamp,
 		.access_count = 0,
 		.current_policy = current_policy,
+		.nr_pages = folio_nr_pages(folio),
 		.freq = 0,
 		.in_main = false,
 		.last_hit_age = 0,
@@ -546,69 +955,98 @@ void BPF_STRUCT_OPS(adaptive_v3_folio_added, struct folio *folio)
 	u64 curr_inode = (u64)folio->mapping->host;
 	u64 curr_offset = folio->index;
 
-	if (curr_inode == last_inode && curr_offset == last_offset + 1) {
-		__sync_fetch_and_add(&sequential_accesses, 1);
+	if (curr_inode == pcpu->last_inode && curr_offset == pcpu->last_offset + 1) {
+		pcpu->stats.sequential_accesses++;
 	} else {
-		__sync_fetch_and_add(&random_accesses, 1);
+		pcpu->stats.random_accesses++;
 	}
 
-	last_inode = curr_inode;
-	last_offset = curr_offset;
+	pcpu->last_inode = curr_inode;
+	pcpu->last_offset = curr_offset;
 
 	// 🆕 Working set 업데이트
-	u8 dummy = 1;
-	bpf_map_update_elem(&working_set_map, &curr_inode, &dummy, BPF_ANY);
 	// 근사치: 엔트리 추가마다 증가 (정확하지 않지만 트렌드는 파악)
-	__sync_fetch_and_add(&working_set_size, 1);
-
-	bpf_map_update_elem(&folio_metadata_map, &key, &meta, BPF_ANY);
-
-	// 정책별 처리
-	switch (current_policy) {
-	case POLICY_MRU:
-		mru_handle_added(folio);
-		break;
-	case POLICY_FIFO:
-		fifo_handle_added(folio);
-		break;
-	case POLICY_LRU:
-		lru_handle_added(folio);
-		break;
-	case POLICY_S3FIFO:
-		s3fifo_handle_added(folio, &meta);
-		break;
-	case POLICY_LHD_SIMPLE:
-		lhd_handle_added(folio, &meta);
-		break;
+	pcpu->stats.working_set_size += meta.nr_pages;
+
+	// Re-added without folio_evicted: drop it from the S3-FIFO sizes first
+	struct folio_metadata *old_meta = get_folio_metadata(folio);
+	if (old_meta)
+		s3fifo_unaccount(old_meta);
+
+	// A full store still lists the folio, the handlers take a NULL meta
+	new_meta = folio_store_insert(folio, &meta);
+
+	// Prefetched folios wait on probation instead, see cache_ext_readahead.bpf.h
+	if (!ra_probation_admit(folio)) {
+		// 정책별 처리
+		switch (current_policy) {
+		case POLICY_MRU:
+			mru_handle_added(folio);
+			break;
+		case POLICY_FIFO:
+			fifo_handle_added(folio);
+			break;
+		case POLICY_LRU:
+			lru_handle_added(folio);
+			break;
+		case POLICY_S3FIFO:
+			s3fifo_handle_added(folio, new_meta);
+			break;
+		case POLICY_LHD_SIMPLE:
+			lhd_handle_added(folio, new_meta);
+			break;
+		}
 	}
 
-	__sync_fetch_and_add(&cache_misses, 1);
-	__sync_fetch_and_add(&total_accesses, 1);
-	update_policy_stats(current_policy, false);
+	pcpu->stats.cache_misses++;
+	pcpu->stats.total_accesses++;
+	update_policy_stats(&pcpu->stats, current_policy, false);
 	__sync_fetch_and_add(&timestamp, 1);
 }
 
 void BPF_STRUCT_OPS(adaptive_v3_folio_accessed, struct folio *folio)
 {
+	PROF_SCOPE(PROF_FOLIO_ACCESSED);
+	cache_ext_trace(CACHE_EXT_TRACE_ACCESS, folio);
 	if (!is_folio_relevant(folio))
 		return;
 
+	cache_ext_stat_inc(CACHE_EXT_STAT_HITS);
+
+	shadow_sample_access(folio);
+	mrc_access(folio);
+
 	struct folio_metadata *meta = get_folio_metadata(folio);
+
+	if (ra_probation_promote(folio))
+		ra_handle_promoted(folio, meta);
 	if (!meta)
 		return;
 
+	struct adaptive_pcpu *pcpu = get_pcpu();
+	if (!pcpu)
+		return;
+
 	// Reuse distance
 	if (meta->access_count > 0) {
 		u64 reuse_dist = timestamp - meta->last_access_time;
-		__sync_fetch_and_add(&reuse_distance_sum, reuse_dist);
-		__sync_fetch_and_add(&reuse_distance_count, 1);
+		pcpu->stats.reuse_distance_sum += reuse_dist;
+		pcpu->stats.reuse_distance_count++;
 	}
 
 	meta->last_access_time = timestamp;
 	meta->access_count++;
 
+	// MRU/LRU move the folio onto their own list, which migrates it early
+	u32 policy = current_policy;
+	if (meta->current_policy != policy &&
+	    (policy == POLICY_MRU || policy == POLICY_LRU)) {
+		s3fifo_unaccount(meta);
+		meta->current_policy = policy;
+	}
+
 	// 정책별 처리
-	switch (current_policy) {
+	switch (policy) {
 	case POLICY_MRU:
 		mru_handle_accessed(folio);
 		break;
@@ -625,57 +1063,58 @@ void BPF_STRUCT_OPS(adaptive_v3_folio_accessed, struct folio *folio)
 		break;
 	}
 
-	__sync_fetch_and_add(&cache_hits, 1);
-	__sync_fetch_and_add(&total_accesses, 1);
-	update_policy_stats(current_policy, true);
+	pcpu->stats.cache_hits++;
+	pcpu->stats.total_accesses++;
+	update_policy_stats(&pcpu->stats, current_policy, true);
 	__sync_fetch_and_add(&timestamp, 1);
 }
 
 void BPF_STRUCT_OPS(adaptive_v3_folio_evicted, struct folio *folio)
 {
-	u64 key = (u64)folio;
+	PROF_SCOPE(PROF_FOLIO_EVICTED);
+	cache_ext_trace(CACHE_EXT_TRACE_EVICT, folio);
 	struct folio_metadata *meta = get_folio_metadata(folio);
+	struct adaptive_pcpu *pcpu = get_pcpu();
+	if (!pcpu)
+		return;
 
 	if (meta) {
 		// One-time vs Multi
 		if (meta->access_count <= 1) {
-			__sync_fetch_and_add(&one_time_accesses, 1);
+			pcpu->stats.one_time_accesses++;
 		} else {
-			__sync_fetch_and_add(&multi_accesses, 1);
+			pcpu->stats.multi_accesses++;
 		}
 
 		// Hits per page
-		__sync_fetch_and_add(&total_hits_sum, meta->access_count);
-		__sync_fetch_and_add(&pages_evicted, 1);
+		pcpu->stats.total_hits_sum += meta->access_count;
+		pcpu->stats.pages_evicted++;
 
 		// Lifetime & Idle
 		u64 lifetime = timestamp - meta->added_time;
 		u64 idle_time = timestamp - meta->last_access_time;
-		__sync_fetch_and_add(&total_lifetime_sum, lifetime);
-		__sync_fetch_and_add(&total_idle_time_sum, idle_time);
-
-		// S3-FIFO size 업데이트
-		if (current_policy == POLICY_S3FIFO) {
-			if (meta->in_main)
-				__sync_fetch_and_sub(&s3fifo_main_size, 1);
-			else
-				__sync_fetch_and_sub(&s3fifo_small_size, 1);
-		}
+		pcpu->stats.total_lifetime_sum += lifetime;
+		pcpu->stats.total_idle_time_sum += idle_time;
+
+		// S3-FIFO size 업데이트, regardless of the policy now active
+		s3fifo_unaccount(meta);
 	}
 
 	if (folio_test_dirty(folio)) {
-		__sync_fetch_and_add(&dirty_evictions, 1);
+		pcpu->stats.dirty_evictions++;
 	}
 
+	ra_probation_evicted(folio);
 	bpf_cache_ext_list_del(folio);
-	bpf_map_delete_elem(&folio_metadata_map, &key);
+	folio_store_delete(folio);
 
-	__sync_fetch_and_add(&total_evictions, 1);
+	pcpu->stats.total_evictions++;
+	cache_ext_stat_inc(CACHE_EXT_STAT_EVICTIONS);
 
 	// Bounds check for verifier
 	u32 policy = current_policy;
-	if (policy < 5) {
-		__sync_fetch_and_add(&stats[policy].evictions, 1);
+	if (policy < NR_POLICIES) {
+		pcpu->stats.policy_evictions[policy]++;
 	}
 }
 
@@ -683,10 +1122,41 @@ void BPF_STRUCT_OPS(adaptive_v3_evict_folios,
 		    struct cache_ext_eviction_ctx *eviction_ctx,
 		    struct mem_cgroup *memcg)
 {
+	PROF_EVICT_SCOPE(eviction_ctx);
+	EVICTION_TARGET_SCOPE(eviction_ctx);
 	int ret = 0;
 
-	if ((total_accesses % CHECK_INTERVAL) == 0) {
-		check_and_switch_policy();
+	u64 cache_pages = memcg_max_pages(memcg);
+	if (!cache_pages)
+		cache_pages = CACHE_SIZE_FALLBACK;
+	if (cache_pages != cache_size_pages)
+		WRITE_ONCE(cache_size_pages, cache_pages);
+
+	/*
+	 * Only sum up the per-CPU counters once this CPU has seen another
+	 * CHECK_INTERVAL accesses, so eviction doesn't walk all CPUs each time.
+	 */
+	struct adaptive_pcpu *pcpu = get_pcpu();
+	if (pcpu && pcpu->stats.total_accesses - pcpu->last_check_accesses >= CHECK_INTERVAL) {
+		struct adaptive_stats totals;
+
+		pcpu->last_check_accesses = pcpu->stats.total_accesses;
+		aggregate_stats(&totals);
+		// Distinct pages over the recent horizon, not pages ever added
+		u64 ws = mrc_working_set_pages(memcg);
+		if (ws)
+			totals.working_set_size = ws;
+		check_and_switch_policy(&totals);
+	}
+
+	migrate_step(eviction_ctx, memcg);
+	if (eviction_ctx_done(eviction_ctx))
+		return;
+
+	if (ra_probation_over_budget(memcg)) {
+		ra_probation_evict(eviction_ctx, memcg);
+		if (eviction_ctx_done(eviction_ctx))
+			return;
 	}
 
 	// 정책별 eviction
@@ -702,7 +1172,7 @@ void BPF_STRUCT_OPS(adaptive_v3_evict_folios,
 		break;
 	case POLICY_S3FIFO:
 		// Small queue 우선
-		if (s3fifo_small_size >= CACHE_SIZE_ESTIMATE / 10) {
+		if (s3fifo_small_size >= cache_pages / 10) {
 			struct cache_ext_iterate_opts opts = {
 				.continue_list = s3fifo_main_list,
 				.continue_mode = CACHE_EXT_ITERATE_TAIL,
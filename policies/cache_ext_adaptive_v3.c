@@ -5,12 +5,18 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "cache_ext_adaptive_v3.skel.h"
 #include "dir_watcher.h"
+#include "cache_ext_events.h"
+#include "cache_ext_folio_store.h"
+#include "cache_ext_shadow.h"
+#include "cache_ext_mrc.h"
+#include "cache_ext_readahead.h"
 
 static volatile bool exiting = false;
 
@@ -22,29 +28,54 @@ const char *policy_names[] = {
 	"LHD-Simple",
 };
 
-// 정책 전환 이벤트 (v3 - working set size 추가)
+// 정책 전환 이벤트 (must match the compact record in the BPF program)
 struct policy_switch_event {
-	unsigned int old_policy;
-	unsigned int new_policy;
 	unsigned long long timestamp;
-
-	// 기본 메트릭
-	unsigned long long hit_rate;
 	unsigned long long total_accesses;
+	unsigned long long working_set_size;
+	unsigned int avg_hits_per_page;
+	unsigned int avg_reuse_distance;
+	unsigned int working_set_ratio; // (WS / cache_size) * 100
+	unsigned char old_policy;
+	unsigned char new_policy;
+	unsigned char hit_rate;
+	unsigned char old_policy_hit_rate;
+	unsigned char one_time_ratio;
+	unsigned char sequential_ratio;
+	unsigned char dirty_ratio;
+	unsigned char __pad[5];
+};
 
-	// v2 메트릭
-	unsigned long long one_time_ratio;
-	unsigned long long sequential_ratio;
-	unsigned long long avg_hits_per_page;
-	unsigned long long avg_reuse_distance;
-	unsigned long long dirty_ratio;
-
-	// 이전 정책 성능
-	unsigned long long old_policy_hit_rate;
+#define NR_POLICIES 5
 
-	// v3 추가: Working set size
+// Per-CPU counters (must match struct adaptive_stats in the BPF program)
+struct adaptive_stats {
+	unsigned long long total_accesses;
+	unsigned long long cache_hits;
+	unsigned long long cache_misses;
+	unsigned long long total_evictions;
+	unsigned long long one_time_accesses;
+	unsigned long long multi_accesses;
+	unsigned long long sequential_accesses;
+	unsigned long long random_accesses;
+	unsigned long long total_hits_sum;
+	unsigned long long pages_evicted;
+	unsigned long long reuse_distance_sum;
+	unsigned long long reuse_distance_count;
+	unsigned long long total_lifetime_sum;
+	unsigned long long total_idle_time_sum;
+	unsigned long long dirty_evictions;
 	unsigned long long working_set_size;
-	unsigned long long working_set_ratio; // (WS / cache_size) * 100
+	unsigned long long policy_hits[NR_POLICIES];
+	unsigned long long policy_misses[NR_POLICIES];
+	unsigned long long policy_evictions[NR_POLICIES];
+};
+
+struct adaptive_pcpu {
+	struct adaptive_stats stats;
+	unsigned long long last_inode;
+	unsigned long long last_offset;
+	unsigned long long last_check_accesses;
 };
 
 char *USAGE =
@@ -57,17 +88,21 @@ char *USAGE =
 	"  - Sequential access ratio\n"
 	"  - Average hits per page\n"
 	"  - Average reuse distance\n"
-	"  - Per-policy performance tracking\n";
+	"  - Per-policy performance tracking\n"
+	"  - Sampled shadow caches of all policies to pick the next one\n";
 
 struct cmdline_args {
 	char *watch_dir;
 	char *cgroup_path;
+	double shadow_sample_pct;
 };
 
 static struct argp_option options[] = {
 	{ "watch_dir", 'w', "DIR", 0, "Directory to watch" },
 	{ "cgroup_path", 'c', "PATH", 0,
 	  "Path to cgroup (e.g., /sys/fs/cgroup/cache_ext_test)" },
+	{ "shadow_sample_pct", 'p', "PCT", 0,
+	  "Share of pages fed to the shadow caches (default: 1)" },
 	{ 0 }
 };
 
@@ -81,17 +116,84 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 	case 'c':
 		args->cgroup_path = arg;
 		break;
+	case 'p':
+		args->shadow_sample_pct = strtod(arg, NULL);
+		break;
 	default:
 		return ARGP_ERR_UNKNOWN;
 	}
 	return 0;
 }
 
+// The event pipeline's options, plus --mrc for the working set estimate and --readahead
+static struct argp_child adaptive_v3_argp_children[] = {
+	{ &cache_ext_events_argp, 0, "Event pipeline:", 0 },
+	{ &cache_ext_mrc_argp, 0, "Miss ratio curves:", 0 },
+	{ &cache_ext_readahead_argp, 0, "Readahead tracking:", 0 },
+	{ &cache_ext_stats_argp, 0, "Stats export:", 0 },
+	{ 0 }
+};
+
 static void sig_handler(int sig)
 {
 	exiting = true;
 }
 
+// Sum the per-CPU counters of the BPF program into *out.
+static int read_adaptive_stats(int map_fd, struct adaptive_stats *out)
+{
+	int nr_cpus = libbpf_num_possible_cpus();
+	struct adaptive_pcpu *values;
+	unsigned int key = 0;
+
+	if (nr_cpus < 0)
+		return nr_cpus;
+
+	values = calloc(nr_cpus, sizeof(*values));
+	if (!values)
+		return -ENOMEM;
+
+	if (bpf_map_lookup_elem(map_fd, &key, values)) {
+		free(values);
+		return -errno;
+	}
+
+	memset(out, 0, sizeof(*out));
+	for (int cpu = 0; cpu < nr_cpus; cpu++) {
+		unsigned long long *src = (unsigned long long *)&values[cpu].stats;
+		unsigned long long *dst = (unsigned long long *)out;
+
+		for (size_t i = 0; i < sizeof(*out) / sizeof(*dst); i++)
+			dst[i] += src[i];
+	}
+
+	free(values);
+	return 0;
+}
+
+static void print_adaptive_stats(int map_fd)
+{
+	struct adaptive_stats st;
+
+	if (read_adaptive_stats(map_fd, &st)) {
+		fprintf(stderr, "Failed to read adaptive stats\n");
+		return;
+	}
+
+	printf("Final Statistics:\n");
+	printf("  Total Accesses:      %llu\n", st.total_accesses);
+	printf("  Cache Hits:          %llu\n", st.cache_hits);
+	printf("  Cache Misses:        %llu\n", st.cache_misses);
+	printf("  Evictions:           %llu\n", st.total_evictions);
+	printf("  Sequential Accesses: %llu\n", st.sequential_accesses);
+	printf("  Dirty Evictions:     %llu\n", st.dirty_evictions);
+	for (int i = 0; i < NR_POLICIES; i++) {
+		printf("  %-10s hits=%llu misses=%llu evictions=%llu\n",
+		       policy_names[i], st.policy_hits[i], st.policy_misses[i],
+		       st.policy_evictions[i]);
+	}
+}
+
 static int handle_event(void *ctx, void *data, size_t data_sz)
 {
 	const struct policy_switch_event *e = data;
@@ -110,20 +212,20 @@ static int handle_event(void *ctx, void *data, size_t data_sz)
 	printf("  New Policy:          %s\n", policy_names[e->new_policy]);
 	printf("\n");
 	printf("Performance Metrics:\n");
-	printf("  Hit Rate:            %llu%%\n", e->hit_rate);
-	printf("  Old Policy Hit Rate: %llu%%\n", e->old_policy_hit_rate);
+	printf("  Hit Rate:            %u%%\n", e->hit_rate);
+	printf("  Old Policy Hit Rate: %u%%\n", e->old_policy_hit_rate);
 	printf("  Total Accesses:      %llu\n", e->total_accesses);
 	printf("\n");
 	printf("Workload Characteristics:\n");
-	printf("  One-time Ratio:      %llu%%\n", e->one_time_ratio);
-	printf("  Sequential Ratio:    %llu%%\n", e->sequential_ratio);
-	printf("  Avg Hits/Page:       %llu\n", e->avg_hits_per_page);
-	printf("  Avg Reuse Distance:  %llu\n", e->avg_reuse_distance);
-	printf("  Dirty Page Ratio:    %llu%%\n", e->dirty_ratio);
+	printf("  One-time Ratio:      %u%%\n", e->one_time_ratio);
+	printf("  Sequential Ratio:    %u%%\n", e->sequential_ratio);
+	printf("  Avg Hits/Page:       %u\n", e->avg_hits_per_page);
+	printf("  Avg Reuse Distance:  %u\n", e->avg_reuse_distance);
+	printf("  Dirty Page Ratio:    %u%%\n", e->dirty_ratio);
 	printf("\n");
 	printf("Working Set Analysis:\n");
 	printf("  Working Set Size:    %llu pages\n", e->working_set_size);
-	printf("  WS/Cache Ratio:      %llu%%\n", e->working_set_ratio);
+	printf("  WS/Cache Ratio:      %u%%\n", e->working_set_ratio);
 	printf("========================================\n");
 
 	// 정책 선택 이유 추론
@@ -146,18 +248,32 @@ static int handle_event(void *ctx, void *data, size_t data_sz)
 	return 0;
 }
 
+// Controller state in .data.model and the access counters it is judged by
+static const struct cache_ext_state_map adaptive_v3_state[] = {
+	{ CACHE_EXT_STATE_MODEL },
+	{ "adaptive_pcpu_map" },
+	{ 0 },
+};
+
 int main(int argc, char **argv)
 {
 	int ret = 1;
 	struct cache_ext_adaptive_v3_bpf *skel = NULL;
 	struct bpf_link *link = NULL;
+	struct cache_ext_swap swap = { 0 };
+	struct cache_ext_state state = { 0 };
+	struct cache_ext_exporter exporter = { 0 };
+	struct cache_ext_profiler prof = { 0 };
+	struct cache_ext_recorder rec = { 0 };
+	struct cache_ext_readahead ra = { 0 };
 	struct ring_buffer *rb = NULL;
 	int cgroup_fd = -1;
 
 	libbpf_set_strict_mode(LIBBPF_STRICT_ALL);
 
-	struct cmdline_args args = { 0 };
-	struct argp argp = { options, parse_opt, 0, 0 };
+	struct shadow_sims shadow = { 0 };
+	struct cmdline_args args = { .shadow_sample_pct = 1.0 };
+	struct argp argp = { options, parse_opt, 0, 0, adaptive_v3_argp_children };
 	argp_parse(&argp, argc, argv, 0, 0, &args);
 
 	if (args.watch_dir == NULL) {
@@ -172,6 +288,11 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	if (args.shadow_sample_pct <= 0 || args.shadow_sample_pct > 100) {
+		fprintf(stderr, "Invalid shadow_sample_pct\n");
+		return 1;
+	}
+
 	if (access(args.watch_dir, F_OK) == -1) {
 		fprintf(stderr, "Directory does not exist: %s\n",
 			args.watch_dir);
@@ -184,11 +305,6 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	if (strlen(watch_dir_full_path) > 128) {
-		fprintf(stderr, "watch_dir path too long\n");
-		return 1;
-	}
-
 	cgroup_fd = open(args.cgroup_path, O_RDONLY);
 	if (cgroup_fd < 0) {
 		perror("Failed to open cgroup path");
@@ -204,6 +320,62 @@ int main(int argc, char **argv)
 		goto cleanup;
 	}
 
+	// Size folio metadata store from the cgroup limit
+	ret = folio_store_resize(folio_store_map(skel), &folio_store_mask(skel),
+				 args.cgroup_path);
+	if (ret)
+		goto cleanup;
+
+	// Set watch_dir
+	ret = set_watch_dir_root(watch_dir_full_path, &watch_dir_ino_map(skel), &watch_dir_dev_map(skel));
+	if (ret)
+		goto cleanup;
+
+	// Size inode_watchlist for the watch dir
+	ret = resize_watch_dir_map(inode_watchlist_map(skel), watch_dir_full_path, true);
+	if (ret)
+		goto cleanup;
+
+	// SHARDS sampling rate of the shadow caches
+	shadow_sample_threshold(skel) = SHADOW_SAMPLE_MODULUS * args.shadow_sample_pct / 100;
+	if (shadow_sample_threshold(skel) == 0)
+		shadow_sample_threshold(skel) = 1;
+
+	// Hook profiling, if enabled
+	cache_ext_prof_setup(skel);
+
+	// Page access recording, if enabled
+	ret = cache_ext_recorder_setup(skel);
+	if (ret)
+		goto cleanup;
+
+	// One stats slot per CPU
+	ret = cache_ext_stats_resize(cache_ext_stats_map(skel));
+	if (ret)
+		goto cleanup;
+
+	// Miss ratio curve and working set estimates, if enabled
+	ret = cache_ext_mrc_setup(skel, read_cgroup_memory_max(args.cgroup_path));
+	if (ret)
+		goto cleanup;
+
+	// Readahead probes and probation map
+	ret = cache_ext_readahead_setup(skel, args.cgroup_path);
+	if (ret)
+		goto cleanup;
+
+	// Event rings: size and wakeup watermark
+	events_wakeup_pct(skel) = cache_ext_events_args.wakeup_pct;
+	ret = cache_ext_events_resize(skel->maps.events) ||
+	      cache_ext_events_resize(shadow_samples_map(skel));
+	if (ret)
+		goto cleanup;
+
+	// Resume from the state saved by --state, if there is one
+	ret = cache_ext_state_restore(&state, skel->obj, "adaptive_v3", adaptive_v3_state);
+	if (ret)
+		goto cleanup;
+
 	ret = cache_ext_adaptive_v3_bpf__load(skel);
 	if (ret) {
 		perror("Failed to load BPF skeleton");
@@ -218,6 +390,10 @@ int main(int argc, char **argv)
 		goto cleanup;
 	}
 
+	ret = cache_ext_state_apply(&state);
+	if (ret)
+		goto cleanup;
+
 	rb = ring_buffer__new(bpf_map__fd(skel->maps.events), handle_event,
 			      NULL, NULL);
 	if (!rb) {
@@ -225,13 +401,51 @@ int main(int argc, char **argv)
 		goto cleanup;
 	}
 
-	link = bpf_map__attach_cache_ext_ops(skel->maps.adaptive_v3_ops,
-					     cgroup_fd);
+	ret = shadow_sims_init(&shadow, args.cgroup_path, args.shadow_sample_pct,
+			       bpf_map__fd(shadow_verdict_map(skel)));
+	if (ret)
+		goto cleanup;
+
+	ret = ring_buffer__add(rb, bpf_map__fd(shadow_samples_map(skel)),
+			       shadow_handle_sample, &shadow);
+	if (ret) {
+		perror("Failed to add shadow_samples ring buffer");
+		goto cleanup;
+	}
+
+	link = cache_ext_swap_attach(&swap, skel->obj, skel->maps.adaptive_v3_ops, cgroup_fd);
 	if (link == NULL) {
 		perror("Failed to attach cache_ext_ops to cgroup");
 		goto cleanup;
 	}
 
+	ret = cache_ext_readahead_attach(&ra, skel);
+	if (ret)
+		goto cleanup;
+
+	// The skeleton isn't attached as a whole, so attach the MRC's memcg free probe here
+	skel->links.mrc_memcg_free = bpf_program__attach(skel->progs.mrc_memcg_free);
+	if (skel->links.mrc_memcg_free == NULL) {
+		perror("Failed to attach mrc_memcg_free");
+		ret = 1;
+		goto cleanup;
+	}
+
+	// Map the stats region and start the exporter, if enabled
+	ret = cache_ext_exporter_start(&exporter, cache_ext_stats_map(skel), "adaptive_v3");
+	if (ret)
+		goto cleanup;
+
+	// Dump hook profiles on SIGUSR1 and at exit, if enabled
+	ret = cache_ext_prof_start(&prof, cache_ext_prof_map(skel), "adaptive_v3");
+	if (ret)
+		goto cleanup;
+
+	// Stream page accesses to the --record file, if enabled
+	ret = cache_ext_recorder_start(&rec, cache_ext_trace_ring(skel));
+	if (ret)
+		goto cleanup;
+
 	printf("========================================\n");
 	printf("Enhanced Adaptive Policy v3 Started\n");
 	printf("========================================\n");
@@ -261,8 +475,12 @@ int main(int argc, char **argv)
 	printf("========================================\n");
 	printf("\n");
 
+	// Tell whoever started us that the policy is live
+	cache_ext_ready();
+
+	// Records below the wakeup watermark are consumed when the poll times out
 	while (!exiting) {
-		ret = ring_buffer__poll(rb, 100);
+		ret = cache_ext_events_poll(rb, EVENTS_POLL_MS);
 		if (ret == -EINTR) {
 			break;
 		}
@@ -272,12 +490,33 @@ int main(int argc, char **argv)
 		}
 	}
 
+	// Drain what is left below the watermark
+	ring_buffer__consume(rb);
+
 	printf("\nShutting down...\n");
+	print_adaptive_stats(bpf_map__fd(skel->maps.adaptive_pcpu_map));
+	printf("Shadow caches (%llu samples, %llu dropped):\n",
+	       (unsigned long long)shadow.nr_samples,
+	       (unsigned long long)skel->bss->shadow_dropped);
+	printf("Events dropped: %llu\n",
+	       (unsigned long long)cache_ext_events_dropped(&exporter));
+
+	for (int i = 0; i < NR_POLICIES; i++)
+		printf("  %-12s %.2f%%\n", policy_names[i],
+		       shadow.caches[shadow_policy_sim[i]].hit_rate * 100);
 	ret = 0;
 
 cleanup:
 	ring_buffer__free(rb);
+	shadow_sims_free(&shadow);
+	cache_ext_recorder_stop(&rec);
+	cache_ext_prof_stop(&prof);
+	cache_ext_exporter_stop(&exporter);
+	cache_ext_readahead_detach(&ra);
+	cache_ext_swap_release(&swap, link);
 	bpf_link__destroy(link);
+	cache_ext_state_save(&state);
+	cache_ext_state_free(&state);
 	cache_ext_adaptive_v3_bpf__destroy(skel);
 	if (cgroup_fd >= 0)
 		close(cgroup_fd);
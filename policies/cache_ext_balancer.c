@@ -0,0 +1,666 @@
+#include <argp.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Shift memory.max between the cgroups of several cache_ext tenants to
+ * maximize their combined hit rate under a fixed budget:
+ *
+ *	cache_ext_balancer --budget 12G --interval 5000 \
+ *		/sys/fs/cgroup/tenant_a:/run/tenant_a.json \
+ *		/sys/fs/cgroup/tenant_b:/run/tenant_b.json:1G
+ *
+ * A tenant is CGROUP[:STATS_FILE[:FLOOR]]. STATS_FILE is the --stats_file of
+ * the tenant's loader running with --mrc --stats_format json (see
+ * cache_ext_mrc.h). It carries the cgroup's miss ratio curve and access
+ * count, so the hits a tenant would gain or lose per second with one more or
+ * one less --step of memory are read off the curve. Tenants without a curve
+ * fall back to the kernel's refault counter in memory.stat, assuming each
+ * step of memory saves a proportional share of the refaults.
+ *
+ * Every interval, steps go from the tenant that loses the fewest hits to the
+ * one that gains the most, as long as the gain beats the loss by
+ * --hysteresis percent and by at least --min_gain hits per second, no tenant
+ * drops below its floor and no more than --max_move bytes change hands. The
+ * absolute margin matters when the donor isn't refaulting: its loss reads as
+ * zero, and any noise in the receiver's refaults would beat it. A tenant that
+ * gave memory away can't take any back for BALANCER_HOLD_INTERVALS, and one
+ * that received can't give, so a donor that starts refaulting once it is
+ * smaller doesn't make the limits swing back and forth. Limits are lowered before others are
+ * raised, so the tenants never hold more than the budget. The cache_ext
+ * policies follow the live memory.max, so a move takes effect at their
+ * next eviction.
+ */
+
+#define BALANCER_MAX_TENANTS	64
+#define BALANCER_MAX_POINTS	72	// MRC_NR_BUCKETS in cache_ext_mrc.h
+#define BALANCER_EWMA_WEIGHT	0.5	// Of the newest interval
+#define BALANCER_STALE_INTERVALS 3	// Ignore stats files older than this
+#define BALANCER_HOLD_INTERVALS	3	// Before a tenant may move the other way
+
+struct tenant {
+	const char *path;
+	const char *stats_file;
+	uint64_t floor;		// Bytes, 0: --floor
+	uint64_t cgroup_id;	// Inode of the cgroup directory
+
+	uint64_t limit;		// memory.max in bytes
+	uint64_t anon;		// Bytes of memory.max the page cache can't have
+
+	// Refaults of file pages, from memory.stat
+	uint64_t refaults;
+	double refault_rate;	// Per second
+
+	// From the MRC in the stats file
+	bool has_curve;
+	uint64_t accesses;
+	double access_rate;	// Per second
+	unsigned int nr_points;
+	double pages[BALANCER_MAX_POINTS];
+	double ratios[BALANCER_MAX_POINTS];
+
+	bool primed;		// Counters read once, rates are valid
+
+	int moved;		// Last move: 1 received, -1 gave
+	unsigned int hold;	// Intervals before it may move the other way
+};
+
+struct cmdline_args {
+	uint64_t budget;	// 0: sum of the current limits
+	uint64_t floor;		// 0: a quarter of an equal share
+	uint64_t step;		// 0: budget / 128
+	uint64_t max_move;	// 0: budget / 16
+	unsigned long interval_ms;
+	unsigned int hysteresis_pct;
+	double min_gain;	// Hits per second
+	bool dry_run;
+	bool verbose;
+	struct tenant tenants[BALANCER_MAX_TENANTS];
+	int nr_tenants;
+};
+
+static struct argp_option options[] = {
+	{ "budget", 'b', "SIZE", 0, "Memory shared by the tenants (default: sum of their memory.max)" },
+	{ "floor", 'f', "SIZE", 0, "Smallest memory.max of a tenant without its own FLOOR (default: budget / 4 / tenants)" },
+	{ "step", 's', "SIZE", 0, "Memory moved at a time (default: budget / 128)" },
+	{ "max_move", 'm', "SIZE", 0, "Most memory moved per interval (default: budget / 16)" },
+	{ "interval", 'i', "MS", 0, "Rebalance every MS milliseconds (default: 5000)" },
+	{ "hysteresis", 'H', "PCT", 0, "Only move if the gain beats the loss by PCT percent (default: 10)" },
+	{ "min_gain", 'g', "HITS", 0, "Only move if the gain beats the loss by HITS hits per second (default: 1)" },
+	{ "dry_run", 'n', 0, 0, "Print the moves without writing memory.max" },
+	{ "verbose", 'v', 0, 0, "Print every tenant's signals each interval" },
+	{ 0 },
+};
+
+static volatile sig_atomic_t exiting;
+
+static void sig_handler(int signo) {
+	exiting = 1;
+}
+
+// Bytes with an optional K, M or G suffix
+static int parse_size(const char *s, uint64_t *out) {
+	char *end;
+
+	errno = 0;
+	*out = strtoull(s, &end, 10);
+	if (errno || end == s)
+		return -1;
+	switch (*end) {
+	case 'G': case 'g':
+		*out <<= 10;
+		/* fallthrough */
+	case 'M': case 'm':
+		*out <<= 10;
+		/* fallthrough */
+	case 'K': case 'k':
+		*out <<= 10;
+		end++;
+		break;
+	}
+	return *end == '\0' ? 0 : -1;
+}
+
+// CGROUP[:STATS_FILE[:FLOOR]], split in place
+static int parse_tenant(char *spec, struct tenant *t) {
+	char *stats = strchr(spec, ':');
+	char *floor = NULL;
+
+	memset(t, 0, sizeof(*t));
+	t->path = spec;
+	if (stats) {
+		*stats++ = '\0';
+		floor = strchr(stats, ':');
+		if (floor)
+			*floor++ = '\0';
+		if (*stats)
+			t->stats_file = stats;
+	}
+	if (floor && parse_size(floor, &t->floor))
+		return -1;
+	return 0;
+}
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+	struct cmdline_args *args = state->input;
+	char *end;
+
+	switch (key) {
+	case 'b':
+		if (parse_size(arg, &args->budget))
+			argp_error(state, "Invalid budget: %s", arg);
+		break;
+	case 'f':
+		if (parse_size(arg, &args->floor))
+			argp_error(state, "Invalid floor: %s", arg);
+		break;
+	case 's':
+		if (parse_size(arg, &args->step) || args->step == 0)
+			argp_error(state, "Invalid step: %s", arg);
+		break;
+	case 'm':
+		if (parse_size(arg, &args->max_move))
+			argp_error(state, "Invalid max_move: %s", arg);
+		break;
+	case 'i':
+		errno = 0;
+		args->interval_ms = strtoul(arg, &end, 10);
+		if (errno || *end != '\0' || args->interval_ms == 0)
+			argp_error(state, "Invalid interval: %s", arg);
+		break;
+	case 'H':
+		errno = 0;
+		args->hysteresis_pct = strtoul(arg, &end, 10);
+		if (errno || *end != '\0')
+			argp_error(state, "Invalid hysteresis: %s", arg);
+		break;
+	case 'g':
+		errno = 0;
+		args->min_gain = strtod(arg, &end);
+		if (errno || *end != '\0' || args->min_gain < 0)
+			argp_error(state, "Invalid min_gain: %s", arg);
+		break;
+	case 'n':
+		args->dry_run = true;
+		break;
+	case 'v':
+		args->verbose = true;
+		break;
+	case ARGP_KEY_ARG:
+		if (args->nr_tenants >= BALANCER_MAX_TENANTS)
+			argp_error(state, "Too many tenants, at most %d", BALANCER_MAX_TENANTS);
+		if (parse_tenant(arg, &args->tenants[args->nr_tenants]))
+			argp_error(state, "Invalid tenant: %s", arg);
+		args->nr_tenants++;
+		break;
+	case ARGP_KEY_END:
+		if (args->nr_tenants < 2)
+			argp_error(state, "Need at least two tenants");
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static double now_s(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t now_realtime_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int read_memory_max(const struct tenant *t, uint64_t *out) {
+	char path[PATH_MAX];
+	char buf[64] = { 0 };
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/memory.max", t->path);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fgets(buf, sizeof(buf), f) == NULL) {
+		fprintf(stderr, "Failed to read %s\n", path);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	// An unlimited tenant gets its share of the budget on the first move
+	if (strncmp(buf, "max", 3) == 0)
+		*out = UINT64_MAX;
+	else
+		*out = strtoull(buf, NULL, 10);
+	return 0;
+}
+
+static int write_memory_max(const struct tenant *t, uint64_t limit) {
+	char path[PATH_MAX];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/memory.max", t->path);
+	f = fopen(path, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	fprintf(f, "%llu\n", (unsigned long long)limit);
+	if (fclose(f)) {
+		fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+// File page refaults and anonymous memory, from memory.stat
+static int read_memory_stat(struct tenant *t, uint64_t *refaults) {
+	char path[PATH_MAX];
+	char key[64];
+	unsigned long long val;
+	bool found = false;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/memory.stat", t->path);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	*refaults = 0;
+	t->anon = 0;
+	while (fscanf(f, "%63s %llu", key, &val) == 2) {
+		if (strcmp(key, "workingset_refault_file") == 0) {
+			*refaults = val;
+			found = true;
+		} else if (strcmp(key, "workingset_refault") == 0 && !found) {
+			// Before 5.9, file and anon refaults were one counter
+			*refaults = val;
+		} else if (strcmp(key, "anon") == 0) {
+			t->anon = val;
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+/*
+ * Find the tenant's cgroup in the last snapshot of its stats file and take
+ * its access count and curve. Returns -1 if there is no fresh curve.
+ */
+static int read_curve(struct tenant *t, uint64_t *accesses, unsigned long interval_ms) {
+	static char buf[1 << 20];
+	unsigned long long ts, id, acc, pages;
+	double ratio;
+	size_t len;
+	char *p, *end;
+	FILE *f;
+
+	if (!t->stats_file)
+		return -1;
+
+	f = fopen(t->stats_file, "r");
+	if (f == NULL)
+		return -1;	// The loader hasn't written it yet
+	len = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[len] = '\0';
+
+	// The file holds one JSON snapshot, see cache_ext_stats_write()
+	p = strstr(buf, "\"timestamp_ms\":");
+	if (!p || sscanf(p, "\"timestamp_ms\":%llu", &ts) != 1 ||
+	    ts + BALANCER_STALE_INTERVALS * interval_ms < now_realtime_ms())
+		return -1;
+
+	p = strstr(buf, "\"cgroups\":[");
+	while (p && (p = strstr(p, "{\"cgroup_id\":")) != NULL) {
+		if (sscanf(p, "{\"cgroup_id\":%llu,\"accesses\":%llu", &id, &acc) != 2)
+			return -1;
+		p++;
+		if (id == t->cgroup_id)
+			break;
+	}
+	if (!p)
+		return -1;
+
+	p = strstr(p, "\"mrc\":[");
+	if (!p)
+		return -1;
+	p += strlen("\"mrc\":[");
+	end = strchr(p, '}');
+
+	t->nr_points = 0;
+	while (t->nr_points < BALANCER_MAX_POINTS && sscanf(p, "[%llu,%lf]", &pages, &ratio) == 2 &&
+	       (!end || p < end)) {
+		t->pages[t->nr_points] = pages;
+		t->ratios[t->nr_points] = ratio;
+		t->nr_points++;
+		p = strchr(p, ']');
+		if (!p)
+			break;
+		p++;
+		if (*p == ',')
+			p++;
+	}
+	if (t->nr_points == 0)
+		return -1;
+
+	*accesses = acc;
+	return 0;
+}
+
+static double ewma(double old, double sample, bool primed) {
+	if (!primed)
+		return sample;
+	return old * (1 - BALANCER_EWMA_WEIGHT) + sample * BALANCER_EWMA_WEIGHT;
+}
+
+static int tenant_update(struct tenant *t, double elapsed, unsigned long interval_ms) {
+	uint64_t refaults, accesses;
+	bool had_curve = t->has_curve;
+
+	if (read_memory_max(t, &t->limit) || read_memory_stat(t, &refaults))
+		return -1;
+
+	t->has_curve = read_curve(t, &accesses, interval_ms) == 0;
+
+	if (t->primed && elapsed > 0) {
+		if (refaults >= t->refaults)
+			t->refault_rate = ewma(t->refault_rate,
+					       (refaults - t->refaults) / elapsed, true);
+		if (t->has_curve && had_curve && accesses >= t->accesses)
+			t->access_rate = ewma(t->access_rate,
+					      (accesses - t->accesses) / elapsed, true);
+	}
+	t->refaults = refaults;
+	if (t->has_curve)
+		t->accesses = accesses;
+	else
+		t->access_rate = 0;
+	t->primed = true;
+	return 0;
+}
+
+// Estimated miss ratio with cache_pages of page cache, log-linear between points
+static double curve_miss_ratio(const struct tenant *t, double cache_pages) {
+	unsigned int i;
+	double x0, x1;
+
+	if (cache_pages <= t->pages[0])
+		return t->ratios[0];
+	for (i = 1; i < t->nr_points; i++)
+		if (cache_pages < t->pages[i])
+			break;
+	if (i == t->nr_points)
+		return t->ratios[t->nr_points - 1];	// No reuse seen that far out
+
+	x0 = log(t->pages[i - 1]);
+	x1 = log(t->pages[i]);
+	return t->ratios[i - 1] + (t->ratios[i] - t->ratios[i - 1]) *
+				  (log(cache_pages) - x0) / (x1 - x0);
+}
+
+/*
+ * Hits per second the tenant gains with delta more bytes of memory.max, or
+ * loses, as a negative number, with less.
+ */
+static double tenant_gain(const struct tenant *t, int64_t delta) {
+	double page_size = sysconf(_SC_PAGESIZE);
+	double cache = t->limit > t->anon ? (double)(t->limit - t->anon) : 0;
+
+	if (t->has_curve && t->access_rate > 0) {
+		double before = curve_miss_ratio(t, cache / page_size);
+		double after = curve_miss_ratio(t, fmax(cache + delta, 0) / page_size);
+
+		return t->access_rate * (before - after);
+	}
+
+	// Without a curve, assume the refaults shrink in proportion to the memory
+	if (cache == 0)
+		return delta > 0 ? t->refault_rate : 0;
+	return t->refault_rate * delta / cache;
+}
+
+static uint64_t tenant_floor(const struct tenant *t, const struct cmdline_args *args) {
+	return t->floor ? t->floor : args->floor;
+}
+
+static void print_tenants(const struct cmdline_args *args) {
+	for (int i = 0; i < args->nr_tenants; i++) {
+		const struct tenant *t = &args->tenants[i];
+
+		fprintf(stderr, "  %s: limit %llu MiB, anon %llu MiB, refaults %.1f/s, accesses %.1f/s, %s\n",
+			t->path, (unsigned long long)(t->limit >> 20),
+			(unsigned long long)(t->anon >> 20), t->refault_rate, t->access_rate,
+			t->has_curve ? "curve" : "no curve");
+	}
+}
+
+/*
+ * Greedy rebalancing: move one step at a time from the cheapest donor to the
+ * most valuable receiver. Fills new[] with the planned limits and returns the
+ * bytes moved.
+ */
+static uint64_t plan_moves(const struct cmdline_args *args, uint64_t new[]) {
+	struct tenant tmp[BALANCER_MAX_TENANTS];
+	double factor = 1 + args->hysteresis_pct / 100.0;
+	uint64_t moved = 0;
+
+	memcpy(tmp, args->tenants, sizeof(tmp[0]) * args->nr_tenants);
+
+	while (moved + args->step <= args->max_move) {
+		int donor = -1, receiver = -1;
+		double best_gain = 0, best_loss = INFINITY;
+
+		for (int i = 0; i < args->nr_tenants; i++) {
+			double gain = tenant_gain(&tmp[i], args->step);
+
+			if (tmp[i].hold && tmp[i].moved < 0)
+				continue;
+			if (tmp[i].limit + args->step <= args->budget && gain > best_gain) {
+				best_gain = gain;
+				receiver = i;
+			}
+		}
+		if (receiver < 0)
+			break;
+
+		for (int i = 0; i < args->nr_tenants; i++) {
+			double loss;
+
+			if (i == receiver || tmp[i].limit < tenant_floor(&tmp[i], args) + args->step)
+				continue;
+			if (tmp[i].hold && tmp[i].moved > 0)
+				continue;
+			loss = -tenant_gain(&tmp[i], -(int64_t)args->step);
+			if (loss < best_loss) {
+				best_loss = loss;
+				donor = i;
+			}
+		}
+		if (donor < 0 || best_gain <= best_loss * factor ||
+		    best_gain - best_loss < args->min_gain)
+			break;
+
+		tmp[donor].limit -= args->step;
+		tmp[receiver].limit += args->step;
+		moved += args->step;
+	}
+
+	for (int i = 0; i < args->nr_tenants; i++)
+		new[i] = tmp[i].limit;
+	return moved;
+}
+
+// Start the hold of every tenant new[] moves, count down the others
+static void hold_moved(struct cmdline_args *args, const uint64_t new[]) {
+	for (int i = 0; i < args->nr_tenants; i++) {
+		struct tenant *t = &args->tenants[i];
+
+		if (new[i] != t->limit) {
+			t->moved = new[i] > t->limit ? 1 : -1;
+			t->hold = BALANCER_HOLD_INTERVALS;
+		} else if (t->hold) {
+			t->hold--;
+		}
+	}
+}
+
+// Lower limits first, so the tenants never hold more than the budget
+static int apply_limits(struct cmdline_args *args, const uint64_t new[]) {
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; i < args->nr_tenants; i++) {
+			struct tenant *t = &args->tenants[i];
+			bool lower = new[i] < t->limit;
+
+			if (new[i] == t->limit || lower != (pass == 0))
+				continue;
+			fprintf(stderr, "%s: %llu MiB -> %llu MiB\n", t->path,
+				(unsigned long long)(t->limit >> 20),
+				(unsigned long long)(new[i] >> 20));
+			if (!args->dry_run && write_memory_max(t, new[i]))
+				return -1;
+			t->limit = new[i];
+		}
+	}
+	return 0;
+}
+
+/*
+ * Without --budget, the tenants keep sharing what they have. With it, each
+ * gets its floor plus an equal part of the rest to start from.
+ */
+static int init_limits(struct cmdline_args *args) {
+	uint64_t new[BALANCER_MAX_TENANTS];
+	uint64_t sum = 0, floors = 0;
+	bool unlimited = false;
+
+	for (int i = 0; i < args->nr_tenants; i++) {
+		if (read_memory_max(&args->tenants[i], &args->tenants[i].limit))
+			return -1;
+		if (args->tenants[i].limit == UINT64_MAX)
+			unlimited = true;
+		else
+			sum += args->tenants[i].limit;
+	}
+
+	if (args->budget == 0) {
+		if (unlimited) {
+			fprintf(stderr, "A tenant has no memory.max, --budget is required\n");
+			return -1;
+		}
+		args->budget = sum;
+	}
+	if (args->floor == 0)
+		args->floor = args->budget / 4 / args->nr_tenants;
+	if (args->step == 0)
+		args->step = args->budget / 128;
+	if (args->max_move == 0)
+		args->max_move = args->budget / 16;
+
+	for (int i = 0; i < args->nr_tenants; i++)
+		floors += tenant_floor(&args->tenants[i], args);
+	if (floors > args->budget) {
+		fprintf(stderr, "Floors (%llu MiB) exceed the budget (%llu MiB)\n",
+			(unsigned long long)(floors >> 20), (unsigned long long)(args->budget >> 20));
+		return -1;
+	}
+
+	fprintf(stderr, "Balancing %llu MiB across %d tenants, steps of %llu MiB, at most %llu MiB per %lu ms\n",
+		(unsigned long long)(args->budget >> 20), args->nr_tenants,
+		(unsigned long long)(args->step >> 20), (unsigned long long)(args->max_move >> 20),
+		args->interval_ms);
+
+	if (!unlimited && sum == args->budget)
+		return 0;
+
+	for (int i = 0; i < args->nr_tenants; i++)
+		new[i] = tenant_floor(&args->tenants[i], args) +
+			 (args->budget - floors) / args->nr_tenants;
+	return apply_limits(args, new);
+}
+
+int main(int argc, char **argv) {
+	struct cmdline_args args = {
+		.interval_ms = 5000,
+		.hysteresis_pct = 10,
+		.min_gain = 1,
+	};
+	struct argp argp = { options, parse_opt, "CGROUP[:STATS_FILE[:FLOOR]]...", 0 };
+	uint64_t new[BALANCER_MAX_TENANTS];
+	double last;
+	int ret = 1;
+
+	argp_parse(&argp, argc, argv, 0, 0, &args);
+
+	for (int i = 0; i < args.nr_tenants; i++) {
+		struct stat st;
+
+		if (stat(args.tenants[i].path, &st)) {
+			fprintf(stderr, "Failed to stat cgroup %s: %s\n", args.tenants[i].path,
+				strerror(errno));
+			return 1;
+		}
+		args.tenants[i].cgroup_id = st.st_ino;
+	}
+
+	signal(SIGINT, sig_handler);
+	signal(SIGTERM, sig_handler);
+
+	if (init_limits(&args))
+		return 1;
+
+	last = now_s();
+	for (int i = 0; i < args.nr_tenants; i++)
+		if (tenant_update(&args.tenants[i], 0, args.interval_ms))
+			return 1;
+
+	while (!exiting) {
+		double now;
+		uint64_t moved;
+
+		usleep(args.interval_ms * 1000);
+		if (exiting)
+			break;
+
+		now = now_s();
+		for (int i = 0; i < args.nr_tenants; i++)
+			if (tenant_update(&args.tenants[i], now - last, args.interval_ms))
+				goto cleanup;
+		last = now;
+
+		if (args.verbose)
+			print_tenants(&args);
+
+		moved = plan_moves(&args, new);
+		hold_moved(&args, new);
+		if (moved && apply_limits(&args, new))
+			goto cleanup;
+	}
+	ret = 0;
+
+cleanup:
+	fprintf(stderr, "Final limits:\n");
+	print_tenants(&args);
+	return ret;
+}
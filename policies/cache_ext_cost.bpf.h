@@ -0,0 +1,222 @@
+#ifndef _CACHE_EXT_COST_BPF_H
+#define _CACHE_EXT_COST_BPF_H 1
+
+#include "cache_ext_lib.bpf.h"
+#include "cache_ext_stats.bpf.h"
+#include "cache_ext_hints.bpf.h"
+#include "dir_watcher.bpf.h"
+
+/*
+ * Refault cost estimates for cost-aware eviction.
+ *
+ * Misses are filled through page_cache_sync_ra() (demand) or
+ * page_cache_async_ra() (a reader passed the PG_readahead marker), and
+ * folio_added runs inside them. A sync readahead opens a window for the
+ * task, stamped with the time, and cost_folio_added() counts the pages the
+ * call brings in. The reader then sleeps on the folio it asked for until the
+ * read completes, and touches it right after, so the task's first access to
+ * that folio closes the window in cost_folio_accessed(). The wait divided by
+ * the pages read is one sample of what a page of the file costs to fault
+ * back. An async readahead is a sample of 0, nobody waits for those pages.
+ * Random reads from a slow device thus cost the most, files streamed through
+ * readahead the least. Pages faulted in through mmap are never marked
+ * accessed and give no samples.
+ *
+ * Samples feed an EWMA per file, in the LRU map cost_files keyed like
+ * inode_class_map, and one per device for files without samples yet.
+ * cost_factor() is a file's estimate relative to the mean of all samples, in
+ * units of COST_UNIT and clamped to COST_RANGE either way. Policies scale
+ * their score by it where they refresh their metadata:
+ *
+ *	folio_added:	cost_folio_added(folio); meta->cost = cost_factor(folio);
+ *	folio_accessed:	cost_folio_accessed(folio); meta->cost = cost_factor(folio);
+ *
+ * LHD multiplies the hit density (cost-aware LHD, like GDSF), sampling the
+ * access count. With cost_tracking off, or before the first sample, the
+ * factor is COST_UNIT and scores are unchanged. The loader side is
+ * cache_ext_cost.h.
+ */
+
+#define COST_UNIT		16
+#define COST_RANGE		8	// Factors stay in [COST_UNIT / 8, COST_UNIT * 8]
+#define COST_EWMA_SHIFT		3	// Each sample weighs 1/8
+#define COST_MAX_WAIT_NS	1000000000ULL	// Longer waits are not the read
+#define COST_TRACKED_TASKS	4096
+#define COST_MAX_FILES		65536
+#define COST_MAX_DEVICES	64
+
+// Set from userspace
+const volatile bool cost_tracking = false;
+
+struct cost_window {
+	u64 mapping;
+	u64 index;	// First page the reader asked for
+	u64 start_ns;
+	u32 nr_pages;	// Pages added by the readahead call
+	u32 open;	// Still inside page_cache_sync_ra()
+};
+
+struct cost_estimate {
+	u64 ns_per_page;
+	u64 samples;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__type(key, u32);
+	__type(value, struct cost_window);
+	__uint(max_entries, COST_TRACKED_TASKS);
+} cost_windows SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__type(key, struct inode_class_key);
+	__type(value, struct cost_estimate);
+	__uint(max_entries, COST_MAX_FILES);
+} cost_files SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, u32);
+	__type(value, struct cost_estimate);
+	__uint(max_entries, COST_MAX_DEVICES);
+} cost_devices SEC(".maps");
+
+// Mean over all samples, what cost_factor() calls COST_UNIT
+static u64 cost_mean_ns = 0;
+static u64 cost_mean_samples = 0;
+
+// Racy like the other EWMAs, a lost update only drops a sample
+static __always_inline u64 cost_ewma(u64 old, u64 sample, u64 samples)
+{
+	if (samples == 0)
+		return sample;
+	return old - (old >> COST_EWMA_SHIFT) + (sample >> COST_EWMA_SHIFT);
+}
+
+static __always_inline void cost_estimate_update(void *map, void *key, u64 sample)
+{
+	struct cost_estimate init = { 0 }, *est;
+
+	bpf_map_update_elem(map, key, &init, BPF_NOEXIST);
+	est = bpf_map_lookup_elem(map, key);
+	if (!est)
+		return;
+	est->ns_per_page = cost_ewma(est->ns_per_page, sample, est->samples);
+	est->samples++;
+}
+
+static inline void cost_sample(struct inode *inode, u64 ns_per_page)
+{
+	struct inode_class_key key = {
+		.ino = inode->i_ino,
+		.dev = inode->i_sb->s_dev,
+	};
+
+	cost_estimate_update(&cost_files, &key, ns_per_page);
+	cost_estimate_update(&cost_devices, &key.dev, ns_per_page);
+	cost_mean_ns = cost_ewma(cost_mean_ns, ns_per_page, cost_mean_samples++);
+}
+
+SEC("fentry/page_cache_sync_ra")
+int BPF_PROG(cost_sync_enter, struct readahead_control *ractl, unsigned long req_count)
+{
+	u32 tid = (u32)bpf_get_current_pid_tgid();
+	struct cost_window win = {
+		.mapping = (u64)ractl->mapping,
+		.index = ractl->_index,
+		.start_ns = bpf_ktime_get_ns(),
+		.open = 1,
+	};
+
+	bpf_map_update_elem(&cost_windows, &tid, &win, BPF_ANY);
+	return 0;
+}
+
+SEC("fexit/page_cache_sync_ra")
+int BPF_PROG(cost_sync_exit, struct readahead_control *ractl, unsigned long req_count)
+{
+	u32 tid = (u32)bpf_get_current_pid_tgid();
+	struct cost_window *win = bpf_map_lookup_elem(&cost_windows, &tid);
+
+	if (win)
+		win->open = 0;
+	return 0;
+}
+
+// The pages are in before anyone needs them
+SEC("fentry/page_cache_async_ra")
+int BPF_PROG(cost_async_enter, struct readahead_control *ractl, struct folio *folio,
+	     unsigned long req_count)
+{
+	struct inode *inode = ractl->mapping->host;
+
+	if (inode_in_watchlist(inode->i_ino))
+		cost_sample(inode, 0);
+	return 0;
+}
+
+// Count a folio into the task's readahead window, if it is filling one
+static inline void cost_folio_added(struct folio *folio)
+{
+	u32 tid = (u32)bpf_get_current_pid_tgid();
+	struct cost_window *win;
+
+	if (!cost_tracking)
+		return;
+
+	win = bpf_map_lookup_elem(&cost_windows, &tid);
+	if (win && win->open && win->mapping == (u64)folio->mapping)
+		win->nr_pages += folio_nr_pages(folio);
+}
+
+// Close the task's window on the first access to the folio it waited for
+static inline void cost_folio_accessed(struct folio *folio)
+{
+	u32 tid = (u32)bpf_get_current_pid_tgid();
+	struct cost_window *win;
+	u64 wait;
+
+	if (!cost_tracking)
+		return;
+
+	win = bpf_map_lookup_elem(&cost_windows, &tid);
+	if (!win || win->open || win->mapping != (u64)folio->mapping ||
+	    win->index < folio->index || win->index >= folio->index + folio_nr_pages(folio))
+		return;
+
+	wait = bpf_ktime_get_ns() - win->start_ns;
+	if (wait < COST_MAX_WAIT_NS) {
+		cost_sample(folio->mapping->host, wait / max(win->nr_pages, 1));
+		cache_ext_stat_inc(CACHE_EXT_STAT_COST_SAMPLES);
+		cache_ext_stat_add(CACHE_EXT_STAT_COST_WAIT_NS, wait);
+	}
+	bpf_map_delete_elem(&cost_windows, &tid);
+}
+
+// Refault cost of folio's file relative to the mean, COST_UNIT is average
+static inline u32 cost_factor(struct folio *folio)
+{
+	struct inode *inode = folio->mapping->host;
+	struct inode_class_key key = {
+		.ino = inode->i_ino,
+		.dev = inode->i_sb->s_dev,
+	};
+	u64 mean = READ_ONCE(cost_mean_ns);
+	struct cost_estimate *est;
+	u64 factor;
+
+	if (!cost_tracking || mean == 0)
+		return COST_UNIT;
+
+	est = bpf_map_lookup_elem(&cost_files, &key);
+	if (!est)
+		est = bpf_map_lookup_elem(&cost_devices, &key.dev);
+	if (!est)
+		return COST_UNIT;
+
+	factor = est->ns_per_page * COST_UNIT / mean;
+	return min(max(factor, COST_UNIT / COST_RANGE), COST_UNIT * COST_RANGE);
+}
+
+#endif /* _CACHE_EXT_COST_BPF_H */
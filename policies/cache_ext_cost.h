@@ -0,0 +1,122 @@
+#ifndef _CACHE_EXT_COST_H
+#define _CACHE_EXT_COST_H
+
+#include <argp.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <bpf/libbpf.h>
+
+#include "cache_ext_stats.h"
+
+/*
+ * Userspace half of cost-aware eviction (see cache_ext_cost.bpf.h).
+ *
+ * --cost times demand misses and scales the policy's scores by how
+ * expensive each file is to fault back in. The timed misses and the total
+ * wait show up in the stats exporter as cost_samples and cost_wait_ns.
+ *
+ * Like the readahead probes, the cost probes are only loaded when the mode
+ * is on, and are attached separately from the rest of the skeleton:
+ *
+ *	cache_ext_cost_setup(skel);		// before skel__load()
+ *	cache_ext_cost_attach(&cost, skel);	// after attaching the ops
+ *	cache_ext_cost_detach(&cost);
+ *
+ * Loaders use cache_ext_cost_argp_children, which also carries the stats
+ * exporter options.
+ */
+
+#define CACHE_EXT_COST_NR_PROGS	3
+
+#define cache_ext_cost_progs(skel)							\
+	((struct bpf_program *[CACHE_EXT_COST_NR_PROGS]){ (skel)->progs.cost_sync_enter,	\
+		(skel)->progs.cost_sync_exit, (skel)->progs.cost_async_enter })
+
+#define cache_ext_cost_setup(skel)							\
+	cache_ext_cost_configure(cache_ext_cost_progs(skel), &(skel)->rodata->cost_tracking)
+
+#define cache_ext_cost_attach(cost, skel)						\
+	cache_ext_cost_attach_progs(cost, cache_ext_cost_progs(skel))
+
+struct cache_ext_cost_args {
+	bool enabled;
+};
+
+struct cache_ext_cost_args cache_ext_cost_args = { 0 };
+
+struct cache_ext_cost {
+	struct bpf_link *links[CACHE_EXT_COST_NR_PROGS];
+};
+
+enum {
+	CACHE_EXT_COST_OPT_ENABLE = 0x1800,
+};
+
+static struct argp_option cache_ext_cost_options[] = {
+	{ "cost", CACHE_EXT_COST_OPT_ENABLE, 0, 0,
+	  "Weigh eviction scores by each file's measured refault cost" },
+	{ 0 }
+};
+
+static error_t cache_ext_cost_parse_opt(int key, char *arg, struct argp_state *state)
+{
+	switch (key) {
+	case CACHE_EXT_COST_OPT_ENABLE:
+		cache_ext_cost_args.enabled = true;
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static struct argp cache_ext_cost_argp = {
+	cache_ext_cost_options, cache_ext_cost_parse_opt, 0, 0
+};
+
+static struct argp_child cache_ext_cost_argp_children[] = {
+	{ &cache_ext_cost_argp, 0, "Refault cost:", 0 },
+	{ &cache_ext_stats_argp, 0, "Stats export:", 0 },
+	{ 0 }
+};
+
+// Apply --cost. Must be called between skel__open() and skel__load().
+int cache_ext_cost_configure(struct bpf_program **progs, bool *tracking) {
+	for (int i = 0; i < CACHE_EXT_COST_NR_PROGS; i++) {
+		if (bpf_program__set_autoload(progs[i], cache_ext_cost_args.enabled) ||
+		    bpf_program__set_autoattach(progs[i], false)) {
+			fprintf(stderr, "Failed to configure %s\n", bpf_program__name(progs[i]));
+			return -1;
+		}
+	}
+
+	*tracking = cache_ext_cost_args.enabled;
+	return 0;
+}
+
+int cache_ext_cost_attach_progs(struct cache_ext_cost *cost, struct bpf_program **progs) {
+	if (!cache_ext_cost_args.enabled)
+		return 0;
+
+	for (int i = 0; i < CACHE_EXT_COST_NR_PROGS; i++) {
+		cost->links[i] = bpf_program__attach(progs[i]);
+		if (cost->links[i] == NULL) {
+			fprintf(stderr, "Failed to attach %s: %s\n", bpf_program__name(progs[i]),
+				strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void cache_ext_cost_detach(struct cache_ext_cost *cost) {
+	for (int i = 0; i < CACHE_EXT_COST_NR_PROGS; i++) {
+		bpf_link__destroy(cost->links[i]);
+		cost->links[i] = NULL;
+	}
+}
+
+#endif /* _CACHE_EXT_COST_H */
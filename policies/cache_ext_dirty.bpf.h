@@ -0,0 +1,315 @@
+#ifndef _CACHE_EXT_DIRTY_BPF_H
+#define _CACHE_EXT_DIRTY_BPF_H 1
+
+#include "cache_ext_lib.bpf.h"
+#include "cache_ext_stats.bpf.h"
+
+/*
+ * Parking of dirty and writeback folios.
+ *
+ * Eviction callbacks on walks that leave passed-over folios where they are
+ * (iterate, sample) hand the folios they can't evict because of writeback
+ * state to dirty_skip() or dirty_park(). Those move them to the policy's
+ * parked list on the spot, through the callback's own node, and remember the
+ * list they came from. Walks that already rotate passed-over folios to the
+ * tail (iterate_extended) use dirty_rotate() instead, which only counts them.
+ * The fexit probe on folio_end_writeback() counts parked folios as they
+ * finish writeback, per parked list, and while its list's count is up
+ * dirty_unpark() walks the parked list at the start of the next eviction,
+ * returning clean folios to the eviction end of their home list. Each dirty folio costs the policy's
+ * walk one visit per dirty period instead of one per eviction.
+ *
+ * dirty_skip() and dirty_rotate() also enforce dirty_skip_budget, capped at
+ * DIRTY_PARK_BATCH: once a walk has skipped that many nodes, they return
+ * CACHE_EXT_STOP_ITER and the walk ends with what it has.
+ *
+ * Folios whose cleaning was missed or that were cleaned without writeback
+ * are found again by dirty_evict_parked(), which policies call only when
+ * their own lists couldn't satisfy the request.
+ *
+ *	evict_folios:	dirty_scan_begin(parked_list, home_list);
+ *			dirty_unpark(eviction_ctx, memcg);
+ *			<walk; callbacks return dirty_skip(folio) or dirty_rotate()>
+ *	folio_evicted:	dirty_evicted(folio);
+ */
+
+#define DIRTY_PARK_BATCH	32	// Folios parked per walk, at most
+#define DIRTY_UNPARK_BATCH	64	// Parked folios visited per eviction, at most
+#define DIRTY_MAX_PARKED	(1 << 16)
+#define DIRTY_MAX_PARKED_LISTS	256	// One per memcg, as many as cache_ext_memcg.h attaches to
+
+// Set from userspace. 0 or more than DIRTY_PARK_BATCH: DIRTY_PARK_BATCH.
+const volatile u32 dirty_skip_budget = DIRTY_PARK_BATCH;
+
+struct dirty_scan {
+	u64 parked_list;
+	u64 home_list;
+	u32 skipped;
+	u32 nr_parked;
+	u32 unpark_visits;
+	u32 unpark_left;
+};
+
+struct dirty_parked_folio {
+	u64 home_list;
+	u64 parked_list;
+	u32 cleaned;	// Counted in dirty_cleaned, see dirty_writeback_done()
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, u32);
+	__type(value, struct dirty_scan);
+	__uint(max_entries, 1);
+} dirty_scans SEC(".maps");
+
+// Parked folio -> its lists. The folio is only a key, never dereferenced.
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, u64);
+	__type(value, struct dirty_parked_folio);
+	__uint(max_entries, DIRTY_MAX_PARKED);
+} dirty_parked SEC(".maps");
+
+/*
+ * Parked list -> folios on it that finished writeback and haven't been
+ * unparked or evicted yet. Each memcg's policy instance has its own parked
+ * list, so one cgroup's writeback never sends another's unpark walk looking.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, u64);
+	__type(value, s64);
+	__uint(max_entries, DIRTY_MAX_PARKED_LISTS);
+} dirty_cleaned SEC(".maps");
+
+static __always_inline bool folio_writeback_pending(struct folio *folio)
+{
+	return folio_test_dirty(folio) || folio_test_writeback(folio);
+}
+
+static __always_inline struct dirty_scan *dirty_scan_get(void)
+{
+	u32 key = 0;
+
+	return bpf_map_lookup_elem(&dirty_scans, &key);
+}
+
+static inline void dirty_scan_begin(u64 parked_list, u64 home_list)
+{
+	struct dirty_scan *scan = dirty_scan_get();
+
+	if (scan) {
+		scan->parked_list = parked_list;
+		scan->home_list = home_list;
+		scan->skipped = 0;
+		scan->nr_parked = 0;
+	}
+}
+
+/*
+ * Move folio to the parked list if it is dirty or under writeback. Only for
+ * the node of the running iterate or sample callback.
+ */
+static inline void dirty_park(struct folio *folio)
+{
+	struct dirty_scan *scan;
+	u64 key = (u64)folio;
+
+	if (!folio_writeback_pending(folio))
+		return;
+
+	scan = dirty_scan_get();
+	if (!scan || !scan->parked_list || scan->nr_parked >= DIRTY_PARK_BATCH)
+		return;
+
+	struct dirty_parked_folio parked = {
+		.home_list = scan->home_list,
+		.parked_list = scan->parked_list,
+	};
+
+	if (bpf_map_update_elem(&dirty_parked, &key, &parked, BPF_NOEXIST))
+		return;
+	if (bpf_cache_ext_list_move(scan->parked_list, folio, true)) {
+		bpf_map_delete_elem(&dirty_parked, &key);
+		return;
+	}
+	scan->nr_parked++;
+	cache_ext_stat_inc(CACHE_EXT_STAT_DIRTY_PARKED);
+}
+
+// Count a skipped node. Returns true once the walk is over budget.
+static inline bool dirty_skip_exhausted(void)
+{
+	struct dirty_scan *scan = dirty_scan_get();
+	u32 budget = dirty_skip_budget;
+
+	if (!scan)
+		return false;
+	if (!budget || budget > DIRTY_PARK_BATCH)
+		budget = DIRTY_PARK_BATCH;
+	return ++scan->skipped > budget;
+}
+
+/*
+ * iterate_extended callback result for a folio that can't be evicted now.
+ * The walk's continue placement passes it over.
+ */
+static inline int dirty_rotate(void)
+{
+	if (dirty_skip_exhausted())
+		return CACHE_EXT_STOP_ITER;
+	return CACHE_EXT_CONTINUE_ITER;
+}
+
+// iterate callback result for a folio that can't be evicted now
+static inline int dirty_skip(struct folio *folio)
+{
+	if (dirty_skip_exhausted())
+		return CACHE_EXT_STOP_ITER;
+
+	dirty_park(folio);
+	return CACHE_EXT_CONTINUE_ITER;
+}
+
+/*
+ * Take a parked folio's writeback completion off its list's count, once it
+ * is unparked or evicted, or found dirty again (its next writeback counts).
+ */
+static __always_inline void dirty_uncount(struct dirty_parked_folio *parked)
+{
+	s64 *cleaned;
+
+	if (__sync_val_compare_and_swap(&parked->cleaned, 1, 0) != 1)
+		return;
+	cleaned = bpf_map_lookup_elem(&dirty_cleaned, &parked->parked_list);
+	if (cleaned)
+		__sync_fetch_and_sub(cleaned, 1);
+}
+
+static int dirty_unpark_cb(int idx, struct cache_ext_list_node *a)
+{
+	struct dirty_scan *scan = dirty_scan_get();
+	struct dirty_parked_folio *parked;
+	u64 key = (u64)a->folio;
+	u64 home_list;
+
+	if (!scan || !scan->unpark_left || scan->unpark_visits >= DIRTY_UNPARK_BATCH)
+		return CACHE_EXT_STOP_ITER;
+	scan->unpark_visits++;
+
+	parked = bpf_map_lookup_elem(&dirty_parked, &key);
+
+	// Still (or again) dirty: to the back, so the next pass starts on others
+	if (folio_writeback_pending(a->folio)) {
+		if (parked)
+			dirty_uncount(parked);
+		bpf_cache_ext_list_move(scan->parked_list, a->folio, true);
+		return CACHE_EXT_CONTINUE_ITER;
+	}
+
+	home_list = scan->home_list;
+	if (parked) {
+		home_list = parked->home_list;
+		dirty_uncount(parked);
+	}
+	bpf_map_delete_elem(&dirty_parked, &key);
+	if (bpf_cache_ext_list_move(home_list, a->folio, false))
+		return CACHE_EXT_CONTINUE_ITER;
+
+	scan->unpark_left--;
+	cache_ext_stat_inc(CACHE_EXT_STAT_DIRTY_UNPARKED);
+	return CACHE_EXT_CONTINUE_ITER;
+}
+
+// Return finished folios to the eviction end of their home list
+static inline void dirty_unpark(struct cache_ext_eviction_ctx *ctx, struct mem_cgroup *memcg)
+{
+	struct dirty_scan *scan = dirty_scan_get();
+	s64 *count, cleaned;
+
+	if (!scan || !scan->parked_list)
+		return;
+	count = bpf_map_lookup_elem(&dirty_cleaned, &scan->parked_list);
+	if (!count)
+		return;
+	cleaned = READ_ONCE(*count);
+	if (cleaned <= 0)
+		return;
+
+	scan->unpark_left = cleaned < DIRTY_UNPARK_BATCH ? cleaned : DIRTY_UNPARK_BATCH;
+	scan->unpark_visits = 0;
+
+	/*
+	 * dirty_uncount() takes each counted folio off as it is unparked, so a
+	 * walk cut short by DIRTY_UNPARK_BATCH leaves the rest for the next one.
+	 */
+	if (bpf_cache_ext_list_iterate(memcg, scan->parked_list, dirty_unpark_cb, ctx) < 0)
+		bpf_printk("cache_ext: evict: Failed to iterate parked_list\n");
+}
+
+static inline void dirty_evicted(struct folio *folio)
+{
+	struct dirty_parked_folio *parked;
+	u64 key = (u64)folio;
+
+	parked = bpf_map_lookup_elem(&dirty_parked, &key);
+	if (!parked)
+		return;
+	dirty_uncount(parked);
+	bpf_map_delete_elem(&dirty_parked, &key);
+}
+
+SEC("fexit/folio_end_writeback")
+int BPF_PROG(dirty_writeback_done, struct folio *folio)
+{
+	struct dirty_parked_folio *parked;
+	s64 zero = 0, *cleaned;
+	u64 key = (u64)folio;
+
+	parked = bpf_map_lookup_elem(&dirty_parked, &key);
+	if (!parked || __sync_val_compare_and_swap(&parked->cleaned, 0, 1) != 0)
+		return 0;
+
+	cleaned = bpf_map_lookup_elem(&dirty_cleaned, &parked->parked_list);
+	if (!cleaned) {
+		bpf_map_update_elem(&dirty_cleaned, &parked->parked_list, &zero, BPF_NOEXIST);
+		cleaned = bpf_map_lookup_elem(&dirty_cleaned, &parked->parked_list);
+		if (!cleaned)
+			return 0;
+	}
+	__sync_fetch_and_add(cleaned, 1);
+	return 0;
+}
+
+static int dirty_parked_evict_cb(int idx, struct cache_ext_list_node *a)
+{
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+
+	if (!folio_test_uptodate(a->folio) || !folio_test_lru(a->folio) ||
+	    folio_writeback_pending(a->folio))
+		return dirty_rotate();
+
+	return CACHE_EXT_EVICT_NODE;
+}
+
+// Evict clean folios straight from the parked list, oldest first
+static inline void dirty_evict_parked(struct cache_ext_eviction_ctx *ctx,
+				      struct mem_cgroup *memcg, u64 parked_list)
+{
+	struct cache_ext_iterate_opts opts = {
+		.continue_list = CACHE_EXT_ITERATE_SELF,
+		.continue_mode = CACHE_EXT_ITERATE_TAIL,
+		.evict_list = CACHE_EXT_ITERATE_SELF,
+		.evict_mode = CACHE_EXT_ITERATE_TAIL,
+	};
+
+	if (eviction_ctx_done(ctx))
+		return;
+
+	if (bpf_cache_ext_list_iterate_extended(memcg, parked_list, dirty_parked_evict_cb, &opts,
+						ctx) < 0)
+		bpf_printk("cache_ext: evict: Failed to iterate parked_list\n");
+}
+
+#endif /* _CACHE_EXT_DIRTY_BPF_H */
@@ -0,0 +1,56 @@
+#ifndef _CACHE_EXT_EVENTS_BPF_H
+#define _CACHE_EXT_EVENTS_BPF_H 1
+
+#include "cache_ext_stats.bpf.h"
+
+/*
+ * Low-wakeup ring buffer submission.
+ *
+ * Records are committed with BPF_RB_NO_WAKEUP, so reporting an event doesn't
+ * wake the loader by itself. A submit forces a wakeup only once the ring is
+ * events_wakeup_pct full; anything below that watermark is drained in one
+ * batch by ring_buffer__consume() when the loader's poll times out
+ * (cache_ext_events_poll(), EVENTS_POLL_MS).
+ * Delivery then costs at most one wakeup per poll period plus one per
+ * watermark's worth of records, however often the policy reports.
+ *
+ * Records lost to a full ring are counted in CACHE_EXT_STAT_EVENTS_DROPPED.
+ */
+
+// Set from userspace
+const volatile u32 events_wakeup_pct = 25;
+
+static __always_inline u64 events_wakeup_flags(void *rb)
+{
+	u64 avail = bpf_ringbuf_query(rb, BPF_RB_AVAIL_DATA);
+	u64 size = bpf_ringbuf_query(rb, BPF_RB_RING_SIZE);
+
+	if (avail * 100 >= size * events_wakeup_pct)
+		return BPF_RB_FORCE_WAKEUP;
+	return BPF_RB_NO_WAKEUP;
+}
+
+static __always_inline void *events_reserve(void *rb, u64 size)
+{
+	void *rec = bpf_ringbuf_reserve(rb, size, 0);
+
+	if (!rec)
+		cache_ext_stat_inc(CACHE_EXT_STAT_EVENTS_DROPPED);
+	return rec;
+}
+
+static __always_inline void events_submit(void *rb, void *rec)
+{
+	bpf_ringbuf_submit(rec, events_wakeup_flags(rb));
+}
+
+static __always_inline long events_output(void *rb, void *data, u64 size)
+{
+	long ret = bpf_ringbuf_output(rb, data, size, events_wakeup_flags(rb));
+
+	if (ret)
+		cache_ext_stat_inc(CACHE_EXT_STAT_EVENTS_DROPPED);
+	return ret;
+}
+
+#endif /* _CACHE_EXT_EVENTS_BPF_H */
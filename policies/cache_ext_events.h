@@ -0,0 +1,133 @@
+#ifndef _CACHE_EXT_EVENTS_H
+#define _CACHE_EXT_EVENTS_H
+
+#include <argp.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <bpf/libbpf.h>
+
+#include "cache_ext_stats.h"
+
+/*
+ * Userspace half of the low-wakeup event pipeline (see
+ * cache_ext_events.bpf.h).
+ *
+ * The BPF side only wakes us once a ring reaches the --events_wakeup_pct
+ * watermark. ring_buffer__poll() only reads rings that woke it, so loaders
+ * call cache_ext_events_poll(), which waits up to EVENTS_POLL_MS and on a
+ * timeout drains the records still below the watermark with
+ * ring_buffer__consume(). --events_ring_kb resizes the policy's event rings
+ * before load.
+ *
+ * Loaders with event rings use cache_ext_events_argp_children, which also
+ * carries the stats exporter options.
+ */
+
+#define EVENTS_POLL_MS		100
+#define EVENTS_MIN_RING_BYTES	4096
+
+#define events_wakeup_pct(skel)	((skel)->rodata->events_wakeup_pct)
+
+struct cache_ext_events_args {
+	unsigned long ring_kb;		// 0: keep the policy's default sizes
+	unsigned int wakeup_pct;
+};
+
+struct cache_ext_events_args cache_ext_events_args = { .wakeup_pct = 25 };
+
+enum {
+	CACHE_EXT_EVENTS_OPT_RING_KB = 0x1100,
+	CACHE_EXT_EVENTS_OPT_WAKEUP_PCT,
+};
+
+static struct argp_option cache_ext_events_options[] = {
+	{ "events_ring_kb", CACHE_EXT_EVENTS_OPT_RING_KB, "KB", 0,
+	  "Size of each event ring buffer (default: per-policy)" },
+	{ "events_wakeup_pct", CACHE_EXT_EVENTS_OPT_WAKEUP_PCT, "PCT", 0,
+	  "Wake the loader once a ring is PCT full (default: 25)" },
+	{ 0 }
+};
+
+static error_t cache_ext_events_parse_opt(int key, char *arg, struct argp_state *state)
+{
+	struct cache_ext_events_args *args = &cache_ext_events_args;
+	char *end;
+
+	switch (key) {
+	case CACHE_EXT_EVENTS_OPT_RING_KB:
+		errno = 0;
+		args->ring_kb = strtoul(arg, &end, 10);
+		if (errno || *end != '\0')
+			argp_error(state, "Invalid ring size: %s", arg);
+		break;
+	case CACHE_EXT_EVENTS_OPT_WAKEUP_PCT:
+		errno = 0;
+		args->wakeup_pct = strtoul(arg, &end, 10);
+		if (errno || *end != '\0' || args->wakeup_pct == 0 || args->wakeup_pct > 100)
+			argp_error(state, "Invalid wakeup watermark: %s", arg);
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static struct argp cache_ext_events_argp = {
+	cache_ext_events_options, cache_ext_events_parse_opt, 0, 0
+};
+
+static struct argp_child cache_ext_events_argp_children[] = {
+	{ &cache_ext_events_argp, 0, "Event pipeline:", 0 },
+	{ &cache_ext_stats_argp, 0, "Stats export:", 0 },
+	{ 0 }
+};
+
+/*
+ * Apply --events_ring_kb to a ring buffer map. Ring sizes must be a power of
+ * two multiple of the page size, so round up. Must be called between
+ * skel__open() and skel__load().
+ */
+int cache_ext_events_resize(struct bpf_map *map) {
+	unsigned long bytes = cache_ext_events_args.ring_kb * 1024;
+	unsigned long size = sysconf(_SC_PAGESIZE);
+
+	if (bytes == 0)
+		return 0;
+
+	if (size < EVENTS_MIN_RING_BYTES)
+		size = EVENTS_MIN_RING_BYTES;
+	while (size < bytes)
+		size <<= 1;
+
+	if (bpf_map__set_max_entries(map, size)) {
+		fprintf(stderr, "Failed to resize ring buffer %s\n", bpf_map__name(map));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Wait up to timeout_ms for a wakeup, then drain the rings. Returns the
+ * number of records handled, or a negative error like ring_buffer__poll().
+ */
+int cache_ext_events_poll(struct ring_buffer *rb, int timeout_ms) {
+	int ret = ring_buffer__poll(rb, timeout_ms);
+
+	// No ring reached its watermark: nothing woke us, so read them anyway
+	if (ret == 0)
+		ret = ring_buffer__consume(rb);
+	return ret;
+}
+
+// Records lost to full rings so far, from the stats region
+__u64 cache_ext_events_dropped(const struct cache_ext_exporter *e) {
+	__u64 vals[NR_CACHE_EXT_STATS];
+
+	cache_ext_stats_read(&e->region, vals);
+	return vals[CACHE_EXT_STAT_EVENTS_DROPPED];
+}
+
+#endif /* _CACHE_EXT_EVENTS_H */
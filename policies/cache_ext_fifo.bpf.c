@@ -5,10 +5,17 @@
 
 #include "cache_ext_lib.bpf.h"
 #include "dir_watcher.bpf.h"
+#include "cache_ext_stats.bpf.h"
+#include "cache_ext_prof.bpf.h"
+#include "cache_ext_trace.bpf.h"
+#include "cache_ext_readahead.bpf.h"
+#include "cache_ext_dirty.bpf.h"
+#include "cache_ext_handoff.bpf.h"
 
 char _license[] SEC("license") = "GPL";
 
 static u64 main_list;
+static u64 parked_list;
 
 static inline bool is_folio_relevant(struct folio *folio) {
 	if (!folio || !folio->mapping || !folio->mapping->host)
@@ -26,16 +33,35 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(fifo_init, struct mem_cgroup *memcg)
 	}
 	bpf_printk("cache_ext: Created main_list: %llu\n", main_list);
 
+	parked_list = bpf_cache_ext_ds_registry_new_list(memcg);
+	if (parked_list == 0) {
+		bpf_printk("cache_ext: init: Failed to create parked_list\n");
+		return -1;
+	}
+
+	if (ra_probation_init(memcg))
+		return -1;
+
+	handoff_export(memcg, ra_probation_list);
+	handoff_export(memcg, main_list);
+	handoff_export(memcg, parked_list);
 	return 0;
 }
 
+// Adopted folios join the FIFO in the order the replaced policy kept them
+static void handoff_adopt(struct folio *folio)
+{
+}
+
 static int bpf_fifo_evict_cb(int idx, struct cache_ext_list_node *a)
 {
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+
 	if (!folio_test_uptodate(a->folio) || !folio_test_lru(a->folio))
-		return CACHE_EXT_CONTINUE_ITER;
+		return dirty_skip(a->folio);
 
 	if (folio_test_dirty(a->folio) || folio_test_writeback(a->folio))
-		return CACHE_EXT_CONTINUE_ITER;
+		return dirty_skip(a->folio);
 
 	return CACHE_EXT_EVICT_NODE;
 }
@@ -43,13 +69,47 @@ static int bpf_fifo_evict_cb(int idx, struct cache_ext_list_node *a)
 void BPF_STRUCT_OPS(fifo_evict_folios, struct cache_ext_eviction_ctx *eviction_ctx,
 		    struct mem_cgroup *memcg)
 {
+	PROF_EVICT_SCOPE(eviction_ctx);
+	EVICTION_TARGET_SCOPE(eviction_ctx);
+	dirty_scan_begin(parked_list, main_list);
+	dirty_unpark(eviction_ctx, memcg);
+
+	if (handoff_step(eviction_ctx, memcg, main_list, false) &&
+	    eviction_ctx_done(eviction_ctx))
+		return;
+
+	if (ra_probation_over_budget(memcg)) {
+		ra_probation_evict(eviction_ctx, memcg);
+		if (eviction_ctx_done(eviction_ctx))
+			return;
+	}
+
 	if (bpf_cache_ext_list_iterate(memcg, main_list, bpf_fifo_evict_cb, eviction_ctx) < 0) {
 		bpf_printk("cache_ext: evict: Failed to iterate main_list\n");
 		return;
 	}
+
+	dirty_evict_parked(eviction_ctx, memcg, parked_list);
+}
+
+void BPF_STRUCT_OPS(fifo_folio_accessed, struct folio *folio) {
+	PROF_SCOPE(PROF_FOLIO_ACCESSED);
+	cache_ext_trace(CACHE_EXT_TRACE_ACCESS, folio);
+	if (!is_folio_relevant(folio))
+		return;
+	cache_ext_stat_inc(CACHE_EXT_STAT_HITS);
+
+	// Promoted readahead joins the FIFO as if it had just been faulted in
+	if (ra_probation_promote(folio) && bpf_cache_ext_list_move(main_list, folio, true))
+		bpf_printk("cache_ext: accessed: Failed to move folio to main_list\n");
 }
 
 void BPF_STRUCT_OPS(fifo_folio_evicted, struct folio *folio) {
+	PROF_SCOPE(PROF_FOLIO_EVICTED);
+	cache_ext_trace(CACHE_EXT_TRACE_EVICT, folio);
+	cache_ext_stat_inc(CACHE_EXT_STAT_EVICTIONS);
+	ra_probation_evicted(folio);
+	dirty_evicted(folio);
 	// if (bpf_cache_ext_list_del(folio)) {
 	// 	bpf_printk("cache_ext: Failed to delete folio from list\n");
 	// 	return;
@@ -57,19 +117,27 @@ void BPF_STRUCT_OPS(fifo_folio_evicted, struct folio *folio) {
 }
 
 void BPF_STRUCT_OPS(fifo_folio_added, struct folio *folio) {
+	PROF_SCOPE(PROF_FOLIO_ADDED);
+	cache_ext_trace(CACHE_EXT_TRACE_ADD, folio);
 	if (!is_folio_relevant(folio))
 		return;
+	cache_ext_stat_inc(CACHE_EXT_STAT_MISSES);
+
+	if (ra_probation_admit(folio))
+		return;
 
 	if (bpf_cache_ext_list_add_tail(main_list, folio)) {
 		bpf_printk("cache_ext: added: Failed to add folio to main_list\n");
 		return;
 	}
+
 }
 
 SEC(".struct_ops.link")
 struct cache_ext_ops fifo_ops = {
 	.init = (void *)fifo_init,
 	.evict_folios = (void *)fifo_evict_folios,
+	.folio_accessed = (void *)fifo_folio_accessed,
 	.folio_evicted = (void *)fifo_folio_evicted,
 	.folio_added = (void *)fifo_folio_added,
 };
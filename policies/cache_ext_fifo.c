@@ -10,6 +10,8 @@
 #include <unistd.h>
 
 #include "dir_watcher.h"
+#include "cache_ext_stats.h"
+#include "cache_ext_readahead.h"
 #include "cache_ext_fifo.skel.h"
 
 char *USAGE = "Usage: ./cache_ext_fifo --watch_dir <dir> --cgroup_path <path>\n";
@@ -47,7 +49,7 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 }
 
 static int parse_args(int argc, char **argv, struct cmdline_args *args) {
-	struct argp argp = { options, parse_opt, 0, 0 };
+	struct argp argp = { options, parse_opt, 0, 0, cache_ext_readahead_argp_children };
 	argp_parse(&argp, argc, argv, 0, 0, args);
 
 	if (args->watch_dir == NULL) {
@@ -81,12 +83,6 @@ static int validate_watch_dir(const char *watch_dir, char *watch_dir_full_path)
 		return 1;
 	}
 
-	// BPF policy restriction
-	if (strlen(watch_dir_full_path) > 128) {
-		fprintf(stderr, "watch_dir path too long\n");
-		return 1;
-	}
-
 	return 0;
 }
 
@@ -94,6 +90,11 @@ int main(int argc, char **argv) {
 	struct cmdline_args args = { 0 };
 	struct cache_ext_fifo_bpf *skel = NULL;
 	struct bpf_link *link = NULL;
+	struct cache_ext_swap swap = { 0 };
+	struct cache_ext_exporter exporter = { 0 };
+	struct cache_ext_profiler prof = { 0 };
+	struct cache_ext_recorder rec = { 0 };
+	struct cache_ext_readahead ra = { 0 };
 	struct sigaction sa;
 	char watch_dir_path[PATH_MAX];
 	int cgroup_fd = -1;
@@ -129,8 +130,28 @@ int main(int argc, char **argv) {
 		goto cleanup;
 	}
 
-	watch_dir_path_len_map(skel) = strlen(watch_dir_path);
-	strcpy(watch_dir_path_map(skel), watch_dir_path);
+	// Set watch_dir
+	if (set_watch_dir_root(watch_dir_path, &watch_dir_ino_map(skel), &watch_dir_dev_map(skel)))
+		goto cleanup;
+
+	// Size inode_watchlist for the watch dir
+	if (resize_watch_dir_map(inode_watchlist_map(skel), watch_dir_path, true))
+		goto cleanup;
+
+	// Hook profiling, if enabled
+	cache_ext_prof_setup(skel);
+
+	// Page access recording, if enabled
+	if (cache_ext_recorder_setup(skel))
+		goto cleanup;
+
+	// One stats slot per CPU
+	if (cache_ext_stats_resize(cache_ext_stats_map(skel)))
+		goto cleanup;
+
+	// Readahead probes and probation map
+	if (cache_ext_readahead_setup(skel, args.cgroup_path))
+		goto cleanup;
 
 	if (cache_ext_fifo_bpf__load(skel)) {
 		perror("Failed to load BPF skeleton");
@@ -142,18 +163,36 @@ int main(int argc, char **argv) {
 		goto cleanup;
 	}
 
-	link = bpf_map__attach_cache_ext_ops(skel->maps.fifo_ops, cgroup_fd);
+	link = cache_ext_swap_attach(&swap, skel->obj, skel->maps.fifo_ops, cgroup_fd);
 	if (link == NULL) {
 		perror("Failed to attach cache_ext_ops to cgroup");
 		goto cleanup;
 	}
 
+	if (cache_ext_readahead_attach(&ra, skel))
+		goto cleanup;
+
+	// Map the stats region and start the exporter, if enabled
+	if (cache_ext_exporter_start(&exporter, cache_ext_stats_map(skel), "fifo"))
+		goto cleanup;
+
+	// Dump hook profiles on SIGUSR1 and at exit, if enabled
+	if (cache_ext_prof_start(&prof, cache_ext_prof_map(skel), "fifo"))
+		goto cleanup;
+
+	// Stream page accesses to the --record file, if enabled
+	if (cache_ext_recorder_start(&rec, cache_ext_trace_ring(skel)))
+		goto cleanup;
+
 	// This is necessary for the dir_watcher functionality
 	if (cache_ext_fifo_bpf__attach(skel)) {
 		perror("Failed to attach BPF skeleton");
 		goto cleanup;
 	}
 
+	// Tell whoever started us that the policy is live
+	cache_ext_ready();
+
 	// Wait for keyboard input
 	printf("Press any key to exit...\n");
 	getchar();
@@ -161,6 +200,11 @@ int main(int argc, char **argv) {
 
 cleanup:
 	close(cgroup_fd);
+	cache_ext_recorder_stop(&rec);
+	cache_ext_prof_stop(&prof);
+	cache_ext_exporter_stop(&exporter);
+	cache_ext_readahead_detach(&ra);
+	cache_ext_swap_release(&swap, link);
 	bpf_link__destroy(link);
 	cache_ext_fifo_bpf__destroy(skel);
 	return ret;
@@ -0,0 +1,199 @@
+#ifndef _CACHE_EXT_FOLIO_STORE_BPF_H
+#define _CACHE_EXT_FOLIO_STORE_BPF_H 1
+
+#include "cache_ext_lib.bpf.h"
+
+/*
+ * Dense, array-backed per-folio metadata store.
+ *
+ * Folios live in the vmemmap array, so (u64)folio / sizeof(struct page) is the
+ * folio's PFN plus a constant. Its low bits are used directly as the home slot
+ * in a power-of-two BPF_MAP_TYPE_ARRAY that the loader sizes from the cgroup's
+ * memory.max (see cache_ext_folio_store.h). Collisions are resolved by probing
+ * the next FOLIO_STORE_NR_WAYS slots, and slots are claimed/released with a
+ * cmpxchg on the owner field, so the hot path does no hashing and takes no
+ * bucket locks.
+ *
+ * The including policy must define struct folio_metadata before including
+ * this header. It gets folio_metadata_map plus the helpers below.
+ *
+ * When the store is restored by --state (see cache_ext_state.h), every owner
+ * is tagged FOLIO_STORE_RESTORED: the folio may have been evicted and its
+ * struct folio reused while no policy was attached. folio_store_lookup()
+ * ignores tagged slots and folio_store_insert() treats them as free, so
+ * entries for folios that are gone are dropped as their slots are needed.
+ * folio_store_lookup_restored() claims a tagged entry for a folio that turns
+ * out to still be resident.
+ *
+ * Every insert gives the slot a new generation, so code that holds on to a
+ * folio pointer (the eviction pool in cache_ext_lib.bpf.h) can tell if the
+ * struct folio was freed and reused since, see folio_store_gen().
+ */
+
+#define FOLIO_STORE_NR_WAYS 16
+#define FOLIO_STORE_RESTORED 1ULL  // Folios are aligned, bit 0 of the owner is free
+#define FOLIO_STORE_DEFAULT_ENTRIES (1 << 22)  // Must be power of two
+
+// Set from userspace to (number of slots - 1)
+const volatile u64 folio_store_mask = FOLIO_STORE_DEFAULT_ENTRIES - 1;
+
+struct folio_store_slot {
+	u64 folio;  // Owner, 0 if free
+	u64 gen;  // New on every insert, tells a reused struct folio from the last owner
+	struct folio_metadata meta;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, u32);
+	__type(value, struct folio_store_slot);
+	__uint(max_entries, FOLIO_STORE_DEFAULT_ENTRIES);
+} folio_metadata_map SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, u32);
+	__type(value, u64);
+	__uint(max_entries, 1);
+} folio_store_gens SEC(".maps");
+
+// Unique without a shared counter: the CPU in the top bits, a per-CPU count below
+static __always_inline u64 folio_store_next_gen(void)
+{
+	u32 key = 0;
+	u64 *count = bpf_map_lookup_elem(&folio_store_gens, &key);
+
+	if (!count)
+		return 0;
+	return ((u64)bpf_get_smp_processor_id() << 48) | ++*count;
+}
+
+static __always_inline u32 folio_store_home(struct folio *folio)
+{
+	return ((u64)folio / sizeof(struct page)) & folio_store_mask;
+}
+
+static __always_inline struct folio_store_slot *folio_store_slot(u32 home, u32 way)
+{
+	u32 idx = (home + way) & folio_store_mask;
+	return bpf_map_lookup_elem(&folio_metadata_map, &idx);
+}
+
+static inline struct folio_store_slot *folio_store_lookup_slot(struct folio *folio)
+{
+	u32 home = folio_store_home(folio);
+
+	for (u32 i = 0; i < FOLIO_STORE_NR_WAYS; i++) {
+		struct folio_store_slot *slot = folio_store_slot(home, i);
+		if (!slot)
+			return NULL;
+		if (READ_ONCE(slot->folio) == (u64)folio)
+			return slot;
+	}
+
+	return NULL;
+}
+
+static inline struct folio_metadata *folio_store_lookup(struct folio *folio)
+{
+	struct folio_store_slot *slot = folio_store_lookup_slot(folio);
+
+	return slot ? &slot->meta : NULL;
+}
+
+// The insert generation of the slot holding meta, see eviction_pool_revalidate()
+static __always_inline u64 folio_store_gen(const struct folio_metadata *meta)
+{
+	return ((const struct folio_store_slot *)((const void *)meta -
+		__builtin_offsetof(struct folio_store_slot, meta)))->gen;
+}
+
+/*
+ * Like folio_store_lookup(), but also claims an entry restored from a
+ * snapshot. Sets *restored if it did, the caller then has to take the folio
+ * in as if it had just been added, with the restored metadata.
+ */
+static inline struct folio_metadata *folio_store_lookup_restored(struct folio *folio,
+								  bool *restored)
+{
+	struct folio_metadata *meta = folio_store_lookup(folio);
+	u64 tagged = (u64)folio | FOLIO_STORE_RESTORED;
+	u32 home;
+
+	*restored = false;
+	if (meta)
+		return meta;
+
+	home = folio_store_home(folio);
+	for (u32 i = 0; i < FOLIO_STORE_NR_WAYS; i++) {
+		struct folio_store_slot *slot = folio_store_slot(home, i);
+		if (!slot)
+			return NULL;
+		if (READ_ONCE(slot->folio) != tagged)
+			continue;
+		if (__sync_val_compare_and_swap(&slot->folio, tagged, (u64)folio) != tagged)
+			return NULL;
+		*restored = true;
+		return &slot->meta;
+	}
+
+	return NULL;
+}
+
+/*
+ * Claim a slot for folio and initialize it with *init. If the folio already
+ * owns a slot (e.g. folio_evicted was never called for it), that slot is
+ * reused. A slot holding a restored entry counts as free. Returns NULL if all
+ * FOLIO_STORE_NR_WAYS candidate slots are taken.
+ */
+static inline struct folio_metadata *folio_store_insert(struct folio *folio,
+							 const struct folio_metadata *init)
+{
+	struct folio_store_slot *slot = folio_store_lookup_slot(folio);
+	u32 home;
+
+	if (slot) {
+		slot->gen = folio_store_next_gen();
+		slot->meta = *init;
+		return &slot->meta;
+	}
+
+	home = folio_store_home(folio);
+	for (u32 i = 0; i < FOLIO_STORE_NR_WAYS; i++) {
+		u64 owner;
+
+		slot = folio_store_slot(home, i);
+		if (!slot)
+			return NULL;
+		owner = READ_ONCE(slot->folio);
+		if (owner != 0 && !(owner & FOLIO_STORE_RESTORED))
+			continue;
+		if (__sync_val_compare_and_swap(&slot->folio, owner, (u64)folio) != owner)
+			continue;
+		slot->gen = folio_store_next_gen();
+		slot->meta = *init;
+		return &slot->meta;
+	}
+
+	return NULL;
+}
+
+// Release the folio's slot. Returns -ENOENT if the folio has no slot.
+static inline int folio_store_delete(struct folio *folio)
+{
+	u32 home = folio_store_home(folio);
+
+	for (u32 i = 0; i < FOLIO_STORE_NR_WAYS; i++) {
+		struct folio_store_slot *slot = folio_store_slot(home, i);
+		if (!slot)
+			break;
+		if (READ_ONCE(slot->folio) != (u64)folio)
+			continue;
+		if (__sync_val_compare_and_swap(&slot->folio, (u64)folio, 0) == (u64)folio)
+			return 0;
+	}
+
+	return -2;  // -ENOENT
+}
+
+#endif /* _CACHE_EXT_FOLIO_STORE_BPF_H */
@@ -0,0 +1,92 @@
+#ifndef _CACHE_EXT_FOLIO_STORE_H
+#define _CACHE_EXT_FOLIO_STORE_H
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <bpf/libbpf.h>
+
+#define FOLIO_STORE_MIN_ENTRIES (1ULL << 16)
+#define FOLIO_STORE_MAX_ENTRIES (1ULL << 31)
+#define FOLIO_STORE_HEADROOM	4	// Store covers this many times the limit it is sized for
+
+#define folio_store_map(skel)		((skel)->maps.folio_metadata_map)
+#define folio_store_mask(skel)		((skel)->rodata->folio_store_mask)
+
+/*
+ * Read memory.max of the cgroup in bytes. Falls back to the amount of
+ * physical memory if the cgroup is unlimited or the file can't be read.
+ */
+uint64_t read_cgroup_memory_max(const char *cgroup_path) {
+	char path[PATH_MAX];
+	char buf[64] = { 0 };
+	uint64_t phys = (uint64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/memory.max", cgroup_path);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		return phys;
+	}
+
+	if (fgets(buf, sizeof(buf), f) == NULL || strncmp(buf, "max", 3) == 0) {
+		fclose(f);
+		return phys;
+	}
+	fclose(f);
+
+	errno = 0;
+	uint64_t limit = strtoull(buf, NULL, 10);
+	if (errno || limit == 0 || limit > phys)
+		return phys;
+
+	return limit;
+}
+
+/*
+ * Size the folio metadata store for mem_bytes of page cache. Must be called
+ * between skel__open() and skel__load(). The table can't grow once loaded,
+ * while memory.max can (cache_ext_balancer moves it), so it covers
+ * FOLIO_STORE_HEADROOM times mem_bytes, up to physical memory. It gets
+ * at least twice as many slots as there are pages, rounded up to a power of
+ * two, so probing stays short.
+ */
+int folio_store_resize_bytes(struct bpf_map *map, __u64 *mask, uint64_t mem_bytes) {
+	uint64_t page_size = sysconf(_SC_PAGESIZE);
+	uint64_t phys = (uint64_t)sysconf(_SC_PHYS_PAGES) * page_size;
+	uint64_t nr_pages, entries = FOLIO_STORE_MIN_ENTRIES;
+
+	if (mem_bytes < phys / FOLIO_STORE_HEADROOM)
+		mem_bytes *= FOLIO_STORE_HEADROOM;
+	else
+		mem_bytes = phys;
+	nr_pages = mem_bytes / page_size;
+
+	while (entries < 2 * nr_pages && entries < FOLIO_STORE_MAX_ENTRIES)
+		entries <<= 1;
+
+	if (bpf_map__set_max_entries(map, entries)) {
+		perror("Failed to resize folio_metadata_map");
+		return -1;
+	}
+	*mask = entries - 1;
+
+	fprintf(stderr, "Folio store: %lu slots for %lu pages (%lu MiB)\n",
+		entries, nr_pages,
+		entries * bpf_map__value_size(map) >> 20);
+
+	return 0;
+}
+
+// Size the folio metadata store from the cgroup limit
+int folio_store_resize(struct bpf_map *map, __u64 *mask, const char *cgroup_path) {
+	return folio_store_resize_bytes(map, mask, read_cgroup_memory_max(cgroup_path));
+}
+
+#endif /* _CACHE_EXT_FOLIO_STORE_H */
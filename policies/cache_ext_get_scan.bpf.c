@@ -5,6 +5,10 @@
 
 #include "cache_ext_lib.bpf.h"
 #include "dir_watcher.bpf.h"
+#include "cache_ext_stats.bpf.h"
+#include "cache_ext_prof.bpf.h"
+#include "cache_ext_trace.bpf.h"
+#include "cache_ext_scan.bpf.h"
 
 char _license[] SEC("license") = "GPL";
 
@@ -55,12 +59,7 @@ struct folio_metadata {
 	bool touched_by_scan;
 };
 
-struct {
-	__uint(type, BPF_MAP_TYPE_HASH);
-	__type(key, __u64);
-	__type(value, struct folio_metadata);
-	__uint(max_entries, 4000000);
-} folio_metadata_map SEC(".maps");
+#include "cache_ext_folio_store.bpf.h"
 
 struct {
 	__uint(type, BPF_MAP_TYPE_ARRAY);
@@ -179,13 +178,16 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(mixed_init, struct mem_cgroup *memcg)
 
 void BPF_STRUCT_OPS(mixed_folio_added, struct folio *folio)
 {
+	PROF_SCOPE(PROF_FOLIO_ADDED);
+	cache_ext_trace(CACHE_EXT_TRACE_ADD, folio);
 	dbg_printk(
 		"cache_ext: Hi from the mixed_folio_added hook! :D\n");
 	if (!is_folio_relevant(folio)) {
 		return;
 	}
     enum ListType list_type = LIST_GENERAL;
-	bool touched_by_scan = is_scanning_pid();
+	// Pinned scan_pids override the classifier
+	bool touched_by_scan = is_scanning_pid() || folio_added_by_scan(folio);
     if (touched_by_scan) {
         list_type = LIST_FOR_SCANS;
     }
@@ -204,47 +206,41 @@ void BPF_STRUCT_OPS(mixed_folio_added, struct folio *folio)
 	dbg_printk("cache_ext: Added folio to sampling_list\n");
 
     // Stats
-	update_stat(&STAT_TOTAL_PAGES, 1);
-	update_stat(&STAT_INSERTED_TOTAL_PAGES, 1);
+	cache_ext_stat_inc(CACHE_EXT_STAT_MISSES);
+	long nr_pages = folio_nr_pages(folio);
+	update_stat(&STAT_TOTAL_PAGES, nr_pages);
+	update_stat(&STAT_INSERTED_TOTAL_PAGES, nr_pages);
 	if (touched_by_scan) {
-		__sync_fetch_and_add(&scan_pages, 1);
+		__sync_fetch_and_add(&scan_pages, nr_pages);
 		//update_stat(&STAT_SCAN_PAGES, 1);
-		update_stat(&STAT_INSERTED_SCAN_PAGES, 1);
+		update_stat(&STAT_INSERTED_SCAN_PAGES, nr_pages);
 	}
 
 	// Create folio metadata
-	u64 key = (u64)folio;
 	struct folio_metadata new_meta = {
 		.accesses = 1,
 		.touched_by_scan = touched_by_scan,
 		.last_access_time = bpf_ktime_get_ns(),
 	};
-	bpf_map_update_elem(&folio_metadata_map, &key, &new_meta, BPF_ANY);
+	folio_store_insert(folio, &new_meta);
 }
 
 void BPF_STRUCT_OPS(mixed_folio_accessed, struct folio *folio)
 {
+	PROF_SCOPE(PROF_FOLIO_ACCESSED);
+	cache_ext_trace(CACHE_EXT_TRACE_ACCESS, folio);
 	if (!is_folio_relevant(folio)) {
 		return;
 	}
 	// TODO: Update folio metadata with other values we want to track
 	struct folio_metadata *meta;
-	u64 key = (u64)folio;
-	meta = bpf_map_lookup_elem(&folio_metadata_map, &key);
+	meta = folio_store_lookup(folio);
 	if (!meta) {
         // If metadata does not exist, try to add it
 		struct folio_metadata new_meta = { 0 };
-		int ret = bpf_map_update_elem(&folio_metadata_map, &key,
-					      &new_meta, BPF_ANY);
-		if (ret != 0) {
-			bpf_printk(
-				"cache_ext: Failed to create folio metadata in accessed. Return value: %d\n",
-				ret);
-			return;
-		}
-		meta = bpf_map_lookup_elem(&folio_metadata_map, &key);
+		meta = folio_store_insert(folio, &new_meta);
 		if (meta == NULL) {
-			bpf_printk("cache_ext: Failed to get created folio metadata in accessed\n");
+			bpf_printk("cache_ext: Failed to create folio metadata in accessed\n");
 			return;
 		}
 	}
@@ -265,6 +261,7 @@ void BPF_STRUCT_OPS(mixed_folio_accessed, struct folio *folio)
     //     bpf_cache_ext_list_add(sampling_list, folio);
     // }
 
+	cache_ext_stat_inc(CACHE_EXT_STAT_HITS);
 	update_stat(&STAT_ACCESSED_TOTAL_PAGES, 1);
 	if (meta->touched_by_scan) {
 		update_stat(&STAT_ACCESSED_SCAN_PAGES, 1);
@@ -276,6 +273,8 @@ void BPF_STRUCT_OPS(mixed_folio_accessed, struct folio *folio)
 
 void BPF_STRUCT_OPS(mixed_folio_evicted, struct folio *folio)
 {
+	PROF_SCOPE(PROF_FOLIO_EVICTED);
+	cache_ext_trace(CACHE_EXT_TRACE_EVICT, folio);
 	dbg_printk(
 		"cache_ext: Hi from the mixed_folio_evicted hook! :D\n");
 	int ret = bpf_cache_ext_list_del(folio);
@@ -284,23 +283,24 @@ void BPF_STRUCT_OPS(mixed_folio_evicted, struct folio *folio)
 			   ret);
 	}
 
-	u64 key = (u64)folio;
 	bool touched_by_scan = false;
-	struct folio_metadata *meta = bpf_map_lookup_elem(&folio_metadata_map, &key);
+	struct folio_metadata *meta = folio_store_lookup(folio);
 	if (meta) {
 		touched_by_scan = meta->touched_by_scan;
 	} else {
 		bpf_printk("cache_ext: Failed to get metadata for evicted folio\n");
 	}
-	bpf_map_delete_elem(&folio_metadata_map, &key);
+	folio_store_delete(folio);
 	// Update stats
+	long nr_pages = folio_nr_pages(folio);
 	if (touched_by_scan) {
-		__sync_fetch_and_sub(&scan_pages, 1);
+		__sync_fetch_and_sub(&scan_pages, nr_pages);
 		//update_stat(&STAT_SCAN_PAGES, -1);
-		update_stat(&STAT_EVICTED_SCAN_PAGES, 1);
+		update_stat(&STAT_EVICTED_SCAN_PAGES, nr_pages);
 	}
-	update_stat(&STAT_TOTAL_PAGES, -1);
-	update_stat(&STAT_EVICTED_TOTAL_PAGES, 1);
+	cache_ext_stat_inc(CACHE_EXT_STAT_EVICTIONS);
+	update_stat(&STAT_TOTAL_PAGES, -nr_pages);
+	update_stat(&STAT_EVICTED_TOTAL_PAGES, nr_pages);
 
 }
 
@@ -330,13 +330,14 @@ static s64 bpf_lfu_score_fn(struct cache_ext_list_node *a)
 {
 	s64 score = 0;
 	struct folio_metadata *meta_a;
-	u64 key_a = (u64)a->folio;
-	meta_a = bpf_map_lookup_elem(&folio_metadata_map, &key_a);
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+	meta_a = folio_store_lookup(a->folio);
 	if (!meta_a) {
 		bpf_printk("cache_ext: Failed to get metadata\n");
 		return INT64_MAX;
 	}
 	// if (!meta_a->touched_by_scan) {
+
 	// 	bpf_printk("cache_ext: Found page not in scan in score_fn\n");
 	// }
 	score = meta_a->accesses;
@@ -353,6 +354,8 @@ void BPF_STRUCT_OPS(mixed_evict_folios,
 		    struct cache_ext_eviction_ctx *eviction_ctx,
 		    struct mem_cgroup *memcg)
 {
+	PROF_EVICT_SCOPE(eviction_ctx);
+	EVICTION_TARGET_SCOPE(eviction_ctx);
 	int sampling_rate = 5;
 	dbg_printk(
 		"cache_ext: Hi from the mixed_evict_folios hook! :D\n");
@@ -378,7 +381,7 @@ void BPF_STRUCT_OPS(mixed_evict_folios,
 	};
 	bpf_cache_ext_list_sample(memcg, sampling_list, bpf_lfu_score_fn,
 				  &sampling_opts, eviction_ctx);
-	if (eviction_ctx->nr_folios_to_evict != eviction_ctx->request_nr_folios_to_evict) {
+	if (!eviction_ctx_done(eviction_ctx)) {
 		bpf_printk("cache_ext: Failed to evict enough pages: %d/%d\n",
 			   eviction_ctx->nr_folios_to_evict,
 			   eviction_ctx->request_nr_folios_to_evict);
@@ -1,26 +1,53 @@
 #include <argp.h>
 #include <bpf/bpf.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "cache_ext_get_scan.skel.h"
 #include "dir_watcher.h"
+#include "cache_ext_stats.h"
+#include "cache_ext_folio_store.h"
 
 char *USAGE = "Usage: ./cache_ext_get_scan --watch_dir <dir> --cgroup_path <path>\n";
 struct cmdline_args {
 	char *watch_dir;
 	char *cgroup_path;
+	long scan_min_run;		// -1: keep the BPF default
+	long scan_max_ns_per_page;	// -1: keep the BPF default
+};
+
+enum {
+	OPT_SCAN_MIN_RUN = 0x100,
+	OPT_SCAN_MAX_NS_PER_PAGE,
 };
 
 static struct argp_option options[] = { { "watch_dir", 'w', "DIR", 0, "Directory to watch" },
 					{ "cgroup_path", 'c', "PATH", 0,
 					  "Path to cgroup (e.g., /sys/fs/cgroup/cache_ext_test)" },
+					{ "scan_min_run", OPT_SCAN_MIN_RUN, "PAGES", 0,
+					  "Sequential run length that marks a scan, 0 to rely on scan_pids only (default: 32)" },
+					{ "scan_max_ns_per_page", OPT_SCAN_MAX_NS_PER_PAGE, "NS", 0,
+					  "Slowest average insertion rate still treated as a scan (default: 100000)" },
 					{ 0 } };
 
+static long parse_nonneg(const char *arg, struct argp_state *state)
+{
+	char *end;
+	long val;
+
+	errno = 0;
+	val = strtol(arg, &end, 10);
+	if (errno || *end != '\0' || val < 0)
+		argp_error(state, "Invalid value: %s", arg);
+	return val;
+}
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state)
 {
 	struct cmdline_args *args = state->input;
@@ -31,6 +58,12 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 	case 'c':
 		args->cgroup_path = arg;
 		break;
+	case OPT_SCAN_MIN_RUN:
+		args->scan_min_run = parse_nonneg(arg, state);
+		break;
+	case OPT_SCAN_MAX_NS_PER_PAGE:
+		args->scan_max_ns_per_page = parse_nonneg(arg, state);
+		break;
 	default:
 		return ARGP_ERR_UNKNOWN;
 	}
@@ -42,12 +75,16 @@ int main(int argc, char **argv)
 	int ret = 1;
 	struct cache_ext_get_scan_bpf *skel = NULL;
 	struct bpf_link *link = NULL;
+	struct cache_ext_swap swap = { 0 };
+	struct cache_ext_exporter exporter = { 0 };
+	struct cache_ext_profiler prof = { 0 };
+	struct cache_ext_recorder rec = { 0 };
 	int cgroup_fd = -1;
 	libbpf_set_strict_mode(LIBBPF_STRICT_ALL);
 
 	// Parse command line arguments
-	struct cmdline_args args = { 0 };
-	struct argp argp = { options, parse_opt, 0, 0 };
+	struct cmdline_args args = { .scan_min_run = -1, .scan_max_ns_per_page = -1 };
+	struct argp argp = { options, parse_opt, 0, 0, cache_ext_stats_argp_children };
 	argp_parse(&argp, argc, argv, 0, 0, &args);
 
 	// Validate arguments
@@ -75,12 +112,6 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	// TODO: Enable longer length
-	if (strlen(watch_dir_full_path) > 128) {
-		fprintf(stderr, "watch_dir path too long\n");
-		return 1;
-	}
-
 	cgroup_fd = open(args.cgroup_path, O_RDONLY);
 	if (cgroup_fd < 0) {
 		perror("Failed to open cgroup path");
@@ -95,8 +126,39 @@ int main(int argc, char **argv)
 	}
 
 	// Set watch_dir
-	skel->rodata->watch_dir_path_len = strlen(watch_dir_full_path);
-	strcpy(skel->rodata->watch_dir_path, watch_dir_full_path);
+	ret = set_watch_dir_root(args.watch_dir, &watch_dir_ino_map(skel), &watch_dir_dev_map(skel));
+	if (ret)
+		goto cleanup;
+
+	// Tune the scan classifier
+	if (args.scan_min_run >= 0)
+		skel->rodata->scan_min_run = args.scan_min_run;
+	if (args.scan_max_ns_per_page >= 0)
+		skel->rodata->scan_max_ns_per_page = args.scan_max_ns_per_page;
+
+	// Size folio metadata store from the cgroup limit
+	ret = folio_store_resize(folio_store_map(skel), &folio_store_mask(skel),
+				 args.cgroup_path);
+	if (ret)
+		goto cleanup;
+
+	// Size inode_watchlist for the watch dir
+	ret = resize_watch_dir_map(inode_watchlist_map(skel), args.watch_dir, false);
+	if (ret)
+		goto cleanup;
+
+	// Hook profiling, if enabled
+	cache_ext_prof_setup(skel);
+
+	// Page access recording, if enabled
+	ret = cache_ext_recorder_setup(skel);
+	if (ret)
+		goto cleanup;
+
+	// One stats slot per CPU
+	ret = cache_ext_stats_resize(cache_ext_stats_map(skel));
+	if (ret)
+		goto cleanup;
 
 	// Load programs
 	ret = cache_ext_get_scan_bpf__load(skel);
@@ -109,7 +171,7 @@ int main(int argc, char **argv)
 	ret = initialize_watch_dir_map(args.watch_dir,
 				       bpf_map__fd(skel->maps.inode_watchlist), false);
 
-	// Pin scan_pids map
+	// Pin scan_pids map, for workloads that mark their scans explicitly
 	ret = bpf_map__pin(skel->maps.scan_pids, "/sys/fs/bpf/cache_ext/scan_pids");
 	if (ret < 0) {
 		perror("Failed to pin scan_pids map");
@@ -117,12 +179,27 @@ int main(int argc, char **argv)
 	}
 
 	// Attach cache_ext_ops to the specific cgroup
-	link = bpf_map__attach_cache_ext_ops(skel->maps.sampling_ops, cgroup_fd);
+	link = cache_ext_swap_attach(&swap, skel->obj, skel->maps.sampling_ops, cgroup_fd);
 	if (link == NULL) {
 		perror("Failed to attach cache_ext_ops to cgroup");
 		goto cleanup_unpin;
 	}
 
+	// Map the stats region and start the exporter, if enabled
+	ret = cache_ext_exporter_start(&exporter, cache_ext_stats_map(skel), "get_scan");
+	if (ret)
+		goto cleanup_unpin;
+
+	// Dump hook profiles on SIGUSR1 and at exit, if enabled
+	ret = cache_ext_prof_start(&prof, cache_ext_prof_map(skel), "get_scan");
+	if (ret)
+		goto cleanup_unpin;
+
+	// Stream page accesses to the --record file, if enabled
+	ret = cache_ext_recorder_start(&rec, cache_ext_trace_ring(skel));
+	if (ret)
+		goto cleanup_unpin;
+
 	// Attach probes
 	ret = cache_ext_get_scan_bpf__attach(skel);
 	if (ret) {
@@ -130,6 +207,9 @@ int main(int argc, char **argv)
 		goto cleanup_unpin;
 	}
 
+	// Tell whoever started us that the policy is live
+	cache_ext_ready();
+
 	// Wait for keyboard input
 	printf("Press any key to exit...\n");
 	getchar();
@@ -142,6 +222,10 @@ cleanup_unpin:
 
 cleanup:
 	close(cgroup_fd);
+	cache_ext_recorder_stop(&rec);
+	cache_ext_prof_stop(&prof);
+	cache_ext_exporter_stop(&exporter);
+	cache_ext_swap_release(&swap, link);
 	bpf_link__destroy(link);
 	cache_ext_get_scan_bpf__destroy(skel);
 	return ret;
@@ -0,0 +1,144 @@
+#ifndef _CACHE_EXT_GHOST_BPF_H
+#define _CACHE_EXT_GHOST_BPF_H 1
+
+#include "cache_ext_lib.bpf.h"
+#include "cache_ext_state.bpf.h"
+
+/*
+ * Compact ghost queue of recently evicted pages.
+ *
+ * Instead of keeping full {address_space, offset} keys in an LRU_HASH, each
+ * ghost entry is a 32-bit slot holding a 16-bit fingerprint of the key, an
+ * 8-bit caller-defined value and the 8-bit epoch it was inserted in. Slots
+ * are grouped in buckets of GHOST_BUCKET_SLOTS in a BPF_MAP_TYPE_ARRAY that
+ * the loader sizes as a fraction of the cgroup's pages (see cache_ext_ghost.h).
+ *
+ * Age is tracked with a global insertion clock: every 1 << ghost_epoch_shift
+ * insertions start a new epoch, and entries older than GHOST_NR_EPOCHS epochs
+ * are expired. The ghost window is therefore the last ~ghost_nr_entries
+ * evictions on all CPUs. Within a bucket, inserts replace a free or expired
+ * slot first, then the oldest one (CLOCK-style). A lookup may return a false
+ * positive with probability ~GHOST_BUCKET_SLOTS / 2^16, and since epochs
+ * wrap at 256, a slot left untouched for that long looks fresh again. The
+ * table is sized close to the window, so buckets turn over well before that.
+ *
+ * The clock is model state, so a policy that saves ghost_map with --state
+ * (see cache_ext_state.h) keeps its ghost history across a restart.
+ */
+
+#define GHOST_BUCKET_SLOTS 8
+#define GHOST_NR_EPOCHS 64  // Must be < 256
+#define GHOST_DEFAULT_BUCKETS (1 << 16)  // Must be power of two
+
+#define GHOST_FP_SHIFT 16
+#define GHOST_VAL_SHIFT 8
+
+// Set from userspace
+const volatile u64 ghost_bucket_mask = GHOST_DEFAULT_BUCKETS - 1;
+const volatile u32 ghost_epoch_shift = 13;
+
+struct ghost_bucket {
+	u32 slots[GHOST_BUCKET_SLOTS];  // 0 if free
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, u32);
+	__type(value, struct ghost_bucket);
+	__uint(max_entries, GHOST_DEFAULT_BUCKETS);
+} ghost_map SEC(".maps");
+
+static u64 ghost_clock __model = 0;
+
+static __always_inline u32 ghost_fingerprint(u64 hash)
+{
+	u32 fp = hash >> 48;
+	return fp ? fp : 1;
+}
+
+static __always_inline u8 ghost_cur_epoch(void)
+{
+	return (READ_ONCE(ghost_clock) >> ghost_epoch_shift) & 0xff;
+}
+
+// Age of a used slot in epochs
+static __always_inline u8 ghost_slot_age(u32 slot, u8 epoch)
+{
+	return (u8)(epoch - (slot & 0xff));
+}
+
+static inline struct ghost_bucket *ghost_get_bucket(u64 hash)
+{
+	u32 idx = hash & ghost_bucket_mask;
+	return bpf_map_lookup_elem(&ghost_map, &idx);
+}
+
+/*
+ * Record folio as evicted with an 8-bit value (e.g. its tier). Lossy: if the
+ * chosen slot changes under us, the entry is dropped.
+ */
+static inline void ghost_insert(struct folio *folio, u8 val)
+{
+	u64 hash = folio_key_hash(folio);
+	u32 fp = ghost_fingerprint(hash);
+	struct ghost_bucket *b = ghost_get_bucket(hash);
+	u8 epoch, best_age = 0;
+	int victim = 0;
+
+	if (!b)
+		return;
+
+	epoch = (__sync_fetch_and_add(&ghost_clock, 1) >> ghost_epoch_shift) & 0xff;
+
+	for (int i = 0; i < GHOST_BUCKET_SLOTS; i++) {
+		u32 slot = READ_ONCE(b->slots[i]);
+		u8 age;
+
+		// Same page evicted again: refresh in place
+		if (slot == 0 || (slot >> GHOST_FP_SHIFT) == fp) {
+			victim = i;
+			break;
+		}
+		age = ghost_slot_age(slot, epoch);
+		if (age >= best_age) {
+			best_age = age;
+			victim = i;
+		}
+	}
+	victim &= GHOST_BUCKET_SLOTS - 1;
+
+	u32 old = READ_ONCE(b->slots[victim]);
+	u32 new = (fp << GHOST_FP_SHIFT) | ((u32)val << GHOST_VAL_SHIFT) | epoch;
+	__sync_val_compare_and_swap(&b->slots[victim], old, new);
+}
+
+/*
+ * Check if folio was recently evicted and consume the ghost entry.
+ * Returns the value stored by ghost_insert(), or -1 if not found.
+ */
+static inline int ghost_test_and_clear(struct folio *folio)
+{
+	u64 hash = folio_key_hash(folio);
+	u32 fp = ghost_fingerprint(hash);
+	struct ghost_bucket *b = ghost_get_bucket(hash);
+	u8 epoch = ghost_cur_epoch();
+
+	if (!b)
+		return -1;
+
+	for (int i = 0; i < GHOST_BUCKET_SLOTS; i++) {
+		u32 slot = READ_ONCE(b->slots[i]);
+
+		if (slot == 0 || (slot >> GHOST_FP_SHIFT) != fp)
+			continue;
+		if (ghost_slot_age(slot, epoch) >= GHOST_NR_EPOCHS)
+			continue;
+		if (__sync_val_compare_and_swap(&b->slots[i], slot, 0) != slot)
+			return -1;
+		return (slot >> GHOST_VAL_SHIFT) & 0xff;
+	}
+
+	return -1;
+}
+
+#endif /* _CACHE_EXT_GHOST_BPF_H */
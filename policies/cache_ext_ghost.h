@@ -0,0 +1,59 @@
+#ifndef _CACHE_EXT_GHOST_H
+#define _CACHE_EXT_GHOST_H
+
+#include "cache_ext_folio_store.h"
+
+#define GHOST_BUCKET_SLOTS		8	// Keep in sync with cache_ext_ghost.bpf.h
+#define GHOST_NR_EPOCHS			64
+#define GHOST_MIN_BUCKETS		(1ULL << 10)
+#define GHOST_MAX_BUCKETS		(1ULL << 28)
+
+#define ghost_map(skel)			((skel)->maps.ghost_map)
+#define ghost_bucket_mask(skel)		((skel)->rodata->ghost_bucket_mask)
+#define ghost_epoch_shift(skel)		((skel)->rodata->ghost_epoch_shift)
+
+/*
+ * Size the ghost queue to remember the last ratio_pct percent of mem_bytes
+ * worth of evicted pages. Must be called between skel__open() and
+ * skel__load(). The table gets ~1.5x as many slots as the ghost window,
+ * rounded up to a power of two buckets, so bucket overflows rarely push out
+ * entries that are still in the window.
+ */
+int ghost_resize_bytes(struct bpf_map *map, __u64 *bucket_mask, __u32 *epoch_shift,
+		       uint64_t mem_bytes, unsigned int ratio_pct) {
+	uint64_t page_size = sysconf(_SC_PAGESIZE);
+	uint64_t nr_pages = mem_bytes / page_size;
+	uint64_t nr_entries = nr_pages * ratio_pct / 100;
+	uint64_t buckets = GHOST_MIN_BUCKETS;
+	__u32 shift = 0;
+
+	while (buckets * GHOST_BUCKET_SLOTS < nr_entries + nr_entries / 2 &&
+	       buckets < GHOST_MAX_BUCKETS)
+		buckets <<= 1;
+
+	// Epoch length such that GHOST_NR_EPOCHS epochs cover nr_entries inserts
+	while (((uint64_t)GHOST_NR_EPOCHS << (shift + 1)) <= nr_entries)
+		shift++;
+
+	if (bpf_map__set_max_entries(map, buckets)) {
+		perror("Failed to resize ghost_map");
+		return -1;
+	}
+	*bucket_mask = buckets - 1;
+	*epoch_shift = shift;
+
+	fprintf(stderr, "Ghost queue: %lu entries in %lu buckets (%lu KiB)\n",
+		(uint64_t)GHOST_NR_EPOCHS << shift, buckets,
+		buckets * bpf_map__value_size(map) >> 10);
+
+	return 0;
+}
+
+// Size the ghost queue from the cgroup limit
+int ghost_resize(struct bpf_map *map, __u64 *bucket_mask, __u32 *epoch_shift,
+		 const char *cgroup_path, unsigned int ratio_pct) {
+	return ghost_resize_bytes(map, bucket_mask, epoch_shift,
+				  read_cgroup_memory_max(cgroup_path), ratio_pct);
+}
+
+#endif /* _CACHE_EXT_GHOST_H */
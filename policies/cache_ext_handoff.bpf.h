@@ -0,0 +1,141 @@
+#ifndef _CACHE_EXT_HANDOFF_BPF_H
+#define _CACHE_EXT_HANDOFF_BPF_H 1
+
+#include "cache_ext_lib.bpf.h"
+#include "cache_ext_stats.bpf.h"
+
+/*
+ * Warm handoff between policies on a live swap (see cache_ext_swap.h).
+ *
+ * A policy publishes its lists in cache_ext_handoff_export from init, in
+ * eviction order, coldest list first. Entries are keyed by cgroup id, so
+ * policies attached to several cgroups hand each one off separately. When
+ * another policy takes over a cgroup's struct_ops link with --swap, its
+ * loader copies that cgroup's export into the incoming policy's
+ * cache_ext_handoff_adopt before the switch. From then
+ * on the incoming policy calls handoff_step() at the top of evict_folios,
+ * which moves up to HANDOFF_BATCH folios of the outgoing policy's lists onto
+ * one of its own, like migrate_step() in cache_ext_adaptive_v3.bpf.c. The
+ * outgoing lists are no longer touched by their owner, so the walk sees them
+ * as they were at the swap.
+ *
+ * Adopted folios have no metadata in the incoming policy. The including
+ * policy must define
+ *
+ *	static void handoff_adopt(struct folio *folio);
+ *
+ * which is called for every folio moved, to set it up as if it had just
+ * been added.
+ */
+
+#define HANDOFF_MAX_LISTS	8
+#define HANDOFF_MAX_CGROUPS	64
+#define HANDOFF_BATCH		512
+
+// Keep in sync with cache_ext_swap.h
+struct cache_ext_handoff {
+	u64 lists[HANDOFF_MAX_LISTS];
+	u32 nr_lists;
+	u32 next;	// Adopt only: first list not drained yet
+};
+
+// This policy's lists, for whoever replaces it
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, u64);
+	__type(value, struct cache_ext_handoff);
+	__uint(max_entries, HANDOFF_MAX_CGROUPS);
+} cache_ext_handoff_export SEC(".maps");
+
+// The replaced policy's lists, set from userspace before the swap
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, u64);
+	__type(value, struct cache_ext_handoff);
+	__uint(max_entries, HANDOFF_MAX_CGROUPS);
+} cache_ext_handoff_adopt SEC(".maps");
+
+// Same as the cgroup directory's inode number, which userspace uses
+static __always_inline u64 handoff_key(struct mem_cgroup *memcg)
+{
+	return memcg->css.cgroup->kn->id;
+}
+
+/*
+ * Publish one of this policy's lists. Call from init, coldest first, so the
+ * incoming policy drains the folios it would evict soonest first too.
+ */
+static inline void handoff_export(struct mem_cgroup *memcg, u64 list)
+{
+	struct cache_ext_handoff init = { 0 }, *h;
+	u64 key = handoff_key(memcg);
+
+	// Lists a policy only creates on demand (e.g. ra_probation_list)
+	if (list == 0)
+		return;
+	bpf_map_update_elem(&cache_ext_handoff_export, &key, &init, BPF_NOEXIST);
+	h = bpf_map_lookup_elem(&cache_ext_handoff_export, &key);
+	if (!h || h->nr_lists >= HANDOFF_MAX_LISTS)
+		return;
+	h->lists[h->nr_lists & (HANDOFF_MAX_LISTS - 1)] = list;
+	h->nr_lists++;
+}
+
+static void handoff_adopt(struct folio *folio);
+
+/*
+ * Continued folios go to the incoming policy's list (continue_list). Once
+ * the batch is full, evict as the outgoing policy would have, which ends the
+ * walk as soon as the eviction request is met.
+ */
+static int handoff_iterate_fn(int idx, struct cache_ext_list_node *node)
+{
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+	if (idx >= HANDOFF_BATCH && folio_test_uptodate(node->folio) &&
+	    folio_test_lru(node->folio) && !folio_test_dirty(node->folio) &&
+	    !folio_test_writeback(node->folio))
+		return CACHE_EXT_EVICT_NODE;
+
+	handoff_adopt(node->folio);
+	cache_ext_stat_inc(CACHE_EXT_STAT_HANDOFF_ADOPTED);
+	return CACHE_EXT_CONTINUE_ITER;
+}
+
+/*
+ * Move one batch of the replaced policy's folios onto list, at its head
+ * (tail = false) or tail. Adopted folios are older than anything added
+ * since the swap, so put them where a recency policy evicts first. Returns
+ * true while there is more to adopt.
+ */
+static inline bool handoff_step(struct cache_ext_eviction_ctx *eviction_ctx,
+				struct mem_cgroup *memcg, u64 list, bool tail)
+{
+	u64 key = handoff_key(memcg);
+	struct cache_ext_handoff *h = bpf_map_lookup_elem(&cache_ext_handoff_adopt, &key);
+	u32 next;
+	int ret;
+
+	if (!h)
+		return false;
+	next = READ_ONCE(h->next);
+	if (next >= h->nr_lists || next >= HANDOFF_MAX_LISTS)
+		return false;
+
+	struct cache_ext_iterate_opts opts = {
+		.continue_list = list,
+		.continue_mode = tail ? CACHE_EXT_ITERATE_TAIL : CACHE_EXT_ITERATE_HEAD,
+		.evict_list = CACHE_EXT_ITERATE_SELF,
+		.evict_mode = CACHE_EXT_ITERATE_TAIL,
+	};
+
+	ret = bpf_cache_ext_list_iterate_extended(memcg, h->lists[next & (HANDOFF_MAX_LISTS - 1)],
+						  handoff_iterate_fn, &opts, eviction_ctx);
+
+	// A short batch means the list has been drained. So does a list the
+	// kernel no longer knows, there is nothing left to adopt from it.
+	if (ret < 0 || opts.nr_folios_continue < HANDOFF_BATCH)
+		__sync_val_compare_and_swap(&h->next, next, next + 1);
+	return true;
+}
+
+#endif /* _CACHE_EXT_HANDOFF_BPF_H */
@@ -0,0 +1,177 @@
+#include <argp.h>
+#include <bpf/bpf.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache_ext_hints.h"
+
+/*
+ * Tag files with a cache class for the policies (see cache_ext_hints.bpf.h):
+ *
+ *	cache_ext_hint --class 12 db/000123.ldb db/MANIFEST-000004
+ *	cache_ext_hint --get db/000123.ldb
+ *	cache_ext_hint --clear db/000123.ldb
+ *	cache_ext_hint --list
+ *	cache_ext_hint --flush
+ */
+
+enum hint_cmd {
+	HINT_NONE,
+	HINT_SET,
+	HINT_GET,
+	HINT_CLEAR,
+	HINT_LIST,
+	HINT_FLUSH,
+};
+
+struct cmdline_args {
+	enum hint_cmd cmd;
+	unsigned int cls;
+	char **files;
+	int nr_files;
+};
+
+static struct argp_option options[] = {
+	{ "class", 'C', "CLASS", 0, "Tag FILEs with CLASS (0 coldest .. 15 hottest, untagged: 8)" },
+	{ "get", 'g', 0, 0, "Print the class of each FILE" },
+	{ "clear", 'x', 0, 0, "Remove the tag from each FILE" },
+	{ "list", 'l', 0, 0, "List all tagged files as dev:inode pairs" },
+	{ "flush", 'F', 0, 0, "Remove all tags" },
+	{ 0 },
+};
+
+static void set_cmd(struct cmdline_args *args, enum hint_cmd cmd, struct argp_state *state)
+{
+	if (args->cmd != HINT_NONE)
+		argp_error(state, "Only one of --class, --get, --clear, --list, --flush");
+	args->cmd = cmd;
+}
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+	struct cmdline_args *args = state->input;
+	char *end;
+
+	switch (key) {
+	case 'C':
+		set_cmd(args, HINT_SET, state);
+		errno = 0;
+		args->cls = strtoul(arg, &end, 10);
+		if (errno || *end != '\0' || args->cls >= INODE_CLASSES)
+			argp_error(state, "Invalid class: %s", arg);
+		break;
+	case 'g':
+		set_cmd(args, HINT_GET, state);
+		break;
+	case 'x':
+		set_cmd(args, HINT_CLEAR, state);
+		break;
+	case 'l':
+		set_cmd(args, HINT_LIST, state);
+		break;
+	case 'F':
+		set_cmd(args, HINT_FLUSH, state);
+		break;
+	case ARGP_KEY_ARGS:
+		args->files = state->argv + state->next;
+		args->nr_files = state->argc - state->next;
+		break;
+	case ARGP_KEY_END:
+		if (args->cmd == HINT_NONE)
+			argp_error(state, "Missing command");
+		if ((args->cmd == HINT_LIST || args->cmd == HINT_FLUSH) && args->nr_files)
+			argp_error(state, "--list and --flush take no files");
+		if (args->cmd != HINT_LIST && args->cmd != HINT_FLUSH && !args->nr_files)
+			argp_error(state, "Missing FILE");
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+// Walk all keys, printing or deleting them
+static int walk_map(int map_fd, bool flush)
+{
+	struct inode_class_key key, next;
+	struct inode_class_key *prev = NULL;
+	__u8 val;
+
+	while (bpf_map_get_next_key(map_fd, prev, &next) == 0) {
+		if (flush) {
+			// Deleting invalidates the cursor, so restart from the top
+			if (bpf_map_delete_elem(map_fd, &next) && errno != ENOENT) {
+				perror("Failed to delete hint");
+				return 1;
+			}
+			prev = NULL;
+			continue;
+		}
+		if (bpf_map_lookup_elem(map_fd, &next, &val) == 0)
+			printf("%u:%u:%llu\t%u\n", next.dev >> 20, next.dev & ((1U << 20) - 1),
+			       (unsigned long long)next.ino, val);
+		key = next;
+		prev = &key;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct cmdline_args args = { 0 };
+	struct argp argp = { options, parse_opt, "FILE...", 0 };
+	int map_fd, ret = 0;
+
+	argp_parse(&argp, argc, argv, 0, 0, &args);
+
+	map_fd = cache_ext_hints_open(args.cmd == HINT_SET);
+	if (map_fd < 0) {
+		if (map_fd == -ENOENT) {
+			// Nothing tagged yet
+			for (int i = 0; i < args.nr_files && args.cmd == HINT_GET; i++)
+				printf("%s\t%u\n", args.files[i], INODE_CLASS_DEFAULT);
+			return 0;
+		}
+		fprintf(stderr, "Failed to open %s: %s\n", CACHE_EXT_HINTS_PIN_PATH,
+			strerror(-map_fd));
+		return 1;
+	}
+
+	if (args.cmd == HINT_LIST || args.cmd == HINT_FLUSH) {
+		ret = walk_map(map_fd, args.cmd == HINT_FLUSH);
+		close(map_fd);
+		return ret;
+	}
+
+	for (int i = 0; i < args.nr_files; i++) {
+		const char *file = args.files[i];
+		int err;
+
+		switch (args.cmd) {
+		case HINT_SET:
+			err = cache_ext_hint_set(map_fd, file, args.cls);
+			break;
+		case HINT_GET:
+			err = cache_ext_hint_get(map_fd, file);
+			if (err >= 0) {
+				printf("%s\t%d\n", file, err);
+				err = 0;
+			}
+			break;
+		default:
+			err = cache_ext_hint_clear(map_fd, file);
+			break;
+		}
+
+		if (err) {
+			fprintf(stderr, "%s: %s\n", file, strerror(-err));
+			ret = 1;
+		}
+	}
+
+	close(map_fd);
+	return ret;
+}
@@ -0,0 +1,54 @@
+#ifndef _CACHE_EXT_HINTS_BPF_H
+#define _CACHE_EXT_HINTS_BPF_H 1
+
+#include "cache_ext_lib.bpf.h"
+
+/*
+ * Application-assigned file classes.
+ *
+ * Applications tag files with a class in the pinned inode_class_map
+ * (/sys/fs/bpf/cache_ext/inode_classes), through cache_ext_hints.h or the
+ * cache_ext_hint CLI. Classes are priorities from 0 (coldest) to
+ * INODE_CLASSES - 1 (hottest); untagged files are INODE_CLASS_DEFAULT.
+ * Policies look the class up once per insertion and use it as they see fit:
+ * LHD as its app class, S3-FIFO to admit INODE_CLASS_HOT and above straight
+ * into the main queue, sampling as a score bias.
+ *
+ * Files are keyed by {inode number, kernel dev_t}, like the watch dir root.
+ * The map outlives the loaders, so hints survive policy restarts. Keep the
+ * layout in sync with cache_ext_hints.h.
+ */
+
+#define INODE_CLASSES		16
+#define INODE_CLASS_DEFAULT	8
+#define INODE_CLASS_HOT		12
+#define INODE_CLASS_MAX_FILES	65536
+
+struct inode_class_key {
+	u64 ino;
+	u32 dev;
+	u32 pad;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, struct inode_class_key);
+	__type(value, u8);
+	__uint(max_entries, INODE_CLASS_MAX_FILES);
+} inode_class_map SEC(".maps");
+
+static inline u32 folio_inode_class(struct folio *folio)
+{
+	struct inode *inode = folio->mapping->host;
+	struct inode_class_key key = {
+		.ino = inode->i_ino,
+		.dev = inode->i_sb->s_dev,
+	};
+	u8 *cls = bpf_map_lookup_elem(&inode_class_map, &key);
+
+	if (!cls || *cls >= INODE_CLASSES)
+		return INODE_CLASS_DEFAULT;
+	return *cls;
+}
+
+#endif /* _CACHE_EXT_HINTS_BPF_H */
@@ -0,0 +1,168 @@
+#ifndef _CACHE_EXT_HINTS_H
+#define _CACHE_EXT_HINTS_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+/*
+ * Client API for application-assigned file classes (see
+ * cache_ext_hints.bpf.h). Self-contained, so applications can copy it and
+ * tag their files at open time:
+ *
+ *	int hints = cache_ext_hints_open(true);
+ *	fd = open("000123.ldb", O_RDONLY);
+ *	cache_ext_hint_set_fd(hints, fd, INODE_CLASS_HOT);
+ *
+ * All functions return 0 (or the class) on success and -errno on failure.
+ *
+ * Tagging doesn't need a policy to be running: with create set,
+ * cache_ext_hints_open() creates and pins the map itself, and a policy loaded
+ * later picks it up, because loaders call cache_ext_hints_pin() before
+ * skel__load() and libbpf then reuses the pinned map.
+ */
+
+// Keep in sync with cache_ext_hints.bpf.h
+#define INODE_CLASSES		16
+#define INODE_CLASS_DEFAULT	8
+#define INODE_CLASS_HOT		12
+#define INODE_CLASS_MAX_FILES	65536
+
+#define CACHE_EXT_HINTS_PIN_DIR		"/sys/fs/bpf/cache_ext"
+#define CACHE_EXT_HINTS_PIN_PATH	CACHE_EXT_HINTS_PIN_DIR "/inode_classes"
+
+#define inode_class_map(skel)	((skel)->maps.inode_class_map)
+
+struct inode_class_key {
+	__u64 ino;
+	__u32 dev;	// Kernel dev_t encoding, as in sb->s_dev
+	__u32 pad;
+};
+
+// Share the pinned map. Must be called between skel__open() and skel__load().
+int cache_ext_hints_pin(struct bpf_map *map) {
+	if (bpf_map__set_pin_path(map, CACHE_EXT_HINTS_PIN_PATH)) {
+		fprintf(stderr, "Failed to set pin path for %s\n", bpf_map__name(map));
+		return -1;
+	}
+	return 0;
+}
+
+static int cache_ext_hints_create(void) {
+	LIBBPF_OPTS(bpf_map_create_opts, opts);
+	int fd, err;
+
+	if (mkdir(CACHE_EXT_HINTS_PIN_DIR, 0755) && errno != EEXIST)
+		return -errno;
+
+	fd = bpf_map_create(BPF_MAP_TYPE_HASH, "inode_class_map", sizeof(struct inode_class_key),
+			    sizeof(__u8), INODE_CLASS_MAX_FILES, &opts);
+	if (fd < 0)
+		return fd;
+
+	if (bpf_obj_pin(fd, CACHE_EXT_HINTS_PIN_PATH)) {
+		err = -errno;
+		close(fd);
+		// Lost a race with another creator, use theirs
+		if (err == -EEXIST)
+			return bpf_obj_get(CACHE_EXT_HINTS_PIN_PATH);
+		return err;
+	}
+	return fd;
+}
+
+// Returns a map fd, to be closed by the caller
+int cache_ext_hints_open(bool create) {
+	int fd = bpf_obj_get(CACHE_EXT_HINTS_PIN_PATH);
+
+	if (fd >= 0)
+		return fd;
+	if (errno != ENOENT || !create)
+		return -errno;
+	return cache_ext_hints_create();
+}
+
+int cache_ext_hint_key_fd(int fd, struct inode_class_key *key) {
+	struct stat sb;
+
+	if (fstat(fd, &sb))
+		return -errno;
+	if (!S_ISREG(sb.st_mode))
+		return -EINVAL;
+
+	memset(key, 0, sizeof(*key));
+	key->ino = sb.st_ino;
+	key->dev = (major(sb.st_dev) << 20) | minor(sb.st_dev);
+	return 0;
+}
+
+int cache_ext_hint_key(const char *path, struct inode_class_key *key) {
+	int fd = open(path, O_RDONLY);
+	int ret;
+
+	if (fd < 0)
+		return -errno;
+	ret = cache_ext_hint_key_fd(fd, key);
+	close(fd);
+	return ret;
+}
+
+int cache_ext_hint_set_fd(int map_fd, int fd, unsigned int cls) {
+	struct inode_class_key key;
+	__u8 val = cls;
+	int ret;
+
+	if (cls >= INODE_CLASSES)
+		return -EINVAL;
+	ret = cache_ext_hint_key_fd(fd, &key);
+	if (ret)
+		return ret;
+	return bpf_map_update_elem(map_fd, &key, &val, BPF_ANY) ? -errno : 0;
+}
+
+int cache_ext_hint_set(int map_fd, const char *path, unsigned int cls) {
+	int fd = open(path, O_RDONLY);
+	int ret;
+
+	if (fd < 0)
+		return -errno;
+	ret = cache_ext_hint_set_fd(map_fd, fd, cls);
+	close(fd);
+	return ret;
+}
+
+// Returns the file's class, INODE_CLASS_DEFAULT if it is untagged
+int cache_ext_hint_get(int map_fd, const char *path) {
+	struct inode_class_key key;
+	__u8 val;
+	int ret;
+
+	ret = cache_ext_hint_key(path, &key);
+	if (ret)
+		return ret;
+	if (bpf_map_lookup_elem(map_fd, &key, &val))
+		return errno == ENOENT ? INODE_CLASS_DEFAULT : -errno;
+	return val;
+}
+
+int cache_ext_hint_clear(int map_fd, const char *path) {
+	struct inode_class_key key;
+	int ret;
+
+	ret = cache_ext_hint_key(path, &key);
+	if (ret)
+		return ret;
+	if (bpf_map_delete_elem(map_fd, &key) && errno != ENOENT)
+		return -errno;
+	return 0;
+}
+
+#endif /* _CACHE_EXT_HINTS_H */
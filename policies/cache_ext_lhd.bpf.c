@@ -6,17 +6,26 @@
 #include "cache_ext_lib.bpf.h"
 #include "dir_watcher.bpf.h"
 #include "cache_ext_lhd.bpf.h"
+#include "cache_ext_stats.bpf.h"
+#include "cache_ext_prof.bpf.h"
+#include "cache_ext_trace.bpf.h"
+#include "cache_ext_hints.bpf.h"
+#include "cache_ext_dirty.bpf.h"
+#include "cache_ext_handoff.bpf.h"
+#include "cache_ext_state.bpf.h"
+#include "cache_ext_cost.bpf.h"
+
 
 char _license[] SEC("license") = "GPL";
 
 static u64 next_reconfiguration = REQS_PER_RECONFIG;
-static u32 num_reconfigurations = 0;
+u32 num_reconfigurations = 0;
 
-static u64 age_coarsening_shift = INITIAL_AGE_COARSENING_SHIFT;
-static u64 ewma_num_objects = 0;
-static u64 ewma_num_objects_mass = 0;
+// The learned model below is __model state, kept across restarts with --state
+static u64 ewma_num_objects __model = 0;
+static u64 ewma_num_objects_mass __model = 0;
 
-static u64 ewma_victim_hit_density = 0;
+static u64 ewma_victim_hit_density __model = 0;
 
 /*
 static u64 recently_admitted_head = 0;
@@ -30,41 +39,70 @@ static u64 timestamp = 0;
 static u64 overflows = 0;
 
 static u64 lhd_list;
+static u64 parked_list;
 
+// Folios, not pages: ages count accesses, so the coarsening follows objects
 static u64 num_objects = 0;
 
 #define INT64_MAX  (9223372036854775807LL)
+#define CLOCK_MONOTONIC 1
 
-// We omit size, assume all folios are same size for now
+/*
+ * Hit densities are per object. The score divides them by the folio's size,
+ * as in the LHD paper, so a large folio has to earn its pages.
+ */
 struct folio_metadata {
 	u64 last_access_time;
 	u64 last_hit_age;
 	u64 last_last_hit_age;
 	u32 app;
+	u32 cost;	// Refault cost factor, see cache_ext_cost.bpf.h
 };
 
 struct lhd_class {
 	u64 total_hits;
 	u64 total_evictions;
 
-	u64 hits[MAX_AGE];
-	u64 evictions[MAX_AGE];
-	u64 hit_densities[MAX_AGE];
+	u64 hits[NUM_AGE_BUCKETS];
+	u64 evictions[NUM_AGE_BUCKETS];
 };
 
-static struct lhd_class classes[NUM_CLASSES];
+static struct lhd_class classes[NUM_CLASSES] __model;
 
-struct {
-	__uint(type, BPF_MAP_TYPE_HASH);
-	__type(key, u64);
-	__type(value, struct folio_metadata);
-	__uint(max_entries, 4000000);
-} folio_metadata_map SEC(".maps");
+/*
+ * Hit densities are double buffered. Eviction reads the table (and the age
+ * coarsening it was built for) selected by density_gen, while the
+ * reconfiguration timer rebuilds the other one a few classes per tick and
+ * then publishes it by bumping density_gen. Densities are at most
+ * HIT_DENSITY_SCALING_FACTOR * NUM_CLASSES, so u32 entries are enough.
+ */
+static u32 hit_densities[2][NUM_CLASSES][NUM_AGE_BUCKETS] __model;
+static u64 density_shift[2] __model = { INITIAL_AGE_COARSENING_SHIFT, INITIAL_AGE_COARSENING_SHIFT };
+static u32 density_gen __model = 0;
+
+// Scratch histograms for rescale_class(), only used by the timer
+static u64 rescaled_hits[NUM_AGE_BUCKETS];
+static u64 rescaled_evictions[NUM_AGE_BUCKETS];
+
+// Reconfiguration round in progress
+static u32 reconfig_running = 0;
+static u32 reconfig_next_class = 0;
+static s32 reconfig_delta = 0;
+
+struct reconfig_timer {
+	struct bpf_timer timer;
+};
 
 struct {
-	__uint(type, BPF_MAP_TYPE_RINGBUF);
-	__uint(max_entries, 4096);
-} events SEC(".maps");
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, u32);
+	__type(value, struct reconfig_timer);
+	__uint(max_entries, 1);
+} reconfig_timers SEC(".maps");
+
+#include "cache_ext_folio_store.bpf.h"
+
+DEFINE_EVICTION_POOL(lhd_pool);
 
 static inline long ewma_decay(u64 val) {
 	return (val * 9) / 10;
@@ -82,8 +120,7 @@ static inline bool is_folio_relevant(struct folio *folio) {
 }
 
 static inline struct folio_metadata *get_folio_metadata(struct folio *folio) {
-	u64 key = (u64)folio;
-	return bpf_map_lookup_elem(&folio_metadata_map, &key);
+	return folio_store_lookup(folio);
 }
 
 static inline u32 hit_age_to_class(u64 hit_age) {
@@ -111,8 +148,41 @@ static inline struct lhd_class *get_class(struct folio_metadata *data) {
 	return &classes[class_id & NUM_CLASSES_MASK];
 }
 
-static inline u64 get_age(struct folio_metadata *data) {
-	u64 age = (timestamp - data->last_access_time) >> age_coarsening_shift;
+static inline u32 age_to_bucket(u64 age) {
+	u32 msb, shift;
+
+	if (age < AGE_SUB_BUCKETS)
+		return age;
+
+	msb = ilog2_u64(age);
+	shift = msb - AGE_BUCKET_BITS;
+	return (shift + 1) * AGE_SUB_BUCKETS + ((age >> shift) - AGE_SUB_BUCKETS);
+}
+
+// Smallest age in the bucket
+static inline u64 bucket_age(u32 bucket) {
+	u32 shift;
+
+	if (bucket < AGE_SUB_BUCKETS)
+		return bucket;
+
+	shift = bucket / AGE_SUB_BUCKETS - 1;
+	return (u64)(bucket % AGE_SUB_BUCKETS + AGE_SUB_BUCKETS) << shift;
+}
+
+static inline u64 bucket_width(u32 bucket) {
+	if (bucket < AGE_SUB_BUCKETS)
+		return 1;
+
+	return 1ULL << (bucket / AGE_SUB_BUCKETS - 1);
+}
+
+static inline u32 density_slot(void) {
+	return READ_ONCE(density_gen) & 1;
+}
+
+static inline u64 get_age(struct folio_metadata *data, u32 slot) {
+	u64 age = (timestamp - data->last_access_time) >> density_shift[slot];
 
 	if (age >= MAX_AGE) {
 		overflows++;
@@ -123,15 +193,15 @@ static inline u64 get_age(struct folio_metadata *data) {
 }
 
 static inline u64 get_hit_density(struct folio_metadata *data) {
-	u64 age = get_age(data);
+	u32 slot = density_slot();
+	u64 age = get_age(data, slot);
 	if (age == MAX_AGE - 1)
 		return 0;
 
-	struct lhd_class *cls = get_class(data);
-	if (!cls)
-		return -1;
+	u32 class_id = get_class_id(data);
+	u32 bucket = age_to_bucket(age);
 
-	return cls->hit_densities[age & MAX_AGE_MASK];
+	return hit_densities[slot][class_id & NUM_CLASSES_MASK][bucket % NUM_AGE_BUCKETS];
 }
 
 static inline void update_class(struct lhd_class *class) {
@@ -140,7 +210,7 @@ static inline void update_class(struct lhd_class *class) {
 	class->total_hits = 0;
 	class->total_evictions = 0;
 
-	bpf_for(i, 0, MAX_AGE) {
+	bpf_for(i, 0, NUM_AGE_BUCKETS) {
 		class->hits[i] = ewma_decay(class->hits[i]);
 		class->evictions[i] = ewma_decay(class->evictions[i]);
 
@@ -149,59 +219,43 @@ static inline void update_class(struct lhd_class *class) {
 	}
 }
 
-static inline void stretch_distribution(s32 delta) {
-	int i;
-	bpf_for(i, 0, NUM_CLASSES) {
-		struct lhd_class *cls = &classes[i];
-		int init_age = MAX_AGE >> (-delta);
-		u32 j;
-
-		bpf_for(j, init_age, MAX_AGE - 1) {
-			cls->hits[MAX_AGE - 1] += cls->hits[j];
-			cls->evictions[MAX_AGE - 1] = cls->evictions[j];
-		}
-		bpf_for(j, 2, MAX_AGE + 1) { // MAX_AGE -2 -> 0
-			u32 index = MAX_AGE - j;
-			cls->hits[index & MAX_AGE_MASK] =
-				cls->hits[(j >> (-delta)) & MAX_AGE_MASK] /
-				(1 << (-delta));
-			cls->evictions[index & MAX_AGE_MASK] =
-				cls->evictions[(j >> (-delta)) & MAX_AGE_MASK] /
-				(1 << (-delta));
-		}
+/*
+ * Move a class's histograms to a new age coarsening: a bucket's contents
+ * go to the bucket its smallest age maps to once scaled by 2^-delta.
+ */
+static inline void rescale_class(struct lhd_class *cls, s32 delta) {
+	u32 j;
+
+	bpf_for(j, 0, NUM_AGE_BUCKETS) {
+		rescaled_hits[j] = 0;
+		rescaled_evictions[j] = 0;
 	}
-}
 
-static inline void compress_distribution(s32 delta) {
-	int i;
-	bpf_for(i, 0, NUM_CLASSES) {
-		struct lhd_class *cls = &classes[i];
-		u32 j;
-
-		bpf_for(j, 0, MAX_AGE >> delta) {
-			cls->hits[j & MAX_AGE_MASK] =
-				cls->hits[(j << delta) & MAX_AGE_MASK];
-			cls->evictions[j & MAX_AGE_MASK] =
-				cls->evictions[(j << delta) & MAX_AGE_MASK];
-			int k;
-			bpf_for(k, 1, (1 << delta)) {
-				cls->hits[j & MAX_AGE_MASK] +=
-					cls->hits[((j << delta) + k) &
-						  MAX_AGE_MASK];
-				cls->evictions[j & MAX_AGE_MASK] +=
-					cls->evictions[((j << delta) + k) &
-						       MAX_AGE_MASK];
-			}
-		}
+	bpf_for(j, 0, NUM_AGE_BUCKETS) {
+		u64 age = bucket_age(j);
+		u32 to;
 
-		bpf_for(j, MAX_AGE >> delta, MAX_AGE - 1) {
-			cls->hits[j & MAX_AGE_MASK] = 0;
-			cls->evictions[j & MAX_AGE_MASK] = 0;
-		}
+		if (delta > 0)
+			age >>= delta;
+		else
+			age <<= -delta;
+		to = age_to_bucket(min(age, (u64)MAX_AGE - 1)) % NUM_AGE_BUCKETS;
+
+		rescaled_hits[to] += cls->hits[j];
+		rescaled_evictions[to] += cls->evictions[j];
+	}
+
+	bpf_for(j, 0, NUM_AGE_BUCKETS) {
+		cls->hits[j] = rescaled_hits[j];
+		cls->evictions[j] = rescaled_evictions[j];
 	}
 }
 
-static inline void adapt_age_coarsening(void) {
+/*
+ * Pick the age coarsening for the next table. The histograms are rescaled
+ * class by class as the round reaches them, by reconfig_delta.
+ */
+static inline u64 adapt_age_coarsening(u64 cur_shift) {
 	ewma_num_objects = ewma_decay(ewma_num_objects);
 	ewma_num_objects_mass = ewma_decay(ewma_num_objects_mass);
 
@@ -213,6 +267,8 @@ static inline void adapt_age_coarsening(void) {
 	u64 optimal_age_coarsening =
 		1 * num_objects_coarsening * AGE_COARSENING_ERROR_TOLERANCE / MAX_AGE;
 
+	reconfig_delta = 0;
+
 	if (num_reconfigurations == 5 || num_reconfigurations == 25) {
 		u32 optimal_age_coarsening_log2 = 1;
 
@@ -220,65 +276,110 @@ static inline void adapt_age_coarsening(void) {
 		       optimal_age_coarsening)
 			optimal_age_coarsening_log2++;
 
-		s32 delta = optimal_age_coarsening_log2 - age_coarsening_shift;
-		age_coarsening_shift = optimal_age_coarsening_log2;
+		reconfig_delta = optimal_age_coarsening_log2 - cur_shift;
 
 		ewma_num_objects *= 8;
 		ewma_num_objects_mass *= 8;
 
-		if (delta < 0)
-			stretch_distribution(delta);
-		else if (delta > 0)
-			compress_distribution(delta);
+		return optimal_age_coarsening_log2;
 	}
-}
 
-static inline void model_hit_density(void) {
-	int i;
-
-	bpf_for(i, 0, NUM_CLASSES) {
-		struct lhd_class *cls = &classes[i];
-		u64 total_hits = cls->hits[MAX_AGE - 1];
-		u64 total_events = total_hits + cls->evictions[MAX_AGE - 1];
-		u64 lifetime_unconditoned = total_events;
+	return cur_shift;
+}
 
-		int j;
-		bpf_for(j, 2, MAX_AGE + 1) {
-			u32 index = MAX_AGE - j;
-
-			total_hits += cls->hits[index & MAX_AGE_MASK];
-			total_events += cls->evictions[index & MAX_AGE_MASK];
-			lifetime_unconditoned += total_events;
-
-			if (total_events > TOTAL_EVENTS_THRESH)
-				cls->hit_densities[index & MAX_AGE_MASK] =
-					total_hits * HIT_DENSITY_SCALING_FACTOR /
-					lifetime_unconditoned;
-			else
-				cls->hit_densities[index & MAX_AGE_MASK] = 0;
-		}
+/*
+ * Same backwards pass as with one bucket per age, except that a bucket
+ * spans bucket_width() ages, each of which adds the events at or beyond it
+ * to the unconditioned lifetime.
+ */
+static inline void model_hit_density(struct lhd_class *cls, u32 *densities) {
+	u64 total_hits = 0;
+	u64 total_events = 0;
+	u64 lifetime_unconditoned = 0;
+
+	int j;
+	bpf_for(j, 1, NUM_AGE_BUCKETS + 1) {
+		u32 index = (NUM_AGE_BUCKETS - j) % NUM_AGE_BUCKETS;
+
+		total_hits += cls->hits[index];
+		total_events += cls->evictions[index];
+		lifetime_unconditoned += total_events * bucket_width(index);
+
+		if (total_events > TOTAL_EVENTS_THRESH)
+			densities[index] =
+				total_hits * HIT_DENSITY_SCALING_FACTOR /
+				lifetime_unconditoned;
+		else
+			densities[index] = 0;
 	}
 }
 
-SEC("syscall")
-int reconfigure(void) {
-	int i;
+static inline void reconfigure_class(u32 class_id, u32 next) {
+	struct lhd_class *cls = &classes[class_id & NUM_CLASSES_MASK];
 
-	bpf_for(i, 0, NUM_CLASSES) {
-		update_class(&classes[i]);
+	if (reconfig_delta)
+		rescale_class(cls, reconfig_delta);
+
+	update_class(cls);
+
+	model_hit_density(cls, hit_densities[next & 1][class_id & NUM_CLASSES_MASK]);
+}
+
+/*
+ * One reconfiguration round rebuilds the inactive density table in
+ * NUM_CLASSES / RECONFIG_CLASSES_PER_TICK timer ticks, so no single pass
+ * holds up the hooks, and nothing depends on the loader being scheduled.
+ * Eviction keeps using the published table until the round ends.
+ */
+static int reconfigure_tick(void *map, int *key, struct reconfig_timer *t) {
+	u32 cur = density_slot(), next = cur ^ 1;
+	u32 first = reconfig_next_class;
+	u32 i;
+
+	if (first == 0) {
+		num_reconfigurations++;
+		density_shift[next] = adapt_age_coarsening(density_shift[cur]);
 	}
 
-	adapt_age_coarsening();
+	bpf_for(i, first, first + RECONFIG_CLASSES_PER_TICK) {
+		if (i >= NUM_CLASSES)
+			break;
+		reconfigure_class(i, next);
+	}
 
-	model_hit_density();
+	reconfig_next_class = first + RECONFIG_CLASSES_PER_TICK;
+	if (reconfig_next_class < NUM_CLASSES) {
+		bpf_timer_start(&t->timer, RECONFIG_TICK_NS, 0);
+		return 0;
+	}
 
+	// Publish: the atomic add orders the table writes before the switch
+	__sync_fetch_and_add(&density_gen, 1);
 	overflows = 0;
+	reconfig_next_class = 0;
+	WRITE_ONCE(reconfig_running, 0);
 
 	return 0;
 }
 
+// Start a round unless one is still in flight
+static inline void request_reconfiguration(void) {
+	struct reconfig_timer *t;
+	u32 key = 0;
+
+	if (__sync_val_compare_and_swap(&reconfig_running, 0, 1) != 0)
+		return;
+
+	t = bpf_map_lookup_elem(&reconfig_timers, &key);
+	if (!t || bpf_timer_start(&t->timer, 0, 0)) {
+		WRITE_ONCE(reconfig_running, 0);
+		bpf_printk("cache_ext: Failed to start reconfiguration\n");
+	}
+}
+
 s32 BPF_STRUCT_OPS_SLEEPABLE(lhd_init, struct mem_cgroup *memcg) {
-	uint32_t i;
+	struct reconfig_timer *t;
+	uint32_t i, key = 0;
 
 	lhd_list = bpf_cache_ext_ds_registry_new_list(memcg);
 	if (lhd_list == 0) {
@@ -287,6 +388,29 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(lhd_init, struct mem_cgroup *memcg) {
 	}
 	bpf_printk("cache_ext: Created lhd_list: %llu\n", lhd_list);
 
+	parked_list = bpf_cache_ext_ds_registry_new_list(memcg);
+	if (parked_list == 0) {
+		bpf_printk("cache_ext: init: Failed to create parked_list\n");
+		return -1;
+	}
+	handoff_export(memcg, lhd_list);
+	handoff_export(memcg, parked_list);
+
+	t = bpf_map_lookup_elem(&reconfig_timers, &key);
+	if (!t) {
+		bpf_printk("cache_ext: init: Failed to get reconfiguration timer\n");
+		return -1;
+	}
+	if (bpf_timer_init(&t->timer, &reconfig_timers, CLOCK_MONOTONIC) ||
+	    bpf_timer_set_callback(&t->timer, reconfigure_tick)) {
+		bpf_printk("cache_ext: init: Failed to set up reconfiguration timer\n");
+		return -1;
+	}
+
+	// A restored model keeps its densities
+	if (model_valid)
+		return 0;
+
 	/*
 	 * BPF global variables are zero-initialized, so we only need to
 	 * initialize the hit densities.
@@ -295,21 +419,48 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(lhd_init, struct mem_cgroup *memcg) {
 		uint32_t j;
 
 		// Initialize hit densities to GDSF
-		struct lhd_class *cls = &classes[i];
-		bpf_for(j, 0, MAX_AGE) {
-			cls->hit_densities[j] = 1 * HIT_DENSITY_SCALING_FACTOR * (i + 1) / (j + 1);
+		bpf_for(j, 0, NUM_AGE_BUCKETS) {
+			hit_densities[0][i][j] = 1 * HIT_DENSITY_SCALING_FACTOR * (i + 1) / (bucket_age(j) + 1);
 		}
 	}
+	model_valid = 1;
 
 	return 0;
 }
 
+// Adopted folios are admitted as a miss would be, without counting one
+static void handoff_adopt(struct folio *folio) {
+	struct folio_metadata new_meta = {
+		.last_access_time = timestamp,
+		.last_hit_age = 0,
+		.last_last_hit_age = MAX_AGE,
+		.app = folio_inode_class(folio) % APP_CLASSES,
+		.cost = cost_factor(folio),
+	};
+
+	if (!folio_store_insert(folio, &new_meta))
+		return;
+	__sync_fetch_and_add(&num_objects, 1);
+}
+
+/*
+ * A pooled density stays valid until the folio is accessed again or a new
+ * density table is published.
+ */
+static inline u64 lhd_pool_stamp(struct folio_metadata *data) {
+	return (data->last_access_time << 16) ^ READ_ONCE(density_gen);
+}
+
 static s64 bpf_lhd_score_fn(struct cache_ext_list_node *a) {
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+
 	if (!folio_test_uptodate(a->folio) || !folio_test_lru(a->folio))
 		return INT64_MAX;
 
-	if (folio_test_dirty(a->folio) || folio_test_writeback(a->folio))
+	if (folio_test_dirty(a->folio) || folio_test_writeback(a->folio)) {
+		dirty_park(a->folio);
 		return INT64_MAX;
+	}
 
 	struct folio_metadata *data = get_folio_metadata(a->folio);
 	if (!data) {
@@ -317,21 +468,51 @@ static s64 bpf_lhd_score_fn(struct cache_ext_list_node *a) {
 		return INT64_MAX;
 	}
 
-	return get_hit_density(data);
+	// A folio that is cheap to fault back is worth fewer hits
+	s64 hit_density = get_hit_density(data) * data->cost /
+			  (COST_UNIT * folio_nr_pages(a->folio));
+
+	eviction_pool_offer(&lhd_pool, a->folio, hit_density, lhd_pool_stamp(data),
+			    folio_store_gen(data));
+	return hit_density;
 }
 
 void BPF_STRUCT_OPS(lhd_evict_folios, struct cache_ext_eviction_ctx *eviction_ctx,
 	       struct mem_cgroup *memcg)
 {
+	PROF_EVICT_SCOPE(eviction_ctx);
+	EVICTION_TARGET_SCOPE(eviction_ctx);
 	struct sampling_options opts = {
-		.sample_size = 16,
+		.sample_size = SAMPLE_SIZE_MAX,
 	};
+	struct eviction_pool *pool;
+	u32 valid = 0, supplied;
+
+	dirty_scan_begin(parked_list, lhd_list);
+	dirty_unpark(eviction_ctx, memcg);
+
+	if (handoff_step(eviction_ctx, memcg, lhd_list, true) &&
+	    eviction_ctx_done(eviction_ctx))
+		return;
+
+	pool = eviction_pool_get(&lhd_pool, memcg, SAMPLE_SIZE_MIN, SAMPLE_SIZE_MAX);
+	if (pool) {
+		valid = eviction_pool_revalidate(pool, lhd_pool_stamp);
+		opts.sample_size = pool->sample_size;
+	}
 
 	if (bpf_cache_ext_list_sample(memcg, lhd_list, bpf_lhd_score_fn, &opts, eviction_ctx)) {
 		bpf_printk("cache_ext: evict: Failed to sample\n");
 		return;
 	}
 
+	if (pool) {
+		supplied = eviction_pool_merge(pool, eviction_ctx);
+		eviction_pool_adapt(pool, valid, supplied, SAMPLE_SIZE_MIN, SAMPLE_SIZE_MAX);
+	}
+
+	dirty_evict_parked(eviction_ctx, memcg, parked_list);
+
 	/*
 	 * Yields the following verifier error:
 	 * 	R2 is ptr_cache_ext_eviction_ctx invalid variable offset: off=272, var_off=(0x0; 0xf8)
@@ -368,6 +549,8 @@ void BPF_STRUCT_OPS(lhd_evict_folios, struct cache_ext_eviction_ctx *eviction_ct
 }
 
 void BPF_STRUCT_OPS(lhd_folio_accessed, struct folio *folio) {
+	PROF_SCOPE(PROF_FOLIO_ACCESSED);
+	cache_ext_trace(CACHE_EXT_TRACE_ACCESS, folio);
 	if (!is_folio_relevant(folio))
 		return;
 
@@ -376,8 +559,10 @@ void BPF_STRUCT_OPS(lhd_folio_accessed, struct folio *folio) {
 		bpf_printk("cache_ext: accessed: Failed to get metadata\n");
 		return;
 	}
+	cache_ext_stat_inc(CACHE_EXT_STAT_HITS);
+	cost_folio_accessed(folio);
 
-	u64 age = get_age(data);
+	u64 age = get_age(data, density_slot());
 	struct lhd_class *cls = get_class(data);
 	if (!cls) {
 		bpf_printk("cache_ext: Failed to get class\n");
@@ -387,9 +572,9 @@ void BPF_STRUCT_OPS(lhd_folio_accessed, struct folio *folio) {
 	data->last_last_hit_age = data->last_hit_age;
 	data->last_hit_age = age;
 	data->last_access_time = timestamp;
-	// data->app = DEFAULT_APP_ID % APP_CLASSES;
+	data->cost = cost_factor(folio);
 
-	u64 *hits = cls->hits + age;
+	u64 *hits = cls->hits + age_to_bucket(age) % NUM_AGE_BUCKETS;
 
 	__sync_fetch_and_add(hits, 1 * HIT_SCALING_FACTOR);
 
@@ -397,53 +582,59 @@ void BPF_STRUCT_OPS(lhd_folio_accessed, struct folio *folio) {
 
 	if (__sync_sub_and_fetch(&next_reconfiguration, 1) == 0) {
 		next_reconfiguration = REQS_PER_RECONFIG;
-		num_reconfigurations++;
-
-		// Submit reconfigure event to ring buffer
-		if (bpf_ringbuf_output(&events, &num_reconfigurations, sizeof(num_reconfigurations), 0))
-			bpf_printk("cache_ext: Failed to submit reconfigure event\n");
+		request_reconfiguration();
 	}
 }
 
 void BPF_STRUCT_OPS(lhd_folio_evicted, struct folio *folio) {
-	u64 key = (u64)folio;
+	PROF_SCOPE(PROF_FOLIO_EVICTED);
+	cache_ext_trace(CACHE_EXT_TRACE_EVICT, folio);
 	u64 age, hit_density, *evictions;
 	struct lhd_class *cls;
+	u32 slot, class_id, bucket;
+
+	dirty_evicted(folio);
 
 	// if (bpf_cache_ext_list_del(folio)) {
 	// 	bpf_printk("cache_ext: Failed to delete folio from sampling_list\n");
 	// 	return;
 	// }
 
-	struct folio_metadata *data = bpf_map_lookup_elem(&folio_metadata_map, &key);
+	struct folio_metadata *data = get_folio_metadata(folio);
 	if (!data) {
 		//bpf_printk("cache_ext: evicted: Failed to get metadata\n");
 		return;
 	}
 
-	age = get_age(data);
+	slot = density_slot();
+	age = get_age(data, slot);
+	class_id = get_class_id(data);
 	cls = get_class(data);
 	if (!cls) {
 		bpf_printk("cache_ext: evicted: Failed to get class\n");
 		return;
 	}
 
-	evictions = cls->evictions + age;
+	bucket = age_to_bucket(age) % NUM_AGE_BUCKETS;
+	evictions = cls->evictions + bucket;
 
 	__sync_fetch_and_add(evictions, 1 * HIT_SCALING_FACTOR);
 
 	__sync_fetch_and_sub(&num_objects, 1);
+	cache_ext_stat_inc(CACHE_EXT_STAT_EVICTIONS);
 
 	// Open-coded get_hit_density()
-	hit_density = cls->hit_densities[age];
+	hit_density = hit_densities[slot][class_id & NUM_CLASSES_MASK][bucket];
 	ewma_victim_hit_density = ewma_decay(ewma_victim_hit_density) + rem_ewma_decay(hit_density);
 
 	// Remove folio metadata
-	if (bpf_map_delete_elem(&folio_metadata_map, &key))
+	if (folio_store_delete(folio))
 		bpf_printk("cache_ext: evicted: Failed to delete metadata\n");
 }
 
 void BPF_STRUCT_OPS(lhd_folio_added, struct folio *folio) {
+	PROF_SCOPE(PROF_FOLIO_ADDED);
+	cache_ext_trace(CACHE_EXT_TRACE_ADD, folio);
 	if (!is_folio_relevant(folio))
 		return;
 
@@ -451,16 +642,17 @@ void BPF_STRUCT_OPS(lhd_folio_added, struct folio *folio) {
 		bpf_printk("cache_ext: added: Failed to add folio to lhd_list\n");
 		return;
 	}
+	cost_folio_added(folio);
 
-	u64 key = (u64)folio;
 	struct folio_metadata new_meta = {
 		.last_access_time = timestamp,
 		.last_hit_age = 0,
 		.last_last_hit_age = MAX_AGE,
-		.app = DEFAULT_APP_ID % APP_CLASSES,
+		.app = folio_inode_class(folio) % APP_CLASSES,
+		.cost = cost_factor(folio),
 	};
 
-	if (bpf_map_update_elem(&folio_metadata_map, &key, &new_meta, BPF_ANY)) {
+	if (!folio_store_insert(folio, &new_meta)) {
 		bpf_cache_ext_list_del(folio);
 		bpf_printk("cache_ext: added: Failed to create folio metadata\n");
 		return;
@@ -481,14 +673,12 @@ void BPF_STRUCT_OPS(lhd_folio_added, struct folio *folio) {
 	__sync_fetch_and_add(&timestamp, 1);
 
 	__sync_fetch_and_add(&num_objects, 1);
+	cache_ext_stat_inc(CACHE_EXT_STAT_MISSES);
+
 
 	if (__sync_sub_and_fetch(&next_reconfiguration, 1) == 0) {
 		next_reconfiguration = REQS_PER_RECONFIG;
-		num_reconfigurations++;
-
-		// Submit reconfigure event to ring buffer
-		if (bpf_ringbuf_output(&events, &num_reconfigurations, sizeof(num_reconfigurations), 0))
-			bpf_printk("cache_ext: added: Failed to submit reconfigure event\n");
+		request_reconfiguration();
 	}
 }
 
@@ -2,21 +2,44 @@
 #define _CACHE_EXT_LHD_BPF_H
 
 #define HIT_AGE_CLASSES 16
-#define APP_CLASSES 16
+#define APP_CLASSES 16  // One per file class, see cache_ext_hints.bpf.h
 #define NUM_CLASSES ((HIT_AGE_CLASSES) * (APP_CLASSES))  // Must be power of two for masking
 #define NUM_CLASSES_MASK (NUM_CLASSES - 1)
+#ifndef INITIAL_AGE_COARSENING_SHIFT  // Overridable for cache_ext_sim sweeps, as are the ones below
 #define INITIAL_AGE_COARSENING_SHIFT 10
+#endif
 #define REQS_PER_RECONFIG (1 << 20)
-#define MAX_AGE (1 << 14)  // Must be power of two for masking
+#define RECONFIG_CLASSES_PER_TICK 64 // Classes remodeled per timer tick
+#define RECONFIG_TICK_NS (1000 * 1000)
+#define MAX_AGE_SHIFT 14
+#define MAX_AGE (1 << MAX_AGE_SHIFT)  // Must be power of two for masking
 #define MAX_AGE_MASK (MAX_AGE - 1)
-#define DEFAULT_APP_ID 1  // TODO: can prob delete app stuff
+
+/*
+ * Ages are histogrammed in log-linear buckets: ages below
+ * 2^AGE_BUCKET_BITS get a bucket each, every higher power of two is split
+ * into 2^AGE_BUCKET_BITS equal buckets. Raising AGE_BUCKET_BITS trades
+ * memory and reconfiguration time for resolution, 0 gives plain log2
+ * buckets. With MAX_AGE_SHIFT 14 and 3 bits that is 96 buckets per class.
+ */
+#define AGE_BUCKET_BITS 3
+#define AGE_SUB_BUCKETS (1 << AGE_BUCKET_BITS)
+#define NUM_AGE_BUCKETS ((MAX_AGE_SHIFT - AGE_BUCKET_BITS + 1) * AGE_SUB_BUCKETS)
 #define RECENTLY_ADMITTED_SIZE 8
+#ifndef SAMPLE_SIZE_MIN
+#define SAMPLE_SIZE_MIN 4  // Bounds of the adaptive eviction sample
+#endif
+#ifndef SAMPLE_SIZE_MAX
+#define SAMPLE_SIZE_MAX 16
+#endif
 
 #define HIT_SCALING_FACTOR (1 << 20)
 #define HIT_DENSITY_SCALING_FACTOR (1 << 20)
 #define NUM_OBJECTS_SCALING_FACTOR (1 << 20)
 
 #define TOTAL_EVENTS_THRESH (HIT_SCALING_FACTOR / 100000)
+#ifndef AGE_COARSENING_ERROR_TOLERANCE
 #define AGE_COARSENING_ERROR_TOLERANCE 100 // Inverse of value in libcachesim
+#endif
 
 #endif /* _CACHE_EXT_LHD_BPF_H */
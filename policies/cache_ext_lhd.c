@@ -9,6 +9,10 @@
 #include <unistd.h>
 
 #include "dir_watcher.h"
+#include "cache_ext_stats.h"
+#include "cache_ext_hints.h"
+#include "cache_ext_folio_store.h"
+#include "cache_ext_cost.h"
 #include "cache_ext_lhd.bpf.h"
 #include "cache_ext_lhd.skel.h"
 
@@ -24,7 +28,11 @@ static struct argp_option options[] = {
 	{ 0 },
 };
 
-static long num_reconfigurations;
+// Hit statistics and densities, see the __model globals in cache_ext_lhd.bpf.c
+static const struct cache_ext_state_map lhd_state[] = {
+	{ CACHE_EXT_STATE_MODEL },
+	{ 0 },
+};
 
 static volatile sig_atomic_t exiting;
 
@@ -49,7 +57,7 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 }
 
 static int parse_args(int argc, char **argv, struct cmdline_args *args) {
-	struct argp argp = { options, parse_opt, 0, 0 };
+	struct argp argp = { options, parse_opt, 0, 0, cache_ext_cost_argp_children };
 	argp_parse(&argp, argc, argv, 0, 0, args);
 
 	if (args->watch_dir == NULL) {
@@ -83,41 +91,21 @@ static int validate_watch_dir(const char *watch_dir, char *watch_dir_full_path)
 		return 1;
 	}
 
-	// BPF policy restriction
-	if (strlen(watch_dir_full_path) > 128) {
-		fprintf(stderr, "watch_dir path too long\n");
-		return 1;
-	}
-
 	return 0;
 }
 
-static int handle_event(void *ctx, void *data, size_t data_sz) {
-	// Run BPF reconfigure program using BPF_PROG_RUN
-	int ret = 0;
-	int reconfigure_prog_fd = *(int *)ctx;
-
-	struct bpf_test_run_opts opts = {
-		.sz = sizeof(opts),
-	};
-	
-	++num_reconfigurations;
-
-	ret = bpf_prog_test_run_opts(reconfigure_prog_fd, &opts);
-	if (ret)
-		perror("Failed to run reconfigure program");
-
-	return ret;
-}
-
 int main(int argc, char **argv) {
 	struct cmdline_args args = { 0 };
 	struct cache_ext_lhd_bpf *skel = NULL;
 	struct bpf_link *link = NULL;
-	struct ring_buffer *events = NULL;
+	struct cache_ext_swap swap = { 0 };
+	struct cache_ext_state state = { 0 };
+	struct cache_ext_exporter exporter = { 0 };
+	struct cache_ext_profiler prof = { 0 };
+	struct cache_ext_recorder rec = { 0 };
+	struct cache_ext_cost cost = { 0 };
 	struct sigaction sa;
 	char watch_dir_path[PATH_MAX];
-	int reconfigure_prog_fd;
 	int cgroup_fd = -1;
 	int ret = 1;
 
@@ -152,8 +140,39 @@ int main(int argc, char **argv) {
 		goto cleanup;
 	}
 
-	watch_dir_path_len_map(skel) = strlen(watch_dir_path);
-	strcpy(watch_dir_path_map(skel), watch_dir_path);
+	if (folio_store_resize(folio_store_map(skel), &folio_store_mask(skel), args.cgroup_path))
+		goto cleanup;
+
+	// Set watch_dir
+	if (set_watch_dir_root(watch_dir_path, &watch_dir_ino_map(skel), &watch_dir_dev_map(skel)))
+		goto cleanup;
+
+	// Size inode_watchlist for the watch dir
+	if (resize_watch_dir_map(inode_watchlist_map(skel), watch_dir_path, false))
+		goto cleanup;
+
+	// Hook profiling, if enabled
+	cache_ext_prof_setup(skel);
+
+	// Page access recording, if enabled
+	if (cache_ext_recorder_setup(skel))
+		goto cleanup;
+
+	// One stats slot per CPU
+	if (cache_ext_stats_resize(cache_ext_stats_map(skel)))
+		goto cleanup;
+
+	// Share the pinned file class map with cache_ext_hint
+	if (cache_ext_hints_pin(inode_class_map(skel)))
+		goto cleanup;
+
+	// Refault cost probes, if enabled
+	if (cache_ext_cost_setup(skel))
+		goto cleanup;
+
+	// Resume from the model saved by --state, if there is one
+	if (cache_ext_state_restore(&state, skel->obj, "lhd", lhd_state))
+		goto cleanup;
 
 	if (cache_ext_lhd_bpf__load(skel)) {
 		perror("Failed to load BPF skeleton");
@@ -165,48 +184,56 @@ int main(int argc, char **argv) {
 		goto cleanup;
 	}
 
-	// Get fd of reconfigure program
-	reconfigure_prog_fd = bpf_program__fd(skel->progs.reconfigure);
-
-	events = ring_buffer__new(bpf_map__fd(skel->maps.events), handle_event, &reconfigure_prog_fd, NULL);
-	if (!events) {
-		perror("Failed to create ring buffer");
+	if (cache_ext_state_apply(&state))
 		goto cleanup;
-	}
 
-	link = bpf_map__attach_cache_ext_ops(skel->maps.lhd_ops, cgroup_fd);
+	link = cache_ext_swap_attach(&swap, skel->obj, skel->maps.lhd_ops, cgroup_fd);
 	if (link == NULL) {
 		perror("Failed to attach cache_ext_ops to cgroup");
 		goto cleanup;
 	}
 
+	if (cache_ext_cost_attach(&cost, skel))
+		goto cleanup;
+
+	// Map the stats region and start the exporter, if enabled
+	if (cache_ext_exporter_start(&exporter, cache_ext_stats_map(skel), "lhd"))
+		goto cleanup;
+
+	// Dump hook profiles on SIGUSR1 and at exit, if enabled
+	if (cache_ext_prof_start(&prof, cache_ext_prof_map(skel), "lhd"))
+		goto cleanup;
+
+	// Stream page accesses to the --record file, if enabled
+	if (cache_ext_recorder_start(&rec, cache_ext_trace_ring(skel)))
+		goto cleanup;
+
 	// This is necessary for the dir_watcher functionality
 	if (cache_ext_lhd_bpf__attach(skel)) {
 		perror("Failed to attach BPF skeleton");
 		goto cleanup;
 	}
 
-	while (!exiting) {
-		ret = ring_buffer__poll(events, -1); // infinite timeout
-		
-		if (ret == -EINTR) {
-			ret = 0;
-			break;
-		} else if (ret < 0) {
-			fprintf(stderr, "error polling ring buffer: %d\n", ret);
-			ret = 1;
-			goto cleanup;
-		} else {
-			ret = 0;
-		}
-	}
+	// Tell whoever started us that the policy is live
+	cache_ext_ready();
+
+	// Reconfiguration runs from a BPF timer, just wait for SIGINT
+	while (!exiting)
+		pause();
+	ret = 0;
 
-	printf("Number of reconfigurations: %ld\n", num_reconfigurations);
+	printf("Number of reconfigurations: %u\n", skel->bss->num_reconfigurations);
 
 cleanup:
 	close(cgroup_fd);
-	ring_buffer__free(events);
+	cache_ext_recorder_stop(&rec);
+	cache_ext_prof_stop(&prof);
+	cache_ext_exporter_stop(&exporter);
+	cache_ext_cost_detach(&cost);
+	cache_ext_swap_release(&swap, link);
 	bpf_link__destroy(link);
+	cache_ext_state_save(&state);
+	cache_ext_state_free(&state);
 	cache_ext_lhd_bpf__destroy(skel);
 	return ret;
 }
@@ -4,6 +4,7 @@
 #define U32_MAX		((u32)~0U)
 #define U64_MAX		((u64)~0ULL)
 #define S64_MAX		((s64)(U64_MAX >> 1))
+#define S64_MIN		(-S64_MAX - 1)
 
 #include "vmlinux.h"
 #include <bpf/bpf_helpers.h>
@@ -24,6 +25,9 @@
 
 #define barrier() asm volatile("" ::: "memory")
 
+// Upper bound for loops that aggregate per-CPU map values
+#define MAX_CPUS 1024
+
 typedef __u8  __attribute__((__may_alias__))  __u8_alias_t;
 typedef __u16 __attribute__((__may_alias__)) __u16_alias_t;
 typedef __u32 __attribute__((__may_alias__)) __u32_alias_t;
@@ -197,12 +201,20 @@ static inline bool folio_test_unevictable(struct folio *folio)
 	return ret;
 }
 
+#define MEMCG_DATA_FLAGS_MASK 3UL  // MEMCG_DATA_OBJCGS | MEMCG_DATA_KMEM
+
+// The owning memcg's address, which for page cache folios is memcg_data
+static __always_inline u64 folio_memcg_key(struct folio *folio)
+{
+	return folio->memcg_data & ~MEMCG_DATA_FLAGS_MASK;
+}
+
+// Large page cache folios span up to 512 pages, the count is in the first tail page
 static inline long folio_nr_pages(struct folio *folio)
 {
-	return 1;
-	// if (!folio_test_large(folio))
-	// 	return 1;
-	// return folio->_folio_nr_pages;
+	if (!folio_test_large(folio))
+		return 1;
+	return folio->_folio_nr_pages;
 }
 
 static inline loff_t i_size_read(const struct inode *inode)
@@ -222,6 +234,362 @@ static inline pgoff_t folio_index(struct folio *folio)
 	return folio->index;
 }
 
+/* from page_counter.h, assuming 4K pages */
+#define PAGE_COUNTER_MAX (S64_MAX / 4096)
+
+/*
+ * Current memory.max of the memcg in pages. Read live on every call so
+ * policies follow limit changes at runtime. Returns 0 if unlimited.
+ */
+static inline u64 memcg_max_pages(struct mem_cgroup *memcg)
+{
+	u64 max = memcg->memory.max;
+
+	return max >= PAGE_COUNTER_MAX ? 0 : max;
+}
+
+/*
+ * 64-bit hash of the folio's page cache key {inode, index}. Stable across
+ * evictions, unlike the folio pointer itself.
+ */
+static __always_inline u64 folio_key_hash(struct folio *folio)
+{
+	u64 h = (u64)folio->mapping->host * 0x9E3779B97F4A7C15ULL ^ folio->index;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Eviction Targets ///////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Eviction requests are met in pages. Reclaim asks for
+ * request_nr_folios_to_evict pages' worth, and the list kfuncs stop once
+ * that many folios are proposed, which evicts up to 512 times too much when
+ * they are large. Policies check whether a request is met with
+ * eviction_ctx_done(), and wrap evict_folios in EVICTION_TARGET_SCOPE(),
+ * which trims the proposals to the first ones that cover the request when
+ * the hook returns. The folios dropped stay on their lists.
+ */
+
+#define EVICTION_CTX_SLOTS	32	// Size of cache_ext_eviction_ctx arrays
+
+// Pages covered by the folios proposed so far
+static __always_inline u64 eviction_ctx_pages(struct cache_ext_eviction_ctx *ctx)
+{
+	u32 nr = ctx->nr_folios_to_evict;
+	u64 pages = 0;
+
+#pragma unroll
+	for (int j = 0; j < EVICTION_CTX_SLOTS; j++) {
+		if (j < nr)
+			pages += folio_nr_pages(ctx->folios_to_evict[j]);
+	}
+	return pages;
+}
+
+static __always_inline bool eviction_ctx_done(struct cache_ext_eviction_ctx *ctx)
+{
+	return eviction_ctx_pages(ctx) >= ctx->request_nr_folios_to_evict;
+}
+
+// Drop the proposals beyond the first ones that cover the request
+static __always_inline void eviction_ctx_trim(struct cache_ext_eviction_ctx **ctxp)
+{
+	struct cache_ext_eviction_ctx *ctx = *ctxp;
+	u32 nr = ctx->nr_folios_to_evict;
+	u64 pages = 0;
+
+#pragma unroll
+	for (int j = 0; j < EVICTION_CTX_SLOTS; j++) {
+		if (j >= nr)
+			break;
+		if (pages >= ctx->request_nr_folios_to_evict) {
+			ctx->nr_folios_to_evict = j;
+			break;
+		}
+		pages += folio_nr_pages(ctx->folios_to_evict[j]);
+	}
+}
+
+// Declare after PROF_EVICT_SCOPE(), so the profile sees the trimmed proposals
+#define EVICTION_TARGET_SCOPE(ctx)							\
+	struct cache_ext_eviction_ctx *__eviction_target				\
+		__attribute__((cleanup(eviction_ctx_trim))) = (ctx)
+
+///////////////////////////////////////////////////////////////////////////////
+// Eviction Pool //////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Redis-style eviction pool for policies that evict with
+ * bpf_cache_ext_list_sample().
+ *
+ * The policy's score_fn offers every node it scores to a small per-CPU pool
+ * that keeps the EVICTION_POOL_SIZE lowest scores seen, across calls. Each
+ * entry remembers the folio's memcg, size and folio store generation, and
+ * eviction_pool_get() drops the entries of other memcgs. Before the next
+ * sample, eviction_pool_revalidate() drops entries whose folio was accessed,
+ * evicted or freed and reused since it was scored: the folio must still own a
+ * folio store slot of the same generation, with the same policy-defined stamp
+ * (e.g. last access time). That costs one metadata lookup per pooled entry
+ * instead of a fresh score_fn call. After sampling, eviction_pool_merge()
+ * swaps the worst sampled victims for better pooled ones.
+ *
+ * The sample size adapts: it shrinks while the pool keeps supplying victims
+ * and most entries stay valid, and doubles again when the pool goes stale.
+ *
+ * Usage:
+ *
+ *	DEFINE_EVICTION_POOL(my_pool);
+ *
+ *	score_fn:  eviction_pool_offer(&my_pool, a->folio, score, my_stamp_fn(meta),
+ *				       folio_store_gen(meta));
+ *	evict:     pool = eviction_pool_get(&my_pool, memcg, min_sample, max_sample);
+ *		   valid = eviction_pool_revalidate(pool, my_stamp_fn);
+ *		   opts.sample_size = pool->sample_size;
+ *		   bpf_cache_ext_list_sample(...);
+ *		   supplied = eviction_pool_merge(pool, ctx);
+ *		   eviction_pool_adapt(pool, valid, supplied, min_sample, max_sample);
+ *
+ * my_stamp_fn(struct folio_metadata *) reads the stamp from the folio's
+ * metadata. Pooled folio pointers are plain scalars and are never
+ * dereferenced. The policy has to keep its metadata in the folio store
+ * (cache_ext_folio_store.bpf.h).
+ */
+
+#define EVICTION_POOL_SIZE	16
+#define EVICTION_POOL_MERGE	8	// Max victims supplied per call
+
+struct eviction_pool_entry {
+	u64 folio;	// 0 if free
+	u64 memcg;	// folio_memcg_key() when offered
+	u64 gen;	// Folio store generation when offered
+	s64 score;
+	u64 stamp;
+	u32 nr_pages;
+};
+
+struct eviction_pool {
+	u64 memcg;	// The memcg the entries belong to
+	u32 sample_size;
+	struct eviction_pool_entry entries[EVICTION_POOL_SIZE];
+};
+
+#define DEFINE_EVICTION_POOL(name)					\
+	struct {							\
+		__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);		\
+		__type(key, u32);					\
+		__type(value, struct eviction_pool);			\
+		__uint(max_entries, 1);					\
+	} name SEC(".maps")
+
+static inline void eviction_pool_remove(struct eviction_pool *pool, u32 i)
+{
+	if (i >= EVICTION_POOL_SIZE || !pool->entries[i].folio)
+		return;
+	pool->entries[i].folio = 0;
+}
+
+// The pool for evicting from memcg. Entries offered for another memcg are dropped.
+static __always_inline struct eviction_pool *eviction_pool_get(void *map, struct mem_cgroup *memcg,
+							       u32 min_sample, u32 max_sample)
+{
+	struct eviction_pool *pool;
+	u32 key = 0, i;
+
+	pool = bpf_map_lookup_elem(map, &key);
+	if (!pool)
+		return NULL;
+
+	if (pool->memcg != (u64)memcg) {
+		bpf_for(i, 0, EVICTION_POOL_SIZE) {
+			if (pool->entries[i].memcg != (u64)memcg)
+				eviction_pool_remove(pool, i);
+		}
+		pool->memcg = (u64)memcg;
+	}
+
+	if (pool->sample_size < min_sample || pool->sample_size > max_sample)
+		pool->sample_size = max_sample;
+	return pool;
+}
+
+// Keep (folio, score) if it is among the EVICTION_POOL_SIZE best offered
+static inline void eviction_pool_offer(void *map, struct folio *folio, s64 score, u64 stamp,
+				       u64 gen)
+{
+	struct eviction_pool *pool;
+	u32 key = 0, i, slot = EVICTION_POOL_SIZE;
+	s64 worst = S64_MIN;
+
+	pool = bpf_map_lookup_elem(map, &key);
+	if (!pool)
+		return;
+
+	bpf_for(i, 0, EVICTION_POOL_SIZE) {
+		struct eviction_pool_entry *e = &pool->entries[i];
+
+		if (e->folio == (u64)folio) {
+			e->memcg = folio_memcg_key(folio);
+			e->gen = gen;
+			e->score = score;
+			e->stamp = stamp;
+			e->nr_pages = folio_nr_pages(folio);
+			return;
+		}
+		if (!e->folio) {
+			if (worst != S64_MAX) {
+				worst = S64_MAX;
+				slot = i;
+			}
+		} else if (e->score > worst) {
+			worst = e->score;
+			slot = i;
+		}
+	}
+
+	if (slot >= EVICTION_POOL_SIZE || (pool->entries[slot].folio && score >= worst))
+		return;
+
+	pool->entries[slot].folio = (u64)folio;
+	pool->entries[slot].memcg = folio_memcg_key(folio);
+	pool->entries[slot].gen = gen;
+	pool->entries[slot].score = score;
+	pool->entries[slot].stamp = stamp;
+	pool->entries[slot].nr_pages = folio_nr_pages(folio);
+}
+
+/*
+ * Drop entries whose folio no longer owns a folio store slot of the same
+ * generation, or whose stamp changed since they were offered. Returns the
+ * percentage of entries that were still valid, 0 for an empty pool.
+ */
+#define eviction_pool_revalidate(pool, stamp_fn)				\
+({										\
+	u32 __i, __checked = 0, __valid = 0;					\
+	bpf_for(__i, 0, EVICTION_POOL_SIZE) {					\
+		struct eviction_pool_entry *__e = &(pool)->entries[__i];	\
+		struct folio_store_slot *__slot;				\
+		if (!__e->folio)						\
+			continue;						\
+		__checked++;							\
+		__slot = folio_store_lookup_slot((struct folio *)__e->folio);	\
+		if (__slot && __slot->gen == __e->gen &&			\
+		    stamp_fn(&__slot->meta) == __e->stamp)			\
+			__valid++;						\
+		else								\
+			eviction_pool_remove(pool, __i);			\
+	}									\
+	__checked ? __valid * 100 / __checked : 0;				\
+})
+
+static __always_inline void eviction_ctx_set(struct cache_ext_eviction_ctx *ctx, u32 idx,
+					     u64 folio, s64 score)
+{
+	// Constant offsets only, ctx does not allow variable offset access
+#pragma unroll
+	for (int j = 0; j < EVICTION_CTX_SLOTS; j++) {
+		if (j == idx) {
+			ctx->folios_to_evict[j] = (struct folio *)folio;
+			ctx->scores[j] = score;
+		}
+	}
+}
+
+static inline s32 eviction_pool_best(struct eviction_pool *pool)
+{
+	s64 best = S64_MAX;
+	s32 slot = -1;
+	u32 i;
+
+	bpf_for(i, 0, EVICTION_POOL_SIZE) {
+		struct eviction_pool_entry *e = &pool->entries[i];
+
+		if (e->folio && e->score < best) {
+			best = e->score;
+			slot = i;
+		}
+	}
+	return slot;
+}
+
+/*
+ * Forget the folios the sampler picked, then fill up and improve the
+ * victims with pooled candidates. Returns the number of victims supplied
+ * by the pool. Pooled folios count towards the request with the size they
+ * had when offered, which revalidation ties to the same folio.
+ */
+static __always_inline u32 eviction_pool_merge(struct eviction_pool *pool,
+					       struct cache_ext_eviction_ctx *ctx)
+{
+	u32 nr = ctx->nr_folios_to_evict;
+	u32 req = min(ctx->request_nr_folios_to_evict, EVICTION_CTX_SLOTS);
+	u64 pages = eviction_ctx_pages(ctx);
+	u32 round, supplied = 0;
+
+#pragma unroll
+	for (int j = 0; j < EVICTION_CTX_SLOTS; j++) {
+		u64 victim = (u64)ctx->folios_to_evict[j];
+		u32 i;
+
+		if (j >= nr)
+			break;
+		bpf_for(i, 0, EVICTION_POOL_SIZE) {
+			if (pool->entries[i].folio == victim)
+				eviction_pool_remove(pool, i);
+		}
+	}
+
+	bpf_for(round, 0, EVICTION_POOL_MERGE) {
+		s32 best = eviction_pool_best(pool);
+		u32 slot = nr;
+		s64 worst = S64_MIN;
+
+		if (best < 0 || best >= EVICTION_POOL_SIZE)
+			break;
+
+		if (nr >= req || pages >= ctx->request_nr_folios_to_evict) {
+			// Replace the worst sampled victim, if the pool beats it
+#pragma unroll
+			for (int j = 0; j < EVICTION_CTX_SLOTS; j++) {
+				if (j < nr && ctx->scores[j] > worst) {
+					worst = ctx->scores[j];
+					slot = j;
+				}
+			}
+			if (pool->entries[best].score >= worst)
+				break;
+		} else {
+			nr++;
+			pages += pool->entries[best].nr_pages;
+		}
+
+		eviction_ctx_set(ctx, slot, pool->entries[best].folio,
+				 pool->entries[best].score);
+		eviction_pool_remove(pool, best);
+		supplied++;
+	}
+
+	ctx->nr_folios_to_evict = nr;
+	return supplied;
+}
+
+static inline void eviction_pool_adapt(struct eviction_pool *pool, u32 valid_pct,
+				       u32 supplied, u32 min_sample, u32 max_sample)
+{
+	if (supplied && valid_pct >= 75)
+		pool->sample_size = max(pool->sample_size - 1, min_sample);
+	else if (valid_pct < 50)
+		pool->sample_size = min(pool->sample_size * 2, max_sample);
+}
+
 
 ///////////////////////////////////////////////////////////////////////////////
 // Generic Utils //////////////////////////////////////////////////////////////
@@ -255,4 +623,17 @@ static inline u32 bpf_get_random_biased(u32 max) {
 	return bpf_get_prandom_u32() % max;
 }
 
+// floor(log2(v)), 0 for v == 0. Branchy but loop-free for the verifier.
+static __always_inline u32 ilog2_u64(u64 v) {
+	u32 r = 0;
+
+	if (v >> 32) { v >>= 32; r += 32; }
+	if (v >> 16) { v >>= 16; r += 16; }
+	if (v >> 8) { v >>= 8; r += 8; }
+	if (v >> 4) { v >>= 4; r += 4; }
+	if (v >> 2) { v >>= 2; r += 2; }
+	if (v >> 1) r += 1;
+	return r;
+}
+
 #endif /* _CACHE_EXT_LIB_BPF_H */
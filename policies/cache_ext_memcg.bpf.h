@@ -0,0 +1,71 @@
+#ifndef _CACHE_EXT_MEMCG_BPF_H
+#define _CACHE_EXT_MEMCG_BPF_H 1
+
+#include "cache_ext_lib.bpf.h"
+
+/*
+ * Per-memcg policy state, for loaders that attach one policy instance to
+ * several cgroups (see cache_ext_memcg.h).
+ *
+ * The state lives in a hash map keyed by the mem_cgroup pointer, created
+ * by the policy's init hook for each cgroup it is attached to. Folio hooks
+ * find it through folio->memcg_data, which for page cache folios is the
+ * owning memcg. Folios charged to a child of an attached cgroup have no
+ * state and are ignored, so attach to leaf cgroups.
+ *
+ * The including policy must define struct memcg_state before including
+ * this header. The loader sizes memcg_state_map to the number of cgroups,
+ * and attaching the skeleton drops a cgroup's state when it is freed.
+ */
+
+#define MEMCG_STATE_DEFAULT_ENTRIES 64
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, u64);
+	__type(value, struct memcg_state);
+	__uint(max_entries, MEMCG_STATE_DEFAULT_ENTRIES);
+} memcg_state_map SEC(".maps");
+
+/*
+ * Create the memcg's state from *init. Call from the init hook. Any state
+ * already there is from an earlier attach (or from a freed memcg whose
+ * address was reused) and is replaced.
+ */
+static inline struct memcg_state *memcg_state_create(struct mem_cgroup *memcg,
+						     const struct memcg_state *init)
+{
+	u64 key = (u64)memcg;
+
+	if (bpf_map_update_elem(&memcg_state_map, &key, init, BPF_ANY))
+		return NULL;
+	return bpf_map_lookup_elem(&memcg_state_map, &key);
+}
+
+// css is the first member of struct mem_cgroup, so its address is the key
+SEC("fentry/mem_cgroup_css_free")
+int BPF_PROG(memcg_state_free, struct cgroup_subsys_state *css)
+{
+	u64 key = (u64)css;
+
+	bpf_map_delete_elem(&memcg_state_map, &key);
+	return 0;
+}
+
+static inline struct memcg_state *memcg_state_lookup(struct mem_cgroup *memcg)
+{
+	u64 key = (u64)memcg;
+
+	return bpf_map_lookup_elem(&memcg_state_map, &key);
+}
+
+static inline struct memcg_state *folio_memcg_state(struct folio *folio)
+{
+	u64 key = folio_memcg_key(folio);
+
+	if (!key)
+		return NULL;
+	return bpf_map_lookup_elem(&memcg_state_map, &key);
+}
+
+#endif /* _CACHE_EXT_MEMCG_BPF_H */
@@ -0,0 +1,104 @@
+#ifndef _CACHE_EXT_MEMCG_H
+#define _CACHE_EXT_MEMCG_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <bpf/libbpf.h>
+
+#include "cache_ext_folio_store.h"
+#include "cache_ext_swap.h"
+
+/*
+ * Attach one policy instance to several cgroups. --cgroup_path is given
+ * once per cgroup; the policy's init hook creates that cgroup's state in
+ * memcg_state_map (see cache_ext_memcg.bpf.h). Shared maps such as the
+ * folio store are sized for the cgroups' combined memory.max.
+ */
+
+#define CACHE_EXT_MAX_CGROUPS 256
+
+#define memcg_state_map(skel)	((skel)->maps.memcg_state_map)
+
+struct cache_ext_cgroups {
+	int nr;
+	const char *paths[CACHE_EXT_MAX_CGROUPS];
+	int fds[CACHE_EXT_MAX_CGROUPS];
+	struct bpf_link *links[CACHE_EXT_MAX_CGROUPS];
+	struct cache_ext_swap swaps[CACHE_EXT_MAX_CGROUPS];
+};
+
+// For the loader's argp parser
+int cache_ext_cgroups_add(struct cache_ext_cgroups *cg, const char *path) {
+	if (cg->nr >= CACHE_EXT_MAX_CGROUPS) {
+		fprintf(stderr, "Too many cgroups, at most %d\n", CACHE_EXT_MAX_CGROUPS);
+		return -1;
+	}
+	cg->paths[cg->nr] = path;
+	cg->fds[cg->nr] = -1;
+	cg->nr++;
+	return 0;
+}
+
+int cache_ext_cgroups_open(struct cache_ext_cgroups *cg) {
+	for (int i = 0; i < cg->nr; i++) {
+		cg->fds[i] = open(cg->paths[i], O_RDONLY);
+		if (cg->fds[i] < 0) {
+			fprintf(stderr, "Failed to open cgroup path %s: %s\n",
+				cg->paths[i], strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Combined memory.max of all cgroups in bytes, capped at physical memory
+uint64_t cache_ext_cgroups_memory_max(const struct cache_ext_cgroups *cg) {
+	uint64_t phys = (uint64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+	uint64_t total = 0;
+
+	for (int i = 0; i < cg->nr; i++)
+		total += read_cgroup_memory_max(cg->paths[i]);
+
+	return total < phys ? total : phys;
+}
+
+// One state slot per cgroup. Must be called between skel__open() and skel__load().
+int memcg_state_resize(struct bpf_map *map, const struct cache_ext_cgroups *cg) {
+	if (bpf_map__set_max_entries(map, cg->nr > 0 ? cg->nr : 1)) {
+		perror("Failed to resize memcg_state_map");
+		return -1;
+	}
+	return 0;
+}
+
+// With --swap, each cgroup's running policy is replaced, see cache_ext_swap.h
+int cache_ext_cgroups_attach(struct cache_ext_cgroups *cg, struct bpf_object *obj,
+			     struct bpf_map *ops) {
+	for (int i = 0; i < cg->nr; i++) {
+		cg->links[i] = cache_ext_swap_attach(&cg->swaps[i], obj, ops, cg->fds[i]);
+		if (cg->links[i] == NULL) {
+			fprintf(stderr, "Failed to attach cache_ext_ops to cgroup %s: %s\n",
+				cg->paths[i], strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void cache_ext_cgroups_close(struct cache_ext_cgroups *cg) {
+	for (int i = 0; i < cg->nr; i++) {
+		cache_ext_swap_release(&cg->swaps[i], cg->links[i]);
+		bpf_link__destroy(cg->links[i]);
+		cg->links[i] = NULL;
+		if (cg->fds[i] >= 0)
+			close(cg->fds[i]);
+		cg->fds[i] = -1;
+	}
+}
+
+#endif /* _CACHE_EXT_MEMCG_H */
@@ -32,66 +32,40 @@ char _license[] SEC("license") = "GPL";
 // Maps //
 //////////
 
-#define MAX_NR_FOLIOS 4000000
-#define MAX_NR_GHOST_ENTRIES 400000
 
 struct folio_metadata {
 	s64 accesses;
 	s64 gen;
 };
 
-struct {
-	__uint(type, BPF_MAP_TYPE_HASH);
-	__type(key, __u64);
-	__type(value, struct folio_metadata);
-	__uint(max_entries, MAX_NR_FOLIOS);
-} folio_metadata_map SEC(".maps");
+#include "cache_ext_folio_store.bpf.h"
+#include "cache_ext_ghost.bpf.h"
+#include "cache_ext_stats.bpf.h"
+#include "cache_ext_prof.bpf.h"
+#include "cache_ext_trace.bpf.h"
+#include "cache_ext_mrc.bpf.h"
 
 //////////////////
 // Ghost Enties //
 //////////////////
 
-struct {
-	__uint(type, BPF_MAP_TYPE_LRU_HASH);
-	__type(key, struct ghost_entry);
-	__type(value, u8);
-	__uint(max_entries, MAX_NR_GHOST_ENTRIES);
-	__uint(map_flags, BPF_F_NO_COMMON_LRU);  // Per-CPU LRU eviction logic
-} ghost_map SEC(".maps");
-
-struct ghost_entry {
-	u64 address_space;
-	u64 offset;
-};
+// Ghost entries are kept in the fingerprint queue from cache_ext_ghost.bpf.h
 
 static inline void insert_ghost_entry_for_folio(struct folio *folio, int tier) {
-	struct ghost_entry ghost_key = {
-		.address_space = (u64)folio->mapping->host,
-		.offset = folio->index,
-	};
-	u8 ghost_val = (u8) tier;
-	if (bpf_map_update_elem(&ghost_map, &ghost_key, &ghost_val, BPF_ANY))
-			bpf_printk("cache_ext: evicted: Failed to add to ghost_map\n");
+	ghost_insert(folio, (u8)tier);
 }
 
 /*
- * Check if a folio is in the ghost map and delete the ghost entry.
- * We only check if an element is in the ghost map on inserting into the cache.
- * Relies on bpf_map_delete_elem() returning -ENOENT if the element is not found.
+ * Check if a folio is in the ghost queue and consume the ghost entry.
+ * We only check if an element is in the ghost queue on inserting into the cache.
+ * Returns the tier the folio was evicted from, or -1 if not found.
  */
 static inline int folio_in_ghost(struct folio *folio) {
-	struct ghost_entry key = {
-		.address_space = (u64)folio->mapping->host,
-		.offset = folio->index,
-	};
-	u8 *tier;
-	tier = bpf_map_lookup_elem(&ghost_map, &key);
-	if (tier == NULL) {
-		return -1;
-	}
-	// TODO: handle non-ENOENT errors
-	bpf_map_delete_elem(&ghost_map, &key);
-	return (int)(*tier);
+	int tier = ghost_test_and_clear(folio);
+
+	if (tier >= 0)
+		cache_ext_stat_inc(CACHE_EXT_STAT_GHOST_HITS);
+	return tier;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////
@@ -110,18 +84,21 @@ static inline int folio_in_ghost(struct folio *folio) {
 #define NR_HIST_GENS 1
 #define MIN_LRU_BATCH 64
 
-// Global policy metadata
+/*
+ * Global policy metadata. There is no lock: max_seq/min_seq only move
+ * forward by cmpxchg, and the page counters that change on every fault are
+ * accumulated per-CPU (struct mglru_deltas) and folded in here once a
+ * CPU has batched up enough of them.
+ */
 struct mglru_global_metadata {
-	struct bpf_spin_lock lock;
 	unsigned long max_seq;
 	unsigned long min_seq;
-	s64 evicted[MAX_NR_TIERS];
-	s64 refaulted[MAX_NR_TIERS];
+	// Per-CPU tier totals at the last reset_ctrl_pos() clear
+	s64 evicted_base[MAX_NR_TIERS];
+	s64 refaulted_base[MAX_NR_TIERS];
 	s64 tier_selected[MAX_NR_TIERS];
 	s64 success_evicted;
 	s64 failed_evicted;
-	unsigned long avg_refaulted[MAX_NR_TIERS];
-	unsigned long avg_total[MAX_NR_TIERS];
 	unsigned long protected[MAX_NR_TIERS - 1];
 	long nr_pages[MAX_NR_GENS];
 };
@@ -133,6 +110,53 @@ struct {
 	__uint(max_entries, 1);
 } mglru_global_metadata_map SEC(".maps");
 
+/*
+ * Long-run refault averages per tier. Unlike the rest of the metadata they
+ * don't refer to the lists, so they are __model state and survive a
+ * restart with --state.
+ */
+static unsigned long avg_refaulted[MAX_NR_TIERS] __model;
+static unsigned long avg_total[MAX_NR_TIERS] __model;
+
+/*
+ * Evicted/refaulted tier counters are bumped on every eviction and refault,
+ * so they are kept per-CPU and only summed up by the eviction path
+ * (read_tier_stats()). They are never reset; lrugen->*_base records the sum
+ * at the last clear instead.
+ */
+struct mglru_tier_stats {
+	s64 evicted[MAX_NR_TIERS];
+	s64 refaulted[MAX_NR_TIERS];
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, u32);
+	__type(value, struct mglru_tier_stats);
+	__uint(max_entries, 1);
+} mglru_tier_stats_map SEC(".maps");
+
+/*
+ * Per-CPU deltas to lrugen->nr_pages and lrugen->protected. The owning CPU
+ * adds to its own slot and folds it into lrugen once it has moved
+ * MIN_LRU_BATCH pages, like the kernel's per-CPU vmstat thresholds. A fault
+ * mostly writes a cache line local to its CPU, and the counters lrugen
+ * sees lag by at most MIN_LRU_BATCH pages per CPU.
+ */
+struct mglru_deltas {
+	s64 nr_pages[MAX_NR_GENS];
+	s64 protected[MAX_NR_TIERS - 1];
+	// Pages moved since the last fold, regardless of sign
+	s64 pending;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, u32);
+	__type(value, struct mglru_deltas);
+	__uint(max_entries, 1);
+} mglru_deltas_map SEC(".maps");
+
 #define DEFINE_LRUGEN_void                                                     \
 	struct mglru_global_metadata *lrugen;                                  \
 	int key__ = 0;                                                         \
@@ -192,47 +216,123 @@ struct {
 		return -1;                                                     \
 	}
 
-inline void update_refaulted_stat(struct mglru_global_metadata *lrugen, int tier_idx,
-			   s64 delta)
+static inline struct mglru_tier_stats *get_tier_stats(void)
+{
+	u32 key = 0;
+	return bpf_map_lookup_elem(&mglru_tier_stats_map, &key);
+}
+
+inline void update_refaulted_stat(int tier_idx, s64 delta)
 {
 	assert_valid_tier_0(tier_idx);
-	__sync_fetch_and_add(&lrugen->refaulted[tier_idx], delta);
+	struct mglru_tier_stats *st = get_tier_stats();
+	if (st)
+		st->refaulted[tier_idx] += delta;
 }
 
-inline void update_evicted_stat(struct mglru_global_metadata *lrugen, int tier_idx,
-			 s64 delta)
+inline void update_evicted_stat(int tier_idx, s64 delta)
 {
 	assert_valid_tier_0(tier_idx);
-	__sync_fetch_and_add(&lrugen->evicted[tier_idx], delta);
+	struct mglru_tier_stats *st = get_tier_stats();
+	if (st)
+		st->evicted[tier_idx] += delta;
 }
 
-inline void update_nr_pages_stat(struct mglru_global_metadata *lrugen, unsigned int gen_idx,
-			  s64 delta)
+static inline struct mglru_deltas *get_deltas(void)
 {
-	assert_valid_gen_0(gen_idx);
-	__sync_fetch_and_add(&lrugen->nr_pages[gen_idx], delta);
+	u32 key = 0;
+	return bpf_map_lookup_elem(&mglru_deltas_map, &key);
 }
 
-inline void update_tier_selected_stat(struct mglru_global_metadata *lrugen, int tier_idx,
-			  s64 delta)
+// Move this CPU's deltas into lrugen.
+static void fold_deltas(struct mglru_deltas *d)
 {
-	assert_valid_tier_0(tier_idx);
-	__sync_fetch_and_add(&lrugen->tier_selected[tier_idx], delta);
+	struct mglru_global_metadata *lrugen;
+	int key = 0;
+
+	lrugen = bpf_map_lookup_elem(&mglru_global_metadata_map, &key);
+	if (!lrugen)
+		return;
+
+	__sync_lock_test_and_set(&d->pending, 0);
+	for (int gen = 0; gen < MAX_NR_GENS; gen++) {
+		s64 v = __sync_lock_test_and_set(&d->nr_pages[gen], 0);
+		if (v)
+			__sync_fetch_and_add(&lrugen->nr_pages[gen], v);
+	}
+	for (int tier = 0; tier < MAX_NR_TIERS - 1; tier++) {
+		s64 v = __sync_lock_test_and_set(&d->protected[tier], 0);
+		if (v)
+			__sync_fetch_and_add(&lrugen->protected[tier], v);
+	}
 }
 
+// Account a delta on this CPU, folding once enough pages have moved.
+static inline void add_delta(struct mglru_deltas *d, s64 *field, s64 delta)
+{
+	__sync_fetch_and_add(field, delta);
+	if (__sync_add_and_fetch(&d->pending, delta < 0 ? -delta : delta) >=
+	    MIN_LRU_BATCH)
+		fold_deltas(d);
+}
 
-inline s64 read_refaulted_stat(struct mglru_global_metadata *lrugen, int tier_idx)
+// Sum the per-CPU tier counters into *out, since the policy started.
+static void sum_tier_stats(struct mglru_tier_stats *out)
 {
-	assert_valid_tier_1(tier_idx);
-	return max(0, atomic_long_read(&lrugen->refaulted[tier_idx]));
+	u32 key = 0;
+	int cpu;
+
+	__builtin_memset(out, 0, sizeof(*out));
+
+	bpf_for(cpu, 0, MAX_CPUS) {
+		struct mglru_tier_stats *st =
+			bpf_map_lookup_percpu_elem(&mglru_tier_stats_map, &key, cpu);
+		if (!st)
+			break;
+
+		for (int tier = 0; tier < MAX_NR_TIERS; tier++) {
+			out->evicted[tier] += st->evicted[tier];
+			out->refaulted[tier] += st->refaulted[tier];
+		}
+	}
 }
 
-inline s64 read_evicted_stat(struct mglru_global_metadata *lrugen, int tier_idx)
+// Make totals in *out relative to the last clear.
+static void rebase_tier_stats(struct mglru_global_metadata *lrugen,
+			      struct mglru_tier_stats *out)
 {
-	assert_valid_tier_1(tier_idx);
-	return max(0, atomic_long_read(&lrugen->evicted[tier_idx]));
+	for (int tier = 0; tier < MAX_NR_TIERS; tier++) {
+		out->evicted[tier] = max(0, out->evicted[tier] -
+					    READ_ONCE(lrugen->evicted_base[tier]));
+		out->refaulted[tier] = max(0, out->refaulted[tier] -
+					      READ_ONCE(lrugen->refaulted_base[tier]));
+	}
+}
+
+// Sum the per-CPU tier counters into *out, relative to the last clear.
+static void read_tier_stats(struct mglru_global_metadata *lrugen,
+			    struct mglru_tier_stats *out)
+{
+	sum_tier_stats(out);
+	rebase_tier_stats(lrugen, out);
+}
+
+inline void update_nr_pages_stat(unsigned int gen_idx, s64 delta)
+{
+	assert_valid_gen_0(gen_idx);
+	struct mglru_deltas *d = get_deltas();
+	if (d)
+		add_delta(d, &d->nr_pages[gen_idx], delta);
+}
+
+inline void update_tier_selected_stat(struct mglru_global_metadata *lrugen, int tier_idx,
+			  s64 delta)
+{
+	assert_valid_tier_0(tier_idx);
+	__sync_fetch_and_add(&lrugen->tier_selected[tier_idx], delta);
 }
 
+
 inline s64 read_nr_pages_stat(struct mglru_global_metadata *lrugen, unsigned int gen_idx)
 {
 	assert_valid_gen_1(gen_idx);
@@ -241,10 +341,13 @@ inline s64 read_nr_pages_stat(struct mglru_global_metadata *lrugen, unsigned int
 
 // Invoke when promoting a folio in the eviction iteration
 // See: https://github.com/cache-ext/linux-cachestream/blob/c22ffcac6b53ef4054483070fb902895ef10fd12/mm/vmscan.c#L4941-L4952
-inline void update_protected_stat(struct mglru_global_metadata *lrugen, int tier_idx,
-			   s64 delta)
+inline void update_protected_stat(int tier_idx, s64 delta)
 {
-	__sync_fetch_and_add(&lrugen->protected[tier_idx - 1], delta);
+	if (tier_idx < 1 || tier_idx >= MAX_NR_TIERS)
+		return;
+	struct mglru_deltas *d = get_deltas();
+	if (d)
+		add_delta(d, &d->protected[tier_idx - 1], delta);
 }
 
 // Gen lists
@@ -281,21 +384,31 @@ static __u64 mglru_lists[MAX_NR_GENS];
 	int gain;
 };
 
-static inline void read_ctrl_pos(struct mglru_global_metadata *lrugen, int tier,
-			  int gain, struct ctrl_pos___x *pos)
+static inline void read_ctrl_pos(struct mglru_global_metadata *lrugen,
+				 struct mglru_tier_stats *tiers, int tier,
+				 int gain, struct ctrl_pos___x *pos)
 {
-	pos->refaulted = lrugen->avg_refaulted[tier] +
-			 __sync_fetch_and_add(&lrugen->refaulted[tier], 0);
-	pos->total = lrugen->avg_total[tier] +
-		     __sync_fetch_and_add(&lrugen->evicted[tier], 0);
+	pos->refaulted = avg_refaulted[tier] + tiers->refaulted[tier];
+	pos->total = avg_total[tier] + tiers->evicted[tier];
 	if (tier)
 		pos->total += lrugen->protected[tier - 1];
 	pos->gain = gain;
 }
 
-// Needs the LRU lock. Why???
-static inline void reset_ctrl_pos(struct mglru_global_metadata *lrugen, bool carryover)
+/*
+ * Only the CPU whose cmpxchg advanced min_seq/max_seq runs this, so there
+ * is one reset per sequence step.
+ *
+ * The caller's tiers snapshot was taken before the cmpxchg, and another
+ * CPU's reset may have moved the bases since. So take a fresh one here, and
+ * clear by setting the bases to the totals it was computed from instead of
+ * adding a delta to them: a stale or repeated clear can't count anything
+ * twice. tiers is left matching the new bases for get_tier_idx().
+ */
+static inline void reset_ctrl_pos(struct mglru_global_metadata *lrugen,
+				  struct mglru_tier_stats *tiers, bool carryover)
 {
+	struct mglru_tier_stats totals;
 	int tier;
 	bool clear = carryover ? NR_HIST_GENS == 1 : NR_HIST_GENS > 1;
 
@@ -304,24 +417,28 @@ static inline void reset_ctrl_pos(struct mglru_global_metadata *lrugen, bool car
 	if (!carryover && !clear)
 		return;
 
+	sum_tier_stats(&totals);
+	*tiers = totals;
+	rebase_tier_stats(lrugen, tiers);
+
 	for (tier = 0; tier < MAX_NR_TIERS; tier++) {
 		if (carryover) {
 			unsigned long sum;
 
-			sum = lrugen->avg_refaulted[tier] +
-			      atomic_long_read(&lrugen->refaulted[tier]);
-			WRITE_ONCE(lrugen->avg_refaulted[tier], sum / 2);
+			sum = avg_refaulted[tier] + tiers->refaulted[tier];
+			WRITE_ONCE(avg_refaulted[tier], sum / 2);
 
-			sum = lrugen->avg_total[tier] +
-			      atomic_long_read(&lrugen->evicted[tier]);
+			sum = avg_total[tier] + tiers->evicted[tier];
 			if (tier)
 				sum += lrugen->protected[tier - 1];
-			WRITE_ONCE(lrugen->avg_total[tier], sum / 2);
+			WRITE_ONCE(avg_total[tier], sum / 2);
 		}
 
 		if (clear) {
-			atomic_long_zero(&lrugen->refaulted[tier]);
-			atomic_long_zero(&lrugen->evicted[tier]);
+			WRITE_ONCE(lrugen->refaulted_base[tier], totals.refaulted[tier]);
+			WRITE_ONCE(lrugen->evicted_base[tier], totals.evicted[tier]);
+			tiers->refaulted[tier] = 0;
+			tiers->evicted[tier] = 0;
 			if (tier)
 				WRITE_ONCE(lrugen->protected[tier - 1], 0);
 		}
@@ -343,7 +460,8 @@ static inline bool positive_ctrl_err(struct ctrl_pos___x *sp, struct ctrl_pos___
 // Utils that use the PID controller //
 ///////////////////////////////////////
 
-static inline int get_tier_idx(struct mglru_global_metadata *lrugen)
+static inline int get_tier_idx(struct mglru_global_metadata *lrugen,
+			       struct mglru_tier_stats *tiers)
 {
 	int tier;
 	struct ctrl_pos___x sp, pv;
@@ -353,9 +471,9 @@ static inline int get_tier_idx(struct mglru_global_metadata *lrugen)
 	 * This value is chosen because any other tier would have at least twice
 	 * as many refaults as the firsfirst tier.
 	 */
-	read_ctrl_pos(lrugen, 0, 1, &sp);
+	read_ctrl_pos(lrugen, tiers, 0, 1, &sp);
 	for (tier = 1; tier < MAX_NR_TIERS; tier++) {
-		read_ctrl_pos(lrugen, tier, 2, &pv);
+		read_ctrl_pos(lrugen, tiers, tier, 2, &pv);
 		if (!positive_ctrl_err(&sp, &pv))
 			break;
 	}
@@ -373,9 +491,8 @@ static inline int get_tier_idx(struct mglru_global_metadata *lrugen)
 static inline void folio_inc_refs(struct folio *folio)
 {
 	struct folio_metadata *metadata;
-	__u64 key = (__u64)folio;
 
-	metadata = bpf_map_lookup_elem(&folio_metadata_map, &key);
+	metadata = folio_store_lookup(folio);
 	if (!metadata) {
 		bpf_printk(
 			"cache_ext: Tried to inc refs but folio not found in map.\n");
@@ -387,9 +504,8 @@ static inline void folio_inc_refs(struct folio *folio)
 static inline int folio_lru_refs(struct folio *folio)
 {
 	struct folio_metadata *metadata;
-	__u64 key = (__u64)folio;
 
-	metadata = bpf_map_lookup_elem(&folio_metadata_map, &key);
+	metadata = folio_store_lookup(folio);
 	if (!metadata)
 		return -1;
 
@@ -492,20 +608,17 @@ static inline bool lru_gen_add_folio(struct folio *folio)
 
 	// Update policy metadata
 	struct folio_metadata metadata = { .accesses = 1, .gen = gen };
-	__u64 key = (__u64)folio;
-	int ret = bpf_map_update_elem(&folio_metadata_map, &key, &metadata,
-				      BPF_ANY);
-	if (ret != 0) {
+	if (!folio_store_insert(folio, &metadata)) {
 		bpf_printk("cache_ext: Failed to save folio metadata\n");
 		return false;
 	}
-	update_nr_pages_stat(lrugen, gen, folio_nr_pages(folio));
+	update_nr_pages_stat(gen, folio_nr_pages(folio));
 
 	// Update refaulted stats
-	ret = folio_in_ghost(folio);
+	int ret = folio_in_ghost(folio);
 	if (ret >= 0) {
 		int tier = ret;
-		update_refaulted_stat(lrugen, tier, 1);
+		update_refaulted_stat(tier, folio_nr_pages(folio));
 	}
 
 	// lru_gen_update_size(lruvec, folio, -1, gen);
@@ -574,64 +687,39 @@ static inline bool should_run_aging(struct mglru_global_metadata *lrugen,
 	return false;
 }
 
-static inline bool try_to_inc_min_seq(struct mglru_global_metadata *lrugen)
+/*
+ * Sequence numbers only advance by cmpxchg from the value the caller based
+ * its decision on. If another CPU got there first the generation already
+ * moved, which is what we wanted, so losing the race counts as success.
+ */
+static inline bool try_to_inc_min_seq(struct mglru_global_metadata *lrugen,
+				      struct mglru_tier_stats *tiers)
 {
-	// TODO: Check if the min_seq list is empty and if it is, increase min_seq.
 	DEFINE_MIN_SEQ(lrugen);
 	if (!gen_almost_empty(lrugen, min_seq)) {
 		return false;
 	}
-	WRITE_ONCE(lrugen->min_seq, lrugen->min_seq + 1);
-	reset_ctrl_pos(lrugen, true);
+	if (__sync_val_compare_and_swap(&lrugen->min_seq, min_seq, min_seq + 1) == min_seq)
+		reset_ctrl_pos(lrugen, tiers, true);
 	return true;
 }
 
-static inline bool try_to_inc_max_seq(struct mglru_global_metadata *lrugen)
+static inline bool try_to_inc_max_seq(struct mglru_global_metadata *lrugen,
+				      struct mglru_tier_stats *tiers,
+				      unsigned long max_seq)
 {
-	// int prev, next;
-	// spin_lock_irq(&lruvec->lru_lock);
-
-	if (get_nr_gens(lrugen) == MAX_NR_GENS) {
+	if (max_seq - READ_ONCE(lrugen->min_seq) + 1 >= MAX_NR_GENS) {
 		// Try to increase min_seq
-		int ret = try_to_inc_min_seq(lrugen);
+		int ret = try_to_inc_min_seq(lrugen, tiers);
 		if (!ret) {
 			return false;
 		}
 	}
-	// spin_unlock_irq(&lruvec->lru_lock);
-
-	// TODO: Do we need this?
-	/*
-	 * Update the active/inactive LRU sizes for compatibility. Both sides of
-	 * the current max_seq need to be covered, since max_seq+1 can overlap
-	 * with min_seq[LRU_GEN_ANON] if swapping is constrained. And if they do
-	 * overlap, cold/hot inversion happens.
-	 */
-	// prev = lru_gen_from_seq(lrugen->max_seq - 1);
-	// next = lru_gen_from_seq(lrugen->max_seq + 1);
-
-	// for (type = 0; type < ANON_AND_FILE; type++) {
-	// 	for (zone = 0; zone < MAX_NR_ZONES; zone++) {
-	// 		enum lru_list lru = type * LRU_INACTIVE_FILE;
-	// 		long delta = lrugen->nr_pages[prev] -
-	// 			     lrugen->nr_pages[next];
-
-	// 		if (!delta)
-	// 			continue;
-
-	// 		__update_lru_size(lruvec, lru, zone, delta);
-	// 		__update_lru_size(lruvec, lru + LRU_ACTIVE, zone, -delta);
-	// 	}
-	// }
-
-	reset_ctrl_pos(lrugen, false);
 
 	// We don't use the timestamp metadata for our MGLRU
-	/* make sure preceding modifications appear */
-	WRITE_ONCE(lrugen->max_seq, lrugen->max_seq + 1);
+	if (__sync_val_compare_and_swap(&lrugen->max_seq, max_seq, max_seq + 1) == max_seq)
+		reset_ctrl_pos(lrugen, tiers, false);
 	return true;
-
-	// spin_unlock_irq(&lruvec->lru_lock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -705,6 +793,8 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(mglru_init, struct mem_cgroup *memcg)
 		}
 		mglru_lists[i] = list_ptr;
 	}
+	if (mrc_init(memcg))
+		bpf_printk("cache_ext: init: Failed to create MRC state\n");
 	return 0;
 }
 
@@ -719,6 +809,8 @@ static int mglru_iter_fn(int idx, struct cache_ext_list_node *a)
 	// - Promoted folios (these only appear through PTE accesses,
 	//                    fd-accessed folios are promoted based on their tier)
 
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+
 	struct mglru_global_metadata *lrugen;
 	int key__ = 0;
 	lrugen = bpf_map_lookup_elem(&mglru_global_metadata_map, &key__);
@@ -736,9 +828,7 @@ static int mglru_iter_fn(int idx, struct cache_ext_list_node *a)
 	eviction_meta->iter_reached = idx;
 
 	// Get folio metadata
-	__u64 key = (__u64)a->folio;
-	struct folio_metadata *meta =
-		bpf_map_lookup_elem(&folio_metadata_map, &key);
+	struct folio_metadata *meta = folio_store_lookup(a->folio);
 	if (!meta) {
 		bpf_printk("cache_ext: iter_fn: Failed to get metadata\n");
 		// TODO: Maybe we should evict it instead?
@@ -754,12 +844,11 @@ static int mglru_iter_fn(int idx, struct cache_ext_list_node *a)
 
 	/* protected */
 	if (tier > tier_threshold) {
-		update_protected_stat(lrugen, tier, folio_nr_pages(a->folio));
+		update_protected_stat(tier, folio_nr_pages(a->folio));
 		// promote to next gen
-		// TODO: Update nr_pages stats
 		int num_pages = folio_nr_pages(a->folio);
-		update_nr_pages_stat(lrugen, eviction_meta->curr_gen, -num_pages);
-		update_nr_pages_stat(lrugen, eviction_meta->next_gen, num_pages);
+		update_nr_pages_stat(eviction_meta->curr_gen, -num_pages);
+		update_nr_pages_stat(eviction_meta->next_gen, num_pages);
 		atomic_long_store(&meta->gen, eviction_meta->next_gen);
 		return CACHE_EXT_CONTINUE_ITER;
 	}
@@ -769,8 +858,8 @@ static int mglru_iter_fn(int idx, struct cache_ext_list_node *a)
 	    folio_test_dirty(a->folio)) {
 		// promote to next gen
 		int num_pages = folio_nr_pages(a->folio);
-		update_nr_pages_stat(lrugen, eviction_meta->curr_gen, -num_pages);
-		update_nr_pages_stat(lrugen, eviction_meta->next_gen, num_pages);
+		update_nr_pages_stat(eviction_meta->curr_gen, -num_pages);
+		update_nr_pages_stat(eviction_meta->next_gen, num_pages);
 		atomic_long_store(&meta->gen, eviction_meta->next_gen);
 		return CACHE_EXT_CONTINUE_ITER;
 	}
@@ -780,32 +869,28 @@ static int mglru_iter_fn(int idx, struct cache_ext_list_node *a)
 void BPF_STRUCT_OPS(mglru_evict_folios, struct cache_ext_eviction_ctx *eviction_ctx,
 		    struct mem_cgroup *memcg)
 {
+	PROF_EVICT_SCOPE(eviction_ctx);
+	EVICTION_TARGET_SCOPE(eviction_ctx);
 	DEFINE_LRUGEN_void;
 
-	bool inc_max_seq_failed = false;
-	bpf_spin_lock(&lrugen->lock);
+	struct mglru_tier_stats tiers;
+	read_tier_stats(lrugen, &tiers);
+
 	DEFINE_MIN_SEQ(lrugen);
 	DEFINE_MAX_SEQ(lrugen);
 	if (should_run_aging(lrugen, max_seq)) {
-		if (!try_to_inc_max_seq(lrugen)){
-			// Workaround: Not allowed to call bpf_printk under spinlock
-			inc_max_seq_failed = true;
-		}
+		if (!try_to_inc_max_seq(lrugen, &tiers, max_seq))
+			bpf_printk("cache_ext: Failed to increment max_seq\n");
 	}
 	if (max_seq - min_seq > MIN_NR_GENS)
-		try_to_inc_min_seq(lrugen);
+		try_to_inc_min_seq(lrugen, &tiers);
 	// Read min/max seq again
 	min_seq = READ_ONCE(lrugen->min_seq);
 	max_seq = READ_ONCE(lrugen->max_seq);
 	int oldest_gen = lru_gen_from_seq(min_seq);
 	volatile unsigned int next_gen = (oldest_gen + 1) % MAX_NR_GENS;
-	bpf_spin_unlock(&lrugen->lock);
-
-	if (inc_max_seq_failed) {
-		bpf_printk("cache_ext: Failed to increment max_seq\n");
-	}
 
-	int tier_threshold = get_tier_idx(lrugen);
+	int tier_threshold = get_tier_idx(lrugen, &tiers);
 	update_tier_selected_stat(lrugen, tier_threshold, 1);
 
 	// Save eviction metadata for stats
@@ -836,7 +921,7 @@ void BPF_STRUCT_OPS(mglru_evict_folios, struct cache_ext_eviction_ctx *eviction_
 	}
 	struct eviction_metadata *eviction_meta = get_eviction_metadata();
 	if (eviction_meta == NULL) return;
-	if (eviction_ctx->nr_folios_to_evict < eviction_ctx->request_nr_folios_to_evict) {
+	if (!eviction_ctx_done(eviction_ctx)) {
 		min_seq = READ_ONCE(lrugen->min_seq);
 		oldest_gen = lru_gen_from_seq(min_seq);
 		next_gen = (oldest_gen + 1) % MAX_NR_GENS;
@@ -855,11 +940,12 @@ void BPF_STRUCT_OPS(mglru_evict_folios, struct cache_ext_eviction_ctx *eviction_
 			return;
 		}
 	}
-	s64 success_evicted = eviction_ctx->nr_folios_to_evict;
-	s64 failed_evicted = max(0, eviction_ctx->request_nr_folios_to_evict - eviction_ctx->nr_folios_to_evict);
+	// In pages, like the request
+	s64 success_evicted = eviction_ctx_pages(eviction_ctx);
+	s64 failed_evicted = max(0, (s64)eviction_ctx->request_nr_folios_to_evict - success_evicted);
 	__sync_fetch_and_add(&lrugen->failed_evicted, failed_evicted);
 	__sync_fetch_and_add(&lrugen->success_evicted, success_evicted);
-	if (eviction_ctx->nr_folios_to_evict < eviction_ctx->request_nr_folios_to_evict) {
+	if (!eviction_ctx_done(eviction_ctx)) {
 		bpf_printk("cache_ext: Failed to evict requested number of folios: %d/%d. Used list idx %d, list ptr: %p. Iter reached: %d\n",
 				eviction_ctx->nr_folios_to_evict,
 				eviction_ctx->request_nr_folios_to_evict,
@@ -871,31 +957,39 @@ void BPF_STRUCT_OPS(mglru_evict_folios, struct cache_ext_eviction_ctx *eviction_
 
 void BPF_STRUCT_OPS(mglru_folio_added, struct folio *folio)
 {
+	PROF_SCOPE(PROF_FOLIO_ADDED);
+	cache_ext_trace(CACHE_EXT_TRACE_ADD, folio);
 	if (!is_folio_relevant(folio)) {
 		return;
 	}
 	lru_gen_add_folio(folio);
+	cache_ext_stat_inc(CACHE_EXT_STAT_MISSES);
+	mrc_access(folio);
 }
 
 void BPF_STRUCT_OPS(mglru_folio_accessed, struct folio *folio)
 {
+	PROF_SCOPE(PROF_FOLIO_ACCESSED);
+	cache_ext_trace(CACHE_EXT_TRACE_ACCESS, folio);
 	if (!is_folio_relevant(folio)) {
 		return;
 	}
 	folio_inc_refs(folio);
+	cache_ext_stat_inc(CACHE_EXT_STAT_HITS);
+	mrc_access(folio);
 }
 
 void BPF_STRUCT_OPS(mglru_folio_evicted, struct folio *folio)
 {
+	PROF_SCOPE(PROF_FOLIO_EVICTED);
+	cache_ext_trace(CACHE_EXT_TRACE_EVICT, folio);
 	if (!is_folio_relevant(folio)) {
 		return;
 	}
-	DEFINE_LRUGEN_void;
 	// Remove tracked metadata
 	struct folio_metadata *metadata;
-	__u64 key = (__u64)folio;
 
-	metadata = bpf_map_lookup_elem(&folio_metadata_map, &key);
+	metadata = folio_store_lookup(folio);
 	if (!metadata) {
 		bpf_printk(
 			"cache_ext: Tried to delete folio metadata but not found in map.\n");
@@ -906,10 +1000,12 @@ void BPF_STRUCT_OPS(mglru_folio_evicted, struct folio *folio)
 	insert_ghost_entry_for_folio(folio, tier);
 
 	// Update generation page count
-	update_evicted_stat(lrugen, tier, 1);
-	update_nr_pages_stat(lrugen, metadata->gen, -folio_nr_pages(folio));
+	update_evicted_stat(tier, folio_nr_pages(folio));
+	cache_ext_stat_inc(CACHE_EXT_STAT_EVICTIONS);
+
+	update_nr_pages_stat(metadata->gen, -folio_nr_pages(folio));
 
-	bpf_map_delete_elem(&folio_metadata_map, &key);
+	folio_store_delete(folio);
 }
 
 SEC(".struct_ops.link")
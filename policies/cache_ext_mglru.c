@@ -9,6 +9,10 @@
 
 #include "cache_ext_mglru.skel.h"
 #include "dir_watcher.h"
+#include "cache_ext_stats.h"
+#include "cache_ext_folio_store.h"
+#include "cache_ext_ghost.h"
+#include "cache_ext_mrc.h"
 
 char *USAGE = "Usage: ./cache_ext_mglru --watch_dir <dir> --cgroup_path <path>\n";
 struct cmdline_args {
@@ -22,6 +26,13 @@ static struct argp_option options[] = { { "watch_dir", 'w', "DIR", 0,
 					  "Path to cgroup (e.g., /sys/fs/cgroup/cache_ext_test)" },
 					{ 0 } };
 
+// Tier refault averages in .data.model and the ghost history
+static const struct cache_ext_state_map mglru_state[] = {
+	{ CACHE_EXT_STATE_MODEL },
+	{ "ghost_map" },
+	{ 0 },
+};
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state)
 {
 	struct cmdline_args *args = state->input;
@@ -43,12 +54,17 @@ int main(int argc, char **argv)
 	int ret = 1;
 	struct cache_ext_mglru_bpf *skel = NULL;
 	struct bpf_link *link = NULL;
+	struct cache_ext_swap swap = { 0 };
+	struct cache_ext_state state = { 0 };
+	struct cache_ext_exporter exporter = { 0 };
+	struct cache_ext_profiler prof = { 0 };
+	struct cache_ext_recorder rec = { 0 };
 	int cgroup_fd = -1;
 	libbpf_set_strict_mode(LIBBPF_STRICT_ALL);
 
 	// Parse command line arguments
 	struct cmdline_args args = { 0 };
-	struct argp argp = { options, parse_opt, 0, 0 };
+	struct argp argp = { options, parse_opt, 0, 0, cache_ext_mrc_argp_children };
 	argp_parse(&argp, argc, argv, 0, 0, &args);
 
 	// Validate arguments
@@ -76,12 +92,6 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	// TODO: Enable longer length
-	if (strlen(watch_dir_full_path) > 128) {
-		fprintf(stderr, "watch_dir path too long\n");
-		return 1;
-	}
-
 	// Open cgroup directory early
 	cgroup_fd = open(args.cgroup_path, O_RDONLY);
 	if (cgroup_fd < 0) {
@@ -97,8 +107,49 @@ int main(int argc, char **argv)
 	}
 
 	// Set watch_dir
-	skel->rodata->watch_dir_path_len = strlen(watch_dir_full_path);
-	strcpy(skel->rodata->watch_dir_path, watch_dir_full_path);
+	ret = set_watch_dir_root(args.watch_dir, &watch_dir_ino_map(skel), &watch_dir_dev_map(skel));
+	if (ret)
+		goto cleanup;
+
+	// Size folio metadata store from the cgroup limit
+	ret = folio_store_resize(folio_store_map(skel), &folio_store_mask(skel),
+				 args.cgroup_path);
+	if (ret)
+		goto cleanup;
+
+	// Ghost queue remembers about one cgroup size worth of evictions
+	ret = ghost_resize(ghost_map(skel), &ghost_bucket_mask(skel), &ghost_epoch_shift(skel),
+			   args.cgroup_path, 100);
+	if (ret)
+		goto cleanup;
+
+	// Size inode_watchlist for the watch dir
+	ret = resize_watch_dir_map(inode_watchlist_map(skel), args.watch_dir, false);
+	if (ret)
+		goto cleanup;
+
+	// Hook profiling, if enabled
+	cache_ext_prof_setup(skel);
+
+	// Page access recording, if enabled
+	ret = cache_ext_recorder_setup(skel);
+	if (ret)
+		goto cleanup;
+
+	// One stats slot per CPU
+	ret = cache_ext_stats_resize(cache_ext_stats_map(skel));
+	if (ret)
+		goto cleanup;
+
+	// Miss ratio curve and working set estimates, if enabled
+	ret = cache_ext_mrc_setup(skel, read_cgroup_memory_max(args.cgroup_path));
+	if (ret)
+		goto cleanup;
+
+	// Resume from the state saved by --state, if there is one
+	ret = cache_ext_state_restore(&state, skel->obj, "mglru", mglru_state);
+	if (ret)
+		goto cleanup;
 
 	// Load programs
 	ret = cache_ext_mglru_bpf__load(skel);
@@ -111,13 +162,32 @@ int main(int argc, char **argv)
 	ret = initialize_watch_dir_map(args.watch_dir,
 				       bpf_map__fd(skel->maps.inode_watchlist), false);
 
+	ret = cache_ext_state_apply(&state);
+	if (ret)
+		goto cleanup;
+
 	// Attach cache_ext_ops to the specific cgroup
-	link = bpf_map__attach_cache_ext_ops(skel->maps.mglru_ops, cgroup_fd);
+	link = cache_ext_swap_attach(&swap, skel->obj, skel->maps.mglru_ops, cgroup_fd);
 	if (link == NULL) {
 		perror("Failed to attach cache_ext_ops to cgroup");
 		goto cleanup;
 	}
 
+	// Map the stats region and start the exporter, if enabled
+	ret = cache_ext_exporter_start(&exporter, cache_ext_stats_map(skel), "mglru");
+	if (ret)
+		goto cleanup;
+
+	// Dump hook profiles on SIGUSR1 and at exit, if enabled
+	ret = cache_ext_prof_start(&prof, cache_ext_prof_map(skel), "mglru");
+	if (ret)
+		goto cleanup;
+
+	// Stream page accesses to the --record file, if enabled
+	ret = cache_ext_recorder_start(&rec, cache_ext_trace_ring(skel));
+	if (ret)
+		goto cleanup;
+
 	// Attach probes
 	ret = cache_ext_mglru_bpf__attach(skel);
 	if (ret) {
@@ -125,6 +195,9 @@ int main(int argc, char **argv)
 		goto cleanup;
 	}
 
+	// Tell whoever started us that the policy is live
+	cache_ext_ready();
+
 	// Wait for keyboard input
 	printf("Press any key to exit...\n");
 	getchar();
@@ -132,7 +205,13 @@ int main(int argc, char **argv)
 
 cleanup:
 	close(cgroup_fd);
+	cache_ext_recorder_stop(&rec);
+	cache_ext_prof_stop(&prof);
+	cache_ext_exporter_stop(&exporter);
+	cache_ext_swap_release(&swap, link);
 	bpf_link__destroy(link);
+	cache_ext_state_save(&state);
+	cache_ext_state_free(&state);
 	cache_ext_mglru_bpf__destroy(skel);
 	return ret;
 }
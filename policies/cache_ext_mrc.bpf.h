@@ -0,0 +1,309 @@
+#ifndef _CACHE_EXT_MRC_BPF_H
+#define _CACHE_EXT_MRC_BPF_H 1
+
+#include "cache_ext_lib.bpf.h"
+
+/*
+ * Online miss ratio curve (MRC) and working set estimates, per cgroup.
+ *
+ * Reuse distances are measured on a spatially hashed sample of the pages
+ * (SHARDS, Waldspurger et al.): a page is sampled if 1 << mrc_rate_shift
+ * divides its folio_key_hash(), so every access to it is, and distances
+ * between sampled pages scale back up by the same factor. Sampled references
+ * are counted into epochs of mrc_epoch_refs. mrc_last_ref remembers the
+ * epoch each sampled page was last referenced in, and epoch_pages[] how many
+ * sampled pages were last referenced in each of the last MRC_NR_EPOCHS
+ * epochs. The reuse distance of a reference, the number of distinct pages
+ * referenced since the page's previous reference, is then the sum of
+ * epoch_pages[] since that epoch, exact up to half an epoch. Reuses older
+ * than the MRC_NR_EPOCHS epochs horizon count as cold misses, like first
+ * references. Distances go into log-scale buckets, four per power of two, so
+ * the miss ratio at a cache size is (cold + reuses at larger distances) /
+ * refs, see cache_ext_mrc.h.
+ *
+ * The distinct pages referenced over the last MRC_NR_EPOCHS / 2 epochs, the
+ * working set, come from a HyperLogLog of the sampled references. Two
+ * sketches take turns, each cleared when it starts a new half horizon; the
+ * estimate is the one that covers the last complete half. The histogram is
+ * halved at the same time, so the curve follows the recent workload.
+ *
+ * Opt-in with mrc_enabled (--mrc). Policies call mrc_init(memcg) from init
+ * and mrc_access(folio) from folio_added and folio_accessed. A cgroup's state
+ * is dropped when its memcg is freed, so a new memcg at the same address
+ * doesn't inherit it; its mrc_last_ref entries age out of the LRU.
+ * mrc_working_set_pages() gives the estimate to the policy itself.
+ */
+
+#define MRC_NR_EPOCHS		64	// Must be power of two
+#define MRC_NR_BUCKETS		72	// Distances below 2^19 sampled pages, the last one takes the rest
+#define MRC_HLL_BITS		8
+#define MRC_HLL_REGS		(1 << MRC_HLL_BITS)
+#define MRC_DEFAULT_SAMPLES	(1 << 16)
+#define MRC_MAX_CGROUPS		64
+
+// Set from userspace
+const volatile bool mrc_enabled = false;
+const volatile u32 mrc_rate_shift = 0;
+const volatile u64 mrc_epoch_refs = 1024;
+
+struct mrc_state {
+	u64 cgroup_id;		// Same as the cgroup directory's inode number
+	u64 clock;		// Sampled references, never aged
+	u64 epoch;
+	u64 refs;		// Sampled references, aged with hist
+	u64 cold;		// ... that were first references or beyond the horizon
+	u64 hist[MRC_NR_BUCKETS];	// ... that were reuses, by distance
+	u64 epoch_pages[MRC_NR_EPOCHS];
+	u64 hll_sum[2];		// Sum of 2^(32 - register) over each HLL
+	u32 hll_zeros[2];	// Registers still 0
+	u32 hll_cur;		// HLL taking this half horizon's references
+	u32 hll_halves;		// Half horizons completed
+	u32 hll[2][MRC_HLL_REGS];	// u32 for cmpxchg
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, u64);
+	__type(value, struct mrc_state);
+	__uint(max_entries, MRC_MAX_CGROUPS);
+} mrc_states SEC(".maps");
+
+struct mrc_page_key {
+	u64 memcg;
+	u64 hash;
+};
+
+// Sampled page -> epoch of its last reference
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__type(key, struct mrc_page_key);
+	__type(value, u64);
+	__uint(max_entries, MRC_DEFAULT_SAMPLES);
+} mrc_last_ref SEC(".maps");
+
+// floor(log2(v)), 0 for v = 0
+static __always_inline u32 mrc_log2(u64 v)
+{
+	u32 r = 0;
+
+	if (v >> 32) { v >>= 32; r += 32; }
+	if (v >> 16) { v >>= 16; r += 16; }
+	if (v >> 8) { v >>= 8; r += 8; }
+	if (v >> 4) { v >>= 4; r += 4; }
+	if (v >> 2) { v >>= 2; r += 2; }
+	if (v >> 1) r += 1;
+	return r;
+}
+
+// log2(x / 2^16) in 1/256ths, for x >= 2^16
+static __always_inline u64 mrc_log2_fp(u64 x)
+{
+	u32 ip = mrc_log2(x) - 16;
+	u64 y = x >> ip;	// In [2^16, 2^17)
+	u64 r = (u64)ip << 8;
+
+	// One fractional bit per squaring
+	for (int i = 0; i < 8; i++) {
+		y = (y * y) >> 16;
+		if (y >= (2 << 16)) {
+			y >>= 1;
+			r |= 1 << (7 - i);
+		}
+	}
+	return r;
+}
+
+// Bucket of a distance in sampled pages: 0-3 as is, then four per power of two
+static __always_inline u32 mrc_bucket(u64 d)
+{
+	u32 b, idx;
+
+	if (d < 4)
+		return d;
+	b = mrc_log2(d);
+	idx = 4 * (b - 1) + ((d >> (b - 2)) & 3);
+	return idx < MRC_NR_BUCKETS ? idx : MRC_NR_BUCKETS - 1;
+}
+
+/*
+ * Distinct sampled pages counted by HLL i. The raw estimate is
+ * alpha * m^2 / sum(2^-register), with alpha ~ 735 / 1024 for 256
+ * registers. Small counts use linear counting, m * ln(m / zeros).
+ */
+static inline u64 mrc_hll_estimate(struct mrc_state *st, u32 i)
+{
+	u64 sum = READ_ONCE(st->hll_sum[i & 1]);
+	u32 zeros = READ_ONCE(st->hll_zeros[i & 1]);
+	u64 est;
+
+	if (sum == 0)
+		return 0;
+	est = (735ULL << (2 * MRC_HLL_BITS + 22)) / sum;
+	if (est <= 5 * MRC_HLL_REGS / 2 && zeros > 0) {
+		// ln(x) = log2(x) * ln(2), ln(2) ~ 710 / 1024
+		u64 lg = mrc_log2_fp(((u64)MRC_HLL_REGS << 16) / zeros);
+
+		est = MRC_HLL_REGS * lg * 710 / (256 * 1024);
+	}
+	return est;
+}
+
+static inline void mrc_hll_clear(struct mrc_state *st, u32 i)
+{
+	u32 j;
+
+	bpf_for(j, 0, MRC_HLL_REGS)
+		st->hll[i & 1][j] = 0;
+	st->hll_sum[i & 1] = (u64)MRC_HLL_REGS << 32;
+	st->hll_zeros[i & 1] = MRC_HLL_REGS;
+}
+
+/*
+ * Register index from the low bits of the hash, rank from bits 8-31. The
+ * sampling bits start at 32, so they don't bias the ranks.
+ */
+static inline void mrc_hll_add(struct mrc_state *st, u64 hash)
+{
+	u32 i = READ_ONCE(st->hll_cur) & 1;
+	u32 idx = hash & (MRC_HLL_REGS - 1);
+	u64 w = (hash >> MRC_HLL_BITS) & 0xffffff;
+	u32 rank = w ? mrc_log2(w & -w) + 1 : 25;
+	u32 *reg = &st->hll[i][idx];
+	u32 old = READ_ONCE(*reg);
+
+	if (rank <= old || __sync_val_compare_and_swap(reg, old, rank) != old)
+		return;
+	__sync_fetch_and_add(&st->hll_sum[i], (1ULL << (32 - rank)) - (1ULL << (32 - old)));
+	if (old == 0)
+		__sync_fetch_and_sub(&st->hll_zeros[i], 1);
+}
+
+/*
+ * Start a new epoch. Pages last referenced in the epoch that falls off the
+ * horizon are forgotten. Every half horizon, age the curve and switch HLLs.
+ */
+static inline void mrc_advance(struct mrc_state *st, u64 epoch)
+{
+	u32 i;
+
+	st->epoch_pages[epoch & (MRC_NR_EPOCHS - 1)] = 0;
+	WRITE_ONCE(st->epoch, epoch);
+
+	if (epoch % (MRC_NR_EPOCHS / 2))
+		return;
+
+	bpf_for(i, 0, MRC_NR_BUCKETS)
+		st->hist[i] >>= 1;
+	st->cold >>= 1;
+	st->refs >>= 1;
+
+	// The finished HLL now covers the last half horizon, reuse the other
+	mrc_hll_clear(st, st->hll_cur ^ 1);
+	WRITE_ONCE(st->hll_cur, st->hll_cur ^ 1);
+	st->hll_halves++;
+}
+
+// Initial value of a cgroup's state, too large for the stack
+static struct mrc_state mrc_zero_state;
+
+// Create the cgroup's estimator. Call from the init hook.
+static inline int mrc_init(struct mem_cgroup *memcg)
+{
+	struct mrc_state *st;
+	u64 key = (u64)memcg;
+
+	if (!mrc_enabled)
+		return 0;
+
+	// Start over if the policy is attached to this memcg again
+	if (bpf_map_update_elem(&mrc_states, &key, &mrc_zero_state, BPF_ANY))
+		return -1;
+	st = bpf_map_lookup_elem(&mrc_states, &key);
+	if (!st)
+		return -1;
+	st->cgroup_id = memcg->css.cgroup->kn->id;
+	mrc_hll_clear(st, 0);
+	mrc_hll_clear(st, 1);
+	return 0;
+}
+
+// css is the first member of struct mem_cgroup, so its address is the key
+SEC("fentry/mem_cgroup_css_free")
+int BPF_PROG(mrc_memcg_free, struct cgroup_subsys_state *css)
+{
+	u64 key = (u64)css;
+
+	if (mrc_enabled)
+		bpf_map_delete_elem(&mrc_states, &key);
+	return 0;
+}
+
+// Count a reference to folio's page if it is sampled
+static inline void mrc_access(struct folio *folio)
+{
+	struct mrc_page_key key;
+	struct mrc_state *st;
+	u64 hash, epoch, clock, *last;
+	u32 j;
+
+	if (!mrc_enabled)
+		return;
+
+	hash = folio_key_hash(folio);
+	if ((hash >> 32) & ((1ULL << mrc_rate_shift) - 1))
+		return;
+
+	key.memcg = folio_memcg_key(folio);
+	key.hash = hash;
+	st = bpf_map_lookup_elem(&mrc_states, &key.memcg);
+	if (!st)
+		return;
+
+	epoch = READ_ONCE(st->epoch);
+	__sync_fetch_and_add(&st->refs, 1);
+	mrc_hll_add(st, hash);
+
+	last = bpf_map_lookup_elem(&mrc_last_ref, &key);
+	if (last && epoch - *last < MRC_NR_EPOCHS) {
+		u64 prev = *last;
+		u64 d = READ_ONCE(st->epoch_pages[prev & (MRC_NR_EPOCHS - 1)]) / 2;
+
+		bpf_for(j, 1, MRC_NR_EPOCHS) {
+			if (prev + j > epoch)
+				break;
+			d += READ_ONCE(st->epoch_pages[(prev + j) & (MRC_NR_EPOCHS - 1)]);
+		}
+		__sync_fetch_and_add(&st->hist[mrc_bucket(d)], 1);
+		// Unless an epoch advance just recycled it
+		if (READ_ONCE(st->epoch_pages[prev & (MRC_NR_EPOCHS - 1)]))
+			__sync_fetch_and_sub(&st->epoch_pages[prev & (MRC_NR_EPOCHS - 1)], 1);
+		*last = epoch;
+	} else {
+		__sync_fetch_and_add(&st->cold, 1);
+		if (last)
+			*last = epoch;
+		else
+			bpf_map_update_elem(&mrc_last_ref, &key, &epoch, BPF_ANY);
+	}
+	__sync_fetch_and_add(&st->epoch_pages[epoch & (MRC_NR_EPOCHS - 1)], 1);
+
+	clock = __sync_fetch_and_add(&st->clock, 1) + 1;
+	if (clock % mrc_epoch_refs == 0)
+		mrc_advance(st, clock / mrc_epoch_refs);
+}
+
+// Working set of memcg in pages, 0 until the estimator has one
+static inline u64 mrc_working_set_pages(struct mem_cgroup *memcg)
+{
+	u64 key = (u64)memcg;
+	struct mrc_state *st;
+
+	if (!mrc_enabled)
+		return 0;
+	st = bpf_map_lookup_elem(&mrc_states, &key);
+	if (!st || READ_ONCE(st->hll_halves) == 0)
+		return 0;
+	return mrc_hll_estimate(st, READ_ONCE(st->hll_cur) ^ 1) << mrc_rate_shift;
+}
+
+#endif /* _CACHE_EXT_MRC_BPF_H */
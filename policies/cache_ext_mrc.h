@@ -0,0 +1,266 @@
+#ifndef _CACHE_EXT_MRC_H
+#define _CACHE_EXT_MRC_H
+
+#include <argp.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "cache_ext_stats.h"
+
+/*
+ * Userspace half of the miss ratio curve estimator (see cache_ext_mrc.bpf.h).
+ *
+ * --mrc turns the estimator on. The stats exporter then adds each cgroup's
+ * curve and working set to every snapshot: in Prometheus format as
+ *
+ *	cache_ext_mrc_miss_ratio{policy="s3fifo",cgroup_id="1234",cache_pages="4096"} 0.25
+ *	cache_ext_working_set_pages{policy="s3fifo",cgroup_id="1234"} 81920
+ *
+ *	cache_ext_mrc_accesses_total{policy="s3fifo",cgroup_id="1234"} 1048576
+ *
+ * and in JSON as a "cgroups" array of { cgroup_id, accesses, refs,
+ * working_set_pages, mrc: [[cache_pages, miss_ratio], ...] }. accesses counts
+ * every reference so far, refs only the recent ones the curve is made of, both
+ * scaled back up from the sample. cgroup_id is the inode number of
+ * the cgroup directory. The curve has a point per distance bucket up to the
+ * largest distance seen, and is meaningful up to MRC_TRACKED_FACTOR times
+ * the memory the loader sized it for.
+ *
+ *	cache_ext_mrc_setup(skel, total_memory);	// before skel__load()
+ *
+ * Loaders use cache_ext_mrc_argp_children, which also carries the stats
+ * exporter options.
+ */
+
+#define MRC_NR_EPOCHS		64	// Keep in sync with cache_ext_mrc.bpf.h
+#define MRC_NR_BUCKETS		72
+#define MRC_HLL_REGS		256
+#define MRC_TARGET_SAMPLES	16384	// Sampled pages per cache size
+#define MRC_HORIZON_FACTOR	16	// Epoch horizon, in cache sizes of references
+#define MRC_TRACKED_FACTOR	4	// Sampled pages remembered, in cache sizes
+#define MRC_MIN_TRACKED		4096
+
+// Keep in sync with cache_ext_mrc.bpf.h
+struct mrc_state {
+	__u64 cgroup_id;
+	__u64 clock;
+	__u64 epoch;
+	__u64 refs;
+	__u64 cold;
+	__u64 hist[MRC_NR_BUCKETS];
+	__u64 epoch_pages[MRC_NR_EPOCHS];
+	__u64 hll_sum[2];
+	__u32 hll_zeros[2];
+	__u32 hll_cur;
+	__u32 hll_halves;
+	__u32 hll[2][MRC_HLL_REGS];
+};
+
+#define cache_ext_mrc_setup(skel, mem_bytes)						\
+	cache_ext_mrc_configure((skel)->maps.mrc_states, (skel)->maps.mrc_last_ref,	\
+				&(skel)->rodata->mrc_enabled, &(skel)->rodata->mrc_rate_shift,	\
+				&(skel)->rodata->mrc_epoch_refs, mem_bytes)
+
+struct cache_ext_mrc_args {
+	bool enabled;
+};
+
+struct cache_ext_mrc_args cache_ext_mrc_args = { 0 };
+
+// What the exporter needs, set by cache_ext_mrc_configure()
+static struct bpf_map *cache_ext_mrc_map = NULL;
+static unsigned int cache_ext_mrc_rate_shift = 0;
+
+enum {
+	CACHE_EXT_MRC_OPT_ENABLE = 0x1900,
+};
+
+static struct argp_option cache_ext_mrc_options[] = {
+	{ "mrc", CACHE_EXT_MRC_OPT_ENABLE, 0, 0,
+	  "Estimate each cgroup's miss ratio curve and working set, exported with the stats" },
+	{ 0 }
+};
+
+static error_t cache_ext_mrc_parse_opt(int key, char *arg, struct argp_state *state)
+{
+	switch (key) {
+	case CACHE_EXT_MRC_OPT_ENABLE:
+		cache_ext_mrc_args.enabled = true;
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static struct argp cache_ext_mrc_argp = {
+	cache_ext_mrc_options, cache_ext_mrc_parse_opt, 0, 0
+};
+
+static struct argp_child cache_ext_mrc_argp_children[] = {
+	{ &cache_ext_mrc_argp, 0, "Miss ratio curves:", 0 },
+	{ &cache_ext_stats_argp, 0, "Stats export:", 0 },
+	{ 0 }
+};
+
+// Smallest distance in bucket i, in sampled pages. Inverse of mrc_bucket().
+static __u64 cache_ext_mrc_bucket_start(unsigned int i) {
+	if (i < 4)
+		return i;
+	return (__u64)(4 + i % 4) << (i / 4 - 1);
+}
+
+/*
+ * Miss ratio at each bucket start: a cache of that many pages hits the
+ * reuses at shorter distances. Fills up to MRC_NR_BUCKETS points and returns
+ * how many, stopping past the largest distance seen.
+ */
+static unsigned int cache_ext_mrc_curve(const struct mrc_state *st, __u64 pages[MRC_NR_BUCKETS],
+					double ratios[MRC_NR_BUCKETS]) {
+	__u64 misses = st->cold;
+	unsigned int last = 0, n = 0;
+
+	if (st->refs == 0)
+		return 0;
+
+	for (unsigned int i = 0; i < MRC_NR_BUCKETS; i++) {
+		misses += st->hist[i];
+		if (st->hist[i])
+			last = i;
+	}
+
+	// misses now counts every reference, shed one bucket per point
+	for (unsigned int i = 1; i <= last + 1 && i < MRC_NR_BUCKETS; i++) {
+		misses -= st->hist[i - 1];
+		pages[n] = cache_ext_mrc_bucket_start(i) << cache_ext_mrc_rate_shift;
+		ratios[n] = (double)misses / st->refs;
+		if (ratios[n] > 1)
+			ratios[n] = 1;
+		n++;
+	}
+	return n;
+}
+
+// Same estimate as mrc_hll_estimate(), in floating point
+static __u64 cache_ext_mrc_working_set(const struct mrc_state *st) {
+	unsigned int i = (st->hll_cur ^ 1) & 1;
+	double m = MRC_HLL_REGS, est;
+
+	if (st->hll_halves == 0 || st->hll_sum[i] == 0)
+		return 0;
+
+	est = 0.7182 * m * m * 4294967296.0 / st->hll_sum[i];
+	if (est <= 2.5 * m && st->hll_zeros[i] > 0)
+		est = m * log(m / st->hll_zeros[i]);
+	return (__u64)est << cache_ext_mrc_rate_shift;
+}
+
+static void cache_ext_mrc_write_state(FILE *f, const char *policy, bool json,
+				      const struct mrc_state *st, bool first) {
+	__u64 pages[MRC_NR_BUCKETS];
+	double ratios[MRC_NR_BUCKETS];
+	unsigned int n = cache_ext_mrc_curve(st, pages, ratios);
+	__u64 ws = cache_ext_mrc_working_set(st);
+
+	if (json) {
+		fprintf(f, "%s{\"cgroup_id\":%llu,\"accesses\":%llu,\"refs\":%llu,"
+			"\"working_set_pages\":%llu,\"mrc\":[",
+			first ? "" : ",", (unsigned long long)st->cgroup_id,
+			(unsigned long long)st->clock << cache_ext_mrc_rate_shift,
+			(unsigned long long)st->refs << cache_ext_mrc_rate_shift,
+			(unsigned long long)ws);
+		for (unsigned int i = 0; i < n; i++)
+			fprintf(f, "%s[%llu,%.4f]", i ? "," : "", (unsigned long long)pages[i],
+				ratios[i]);
+		fprintf(f, "]}");
+		return;
+	}
+
+	for (unsigned int i = 0; i < n; i++)
+		fprintf(f, "cache_ext_mrc_miss_ratio{policy=\"%s\",cgroup_id=\"%llu\",cache_pages=\"%llu\"} %.4f\n",
+			policy, (unsigned long long)st->cgroup_id, (unsigned long long)pages[i],
+			ratios[i]);
+	fprintf(f, "cache_ext_working_set_pages{policy=\"%s\",cgroup_id=\"%llu\"} %llu\n", policy,
+		(unsigned long long)st->cgroup_id, (unsigned long long)ws);
+	fprintf(f, "cache_ext_mrc_accesses_total{policy=\"%s\",cgroup_id=\"%llu\"} %llu\n", policy,
+		(unsigned long long)st->cgroup_id,
+		(unsigned long long)st->clock << cache_ext_mrc_rate_shift);
+}
+
+// Stats exporter hook: every cgroup's curve, see cache_ext_stats_extra_write
+static void cache_ext_mrc_write(FILE *f, const char *policy, bool json) {
+	struct mrc_state st;
+	__u64 key, *prev = NULL;
+	bool first = true;
+	int fd;
+
+	if (!cache_ext_mrc_map)
+		return;
+	fd = bpf_map__fd(cache_ext_mrc_map);
+
+	if (json)
+		fprintf(f, ",\"cgroups\":[");
+	else
+		fprintf(f, "# HELP cache_ext_mrc_miss_ratio Estimated miss ratio at a cache size\n"
+			   "# TYPE cache_ext_mrc_miss_ratio gauge\n");
+
+	while (bpf_map_get_next_key(fd, prev, &key) == 0) {
+		prev = &key;
+		if (bpf_map_lookup_elem(fd, &key, &st))
+			continue;
+		cache_ext_mrc_write_state(f, policy, json, &st, first);
+		first = false;
+	}
+
+	if (json)
+		fprintf(f, "]");
+}
+
+/*
+ * Apply --mrc. Must be called between skel__open() and skel__load(). Samples
+ * about MRC_TARGET_SAMPLES of the pages in mem_bytes, so the estimator's
+ * cost does not grow with the cgroup.
+ */
+int cache_ext_mrc_configure(struct bpf_map *states, struct bpf_map *last_ref, bool *enabled,
+			    __u32 *rate_shift, __u64 *epoch_refs, uint64_t mem_bytes) {
+	uint64_t nr_pages = mem_bytes / sysconf(_SC_PAGESIZE);
+	uint64_t sampled, tracked;
+	unsigned int shift = 0;
+
+	*enabled = cache_ext_mrc_args.enabled;
+	if (!cache_ext_mrc_args.enabled)
+		return 0;
+
+	while ((nr_pages >> shift) > MRC_TARGET_SAMPLES && shift < 24)
+		shift++;
+	sampled = nr_pages >> shift;
+
+	tracked = sampled * MRC_TRACKED_FACTOR;
+	if (tracked < MRC_MIN_TRACKED)
+		tracked = MRC_MIN_TRACKED;
+	if (bpf_map__set_max_entries(last_ref, tracked)) {
+		perror("Failed to resize mrc_last_ref");
+		return -1;
+	}
+
+	*rate_shift = shift;
+	*epoch_refs = sampled * MRC_HORIZON_FACTOR / MRC_NR_EPOCHS;
+	if (*epoch_refs == 0)
+		*epoch_refs = 1;
+
+	cache_ext_mrc_map = states;
+	cache_ext_mrc_rate_shift = shift;
+	cache_ext_stats_extra_write = cache_ext_mrc_write;
+
+	fprintf(stderr, "MRC: sampling 1/%u of pages, %lu tracked, epochs of %llu references\n",
+		1U << shift, tracked, (unsigned long long)*epoch_refs);
+	return 0;
+}
+
+#endif /* _CACHE_EXT_MRC_H */
@@ -5,6 +5,11 @@
 
 #include "cache_ext_lib.bpf.h"
 #include "dir_watcher.bpf.h"
+#include "cache_ext_stats.bpf.h"
+#include "cache_ext_prof.bpf.h"
+#include "cache_ext_trace.bpf.h"
+#include "cache_ext_readahead.bpf.h"
+#include "cache_ext_handoff.bpf.h"
 
 char _license[] SEC("license") = "GPL";
 
@@ -45,15 +50,32 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(mru_init, struct mem_cgroup *memcg)
 		return -1;
 	}
 	bpf_printk("cache_ext: Created mru_list: %llu\n", mru_list);
+	if (ra_probation_init(memcg))
+		return -1;
+
+	handoff_export(memcg, mru_list);
+	handoff_export(memcg, ra_probation_list);
 	return 0;
 }
 
+static void handoff_adopt(struct folio *folio)
+{
+}
+
 void BPF_STRUCT_OPS(mru_folio_added, struct folio *folio)
 {
+	PROF_SCOPE(PROF_FOLIO_ADDED);
+	cache_ext_trace(CACHE_EXT_TRACE_ADD, folio);
 	dbg_printk("cache_ext: Hi from the mru_folio_added hook! :D\n");
 	if (!is_folio_relevant(folio)) {
 		return;
 	}
+	cache_ext_stat_inc(CACHE_EXT_STAT_MISSES);
+
+	if (ra_probation_admit(folio)) {
+		dbg_printk("cache_ext: Added folio to ra_probation_list\n");
+		return;
+	}
 
 	int ret = bpf_cache_ext_list_add(mru_list, folio);
 	if (ret != 0) {
@@ -65,13 +87,18 @@ void BPF_STRUCT_OPS(mru_folio_added, struct folio *folio)
 
 void BPF_STRUCT_OPS(mru_folio_accessed, struct folio *folio)
 {
+	PROF_SCOPE(PROF_FOLIO_ACCESSED);
+	cache_ext_trace(CACHE_EXT_TRACE_ACCESS, folio);
 	int ret;
 	dbg_printk("cache_ext: Hi from the mru_folio_accessed hook! :D\n");
 
 	if (!is_folio_relevant(folio)) {
 		return;
 	}
+	cache_ext_stat_inc(CACHE_EXT_STAT_HITS);
 
+	// A folio on probation is promoted by the move below
+	ra_probation_promote(folio);
 	ret = bpf_cache_ext_list_move(mru_list, folio, false);
 	if (ret != 0) {
 		bpf_printk("cache_ext: Failed to move folio to mru_list head\n");
@@ -83,12 +110,18 @@ void BPF_STRUCT_OPS(mru_folio_accessed, struct folio *folio)
 
 void BPF_STRUCT_OPS(mru_folio_evicted, struct folio *folio)
 {
+	PROF_SCOPE(PROF_FOLIO_EVICTED);
+	cache_ext_trace(CACHE_EXT_TRACE_EVICT, folio);
 	dbg_printk("cache_ext: Hi from the mru_folio_evicted hook! :D\n");
 	bpf_cache_ext_list_del(folio);
+	cache_ext_stat_inc(CACHE_EXT_STAT_EVICTIONS);
+	ra_probation_evicted(folio);
 }
 
 static int iterate_mru(int idx, struct cache_ext_list_node *node)
 {
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+
 	if ((idx < 200) && (!folio_test_uptodate(node->folio) || !folio_test_lru(node->folio))) {
 		return CACHE_EXT_CONTINUE_ITER;
 	}
@@ -98,14 +131,27 @@ static int iterate_mru(int idx, struct cache_ext_list_node *node)
 void BPF_STRUCT_OPS(mru_evict_folios, struct cache_ext_eviction_ctx *eviction_ctx,
 	       struct mem_cgroup *memcg)
 {
+	PROF_EVICT_SCOPE(eviction_ctx);
+	EVICTION_TARGET_SCOPE(eviction_ctx);
 	dbg_printk("cache_ext: Hi from the mru_evict_folios hook! :D\n");
+	// MRU evicts from the head, so adopted (older) folios go to the tail
+	if (handoff_step(eviction_ctx, memcg, mru_list, true) &&
+	    eviction_ctx_done(eviction_ctx))
+		return;
+
+	if (ra_probation_over_budget(memcg)) {
+		ra_probation_evict(eviction_ctx, memcg);
+		if (eviction_ctx_done(eviction_ctx))
+			return;
+	}
+
 	int ret = bpf_cache_ext_list_iterate(memcg, mru_list, iterate_mru,
 					     eviction_ctx);
 	// Check that the right amount of folios were evicted
 	if (ret < 0) {
 		bpf_printk("cache_ext: Failed to evict folios\n");
 	}
-	if (eviction_ctx->request_nr_folios_to_evict > eviction_ctx->nr_folios_to_evict) {
+	if (!eviction_ctx_done(eviction_ctx)) {
 		bpf_printk("cache_ext: Didn't evict enough folios. Requested: %d, Evicted: %d\n",
 			   eviction_ctx->request_nr_folios_to_evict,
 			   eviction_ctx->nr_folios_to_evict);
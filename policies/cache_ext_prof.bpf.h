@@ -0,0 +1,127 @@
+#ifndef _CACHE_EXT_PROF_BPF_H
+#define _CACHE_EXT_PROF_BPF_H 1
+
+#include "cache_ext_lib.bpf.h"
+#include "cache_ext_stats.bpf.h"
+
+/*
+ * Opt-in profiling of the struct_ops hooks.
+ *
+ * A hook starts with PROF_SCOPE(hook) or, for evict_folios,
+ * PROF_EVICT_SCOPE(eviction_ctx). The scope is closed by a cleanup handler on
+ * every return path and adds the hook's run time to a log2 latency histogram
+ * in this CPU's cache_ext_prof_map slot. Eviction scopes also record how many
+ * folios were requested and proposed, how many calls came back short, and
+ * how many list nodes the iterate/sample callbacks visited per folio proposed
+ * (the CACHE_EXT_STAT_SCANNED delta on this CPU).
+ *
+ * The loader sets prof_enabled with --profile; otherwise the verifier prunes
+ * the scopes as dead code. It dumps the histograms on exit and on SIGUSR1,
+ * see cache_ext_prof.h, whose definitions must match these.
+ */
+
+enum cache_ext_prof_hook {
+	PROF_EVICT_FOLIOS = 0,
+	PROF_FOLIO_ADDED,
+	PROF_FOLIO_ACCESSED,
+	PROF_FOLIO_EVICTED,
+	NR_PROF_HOOKS,
+};
+
+#define PROF_BUCKETS 32  // Bucket i holds values in [2^i, 2^(i+1))
+
+struct cache_ext_prof {
+	u64 lat[NR_PROF_HOOKS][PROF_BUCKETS];	// ns
+	u64 lat_sum[NR_PROF_HOOKS];
+	u64 evict_requested;
+	u64 evict_proposed;
+	u64 evict_short;			// Calls proposing fewer folios than requested
+	u64 evict_scanned;
+	u64 scan_ratio[PROF_BUCKETS];		// Nodes visited per folio proposed
+	u64 scan_ratio_empty;			// Calls proposing nothing
+};
+
+// Set from userspace
+const volatile bool prof_enabled = false;
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, u32);
+	__type(value, struct cache_ext_prof);
+	__uint(max_entries, 1);
+} cache_ext_prof_map SEC(".maps");
+
+struct prof_scope {
+	u64 start;
+	u64 scanned;
+	struct cache_ext_eviction_ctx *ctx;
+	u32 hook;
+};
+
+static __always_inline u64 prof_scanned(void)
+{
+	u32 cpu = bpf_get_smp_processor_id();
+	struct cache_ext_stats_slot *slot = bpf_map_lookup_elem(&cache_ext_stats_map, &cpu);
+
+	return slot ? slot->val[CACHE_EXT_STAT_SCANNED] : 0;
+}
+
+static __always_inline struct prof_scope prof_scope_begin(u32 hook,
+							   struct cache_ext_eviction_ctx *ctx)
+{
+	struct prof_scope scope = { .hook = hook, .ctx = ctx };
+
+	if (!prof_enabled)
+		return scope;
+
+	if (ctx)
+		scope.scanned = prof_scanned();
+	scope.start = bpf_ktime_get_ns();
+	return scope;
+}
+
+static __always_inline void prof_scope_end(struct prof_scope *scope)
+{
+	struct cache_ext_eviction_ctx *ctx = scope->ctx;
+	struct cache_ext_prof *prof;
+	u64 delta, scanned;
+	u32 key = 0;
+	s64 proposed;
+
+	if (!prof_enabled || !scope->start)
+		return;
+
+	delta = bpf_ktime_get_ns() - scope->start;
+	prof = bpf_map_lookup_elem(&cache_ext_prof_map, &key);
+	if (!prof || scope->hook >= NR_PROF_HOOKS)
+		return;
+
+	prof->lat[scope->hook][ilog2_u64(delta) & (PROF_BUCKETS - 1)]++;
+	prof->lat_sum[scope->hook] += delta;
+
+	if (!ctx)
+		return;
+
+	scanned = prof_scanned() - scope->scanned;
+	proposed = ctx->nr_folios_to_evict;
+	prof->evict_requested += ctx->request_nr_folios_to_evict;
+	prof->evict_scanned += scanned;
+	if (eviction_ctx_pages(ctx) < ctx->request_nr_folios_to_evict)
+		prof->evict_short++;
+	if (proposed <= 0) {
+		prof->scan_ratio_empty++;
+		return;
+	}
+	prof->evict_proposed += proposed;
+	prof->scan_ratio[ilog2_u64(scanned / (u64)proposed) & (PROF_BUCKETS - 1)]++;
+}
+
+#define PROF_SCOPE(hook)							\
+	struct prof_scope __prof_scope __attribute__((cleanup(prof_scope_end))) =	\
+		prof_scope_begin(hook, NULL)
+
+#define PROF_EVICT_SCOPE(ctx)							\
+	struct prof_scope __prof_scope __attribute__((cleanup(prof_scope_end))) =	\
+		prof_scope_begin(PROF_EVICT_FOLIOS, ctx)
+
+#endif /* _CACHE_EXT_PROF_BPF_H */
@@ -0,0 +1,272 @@
+#ifndef _CACHE_EXT_PROF_H
+#define _CACHE_EXT_PROF_H
+
+#include <argp.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+/*
+ * Userspace half of hook profiling (see cache_ext_prof.bpf.h).
+ *
+ * --profile turns the BPF scopes on. The loader then dumps the per-hook
+ * log2 latency histograms and the eviction scan efficiency to stderr on
+ * exit, and whenever it receives SIGUSR1:
+ *
+ *	cache_ext_prof_setup(skel);				// before skel__load()
+ *	cache_ext_prof_start(&prof, cache_ext_prof_map(skel), "fifo");
+ *	cache_ext_prof_stop(&prof);				// dumps
+ *
+ * The option is a child of cache_ext_stats_argp, so every loader offering
+ * the stats options offers --profile too.
+ */
+
+// Keep in sync with cache_ext_prof.bpf.h
+enum cache_ext_prof_hook {
+	PROF_EVICT_FOLIOS = 0,
+	PROF_FOLIO_ADDED,
+	PROF_FOLIO_ACCESSED,
+	PROF_FOLIO_EVICTED,
+	NR_PROF_HOOKS,
+};
+
+#define PROF_BUCKETS 32
+
+struct cache_ext_prof {
+	__u64 lat[NR_PROF_HOOKS][PROF_BUCKETS];
+	__u64 lat_sum[NR_PROF_HOOKS];
+	__u64 evict_requested;
+	__u64 evict_proposed;
+	__u64 evict_short;
+	__u64 evict_scanned;
+	__u64 scan_ratio[PROF_BUCKETS];
+	__u64 scan_ratio_empty;
+};
+
+#define CACHE_EXT_PROF_POLL_MS	200
+
+#define cache_ext_prof_map(skel)	((skel)->maps.cache_ext_prof_map)
+#define cache_ext_prof_setup(skel)	\
+	((skel)->rodata->prof_enabled = cache_ext_prof_args.enabled)
+
+static const char *cache_ext_prof_hook_names[NR_PROF_HOOKS] = {
+	"evict_folios", "folio_added", "folio_accessed", "folio_evicted",
+};
+
+struct cache_ext_prof_args {
+	bool enabled;
+};
+
+struct cache_ext_prof_args cache_ext_prof_args = { 0 };
+
+enum {
+	CACHE_EXT_PROF_OPT_ENABLE = 0x1300,
+};
+
+static struct argp_option cache_ext_prof_options[] = {
+	{ "profile", CACHE_EXT_PROF_OPT_ENABLE, 0, 0,
+	  "Record hook latency and eviction scan efficiency, dumped on exit and SIGUSR1" },
+	{ 0 }
+};
+
+static error_t cache_ext_prof_parse_opt(int key, char *arg, struct argp_state *state)
+{
+	switch (key) {
+	case CACHE_EXT_PROF_OPT_ENABLE:
+		cache_ext_prof_args.enabled = true;
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static struct argp cache_ext_prof_argp = {
+	cache_ext_prof_options, cache_ext_prof_parse_opt, 0, 0
+};
+
+struct cache_ext_profiler {
+	int map_fd;
+	const char *policy;
+	bool running;
+	volatile bool stop;
+	pthread_t thread;
+};
+
+static volatile sig_atomic_t cache_ext_prof_dump_requested;
+
+static void cache_ext_prof_sigusr1(int signo) {
+	cache_ext_prof_dump_requested = 1;
+}
+
+// Sum the per-CPU values of the profiling map into *out
+static int cache_ext_prof_read(int map_fd, struct cache_ext_prof *out) {
+	int nr_cpus = libbpf_num_possible_cpus();
+	struct cache_ext_prof *vals;
+	__u32 key = 0;
+
+	if (nr_cpus <= 0)
+		return -1;
+
+	vals = calloc(nr_cpus, sizeof(*vals));
+	if (vals == NULL)
+		return -1;
+
+	if (bpf_map_lookup_elem(map_fd, &key, vals)) {
+		free(vals);
+		return -1;
+	}
+
+	memset(out, 0, sizeof(*out));
+	for (int cpu = 0; cpu < nr_cpus; cpu++) {
+		__u64 *dst = (__u64 *)out;
+		const __u64 *src = (const __u64 *)&vals[cpu];
+		for (size_t i = 0; i < sizeof(*out) / sizeof(__u64); i++)
+			dst[i] += src[i];
+	}
+	free(vals);
+	return 0;
+}
+
+// Smallest bucket below which at least pct percent of the samples fall
+static unsigned int cache_ext_prof_percentile(const __u64 *hist, __u64 total, unsigned int pct) {
+	__u64 seen = 0;
+
+	for (unsigned int i = 0; i < PROF_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen * 100 >= total * pct)
+			return i;
+	}
+	return PROF_BUCKETS - 1;
+}
+
+static void cache_ext_prof_print_hist(FILE *f, const __u64 *hist, const char *unit) {
+	__u64 peak = 0;
+
+	for (int i = 0; i < PROF_BUCKETS; i++)
+		if (hist[i] > peak)
+			peak = hist[i];
+
+	for (int i = 0; i < PROF_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		int bar = (int)(hist[i] * 40 / peak);
+		fprintf(f, "  %12llu - %-12llu %s %10llu |%.*s\n", 1ULL << i, (2ULL << i) - 1, unit,
+			(unsigned long long)hist[i], bar, "****************************************");
+	}
+}
+
+static void cache_ext_prof_dump(struct cache_ext_profiler *p) {
+	struct cache_ext_prof prof;
+	FILE *f = stderr;
+
+	if (cache_ext_prof_read(p->map_fd, &prof)) {
+		fprintf(stderr, "Failed to read cache_ext_prof_map: %s\n", strerror(errno));
+		return;
+	}
+
+	fprintf(f, "=== %s hook profile ===\n", p->policy);
+	for (int h = 0; h < NR_PROF_HOOKS; h++) {
+		__u64 calls = 0;
+
+		for (int i = 0; i < PROF_BUCKETS; i++)
+			calls += prof.lat[h][i];
+		if (!calls)
+			continue;
+
+		fprintf(f, "%s: %llu calls, mean %llu ns, p50 < %llu ns, p99 < %llu ns\n",
+			cache_ext_prof_hook_names[h], (unsigned long long)calls,
+			(unsigned long long)(prof.lat_sum[h] / calls),
+			2ULL << cache_ext_prof_percentile(prof.lat[h], calls, 50),
+			2ULL << cache_ext_prof_percentile(prof.lat[h], calls, 99));
+		cache_ext_prof_print_hist(f, prof.lat[h], "ns");
+	}
+
+	__u64 evicts = 0;
+	for (int i = 0; i < PROF_BUCKETS; i++)
+		evicts += prof.lat[PROF_EVICT_FOLIOS][i];
+	if (evicts) {
+		fprintf(f, "eviction: %llu requested, %llu proposed, %llu/%llu calls short, "
+			"%llu nodes scanned (%.2f per folio proposed), %llu calls proposed nothing\n",
+			(unsigned long long)prof.evict_requested,
+			(unsigned long long)prof.evict_proposed,
+			(unsigned long long)prof.evict_short, (unsigned long long)evicts,
+			(unsigned long long)prof.evict_scanned,
+			prof.evict_proposed ? (double)prof.evict_scanned / prof.evict_proposed : 0.0,
+			(unsigned long long)prof.scan_ratio_empty);
+		cache_ext_prof_print_hist(f, prof.scan_ratio, "nodes/folio");
+	}
+	fflush(f);
+}
+
+static void *cache_ext_prof_thread(void *arg) {
+	struct cache_ext_profiler *p = arg;
+	struct timespec ts = {
+		.tv_sec = CACHE_EXT_PROF_POLL_MS / 1000,
+		.tv_nsec = (CACHE_EXT_PROF_POLL_MS % 1000) * 1000000,
+	};
+
+	while (!p->stop) {
+		nanosleep(&ts, NULL);
+		if (cache_ext_prof_dump_requested) {
+			cache_ext_prof_dump_requested = 0;
+			cache_ext_prof_dump(p);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Start answering SIGUSR1 with a dump, if --profile was given. Call after
+ * skel__load().
+ */
+int cache_ext_prof_start(struct cache_ext_profiler *p, struct bpf_map *map, const char *policy) {
+	struct sigaction sa;
+	int err;
+
+	memset(p, 0, sizeof(*p));
+	p->map_fd = -1;
+	if (!cache_ext_prof_args.enabled)
+		return 0;
+
+	p->map_fd = bpf_map__fd(map);
+	p->policy = policy;
+
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = cache_ext_prof_sigusr1;
+	sa.sa_flags = SA_RESTART;
+	if (sigaction(SIGUSR1, &sa, NULL)) {
+		perror("Failed to set up SIGUSR1 handler");
+		return -1;
+	}
+
+	err = pthread_create(&p->thread, NULL, cache_ext_prof_thread, p);
+	if (err) {
+		fprintf(stderr, "Failed to start profile dumper: %s\n", strerror(err));
+		return -1;
+	}
+	p->running = true;
+	return 0;
+}
+
+// Stop the dumper and print the final profile
+void cache_ext_prof_stop(struct cache_ext_profiler *p) {
+	if (!p->running)
+		return;
+
+	p->stop = true;
+	pthread_join(p->thread, NULL);
+	p->running = false;
+	cache_ext_prof_dump(p);
+}
+
+#endif /* _CACHE_EXT_PROF_H */
@@ -0,0 +1,255 @@
+#ifndef _CACHE_EXT_READAHEAD_BPF_H
+#define _CACHE_EXT_READAHEAD_BPF_H 1
+
+#include "cache_ext_lib.bpf.h"
+#include "cache_ext_stats.bpf.h"
+
+/*
+ * Readahead-aware insertion.
+ *
+ * Every page cache miss is filled through page_cache_sync_ra() or
+ * page_cache_async_ra(), and folio_added runs synchronously inside them. The
+ * fentry/fexit pairs below record, per task, the range the reader actually
+ * asked for while the call is in progress: [_index, _index + req_count) for a
+ * sync readahead, nothing for an async one (it was triggered by hitting the
+ * PG_readahead marker, so all of it is speculative). A folio added outside
+ * that range is prefetched.
+ *
+ * With ra_tracking set, prefetched folios go to ra_probation_list instead of
+ * the policy's own list and are remembered in ra_probation. The first access
+ * promotes a folio into the policy proper; folios evicted while still on
+ * probation are wasted readahead. Policies evict from probation first while it
+ * holds more than ra_probation_pct of the cgroup (any of it if the cgroup has
+ * no memory.max):
+ *
+ *	folio_added:	if (ra_probation_admit(folio)) return;
+ *	folio_accessed:	if (ra_probation_promote(folio)) <insert into own list>;
+ *	folio_evicted:	ra_probation_evicted(folio);
+ *	evict_folios:	if (ra_probation_over_budget(memcg))
+ *				ra_probation_evict(ctx, memcg);
+ *
+ * Folios added by other paths (mmap fault-around, fadvise WILLNEED) are
+ * treated as demand. The loader side is cache_ext_readahead.h.
+ */
+
+#define RA_TRACKED_TASKS		4096
+#define RA_PROBATION_DEFAULT_ENTRIES	(1 << 16)
+
+// Set from userspace
+const volatile bool ra_tracking = false;
+const volatile u32 ra_probation_pct = 10;
+
+struct ra_window {
+	u64 mapping;
+	u64 start;	// Demanded range, [start, end)
+	u64 end;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__type(key, u32);
+	__type(value, struct ra_window);
+	__uint(max_entries, RA_TRACKED_TASKS);
+} ra_windows SEC(".maps");
+
+/*
+ * Folios on probation, keyed by folio pointer, to the pages they were
+ * accounted in ra_probation_pages with. A large folio can be split while on
+ * probation, so the same size has to be taken off again. Sized by the loader.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, u64);
+	__type(value, u32);
+	__uint(max_entries, RA_PROBATION_DEFAULT_ENTRIES);
+} ra_probation SEC(".maps");
+
+u64 ra_probation_list;
+s64 ra_probation_pages;
+
+static __always_inline void ra_window_open(struct readahead_control *ractl, u64 nr)
+{
+	u32 tid = (u32)bpf_get_current_pid_tgid();
+	struct ra_window win = {
+		.mapping = (u64)ractl->mapping,
+		.start = ractl->_index,
+		.end = ractl->_index + nr,
+	};
+
+	bpf_map_update_elem(&ra_windows, &tid, &win, BPF_ANY);
+}
+
+static __always_inline void ra_window_close(void)
+{
+	u32 tid = (u32)bpf_get_current_pid_tgid();
+
+	bpf_map_delete_elem(&ra_windows, &tid);
+}
+
+SEC("fentry/page_cache_sync_ra")
+int BPF_PROG(ra_sync_enter, struct readahead_control *ractl, unsigned long req_count)
+{
+	ra_window_open(ractl, req_count);
+	return 0;
+}
+
+SEC("fexit/page_cache_sync_ra")
+int BPF_PROG(ra_sync_exit, struct readahead_control *ractl, unsigned long req_count)
+{
+	ra_window_close();
+	return 0;
+}
+
+SEC("fentry/page_cache_async_ra")
+int BPF_PROG(ra_async_enter, struct readahead_control *ractl, struct folio *folio,
+	     unsigned long req_count)
+{
+	ra_window_open(ractl, 0);
+	return 0;
+}
+
+SEC("fexit/page_cache_async_ra")
+int BPF_PROG(ra_async_exit, struct readahead_control *ractl, struct folio *folio,
+	     unsigned long req_count)
+{
+	ra_window_close();
+	return 0;
+}
+
+// Was folio brought in speculatively? Only valid from folio_added.
+static inline bool folio_added_by_readahead(struct folio *folio)
+{
+	u32 tid = (u32)bpf_get_current_pid_tgid();
+	struct ra_window *win = bpf_map_lookup_elem(&ra_windows, &tid);
+
+	if (!win || win->mapping != (u64)folio->mapping)
+		return false;
+
+	return folio->index + folio_nr_pages(folio) <= win->start || folio->index >= win->end;
+}
+
+// Create the probation list. Call from the policy's init hook.
+static inline s32 ra_probation_init(struct mem_cgroup *memcg)
+{
+	if (!ra_tracking)
+		return 0;
+
+	ra_probation_list = bpf_cache_ext_ds_registry_new_list(memcg);
+	if (ra_probation_list == 0) {
+		bpf_printk("cache_ext: init: Failed to create ra_probation_list\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Put a prefetched folio on probation. Returns false if the folio is demand
+ * or can't be tracked, in which case the policy inserts it as usual.
+ */
+static inline bool ra_probation_admit(struct folio *folio)
+{
+	u64 key = (u64)folio;
+	u32 nr_pages;
+
+	if (!ra_tracking || !folio_added_by_readahead(folio))
+		return false;
+
+	nr_pages = folio_nr_pages(folio);
+	if (bpf_map_update_elem(&ra_probation, &key, &nr_pages, BPF_NOEXIST))
+		return false;
+
+	if (bpf_cache_ext_list_add_tail(ra_probation_list, folio)) {
+		bpf_printk("cache_ext: added: Failed to add folio to ra_probation_list\n");
+		bpf_map_delete_elem(&ra_probation, &key);
+		return false;
+	}
+
+	__sync_fetch_and_add(&ra_probation_pages, nr_pages);
+	cache_ext_stat_add(CACHE_EXT_STAT_RA_INSERTED, nr_pages);
+	return true;
+}
+
+/*
+ * Take folio off probation. Returns the pages it was accounted with, or 0 if
+ * it wasn't on probation or another CPU took it off first.
+ */
+static inline u32 ra_probation_remove(struct folio *folio)
+{
+	u64 key = (u64)folio;
+	u32 *entry, nr_pages;
+
+	entry = bpf_map_lookup_elem(&ra_probation, &key);
+	if (!entry)
+		return 0;
+	nr_pages = *entry;
+	if (bpf_map_delete_elem(&ra_probation, &key))
+		return 0;
+
+	__sync_fetch_and_sub(&ra_probation_pages, nr_pages);
+	return nr_pages;
+}
+
+/*
+ * First access to a folio on probation. Returns true if the folio was on
+ * probation; it is still on ra_probation_list and the caller must move it
+ * into its own list.
+ */
+static inline bool ra_probation_promote(struct folio *folio)
+{
+	u32 nr_pages;
+
+	if (!ra_tracking)
+		return false;
+
+	nr_pages = ra_probation_remove(folio);
+	if (!nr_pages)
+		return false;
+
+	cache_ext_stat_add(CACHE_EXT_STAT_RA_USED, nr_pages);
+	return true;
+}
+
+static inline void ra_probation_evicted(struct folio *folio)
+{
+	u32 nr_pages;
+
+	if (!ra_tracking)
+		return;
+
+	nr_pages = ra_probation_remove(folio);
+	if (nr_pages)
+		cache_ext_stat_add(CACHE_EXT_STAT_RA_WASTED, nr_pages);
+}
+
+static inline bool ra_probation_over_budget(struct mem_cgroup *memcg)
+{
+	s64 pages = READ_ONCE(ra_probation_pages);
+
+	if (!ra_tracking || pages <= 0)
+		return false;
+
+	return (u64)pages > memcg_max_pages(memcg) * ra_probation_pct / 100;
+}
+
+static int ra_probation_evict_cb(int idx, struct cache_ext_list_node *a)
+{
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+
+	if (!folio_test_uptodate(a->folio) || !folio_test_lru(a->folio))
+		return CACHE_EXT_CONTINUE_ITER;
+
+	if (folio_test_dirty(a->folio) || folio_test_writeback(a->folio))
+		return CACHE_EXT_CONTINUE_ITER;
+
+	return CACHE_EXT_EVICT_NODE;
+}
+
+// Evict the oldest prefetched folios into ctx
+static inline void ra_probation_evict(struct cache_ext_eviction_ctx *ctx,
+				      struct mem_cgroup *memcg)
+{
+	if (bpf_cache_ext_list_iterate(memcg, ra_probation_list, ra_probation_evict_cb, ctx) < 0)
+		bpf_printk("cache_ext: evict: Failed to iterate ra_probation_list\n");
+}
+
+#endif /* _CACHE_EXT_READAHEAD_BPF_H */
@@ -0,0 +1,165 @@
+#ifndef _CACHE_EXT_READAHEAD_H
+#define _CACHE_EXT_READAHEAD_H
+
+#include <argp.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <bpf/libbpf.h>
+
+#include "cache_ext_folio_store.h"
+#include "cache_ext_stats.h"
+
+/*
+ * Userspace half of readahead-aware insertion (see cache_ext_readahead.bpf.h).
+ *
+ * --readahead turns on probationary insertion of prefetched folios, and
+ * --ra_probation_pct sets the share of the cgroup they may hold before the
+ * policy evicts them first. Wasted readahead shows up in the stats exporter
+ * as readahead_wasted next to readahead_inserted and readahead_used.
+ *
+ * The readahead probes are only loaded when the mode is on, and are attached
+ * separately from the rest of the skeleton:
+ *
+ *	cache_ext_readahead_setup(skel, cgroup_path);	// before skel__load()
+ *	cache_ext_readahead_attach(&ra, skel);		// after attaching the ops
+ *	cache_ext_readahead_detach(&ra);
+ *
+ * Loaders use cache_ext_readahead_argp_children, which also carries the stats
+ * exporter options.
+ */
+
+#define CACHE_EXT_RA_NR_PROGS		4
+#define RA_PROBATION_MIN_ENTRIES	1024
+
+#define cache_ext_readahead_progs(skel)						\
+	((struct bpf_program *[CACHE_EXT_RA_NR_PROGS]){ (skel)->progs.ra_sync_enter,	\
+		(skel)->progs.ra_sync_exit, (skel)->progs.ra_async_enter,		\
+		(skel)->progs.ra_async_exit })
+
+#define cache_ext_readahead_setup(skel, cgroup_path)					\
+	cache_ext_readahead_configure(cache_ext_readahead_progs(skel),			\
+				      &(skel)->rodata->ra_tracking,			\
+				      &(skel)->rodata->ra_probation_pct,		\
+				      (skel)->maps.ra_probation, cgroup_path)
+
+#define cache_ext_readahead_attach(ra, skel)						\
+	cache_ext_readahead_attach_progs(ra, cache_ext_readahead_progs(skel))
+
+struct cache_ext_readahead_args {
+	bool enabled;
+	unsigned int probation_pct;
+};
+
+struct cache_ext_readahead_args cache_ext_readahead_args = { .probation_pct = 10 };
+
+struct cache_ext_readahead {
+	struct bpf_link *links[CACHE_EXT_RA_NR_PROGS];
+};
+
+enum {
+	CACHE_EXT_RA_OPT_ENABLE = 0x1200,
+	CACHE_EXT_RA_OPT_PROBATION_PCT,
+};
+
+static struct argp_option cache_ext_readahead_options[] = {
+	{ "readahead", CACHE_EXT_RA_OPT_ENABLE, 0, 0,
+	  "Insert prefetched pages on probation until their first access" },
+	{ "ra_probation_pct", CACHE_EXT_RA_OPT_PROBATION_PCT, "PCT", 0,
+	  "Share of the cgroup prefetched pages may hold before they are evicted first (default: 10)" },
+	{ 0 }
+};
+
+static error_t cache_ext_readahead_parse_opt(int key, char *arg, struct argp_state *state)
+{
+	struct cache_ext_readahead_args *args = &cache_ext_readahead_args;
+	char *end;
+
+	switch (key) {
+	case CACHE_EXT_RA_OPT_ENABLE:
+		args->enabled = true;
+		break;
+	case CACHE_EXT_RA_OPT_PROBATION_PCT:
+		errno = 0;
+		args->probation_pct = strtoul(arg, &end, 10);
+		if (errno || *end != '\0' || args->probation_pct > 100)
+			argp_error(state, "Invalid probation share: %s", arg);
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static struct argp cache_ext_readahead_argp = {
+	cache_ext_readahead_options, cache_ext_readahead_parse_opt, 0, 0
+};
+
+static struct argp_child cache_ext_readahead_argp_children[] = {
+	{ &cache_ext_readahead_argp, 0, "Readahead tracking:", 0 },
+	{ &cache_ext_stats_argp, 0, "Stats export:", 0 },
+	{ 0 }
+};
+
+/*
+ * Apply the readahead options. Must be called between skel__open() and
+ * skel__load(). The probation map gets room for twice the probation budget,
+ * or is shrunk to a single entry if the mode is off.
+ */
+int cache_ext_readahead_configure(struct bpf_program **progs, bool *tracking, __u32 *pct,
+				  struct bpf_map *map, const char *cgroup_path) {
+	struct cache_ext_readahead_args *args = &cache_ext_readahead_args;
+	uint64_t nr_pages, entries;
+
+	for (int i = 0; i < CACHE_EXT_RA_NR_PROGS; i++) {
+		if (bpf_program__set_autoload(progs[i], args->enabled) ||
+		    bpf_program__set_autoattach(progs[i], false)) {
+			fprintf(stderr, "Failed to configure %s\n", bpf_program__name(progs[i]));
+			return -1;
+		}
+	}
+
+	*tracking = args->enabled;
+	*pct = args->probation_pct;
+	if (!args->enabled)
+		return bpf_map__set_max_entries(map, 1);
+
+	nr_pages = read_cgroup_memory_max(cgroup_path) / sysconf(_SC_PAGESIZE);
+	entries = nr_pages * args->probation_pct / 100 * 2;
+	if (entries < RA_PROBATION_MIN_ENTRIES)
+		entries = RA_PROBATION_MIN_ENTRIES;
+
+	if (bpf_map__set_max_entries(map, entries)) {
+		fprintf(stderr, "Failed to resize ra_probation map\n");
+		return -1;
+	}
+	return 0;
+}
+
+int cache_ext_readahead_attach_progs(struct cache_ext_readahead *ra, struct bpf_program **progs) {
+	if (!cache_ext_readahead_args.enabled)
+		return 0;
+
+	for (int i = 0; i < CACHE_EXT_RA_NR_PROGS; i++) {
+		ra->links[i] = bpf_program__attach(progs[i]);
+		if (ra->links[i] == NULL) {
+			fprintf(stderr, "Failed to attach %s: %s\n", bpf_program__name(progs[i]),
+				strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void cache_ext_readahead_detach(struct cache_ext_readahead *ra) {
+	for (int i = 0; i < CACHE_EXT_RA_NR_PROGS; i++) {
+		bpf_link__destroy(ra->links[i]);
+		ra->links[i] = NULL;
+	}
+}
+
+#endif /* _CACHE_EXT_READAHEAD_H */
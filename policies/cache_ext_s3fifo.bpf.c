@@ -11,47 +11,105 @@ char _license[] SEC("license") = "GPL";
 #define ENOENT		2  /* include/uapi/asm-generic/errno-base.h */
 #define INT64_MAX	(9223372036854775807LL)
 
-// Set from userspace. In terms of number of pages.
-// TODO: change
+// The small queue gets 1/S3FIFO_SMALL_DIVISOR of the cache. Overridable for cache_ext_sim sweeps.
+#ifndef S3FIFO_SMALL_DIVISOR
+#define S3FIFO_SMALL_DIVISOR 15
+#endif
 
-//#define CACHE_SIZE (((1ull << 30) * 2) / 4096)
-#define CACHE_SIZE (((1ull << 20) * 200) / 4096)
+/*
+ * Set from userspace. In terms of number of pages. Only used while the
+ * cgroup has no memory.max, otherwise the live limit is used.
+ */
 const volatile size_t cache_size = 0;
 
 struct folio_metadata {
 	s64 freq;
 	bool in_main;
+	u32 nr_pages;	// As accounted in the list sizes
 };
 
-struct ghost_entry {
-	u64 address_space;
-	u64 offset;
+/*
+ * One instance per attached cgroup.
+ *
+ * The list sizes are exact, in pages: updated on folio_added/folio_evicted
+ * and when a folio is promoted from the small to the main list. in_main in
+ * the folio's metadata always says which counter it is accounted in, and
+ * nr_pages by how much.
+ */
+struct memcg_state {
+	u64 main_list;
+	u64 small_list;
+	u64 parked_list;	// Dirty folios, still accounted in main_list_size
+	s64 small_list_size;
+	s64 main_list_size;
 };
 
-struct {
-	__uint(type, BPF_MAP_TYPE_HASH);
-	__type(key, u64);
-	__type(value, struct folio_metadata);
-	__uint(max_entries, 4000000);
-} folio_metadata_map SEC(".maps");
+#include "cache_ext_folio_store.bpf.h"
+#include "cache_ext_ghost.bpf.h"
+#include "cache_ext_stats.bpf.h"
+#include "cache_ext_prof.bpf.h"
+#include "cache_ext_trace.bpf.h"
+#include "cache_ext_memcg.bpf.h"
+#include "cache_ext_hints.bpf.h"
+#include "cache_ext_dirty.bpf.h"
+#include "cache_ext_handoff.bpf.h"
+#include "cache_ext_mrc.bpf.h"
 
+/*
+ * Promotions seen by the small list iterate callback, which has no memcg.
+ * evict_small() moves them to the memcg's counters once the iteration is
+ * done, on the same CPU.
+ */
 struct {
-	__uint(type, BPF_MAP_TYPE_LRU_HASH);
-	__type(key, struct ghost_entry);
-	__type(value, u8);
-	//__uint(max_entries, CACHE_SIZE); // TODO: change
-	__uint(map_flags, BPF_F_NO_COMMON_LRU);  // Per-CPU LRU eviction logic
-} ghost_map SEC(".maps");
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, u32);
+	__type(value, s64);
+	__uint(max_entries, 1);
+} pending_promotions SEC(".maps");
+
+// Account a folio that is moved to the main list
+static inline void promote_to_main(struct folio_metadata *data)
+{
+	u32 key = 0;
+	s64 *pending;
 
-static u64 main_list;
-static u64 small_list;
+	if (data->in_main)
+		return;
+	data->in_main = true;
 
-/*
- * This is an approximate value based on what we choose to evict, not what is
- * actually evicted.
- */
-static s64 small_list_size = 0;
-static s64 main_list_size = 0;
+	pending = bpf_map_lookup_elem(&pending_promotions, &key);
+	if (pending)
+		*pending += data->nr_pages;
+}
+
+// Add the folio's pages to (sign 1) or remove them from (sign -1) its list size
+static inline void account_folio(struct memcg_state *st, struct folio_metadata *data, s64 sign)
+{
+	if (data->in_main)
+		__sync_fetch_and_add(&st->main_list_size, sign * data->nr_pages);
+	else
+		__sync_fetch_and_add(&st->small_list_size, sign * data->nr_pages);
+}
+
+static inline void account_promotions(struct memcg_state *st)
+{
+	u32 key = 0;
+	s64 *pending = bpf_map_lookup_elem(&pending_promotions, &key);
+
+	if (!pending || !*pending)
+		return;
+	__sync_fetch_and_sub(&st->small_list_size, *pending);
+	__sync_fetch_and_add(&st->main_list_size, *pending);
+	*pending = 0;
+}
+
+// Cache size in pages, following the live memory.max
+static inline u64 s3fifo_cache_pages(struct mem_cgroup *memcg)
+{
+	u64 pages = memcg_max_pages(memcg);
+
+	return pages ? pages : cache_size;
+}
 
 static inline bool is_folio_relevant(struct folio *folio) {
 	if (!folio || !folio->mapping || !folio->mapping->host)
@@ -61,44 +119,76 @@ static inline bool is_folio_relevant(struct folio *folio) {
 }
 
 static inline struct folio_metadata *get_folio_metadata(struct folio *folio) {
-	u64 key = (u64)folio;
-	return bpf_map_lookup_elem(&folio_metadata_map, &key);
+	return folio_store_lookup(folio);
 }
 
 /*
- * Check if a folio is in the ghost map and delete the ghost entry.
- * We only check if an element is in the ghost map on inserting into the cache.
- * Relies on bpf_map_delete_elem() returning -ENOENT if the element is not found.
+ * Check if a folio is in the ghost queue and consume the ghost entry.
+ * We only check if an element is in the ghost queue on inserting into the cache.
  */
 static inline bool folio_in_ghost(struct folio *folio) {
-	struct ghost_entry key = {
-		.address_space = (u64)folio->mapping->host,
-		.offset = folio->index,
-	};
-	// TODO: handle non-ENOENT errors
-	return bpf_map_delete_elem(&ghost_map, &key) != -ENOENT;
+	if (ghost_test_and_clear(folio) < 0)
+		return false;
+	cache_ext_stat_inc(CACHE_EXT_STAT_GHOST_HITS);
+	return true;
 }
 
 s32 BPF_STRUCT_OPS_SLEEPABLE(s3fifo_init, struct mem_cgroup *memcg)
 {
-	main_list = bpf_cache_ext_ds_registry_new_list(memcg);
-	if (main_list == 0) {
+	struct memcg_state init = { 0 };
+
+	init.main_list = bpf_cache_ext_ds_registry_new_list(memcg);
+	if (init.main_list == 0) {
 		bpf_printk("cache_ext: init: Failed to create main_list\n");
 		return -1;
 	}
-	bpf_printk("cache_ext: Created main_list: %llu\n", main_list);
+	bpf_printk("cache_ext: Created main_list: %llu\n", init.main_list);
 
-	small_list = bpf_cache_ext_ds_registry_new_list(memcg);
-	if (small_list == 0) {
+	init.small_list = bpf_cache_ext_ds_registry_new_list(memcg);
+	if (init.small_list == 0) {
 		bpf_printk("cache_ext: init: Failed to create small_list\n");
 		return -1;
 	}
-	bpf_printk("cache_ext: Created small_list: %llu\n", small_list);
+	bpf_printk("cache_ext: Created small_list: %llu\n", init.small_list);
+
+	init.parked_list = bpf_cache_ext_ds_registry_new_list(memcg);
+	if (init.parked_list == 0) {
+		bpf_printk("cache_ext: init: Failed to create parked_list\n");
+		return -1;
+	}
+
+	if (!memcg_state_create(memcg, &init)) {
+		bpf_printk("cache_ext: init: Failed to create memcg state\n");
+		return -1;
+	}
 
+	if (mrc_init(memcg))
+		bpf_printk("cache_ext: init: Failed to create MRC state\n");
+
+	handoff_export(memcg, init.small_list);
+	handoff_export(memcg, init.main_list);
+	handoff_export(memcg, init.parked_list);
 	return 0;
 }
 
+// Adopted folios were resident for a while already, so they skip the small queue
+static void handoff_adopt(struct folio *folio)
+{
+	struct folio_metadata new_meta = {
+		.freq = 0,
+		.in_main = true,
+		.nr_pages = folio_nr_pages(folio),
+	};
+	struct memcg_state *st = folio_memcg_state(folio);
+
+	if (!st || !folio_store_insert(folio, &new_meta))
+		return;
+	account_folio(st, &new_meta, 1);
+}
+
 static s64 bpf_s3fifo_score_main_fn(struct cache_ext_list_node *a) {
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+
 	if (!folio_test_uptodate(a->folio) || !folio_test_lru(a->folio))
 		return INT64_MAX;
 
@@ -118,13 +208,13 @@ static s64 bpf_s3fifo_score_main_fn(struct cache_ext_list_node *a) {
 	return freq;
 }
 
+/*
+ * Every folio we continue on is moved to the main list (continue_list), so
+ * account all of them as promoted, not only the ones with freq > 1.
+ */
 static int bpf_s3fifo_score_small_fn(int idx, struct cache_ext_list_node *a)
 {
-	if (!folio_test_uptodate(a->folio) || !folio_test_lru(a->folio))
-		return CACHE_EXT_CONTINUE_ITER;
-
-	if (folio_test_dirty(a->folio) || folio_test_writeback(a->folio))
-		return CACHE_EXT_CONTINUE_ITER;
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
 
 	struct folio_metadata *data = get_folio_metadata(a->folio);
 	if (!data) {
@@ -132,9 +222,19 @@ static int bpf_s3fifo_score_small_fn(int idx, struct cache_ext_list_node *a)
 		return CACHE_EXT_CONTINUE_ITER;
 	}
 
+	if (!folio_test_uptodate(a->folio) || !folio_test_lru(a->folio) ||
+	    folio_test_dirty(a->folio) || folio_test_writeback(a->folio)) {
+		// Over budget: leave it in the small list and end the walk
+		if (dirty_skip_exhausted())
+			return CACHE_EXT_STOP_ITER;
+		// Passed over to the main list's tail with the rest
+		promote_to_main(data);
+		return CACHE_EXT_CONTINUE_ITER;
+	}
+
 	// Move to main list if freq > 1
 	if (data->freq > 1) {
-		data->in_main = true;
+		promote_to_main(data);
 		return CACHE_EXT_CONTINUE_ITER;
 	}
 
@@ -142,7 +242,8 @@ static int bpf_s3fifo_score_small_fn(int idx, struct cache_ext_list_node *a)
 	return CACHE_EXT_EVICT_NODE;
 }
 
-static void evict_main(struct cache_ext_eviction_ctx *eviction_ctx, struct mem_cgroup *memcg)
+static void evict_main(struct cache_ext_eviction_ctx *eviction_ctx, struct mem_cgroup *memcg,
+		       struct memcg_state *st)
 {
 	/*
 	 * Iterate from head. If freq > 0, move to tail, freq--.
@@ -153,24 +254,21 @@ static void evict_main(struct cache_ext_eviction_ctx *eviction_ctx, struct mem_c
 		.sample_size = 10,
 	};
 
-	if (bpf_cache_ext_list_sample(memcg, main_list, bpf_s3fifo_score_main_fn, &opts,
+	if (bpf_cache_ext_list_sample(memcg, st->main_list, bpf_s3fifo_score_main_fn, &opts,
 				      eviction_ctx)) {
 		bpf_printk("cache_ext: evict: Failed to sample main_list\n");
 		return;
 	}
-
-	// if (__sync_sub_and_fetch(&main_list_size, eviction_ctx->nr_folios_to_evict) < 0)
-	// 	main_list_size = 0;
 }
 
 #define MAIN_ITER_FN(id) 								\
 static int bpf_s3fifo_score_main_iter_fn_##id(int idx, struct cache_ext_list_node *a) 	\
 { 											\
 	if (!folio_test_uptodate(a->folio) || !folio_test_lru(a->folio)) 		\
-		return CACHE_EXT_CONTINUE_ITER; 					\
+		return dirty_rotate(); 							\
  											\
 	if (folio_test_dirty(a->folio) || folio_test_writeback(a->folio)) 		\
-		return CACHE_EXT_CONTINUE_ITER; 					\
+		return dirty_rotate(); 							\
  											\
 	struct folio_metadata *data = get_folio_metadata(a->folio); 			\
 	if (!data) { 									\
@@ -192,7 +290,8 @@ MAIN_ITER_FN(1)
 MAIN_ITER_FN(2)
 MAIN_ITER_FN(3)
 
-static void evict_main_iter(struct cache_ext_eviction_ctx *eviction_ctx, struct mem_cgroup *memcg)
+static void evict_main_iter(struct cache_ext_eviction_ctx *eviction_ctx, struct mem_cgroup *memcg,
+			    struct memcg_state *st)
 {
 	/*
 	 * Iterate from head. If freq > 0, move to tail, freq--.
@@ -206,14 +305,14 @@ static void evict_main_iter(struct cache_ext_eviction_ctx *eviction_ctx, struct
 		.evict_mode = CACHE_EXT_ITERATE_TAIL,
 	};
 
-	if (bpf_cache_ext_list_iterate_extended(memcg, main_list, bpf_s3fifo_score_main_iter_fn_0, &opts,
+	if (bpf_cache_ext_list_iterate_extended(memcg, st->main_list, bpf_s3fifo_score_main_iter_fn_0, &opts,
 						eviction_ctx) < 0) {
 		bpf_printk("cache_ext: evict: Failed to iterate main_list\n");
 		return;
 	}
 
-	if (eviction_ctx->nr_folios_to_evict < eviction_ctx->request_nr_folios_to_evict) {
-		if (bpf_cache_ext_list_iterate_extended(memcg, main_list, bpf_s3fifo_score_main_iter_fn_1, &opts,
+	if (!eviction_ctx_done(eviction_ctx)) {
+		if (bpf_cache_ext_list_iterate_extended(memcg, st->main_list, bpf_s3fifo_score_main_iter_fn_1, &opts,
 							eviction_ctx) < 0) {
 			bpf_printk("cache_ext: evict: Failed to iterate main_list\n");
 			return;
@@ -222,8 +321,8 @@ static void evict_main_iter(struct cache_ext_eviction_ctx *eviction_ctx, struct
 		return;
 	}
 
-	if (eviction_ctx->nr_folios_to_evict < eviction_ctx->request_nr_folios_to_evict) {
-		if (bpf_cache_ext_list_iterate_extended(memcg, main_list, bpf_s3fifo_score_main_iter_fn_2, &opts,
+	if (!eviction_ctx_done(eviction_ctx)) {
+		if (bpf_cache_ext_list_iterate_extended(memcg, st->main_list, bpf_s3fifo_score_main_iter_fn_2, &opts,
 							eviction_ctx) < 0) {
 			bpf_printk("cache_ext: evict: Failed to iterate main_list\n");
 			return;
@@ -232,8 +331,8 @@ static void evict_main_iter(struct cache_ext_eviction_ctx *eviction_ctx, struct
 		return;
 	}
 
-	if (eviction_ctx->nr_folios_to_evict < eviction_ctx->request_nr_folios_to_evict) {
-		if (bpf_cache_ext_list_iterate_extended(memcg, main_list, bpf_s3fifo_score_main_iter_fn_3, &opts,
+	if (!eviction_ctx_done(eviction_ctx)) {
+		if (bpf_cache_ext_list_iterate_extended(memcg, st->main_list, bpf_s3fifo_score_main_iter_fn_3, &opts,
 							eviction_ctx) < 0) {
 			bpf_printk("cache_ext: evict: Failed to iterate main_list\n");
 			return;
@@ -241,7 +340,8 @@ static void evict_main_iter(struct cache_ext_eviction_ctx *eviction_ctx, struct
 	}
 }
 
-static void evict_small(struct cache_ext_eviction_ctx *eviction_ctx, struct mem_cgroup *memcg)
+static void evict_small(struct cache_ext_eviction_ctx *eviction_ctx, struct mem_cgroup *memcg,
+			struct memcg_state *st)
 {
 	/*
 	 * Iterate from head. If freq > 1, move to main list, otherwise evict.
@@ -251,45 +351,87 @@ static void evict_small(struct cache_ext_eviction_ctx *eviction_ctx, struct mem_
 	 */
 
 	struct cache_ext_iterate_opts opts = {
-		.continue_list = main_list,
+		.continue_list = st->main_list,
 		.continue_mode = CACHE_EXT_ITERATE_TAIL,
 		.evict_list = CACHE_EXT_ITERATE_SELF,
 		.evict_mode = CACHE_EXT_ITERATE_TAIL,
 	};
 
-	if (bpf_cache_ext_list_iterate_extended(memcg, small_list, bpf_s3fifo_score_small_fn, &opts,
-						eviction_ctx) < 0) {
+	int ret = bpf_cache_ext_list_iterate_extended(memcg, st->small_list, bpf_s3fifo_score_small_fn,
+						      &opts, eviction_ctx);
+
+	account_promotions(st);
+	if (ret < 0)
 		bpf_printk("cache_ext: evict: Failed to iterate small_list\n");
+}
+
+void BPF_STRUCT_OPS(s3fifo_evict_folios, struct cache_ext_eviction_ctx *eviction_ctx,
+		    struct mem_cgroup *memcg)
+{
+	PROF_EVICT_SCOPE(eviction_ctx);
+	EVICTION_TARGET_SCOPE(eviction_ctx);
+	struct memcg_state *st = memcg_state_lookup(memcg);
+	u64 cache_pages = s3fifo_cache_pages(memcg);
+
+	if (!st) {
+		bpf_printk("cache_ext: evict: No state for memcg\n");
 		return;
 	}
 
-	if (__sync_fetch_and_sub(&small_list_size, opts.nr_folios_continue) < 0)
-		small_list_size = 0;
+	s64 small_list_size = READ_ONCE(st->small_list_size);
+	s64 main_list_size = READ_ONCE(st->main_list_size);
+
+	// bpf_printk("cache_ext: evict_folios: main_list_size: %lld, small_list_size: %lld, cache_pages: %lld\n",
+	// 	   main_list_size, small_list_size, cache_pages);
+	dirty_scan_begin(st->parked_list, st->main_list);
+	dirty_unpark(eviction_ctx, memcg);
+
+	if (handoff_step(eviction_ctx, memcg, st->main_list, false) &&
+	    eviction_ctx_done(eviction_ctx))
+		return;
+
+	if (small_list_size >= cache_pages / S3FIFO_SMALL_DIVISOR || main_list_size <= 2 * small_list_size)
+		evict_small(eviction_ctx, memcg, st);
+	else
+		evict_main_iter(eviction_ctx, memcg, st);
 
-	if (__sync_fetch_and_add(&main_list_size, opts.nr_folios_continue) < 0)
-		main_list_size = opts.nr_folios_continue;
+	dirty_evict_parked(eviction_ctx, memcg, st->parked_list);
 }
 
-void BPF_STRUCT_OPS(s3fifo_evict_folios, struct cache_ext_eviction_ctx *eviction_ctx,
-		    struct mem_cgroup *memcg)
+/*
+ * A folio that stayed resident across a restart, with its metadata restored
+ * by --state. Queue it where it was, keeping the frequency it had earned.
+ */
+static inline void s3fifo_readmit(struct folio *folio, struct folio_metadata *data)
 {
-	// bpf_printk("cache_ext: evict_folios: main_list_size: %lld, small_list_size: %lld, cache_size: %lld\n",
-	// 	   main_list_size, small_list_size, cache_size);
-	if (small_list_size >= cache_size / 15 || main_list_size <= 2 * small_list_size)
-		evict_small(eviction_ctx, memcg);
-	else
-		evict_main_iter(eviction_ctx, memcg);
+	struct memcg_state *st = folio_memcg_state(folio);
+
+	if (!st || bpf_cache_ext_list_add_tail(data->in_main ? st->main_list : st->small_list, folio)) {
+		folio_store_delete(folio);
+		return;
+	}
+
+	data->nr_pages = folio_nr_pages(folio);
+	account_folio(st, data, 1);
 }
 
 void BPF_STRUCT_OPS(s3fifo_folio_accessed, struct folio *folio) {
+	PROF_SCOPE(PROF_FOLIO_ACCESSED);
+	cache_ext_trace(CACHE_EXT_TRACE_ACCESS, folio);
 	if (!is_folio_relevant(folio))
 		return;
 
-	struct folio_metadata *data = get_folio_metadata(folio);
+	bool restored;
+	struct folio_metadata *data = folio_store_lookup_restored(folio, &restored);
 	if (!data) {
 		bpf_printk("cache_ext: accessed: Failed to get metadata\n");
 		return;
 	}
+	cache_ext_stat_inc(CACHE_EXT_STAT_HITS);
+	mrc_access(folio);
+
+	if (restored)
+		s3fifo_readmit(folio, data);
 
 	// Cap frequency at 3
 	if (__sync_add_and_fetch(&data->freq, 1) > 3)
@@ -297,22 +439,16 @@ void BPF_STRUCT_OPS(s3fifo_folio_accessed, struct folio *folio) {
 }
 
 void BPF_STRUCT_OPS(s3fifo_folio_evicted, struct folio *folio) {
-	u64 key = (u64)folio;
-	u8 ghost_val = 0;
-
+	PROF_SCOPE(PROF_FOLIO_EVICTED);
+	cache_ext_trace(CACHE_EXT_TRACE_EVICT, folio);
 	// if (bpf_cache_ext_list_del(folio)) {
 	// 	bpf_printk("cache_ext: Failed to delete folio from sampling_list\n");
 	// 	return;
 	// }
 
-	struct ghost_entry ghost_key = {
-		.address_space = (u64)folio->mapping->host,
-		.offset = folio->index,
-	};
-
-	// Don't return early, we want to delete the folio metadata regardless
-	if (bpf_map_update_elem(&ghost_map, &ghost_key, &ghost_val, BPF_ANY))
-		bpf_printk("cache_ext: evicted: Failed to add to ghost_map\n");
+	ghost_insert(folio, 0);
+	cache_ext_stat_inc(CACHE_EXT_STAT_EVICTIONS);
+	dirty_evicted(folio);
 
 	struct folio_metadata *data = get_folio_metadata(folio);
 	if (!data) {
@@ -320,39 +456,52 @@ void BPF_STRUCT_OPS(s3fifo_folio_evicted, struct folio *folio) {
 		return;
 	}
 
-	if (data->in_main)
-		__sync_fetch_and_sub(&main_list_size, 1);
-	else
-		__sync_fetch_and_sub(&small_list_size, 1);
+	struct memcg_state *st = folio_memcg_state(folio);
+	if (st)
+		account_folio(st, data, -1);
 
-	bpf_map_delete_elem(&folio_metadata_map, &key);
+	folio_store_delete(folio);
 
-	// if (bpf_map_delete_elem(&folio_metadata_map, &key))
+	// if (folio_store_delete(folio))
 	// 	bpf_printk("cache_ext: evicted: Failed to delete metadata\n");
 }
 
 /*
- * If folio is in the ghost map, add to tail of main list, otherwise add to tail
- * of small list.
+ * If folio is in the ghost map or its file is tagged hot, add to tail of main
+ * list, otherwise add to tail of small list.
  */
 void BPF_STRUCT_OPS(s3fifo_folio_added, struct folio *folio) {
+	PROF_SCOPE(PROF_FOLIO_ADDED);
+	cache_ext_trace(CACHE_EXT_TRACE_ADD, folio);
 	if (!is_folio_relevant(folio))
 		return;
 
-	u64 key = (u64)folio;
+	struct memcg_state *st = folio_memcg_state(folio);
+	if (!st)
+		return;
+
+	mrc_access(folio);
+
 	struct folio_metadata new_meta = {
 		.freq = 0,
+		.nr_pages = folio_nr_pages(folio),
 	};
 
+	// Re-added without folio_evicted: its old slot is reused, so unaccount it
+	struct folio_metadata *old = get_folio_metadata(folio);
+	struct folio_metadata was = { 0 };
+	bool was_tracked = old != NULL;
+
+	if (old)
+		was = *old;
+
 	u64 list_to_add;
-	if (folio_in_ghost(folio)) {
-		list_to_add = main_list;
+	if (folio_in_ghost(folio) || folio_inode_class(folio) >= INODE_CLASS_HOT) {
+		list_to_add = st->main_list;
 		new_meta.in_main = true;
-		__sync_fetch_and_add(&main_list_size, 1);
 	} else {
-		list_to_add = small_list;
+		list_to_add = st->small_list;
 		new_meta.in_main = false;
-		__sync_fetch_and_add(&small_list_size, 1);
 	}
 
 	if (bpf_cache_ext_list_add_tail(list_to_add, folio)) {
@@ -361,14 +510,21 @@ void BPF_STRUCT_OPS(s3fifo_folio_added, struct folio *folio) {
 		return;
 	}
 
-	if (bpf_map_update_elem(&folio_metadata_map, &key, &new_meta, BPF_ANY)) {
+	if (!folio_store_insert(folio, &new_meta)) {
 		// TODO: add back to ghost_map? + error check delete call?
 		bpf_cache_ext_list_del(folio);
 		bpf_printk("cache_ext: added: Failed to create folio metadata\n");
 		return;
 	}
+
+	// Only account the folio once it is on a list and has metadata
+	if (was_tracked)
+		account_folio(st, &was, -1);
+	account_folio(st, &new_meta, 1);
+	cache_ext_stat_inc(CACHE_EXT_STAT_MISSES);
 }
 
+
 SEC(".struct_ops.link")
 struct cache_ext_ops s3fifo_ops = {
 	.init = (void *)s3fifo_init,
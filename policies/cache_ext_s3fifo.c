@@ -11,24 +11,41 @@
 #include <unistd.h>
 
 #include "dir_watcher.h"
+#include "cache_ext_stats.h"
+#include "cache_ext_hints.h"
+#include "cache_ext_folio_store.h"
+#include "cache_ext_ghost.h"
+#include "cache_ext_mrc.h"
+#include "cache_ext_memcg.h"
 #include "cache_ext_s3fifo.skel.h"
 
-char *USAGE = "Usage: ./cache_ext_s3fifo --watch_dir <dir> --cgroup_size <size> --cgroup_path <path>\n";
+char *USAGE = "Usage: ./cache_ext_s3fifo --watch_dir <dir> [--cgroup_size <size>] --cgroup_path <path> [--cgroup_path <path> ...]\n";
 struct cmdline_args {
 	char *watch_dir;
         uint64_t cgroup_size;
-        char *cgroup_path;
+        struct cache_ext_cgroups cgroups;
 };
 
 static struct argp_option options[] = {
 	{ "watch_dir", 'w', "DIR", 0, "Directory to watch" },
-        {"cgroup_size", 's', "SIZE", 0, "Size of the cgroup"},
-        {"cgroup_path", 'c', "PATH", 0, "Path to cgroup (e.g., /sys/fs/cgroup/cache_ext_test)"},
+        {"cgroup_size", 's', "SIZE", 0, "Size of the cgroup if memory.max is unlimited (default: memory.max)"},
+        {"cgroup_path", 'c', "PATH", 0, "Path to cgroup (e.g., /sys/fs/cgroup/cache_ext_test), repeat for more cgroups"},
 	{ 0 },
 };
 
 static const uint64_t page_size = 4096;
 
+/*
+ * Frequencies of resident folios and the ghost history, plus the ghost
+ * clock in .data.model
+ */
+static const struct cache_ext_state_map s3fifo_state[] = {
+	{ CACHE_EXT_STATE_MODEL },
+	{ "ghost_map" },
+	{ "folio_metadata_map", CACHE_EXT_STATE_FOLIO_STORE },
+	{ 0 },
+};
+
 static volatile sig_atomic_t exiting;
 
 static void sig_handler(int signo) {
@@ -51,7 +68,8 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 
                 break;
         case 'c':
-                args->cgroup_path = arg;
+                if (cache_ext_cgroups_add(&args->cgroups, arg))
+                        argp_error(state, "Too many cgroups");
                 break;
 	default:
 		return ARGP_ERR_UNKNOWN;
@@ -60,7 +78,7 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 }
 
 static int parse_args(int argc, char **argv, struct cmdline_args *args) {
-	struct argp argp = { options, parse_opt, 0, 0 };
+	struct argp argp = { options, parse_opt, 0, 0, cache_ext_mrc_argp_children };
 	argp_parse(&argp, argc, argv, 0, 0, args);
 
 	if (args->watch_dir == NULL) {
@@ -68,12 +86,7 @@ static int parse_args(int argc, char **argv, struct cmdline_args *args) {
 		return 1;
 	}
 
-	if (args->cgroup_size == 0) {
-	        fprintf(stderr, "Invalid cgroup size\n");
-	        return 1;
-	}
-
-	if (args->cgroup_path == NULL) {
+	if (args->cgroups.nr == 0) {
 		fprintf(stderr, "Missing required argument: cgroup_path\n");
 		return 1;
 	}
@@ -99,22 +112,20 @@ static int validate_watch_dir(const char *watch_dir, char *watch_dir_full_path)
 		return 1;
 	}
 
-	// BPF policy restriction
-	if (strlen(watch_dir_full_path) > 128) {
-		fprintf(stderr, "watch_dir path too long\n");
-		return 1;
-	}
-
 	return 0;
 }
 
 int main(int argc, char **argv) {
 	struct cmdline_args args = { 0 };
 	struct cache_ext_s3fifo_bpf *skel = NULL;
-	struct bpf_link *link = NULL;
+	struct cache_ext_exporter exporter = { 0 };
+	struct cache_ext_profiler prof = { 0 };
+	struct cache_ext_recorder rec = { 0 };
+	struct cache_ext_state state = { 0 };
 	struct sigaction sa;
 	char watch_dir_path[PATH_MAX];
-	int cgroup_fd = -1;
+	struct cache_ext_cgroups *cgroups = &args.cgroups;
+	uint64_t total_memory;
 	int ret = 1;
 
 	libbpf_set_strict_mode(LIBBPF_STRICT_ALL);
@@ -135,12 +146,10 @@ int main(int argc, char **argv) {
 	if (validate_watch_dir(args.watch_dir, watch_dir_path))
 		return 1;
 
-	// Open cgroup directory early
-	cgroup_fd = open(args.cgroup_path, O_RDONLY);
-	if (cgroup_fd < 0) {
-		perror("Failed to open cgroup path");
-		return 1;
-	}
+	// Open cgroup directories early
+	if (cache_ext_cgroups_open(cgroups))
+		goto cleanup;
+	total_memory = cache_ext_cgroups_memory_max(cgroups);
 
 	skel = cache_ext_s3fifo_bpf__open();
 	if (!skel) {
@@ -148,21 +157,67 @@ int main(int argc, char **argv) {
 		goto cleanup;
 	}
 
-	// Set cache size in terms of number of pages. Assumes uniform page size.
+	/*
+	 * Set cache size in terms of number of pages. Assumes uniform page size.
+	 * The BPF side follows the live memory.max and only falls back to this
+	 * when the cgroup is unlimited, for every cgroup alike.
+	 */
+	if (args.cgroup_size == 0)
+		args.cgroup_size = read_cgroup_memory_max(cgroups->paths[0]);
 	skel->rodata->cache_size = args.cgroup_size / page_size;
 	fprintf(stderr, "Cgroup size: %lu bytes\n", args.cgroup_size);
 	fprintf(stderr, "Cache size: %lu pages\n", skel->rodata->cache_size);
 
-	// Resize ghost_map
-	if (bpf_map__set_max_entries(skel->maps.ghost_map, skel->rodata->cache_size)) {
-		perror("Failed to resize ghost_map");
+	// Ghost queue and folio store are shared by all cgroups
+	if (ghost_resize_bytes(ghost_map(skel), &ghost_bucket_mask(skel), &ghost_epoch_shift(skel),
+			       total_memory, 100)) {
+		ret = 1;
+		goto cleanup;
+	}
+
+	if (folio_store_resize_bytes(folio_store_map(skel), &folio_store_mask(skel), total_memory)) {
 		ret = 1;
 		goto cleanup;
 	}
 
+	// One policy state per cgroup, created by s3fifo_init
+	if (memcg_state_resize(memcg_state_map(skel), cgroups))
+		goto cleanup;
+
 	// Set watch_dir
-	watch_dir_path_len_map(skel) = strlen(watch_dir_path);
-	strcpy(watch_dir_path_map(skel), watch_dir_path);
+	if (set_watch_dir_root(watch_dir_path, &watch_dir_ino_map(skel), &watch_dir_dev_map(skel))) {
+		ret = 1;
+		goto cleanup;
+	}
+
+	// Size inode_watchlist for the watch dir
+	if (resize_watch_dir_map(inode_watchlist_map(skel), watch_dir_path, true)) {
+		ret = 1;
+		goto cleanup;
+	}
+
+	// Hook profiling, if enabled
+	cache_ext_prof_setup(skel);
+
+	// Page access recording, if enabled
+	if (cache_ext_recorder_setup(skel))
+		goto cleanup;
+
+	// One stats slot per CPU
+	if (cache_ext_stats_resize(cache_ext_stats_map(skel)))
+		goto cleanup;
+
+	// Per-cgroup miss ratio curves, if enabled
+	if (cache_ext_mrc_setup(skel, total_memory))
+		goto cleanup;
+
+	// Share the pinned file class map with cache_ext_hint
+	if (cache_ext_hints_pin(inode_class_map(skel)))
+		goto cleanup;
+
+	// Resume from the state saved by --state, if there is one. Needs the final map sizes.
+	if (cache_ext_state_restore(&state, skel->obj, "s3fifo", s3fifo_state))
+		goto cleanup;
 
 	if (cache_ext_s3fifo_bpf__load(skel)) {
 		perror("Failed to load BPF skeleton");
@@ -176,13 +231,26 @@ int main(int argc, char **argv) {
 		goto cleanup;
 	}
 
-	link = bpf_map__attach_cache_ext_ops(skel->maps.s3fifo_ops, cgroup_fd);
-	if (link == NULL) {
-		perror("Failed to attach cache_ext_ops to cgroup");
+	if (cache_ext_state_apply(&state))
+		goto cleanup;
+
+	if (cache_ext_cgroups_attach(cgroups, skel->obj, skel->maps.s3fifo_ops)) {
 		ret = 1;
 		goto cleanup;
 	}
 
+	// Map the stats region and start the exporter, if enabled
+	if (cache_ext_exporter_start(&exporter, cache_ext_stats_map(skel), "s3fifo"))
+		goto cleanup;
+
+	// Dump hook profiles on SIGUSR1 and at exit, if enabled
+	if (cache_ext_prof_start(&prof, cache_ext_prof_map(skel), "s3fifo"))
+		goto cleanup;
+
+	// Stream page accesses to the --record file, if enabled
+	if (cache_ext_recorder_start(&rec, cache_ext_trace_ring(skel)))
+		goto cleanup;
+
 	// This is necessary for the dir_watcher functionality
 	if (cache_ext_s3fifo_bpf__attach(skel)) {
 		perror("Failed to attach BPF skeleton");
@@ -190,14 +258,21 @@ int main(int argc, char **argv) {
 		goto cleanup;
 	}
 
+	// Tell whoever started us that the policy is live
+	cache_ext_ready();
+
 	// Wait for keyboard input
 	printf("Press any key to exit...\n");
 	getchar();
 	ret = 0;
 
 cleanup:
-	close(cgroup_fd);
-	bpf_link__destroy(link);
+	cache_ext_recorder_stop(&rec);
+	cache_ext_prof_stop(&prof);
+	cache_ext_exporter_stop(&exporter);
+	cache_ext_cgroups_close(cgroups);
+	cache_ext_state_save(&state);
+	cache_ext_state_free(&state);
 	cache_ext_s3fifo_bpf__destroy(skel);
 	return ret;
 }
@@ -5,6 +5,12 @@
 
 #include "cache_ext_lib.bpf.h"
 #include "dir_watcher.bpf.h"
+#include "cache_ext_stats.bpf.h"
+#include "cache_ext_prof.bpf.h"
+#include "cache_ext_trace.bpf.h"
+#include "cache_ext_hints.bpf.h"
+#include "cache_ext_handoff.bpf.h"
+#include "cache_ext_cost.bpf.h"
 
 char _license[] SEC("license") = "GPL";
 
@@ -35,25 +41,29 @@ char _license[] SEC("license") = "GPL";
 
 struct folio_metadata {
 	u64 accesses;
+	s64 class_bias;  // Score offset for the file's class, see class_bias()
+	u64 cost;  // Refault cost factor, see cache_ext_cost.bpf.h
 };
 
-struct {
-	__uint(type, BPF_MAP_TYPE_HASH);
-	__type(key, __u64);
-	__type(value, struct folio_metadata);
-	__uint(max_entries, 4000000);
-} folio_metadata_map SEC(".maps");
+#include "cache_ext_folio_store.bpf.h"
 
 __u64 sampling_list;
 
-#define MAX_STAT_NAME_LEN 256
+#ifndef SAMPLE_SIZE_MIN  // Overridable for cache_ext_sim sweeps
+#define SAMPLE_SIZE_MIN 5  // Bounds of the adaptive eviction sample
+#endif
+#ifndef SAMPLE_SIZE_MAX
+#define SAMPLE_SIZE_MAX 20
+#endif
+
+DEFINE_EVICTION_POOL(sampling_pool);
+
+#define CLASS_SCORE_WEIGHT 4  // Accesses per class step away from the default
 
-struct {
-	__uint(type, BPF_MAP_TYPE_HASH);
-	__type(key, char[MAX_STAT_NAME_LEN]);
-	__type(value, s64);
-	__uint(max_entries, 256);
-} stats SEC(".maps");
+static inline s64 class_bias(struct folio *folio)
+{
+	return ((s64)folio_inode_class(folio) - INODE_CLASS_DEFAULT) * CLASS_SCORE_WEIGHT;
+}
 
 /* App type for specific optimizations */
 enum App {
@@ -61,29 +71,9 @@ enum App {
 	LEVELDB,
 };
 
-// Keys for stats
-char STAT_SCAN_PAGES[MAX_STAT_NAME_LEN] = "scan_pages";
-char STAT_TOTAL_PAGES[MAX_STAT_NAME_LEN] = "total_pages";
-char STAT_EVICTED_SCAN_PAGES[MAX_STAT_NAME_LEN] = "evicted_scan_pages";
-char STAT_EVICTED_TOTAL_PAGES[MAX_STAT_NAME_LEN] = "evicted_total_pages";
-
 /* Counter for list size */
 const int APP_TYPE = GENERIC_APP;
 
-inline void update_stat(char (*stat_name)[MAX_STAT_NAME_LEN], s64 delta) {
-#ifdef DEBUG
-	u64 *counter = bpf_map_lookup_elem(&stats, stat_name);
-	if (!counter) {
-		u64 zero = 0;
-		bpf_map_update_elem(&stats, stat_name, &zero, BPF_NOEXIST);
-		counter = bpf_map_lookup_elem(&stats, stat_name);
-	}
-	if (counter) {
-		__sync_fetch_and_add(counter, delta);
-	}
-#endif // DEBUG
-}
-
 inline bool is_folio_relevant(struct folio *folio)
 {
 	if (!folio) {
@@ -118,11 +108,14 @@ s32 BPF_STRUCT_OPS_SLEEPABLE(sampling_init, struct mem_cgroup *memcg)
 	}
 	bpf_printk("cache_ext: Created sampling_list: %llu\n",
 		   sampling_list);
+	handoff_export(memcg, sampling_list);
 	return 0;
 }
 
 void BPF_STRUCT_OPS(sampling_folio_added, struct folio *folio)
 {
+	PROF_SCOPE(PROF_FOLIO_ADDED);
+	cache_ext_trace(CACHE_EXT_TRACE_ADD, folio);
 	dbg_printk(
 		"cache_ext: Hi from the sampling_folio_added hook! :D\n");
 	if (!is_folio_relevant(folio)) {
@@ -137,44 +130,57 @@ void BPF_STRUCT_OPS(sampling_folio_added, struct folio *folio)
 	}
 	dbg_printk("cache_ext: Added folio to sampling_list\n");
 
-	update_stat(&STAT_TOTAL_PAGES, 1);
+	cache_ext_stat_inc(CACHE_EXT_STAT_MISSES);
+	cost_folio_added(folio);
 
 	// Create folio metadata
-	u64 key = (u64)folio;
-	struct folio_metadata new_meta = { .accesses = 1 };
-	bpf_map_update_elem(&folio_metadata_map, &key, &new_meta, BPF_ANY);
+	struct folio_metadata new_meta = {
+		.accesses = 1,
+		.class_bias = class_bias(folio),
+		.cost = cost_factor(folio),
+	};
+	folio_store_insert(folio, &new_meta);
+}
+
+// Adopted folios start out like a fresh miss, the replaced policy's counts are lost
+static void handoff_adopt(struct folio *folio)
+{
+	struct folio_metadata new_meta = {
+		.accesses = 1,
+		.class_bias = class_bias(folio),
+		.cost = cost_factor(folio),
+	};
+	folio_store_insert(folio, &new_meta);
 }
 
 void BPF_STRUCT_OPS(sampling_folio_accessed, struct folio *folio)
 {
+	PROF_SCOPE(PROF_FOLIO_ACCESSED);
+	cache_ext_trace(CACHE_EXT_TRACE_ACCESS, folio);
 	if (!is_folio_relevant(folio)) {
 		return;
 	}
+	cache_ext_stat_inc(CACHE_EXT_STAT_HITS);
+	cost_folio_accessed(folio);
 	// TODO: Update folio metadata with other values we want to track
 	struct folio_metadata *meta;
-	u64 key = (u64)folio;
-	meta = bpf_map_lookup_elem(&folio_metadata_map, &key);
+	meta = folio_store_lookup(folio);
 	if (!meta) {
-		struct folio_metadata new_meta = { 0 };
-		int ret = bpf_map_update_elem(&folio_metadata_map, &key,
-					      &new_meta, BPF_ANY);
-		if (ret != 0) {
-			bpf_printk(
-				"cache_ext: Failed to create folio metadata in accessed. Return value: %d\n",
-				ret);
-			return;
-		}
-		meta = bpf_map_lookup_elem(&folio_metadata_map, &key);
+		struct folio_metadata new_meta = { .class_bias = class_bias(folio) };
+		meta = folio_store_insert(folio, &new_meta);
 		if (meta == NULL) {
-			bpf_printk("cache_ext: Failed to get created folio metadata in accessed\n");
+			bpf_printk("cache_ext: Failed to create folio metadata in accessed\n");
 			return;
 		}
 	}
+	meta->cost = cost_factor(folio);
 	__sync_fetch_and_add(&meta->accesses, 1);
 }
 
 void BPF_STRUCT_OPS(sampling_folio_evicted, struct folio *folio)
 {
+	PROF_SCOPE(PROF_FOLIO_EVICTED);
+	cache_ext_trace(CACHE_EXT_TRACE_EVICT, folio);
 	dbg_printk(
 		"cache_ext: Hi from the sampling_folio_evicted hook! :D\n");
 	// if (bpf_cache_ext_list_del(folio)) {
@@ -182,11 +188,8 @@ void BPF_STRUCT_OPS(sampling_folio_evicted, struct folio *folio)
 	// 	return;
 	// }
 
-	u64 key = (u64)folio;
-	bpf_map_delete_elem(&folio_metadata_map, &key);
-	update_stat(&STAT_TOTAL_PAGES, -1);
-	update_stat(&STAT_EVICTED_TOTAL_PAGES, 1);
-
+	folio_store_delete(folio);
+	cache_ext_stat_inc(CACHE_EXT_STAT_EVICTIONS);
 }
 
 static inline bool is_last_page_in_file(struct folio *folio)
@@ -211,17 +214,25 @@ static inline bool is_last_page_in_file(struct folio *folio)
 	return page_index == last_page_index;
 }
 
+// A pooled score is stale once the folio was accessed again
+static inline u64 sampling_pool_stamp(struct folio_metadata *meta)
+{
+	return meta->accesses;
+}
+
 static s64 bpf_lfu_score_fn(struct cache_ext_list_node *a)
 {
 	s64 score = 0;
 	struct folio_metadata *meta_a;
-	u64 key_a = (u64)a->folio;
-	meta_a = bpf_map_lookup_elem(&folio_metadata_map, &key_a);
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+
+	meta_a = folio_store_lookup(a->folio);
 	if (!meta_a) {
 		bpf_printk("cache_ext: Failed to get metadata\n");
 		return INT64_MAX;
 	}
-	score = meta_a->accesses;
+	// Accesses to a file that is cheap to fault back count for less
+	score = meta_a->accesses * meta_a->cost / COST_UNIT + meta_a->class_bias;
 	if (APP_TYPE == LEVELDB) {
 		// In leveldb, the index block is at the end of the file.
 		bool is_last_page = is_last_page_in_file(a->folio);
@@ -237,6 +248,8 @@ static s64 bpf_lfu_score_fn(struct cache_ext_list_node *a)
 	if (folio_test_dirty(a->folio) || folio_test_writeback(a->folio)) {
 		return INT64_MAX;
 	}
+	eviction_pool_offer(&sampling_pool, a->folio, score, sampling_pool_stamp(meta_a),
+			    folio_store_gen(meta_a));
 	return score;
 }
 
@@ -244,14 +257,34 @@ void BPF_STRUCT_OPS(sampling_evict_folios,
 		    struct cache_ext_eviction_ctx *eviction_ctx,
 		    struct mem_cgroup *memcg)
 {
+	PROF_EVICT_SCOPE(eviction_ctx);
+	EVICTION_TARGET_SCOPE(eviction_ctx);
 	dbg_printk(
 		"cache_ext: Hi from the sampling_evict_folios hook! :D\n");
 
 	struct sampling_options sampling_opts = {
-		.sample_size = 20,
+		.sample_size = SAMPLE_SIZE_MAX,
 	};
+	struct eviction_pool *pool;
+	u32 valid = 0, supplied;
+
+	if (handoff_step(eviction_ctx, memcg, sampling_list, true) &&
+	    eviction_ctx_done(eviction_ctx))
+		return;
+
+	pool = eviction_pool_get(&sampling_pool, memcg, SAMPLE_SIZE_MIN, SAMPLE_SIZE_MAX);
+	if (pool) {
+		valid = eviction_pool_revalidate(pool, sampling_pool_stamp);
+		sampling_opts.sample_size = pool->sample_size;
+	}
+
 	bpf_cache_ext_list_sample(memcg, sampling_list, bpf_lfu_score_fn,
 				  &sampling_opts, eviction_ctx);
+
+	if (pool) {
+		supplied = eviction_pool_merge(pool, eviction_ctx);
+		eviction_pool_adapt(pool, valid, supplied, SAMPLE_SIZE_MIN, SAMPLE_SIZE_MAX);
+	}
 	dbg_printk("cache_ext: Evicting %d pages (%d requested)\n",
 			   eviction_ctx->nr_folios_to_evict,
 			   eviction_ctx->request_nr_folios_to_evict);
@@ -12,6 +12,10 @@
 
 #include "cache_ext_sampling.skel.h"
 #include "dir_watcher.h"
+#include "cache_ext_stats.h"
+#include "cache_ext_hints.h"
+#include "cache_ext_folio_store.h"
+#include "cache_ext_cost.h"
 
 char *USAGE = "Usage: ./cache_ext_sampling --watch_dir <dir> --cgroup_path <path>\n";
 struct cmdline_args {
@@ -46,12 +50,17 @@ int main(int argc, char **argv)
 	int ret = 1;
 	struct cache_ext_sampling_bpf *skel = NULL;
 	struct bpf_link *link = NULL;
+	struct cache_ext_swap swap = { 0 };
+	struct cache_ext_exporter exporter = { 0 };
+	struct cache_ext_profiler prof = { 0 };
+	struct cache_ext_recorder rec = { 0 };
+	struct cache_ext_cost cost = { 0 };
 	int cgroup_fd = -1;
 	libbpf_set_strict_mode(LIBBPF_STRICT_ALL);
 
 	// Parse command line arguments
 	struct cmdline_args args = { 0 };
-	struct argp argp = { options, parse_opt, 0, 0 };
+	struct argp argp = { options, parse_opt, 0, 0, cache_ext_cost_argp_children };
 	argp_parse(&argp, argc, argv, 0, 0, &args);
 
 	// Validate arguments
@@ -79,12 +88,6 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	// TODO: Enable longer length
-	if (strlen(watch_dir_full_path) > 128) {
-		fprintf(stderr, "watch_dir path too long\n");
-		return 1;
-	}
-
 	// Open cgroup directory early
 	cgroup_fd = open(args.cgroup_path, O_RDONLY);
 	if (cgroup_fd < 0) {
@@ -100,8 +103,43 @@ int main(int argc, char **argv)
 	}
 
 	// Set watch_dir
-	skel->rodata->watch_dir_path_len = strlen(watch_dir_full_path);
-	strcpy(skel->rodata->watch_dir_path, watch_dir_full_path);
+	ret = set_watch_dir_root(args.watch_dir, &watch_dir_ino_map(skel), &watch_dir_dev_map(skel));
+	if (ret)
+		goto cleanup;
+
+	// Size folio metadata store from the cgroup limit
+	ret = folio_store_resize(folio_store_map(skel), &folio_store_mask(skel),
+				 args.cgroup_path);
+	if (ret)
+		goto cleanup;
+
+	// Size inode_watchlist for the watch dir
+	ret = resize_watch_dir_map(inode_watchlist_map(skel), args.watch_dir, true);
+	if (ret)
+		goto cleanup;
+
+	// Hook profiling, if enabled
+	cache_ext_prof_setup(skel);
+
+	// Page access recording, if enabled
+	ret = cache_ext_recorder_setup(skel);
+	if (ret)
+		goto cleanup;
+
+	// One stats slot per CPU
+	ret = cache_ext_stats_resize(cache_ext_stats_map(skel));
+	if (ret)
+		goto cleanup;
+
+	// Share the pinned file class map with cache_ext_hint
+	ret = cache_ext_hints_pin(inode_class_map(skel));
+	if (ret)
+		goto cleanup;
+
+	// Refault cost probes, if enabled
+	ret = cache_ext_cost_setup(skel);
+	if (ret)
+		goto cleanup;
 
 	// Load programs
 	ret = cache_ext_sampling_bpf__load(skel);
@@ -119,12 +157,31 @@ int main(int argc, char **argv)
 	}
 
 	// Attach cache_ext_ops to the specific cgroup
-	link = bpf_map__attach_cache_ext_ops(skel->maps.sampling_ops, cgroup_fd);
+	link = cache_ext_swap_attach(&swap, skel->obj, skel->maps.sampling_ops, cgroup_fd);
 	if (link == NULL) {
 		perror("Failed to attach BPF cache_ext_ops to cgroup");
 		goto cleanup;
 	}
 
+	ret = cache_ext_cost_attach(&cost, skel);
+	if (ret)
+		goto cleanup;
+
+	// Map the stats region and start the exporter, if enabled
+	ret = cache_ext_exporter_start(&exporter, cache_ext_stats_map(skel), "sampling");
+	if (ret)
+		goto cleanup;
+
+	// Dump hook profiles on SIGUSR1 and at exit, if enabled
+	ret = cache_ext_prof_start(&prof, cache_ext_prof_map(skel), "sampling");
+	if (ret)
+		goto cleanup;
+
+	// Stream page accesses to the --record file, if enabled
+	ret = cache_ext_recorder_start(&rec, cache_ext_trace_ring(skel));
+	if (ret)
+		goto cleanup;
+
 	// Attach probes
 	ret = cache_ext_sampling_bpf__attach(skel);
 	if (ret) {
@@ -132,12 +189,20 @@ int main(int argc, char **argv)
 		goto cleanup;
 	}
 
+	// Tell whoever started us that the policy is live
+	cache_ext_ready();
+
 	// Wait for keyboard input
 	printf("Press any key to exit...\n");
 	getchar();
 
 cleanup:
 	close(cgroup_fd);
+	cache_ext_recorder_stop(&rec);
+	cache_ext_prof_stop(&prof);
+	cache_ext_exporter_stop(&exporter);
+	cache_ext_cost_detach(&cost);
+	cache_ext_swap_release(&swap, link);
 	bpf_link__destroy(link);
 	cache_ext_sampling_bpf__destroy(skel);
 	return 0;
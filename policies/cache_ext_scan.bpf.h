@@ -0,0 +1,105 @@
+#ifndef _CACHE_EXT_SCAN_BPF_H
+#define _CACHE_EXT_SCAN_BPF_H 1
+
+#include "cache_ext_lib.bpf.h"
+
+/*
+ * Scan classifier for folio insertions.
+ *
+ * A folio is treated as part of a scan when its insertion extends a
+ * sequential run, either of the inserting task or of the file, that is at
+ * least scan_min_run pages long and was faulted in at no more than
+ * scan_max_ns_per_page on average. The per-file run tolerates
+ * SCAN_RUN_SLACK pages of reordering, so several threads reading one file
+ * in parallel still count as one run. Random readers and slow sequential
+ * readers (e.g. a log tail) never reach the threshold.
+ *
+ * Both trackers are LRU hashes, so idle tasks and files age out by
+ * themselves. scan_min_run == 0 turns the classifier off.
+ */
+
+#define SCAN_TRACKED_TASKS	4096
+#define SCAN_TRACKED_INODES	4096
+#define SCAN_RUN_SLACK		8	// Pages
+
+// Set from userspace
+const volatile u32 scan_min_run = 32;
+const volatile u64 scan_max_ns_per_page = 100 * 1000;
+
+struct scan_run {
+	u64 next_index;		// Expected index of the next folio
+	u64 start_ns;
+	u32 len;		// Pages in the current run
+};
+
+// Per-task runs, keyed by TID
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__type(key, u32);
+	__type(value, struct scan_run);
+	__uint(max_entries, SCAN_TRACKED_TASKS);
+} scan_task_runs SEC(".maps");
+
+// Per-file runs, keyed by inode pointer
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__type(key, u64);
+	__type(value, struct scan_run);
+	__uint(max_entries, SCAN_TRACKED_INODES);
+} scan_inode_runs SEC(".maps");
+
+// Extend or restart run with [index, index + nr). Returns true if run is a scan.
+static inline bool scan_run_update(struct scan_run *run, u64 index, u64 nr, u64 now,
+				   u64 slack)
+{
+	if (index + slack >= run->next_index && index <= run->next_index + slack) {
+		run->len += nr;
+		run->next_index = max(run->next_index, index + nr);
+	} else {
+		run->len = nr;
+		run->next_index = index + nr;
+		run->start_ns = now;
+	}
+
+	return run->len >= scan_min_run &&
+	       now - run->start_ns <= run->len * scan_max_ns_per_page;
+}
+
+static inline bool scan_track(void *map, void *key, u64 index, u64 nr, u64 now, u64 slack)
+{
+	struct scan_run *run = bpf_map_lookup_elem(map, key);
+
+	if (!run) {
+		struct scan_run new_run = {
+			.next_index = index + nr,
+			.start_ns = now,
+			.len = nr,
+		};
+		bpf_map_update_elem(map, key, &new_run, BPF_ANY);
+		return false;
+	}
+
+	return scan_run_update(run, index, nr, now, slack);
+}
+
+// Call once per inserted folio, from the folio_added hook
+static inline bool folio_added_by_scan(struct folio *folio)
+{
+	u32 tid = (u32)bpf_get_current_pid_tgid();
+	u64 inode = (u64)folio->mapping->host;
+	u64 index = folio->index;
+	u64 nr = folio_nr_pages(folio);
+	u64 now = bpf_ktime_get_ns();
+	bool task_scan, inode_scan;
+
+	if (scan_min_run == 0)
+		return false;
+
+	// Track both, so each run keeps going while the other one decides
+	task_scan = scan_track(&scan_task_runs, &tid, index, nr, now, 0);
+	inode_scan = scan_track(&scan_inode_runs, &inode, index, nr, now, SCAN_RUN_SLACK);
+
+	return task_scan || inode_scan;
+}
+
+#endif /* _CACHE_EXT_SCAN_BPF_H */
@@ -0,0 +1,80 @@
+#ifndef _CACHE_EXT_SHADOW_BPF_H
+#define _CACHE_EXT_SHADOW_BPF_H 1
+
+#include "cache_ext_lib.bpf.h"
+#include "cache_ext_events.bpf.h"
+
+/*
+ * Sampled shadow-cache feed (SHARDS-style spatial sampling).
+ *
+ * A page is sampled iff bits of its key hash fall below a threshold, so either
+ * every access to a page is sampled or none is, at a fixed rate of
+ * shadow_sample_threshold / SHADOW_SAMPLE_MODULUS. Sampled key hashes are sent
+ * to the loader through the shadow_samples ring buffer. The loader replays
+ * them through scaled-down simulated caches for each policy
+ * (cache_ext_shadow.h) and publishes the simulated hit rates in
+ * shadow_verdict_map. Samples go through the low-wakeup pipeline of
+ * cache_ext_events.bpf.h, the loader replays them in batches.
+ *
+ * Policy indices match enum policy_type in cache_ext_adaptive_v3.bpf.c.
+ */
+
+#define SHADOW_NR_POLICIES 5
+#define SHADOW_SAMPLE_MODULUS (1 << 24)
+
+// Set from userspace, defaults to 1%
+const volatile u32 shadow_sample_threshold = SHADOW_SAMPLE_MODULUS / 100;
+
+struct shadow_sample {
+	u64 key;
+};
+
+// Written by the loader after every simulation window
+struct shadow_verdict {
+	u64 generation;		// 0 until the first window is published
+	u64 nr_samples;		// Sampled references replayed so far
+	u32 best_policy;
+	u32 hit_rate[SHADOW_NR_POLICIES];  // Simulated hit rate, in 1/10000
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 1 << 20);
+} shadow_samples SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, u32);
+	__type(value, struct shadow_verdict);
+	__uint(max_entries, 1);
+} shadow_verdict_map SEC(".maps");
+
+// Samples lost because the ring buffer was full
+u64 shadow_dropped = 0;
+
+// Feed one page cache reference (hit or miss) to the shadow caches
+static inline void shadow_sample_access(struct folio *folio)
+{
+	u64 key = folio_key_hash(folio);
+	struct shadow_sample *s;
+
+	if (((key >> 24) & (SHADOW_SAMPLE_MODULUS - 1)) >= shadow_sample_threshold)
+		return;
+
+	s = events_reserve(&shadow_samples, sizeof(*s));
+	if (!s) {
+		__sync_fetch_and_add(&shadow_dropped, 1);
+		return;
+	}
+	s->key = key;
+	events_submit(&shadow_samples, s);
+
+}
+
+static inline struct shadow_verdict *shadow_get_verdict(void)
+{
+	u32 key = 0;
+	return bpf_map_lookup_elem(&shadow_verdict_map, &key);
+}
+
+#endif /* _CACHE_EXT_SHADOW_BPF_H */
@@ -0,0 +1,367 @@
+#ifndef _CACHE_EXT_SHADOW_H
+#define _CACHE_EXT_SHADOW_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "cache_ext_folio_store.h"
+
+/*
+ * Userspace half of the shadow-cache subsystem (see cache_ext_shadow.bpf.h).
+ *
+ * Sampled page keys are replayed through miniature caches, each sized to
+ * cache_pages * sample rate, that mimic what the in-kernel policies do. Every
+ * SHADOW_WINDOW sampled references the windowed hit rates are folded into an
+ * EWMA and published to shadow_verdict_map, where the policy controller
+ * picks them up.
+ */
+
+#define SHADOW_NR_POLICIES	5	// Keep in sync with cache_ext_shadow.bpf.h
+#define SHADOW_SAMPLE_MODULUS	(1 << 24)
+#define SHADOW_WINDOW		4096	// Sampled references per verdict
+#define SHADOW_MIN_CAPACITY	64
+#define SHADOW_NIL		UINT32_MAX
+
+#define shadow_samples_map(skel)	((skel)->maps.shadow_samples)
+#define shadow_verdict_map(skel)	((skel)->maps.shadow_verdict_map)
+#define shadow_sample_threshold(skel)	((skel)->rodata->shadow_sample_threshold)
+
+struct shadow_sample {
+	__u64 key;
+};
+
+struct shadow_verdict {
+	__u64 generation;
+	__u64 nr_samples;
+	__u32 best_policy;
+	__u32 hit_rate[SHADOW_NR_POLICIES];
+};
+
+enum shadow_sim_type {
+	SHADOW_SIM_MRU,
+	SHADOW_SIM_FIFO,
+	SHADOW_SIM_LRU,
+	SHADOW_SIM_S3FIFO,
+	NR_SHADOW_SIMS,
+};
+
+/*
+ * Simulator backing each adaptive_v3 policy. LHD-Simple evicts in insertion
+ * order (lhd_iterate_fn doesn't look at hit ages), so it shares the FIFO
+ * simulation.
+ */
+static const int shadow_policy_sim[SHADOW_NR_POLICIES] = {
+	SHADOW_SIM_MRU, SHADOW_SIM_FIFO, SHADOW_SIM_LRU, SHADOW_SIM_S3FIFO, SHADOW_SIM_FIFO,
+};
+
+// S3-FIFO lists
+#define SHADOW_SMALL	0
+#define SHADOW_MAIN	1
+
+struct shadow_node {
+	uint64_t key;
+	uint32_t prev, next;	// List links, head is the eviction end
+	uint32_t hnext;		// Hash chain
+	uint8_t freq;
+	uint8_t list;
+};
+
+struct shadow_cache {
+	int type;
+	uint32_t capacity;
+	uint32_t nr;
+	uint32_t nr_list[2];
+	uint32_t head[2], tail[2];
+	uint32_t free;
+	struct shadow_node *nodes;
+	uint32_t *buckets;
+	uint32_t bucket_mask;
+
+	uint64_t window_hits;
+	uint64_t window_refs;
+	double hit_rate;	// EWMA over windows, in [0, 1]
+};
+
+struct shadow_sims {
+	struct shadow_cache caches[NR_SHADOW_SIMS];
+	uint64_t cache_pages;
+	uint32_t threshold;
+	int verdict_fd;
+	const char *cgroup_path;
+
+	uint64_t nr_samples;
+	uint64_t generation;
+	uint32_t window_refs;
+};
+
+static inline uint32_t shadow_bucket(struct shadow_cache *c, uint64_t key) {
+	return (key ^ (key >> 29)) & c->bucket_mask;
+}
+
+static uint32_t shadow_lookup(struct shadow_cache *c, uint64_t key) {
+	for (uint32_t i = c->buckets[shadow_bucket(c, key)]; i != SHADOW_NIL; i = c->nodes[i].hnext) {
+		if (c->nodes[i].key == key)
+			return i;
+	}
+	return SHADOW_NIL;
+}
+
+static void shadow_list_del(struct shadow_cache *c, uint32_t i) {
+	struct shadow_node *n = &c->nodes[i];
+
+	if (n->prev != SHADOW_NIL)
+		c->nodes[n->prev].next = n->next;
+	else
+		c->head[n->list] = n->next;
+	if (n->next != SHADOW_NIL)
+		c->nodes[n->next].prev = n->prev;
+	else
+		c->tail[n->list] = n->prev;
+	c->nr_list[n->list]--;
+}
+
+static void shadow_list_add_tail(struct shadow_cache *c, uint32_t i, uint8_t list) {
+	struct shadow_node *n = &c->nodes[i];
+
+	n->list = list;
+	n->next = SHADOW_NIL;
+	n->prev = c->tail[list];
+	if (c->tail[list] != SHADOW_NIL)
+		c->nodes[c->tail[list]].next = i;
+	else
+		c->head[list] = i;
+	c->tail[list] = i;
+	c->nr_list[list]++;
+}
+
+static void shadow_remove(struct shadow_cache *c, uint32_t i) {
+	uint32_t *p = &c->buckets[shadow_bucket(c, c->nodes[i].key)];
+
+	while (*p != i)
+		p = &c->nodes[*p].hnext;
+	*p = c->nodes[i].hnext;
+
+	shadow_list_del(c, i);
+	c->nodes[i].hnext = c->free;
+	c->free = i;
+	c->nr--;
+}
+
+/*
+ * Pick the victim the way the in-kernel policy would. S3-FIFO
+ * evicts from the small list while it holds >= 10% of the cache, promoting
+ * pages with freq > 1 to main. Main pages get a second chance per freq.
+ */
+static uint32_t shadow_victim(struct shadow_cache *c) {
+	switch (c->type) {
+	case SHADOW_SIM_MRU:
+		return c->tail[0];
+	case SHADOW_SIM_FIFO:
+	case SHADOW_SIM_LRU:
+		return c->head[0];
+	}
+
+	// Every iteration either evicts or lowers a freq, so this terminates
+	for (;;) {
+		uint32_t i;
+
+		if (c->nr_list[SHADOW_SMALL] > 0 &&
+		    (c->nr_list[SHADOW_SMALL] >= c->capacity / 10 || c->nr_list[SHADOW_MAIN] == 0)) {
+			i = c->head[SHADOW_SMALL];
+			if (c->nodes[i].freq <= 1)
+				return i;
+			shadow_list_del(c, i);
+			shadow_list_add_tail(c, i, SHADOW_MAIN);
+		} else {
+			i = c->head[SHADOW_MAIN];
+			if (c->nodes[i].freq == 0)
+				return i;
+			c->nodes[i].freq--;
+			shadow_list_del(c, i);
+			shadow_list_add_tail(c, i, SHADOW_MAIN);
+		}
+	}
+}
+
+static void shadow_cache_access(struct shadow_cache *c, uint64_t key) {
+	uint32_t i = shadow_lookup(c, key);
+
+	c->window_refs++;
+
+	if (i != SHADOW_NIL) {
+		c->window_hits++;
+		switch (c->type) {
+		case SHADOW_SIM_MRU:
+		case SHADOW_SIM_LRU:
+			shadow_list_del(c, i);
+			shadow_list_add_tail(c, i, c->nodes[i].list);
+			break;
+		case SHADOW_SIM_S3FIFO:
+			if (c->nodes[i].freq < 3)
+				c->nodes[i].freq++;
+			break;
+		}
+		return;
+	}
+
+	if (c->nr >= c->capacity)
+		shadow_remove(c, shadow_victim(c));
+
+	i = c->free;
+	c->free = c->nodes[i].hnext;
+	c->nodes[i].key = key;
+	c->nodes[i].freq = 0;
+	c->nodes[i].hnext = c->buckets[shadow_bucket(c, key)];
+	c->buckets[shadow_bucket(c, key)] = i;
+	shadow_list_add_tail(c, i, SHADOW_SMALL);
+	c->nr++;
+}
+
+static void shadow_cache_free(struct shadow_cache *c) {
+	free(c->nodes);
+	free(c->buckets);
+	memset(c, 0, sizeof(*c));
+}
+
+static int shadow_cache_init(struct shadow_cache *c, int type, uint32_t capacity) {
+	uint32_t nr_buckets = 1;
+
+	memset(c, 0, sizeof(*c));
+	while (nr_buckets < capacity)
+		nr_buckets <<= 1;
+
+	c->type = type;
+	c->capacity = capacity;
+	c->nodes = calloc(capacity, sizeof(*c->nodes));
+	c->buckets = malloc(nr_buckets * sizeof(*c->buckets));
+	if (!c->nodes || !c->buckets) {
+		shadow_cache_free(c);
+		return -1;
+	}
+	c->bucket_mask = nr_buckets - 1;
+	memset(c->buckets, 0xff, nr_buckets * sizeof(*c->buckets));
+
+	for (int l = 0; l < 2; l++)
+		c->head[l] = c->tail[l] = SHADOW_NIL;
+	for (uint32_t i = 0; i < capacity; i++)
+		c->nodes[i].hnext = i + 1 < capacity ? i + 1 : SHADOW_NIL;
+	c->free = 0;
+
+	return 0;
+}
+
+static int shadow_sims_size(struct shadow_sims *sims, uint64_t cache_pages) {
+	uint64_t capacity = cache_pages * sims->threshold / SHADOW_SAMPLE_MODULUS;
+
+	if (capacity < SHADOW_MIN_CAPACITY)
+		capacity = SHADOW_MIN_CAPACITY;
+
+	struct shadow_cache caches[NR_SHADOW_SIMS];
+
+	for (int i = 0; i < NR_SHADOW_SIMS; i++) {
+		if (shadow_cache_init(&caches[i], i, capacity)) {
+			fprintf(stderr, "Failed to allocate shadow caches\n");
+			while (i--)
+				shadow_cache_free(&caches[i]);
+			return -1;
+		}
+	}
+
+	// Only replace the old caches once all new ones are allocated
+	for (int i = 0; i < NR_SHADOW_SIMS; i++) {
+		shadow_cache_free(&sims->caches[i]);
+		sims->caches[i] = caches[i];
+	}
+	sims->cache_pages = cache_pages;
+
+	return 0;
+}
+
+/*
+ * Set up the simulators for a cgroup. sample_pct is the SHARDS sampling rate
+ * in percent and is written to the skeleton's rodata by the caller. Must be
+ * called before ring buffer consumption starts.
+ */
+int shadow_sims_init(struct shadow_sims *sims, const char *cgroup_path,
+		     double sample_pct, int verdict_fd) {
+	uint64_t page_size = sysconf(_SC_PAGESIZE);
+
+	memset(sims, 0, sizeof(*sims));
+	sims->threshold = SHADOW_SAMPLE_MODULUS * sample_pct / 100;
+	if (sims->threshold == 0)
+		sims->threshold = 1;
+	sims->verdict_fd = verdict_fd;
+	sims->cgroup_path = cgroup_path;
+
+	if (shadow_sims_size(sims, read_cgroup_memory_max(cgroup_path) / page_size))
+		return -1;
+
+	fprintf(stderr, "Shadow caches: %u entries each (%.2f%% sampling)\n",
+		sims->caches[0].capacity, sample_pct);
+
+	return 0;
+}
+
+void shadow_sims_free(struct shadow_sims *sims) {
+	for (int i = 0; i < NR_SHADOW_SIMS; i++)
+		shadow_cache_free(&sims->caches[i]);
+}
+
+// Close the current window and publish the verdict to the BPF side
+static void shadow_sims_publish(struct shadow_sims *sims) {
+	struct shadow_verdict verdict = { 0 };
+	uint64_t page_size = sysconf(_SC_PAGESIZE);
+	uint64_t cache_pages;
+	__u32 key = 0;
+
+	for (int i = 0; i < NR_SHADOW_SIMS; i++) {
+		struct shadow_cache *c = &sims->caches[i];
+		double rate = c->window_refs ? (double)c->window_hits / c->window_refs : 0;
+
+		c->hit_rate = sims->generation ? 0.7 * c->hit_rate + 0.3 * rate : rate;
+		c->window_hits = c->window_refs = 0;
+	}
+
+	verdict.generation = ++sims->generation;
+	verdict.nr_samples = sims->nr_samples;
+	for (int p = 0; p < SHADOW_NR_POLICIES; p++) {
+		verdict.hit_rate[p] = sims->caches[shadow_policy_sim[p]].hit_rate * 10000;
+		if (verdict.hit_rate[p] > verdict.hit_rate[verdict.best_policy])
+			verdict.best_policy = p;
+	}
+
+	if (bpf_map_update_elem(sims->verdict_fd, &key, &verdict, BPF_ANY))
+		perror("Failed to update shadow_verdict_map");
+
+	// Follow memory.max changes, starting over with empty caches
+	cache_pages = read_cgroup_memory_max(sims->cgroup_path) / page_size;
+	if (cache_pages != sims->cache_pages)
+		shadow_sims_size(sims, cache_pages);
+}
+
+// ring_buffer_sample_fn for the shadow_samples ring buffer
+int shadow_handle_sample(void *ctx, void *data, size_t data_sz) {
+	struct shadow_sims *sims = ctx;
+	const struct shadow_sample *s = data;
+
+	if (data_sz < sizeof(*s))
+		return 0;
+
+	for (int i = 0; i < NR_SHADOW_SIMS; i++)
+		shadow_cache_access(&sims->caches[i], s->key);
+
+	sims->nr_samples++;
+	if (++sims->window_refs >= SHADOW_WINDOW) {
+		sims->window_refs = 0;
+		shadow_sims_publish(sims);
+	}
+
+	return 0;
+}
+
+#endif /* _CACHE_EXT_SHADOW_H */
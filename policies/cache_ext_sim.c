@@ -0,0 +1,1069 @@
+/*
+ * Trace-driven simulator for cache_ext policies.
+ *
+ * Builds a policy's .bpf.c as ordinary C against the userspace shim in
+ * cache_ext_sim.h and replays a page cache trace through its hooks, without
+ * the cache_ext kernel. One binary per policy, see the sim target in the
+ * Makefile:
+ *
+ *   ./cache_ext_sim_s3fifo.out -t trace.txt -c 10000,50000,100000 -s 4
+ *
+ * Traces are either recorded by a loader's --record (cache_ext_trace_fmt.h)
+ * or text, with lines "op inode index [timestamp_ns [tid]]", op one of add,
+ * access or evict. The simulator decides residency itself: a reference to a
+ * resident page is a hit (folio_accessed), anything else a miss
+ * (folio_added). Evict records only say what the traced kernel did and are
+ * skipped. Without timestamps, references are --ns_per_access apart.
+ *
+ * When a miss finds the cache full, evict_folios() is asked for --batch
+ * victims, each valid one gets folio_evicted() and is dropped, like
+ * mm/cache_ext does. If the policy proposes nothing usable, a random
+ * resident folio goes instead and the call counts as a fallback. Eviction
+ * cost is the wall time spent in evict_folios() and the number of list
+ * nodes it visited.
+ *
+ * -s splits the trace into shards by page hash, each with its share of the
+ * cache, and every (cache size, shard) pair runs in its own forked process,
+ * --jobs at a time, since the policy's globals are the state of one
+ * instance. Compile-time policy parameters are swept by rebuilding with
+ * SIM_DEFS, e.g. make sim SIM_DEFS=-DSAMPLE_SIZE_MAX=32.
+ *
+ * --mrc turns on the miss ratio curve estimator of policies that have one
+ * (cache_ext_mrc.bpf.h), sized for the cache like the loaders do. After each
+ * run the curve it ended with is printed next to the exact LRU miss ratio
+ * curve of the same references, from their stack distances, with the mean
+ * absolute error over the sizes the estimator resolves: from half an epoch,
+ * below which distances are only known to within an epoch, up to the pages
+ * it tracks.
+ */
+#include "cache_ext_sim.h"
+
+#include <argp.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include SIM_POLICY
+
+#include "cache_ext_trace_fmt.h"
+
+#ifndef SIM_OPS
+#error "SIM_OPS must name the policy's struct cache_ext_ops"
+#endif
+
+#define SIM_MAX_SIZES		64
+#define SIM_MAX_SHARDS		256
+#define SIM_TABLE_EMPTY		UINT32_MAX
+#define SIM_FILE_SHIFT		40	// Page key: file id << SIM_FILE_SHIFT | index
+#define SIM_INDEX_MASK		((1ULL << SIM_FILE_SHIFT) - 1)
+
+char *USAGE = "Usage: ./cache_ext_sim_<policy>.out --trace <file> --cache_size <pages>[,<pages>...] [--shards <n>]\n";
+struct cmdline_args {
+	char *trace;
+	u64 sizes[SIM_MAX_SIZES];
+	u32 nr_sizes;
+	u32 shards;
+	u32 jobs;
+	u32 batch;
+	u64 ns_per_access;
+	u64 seed;
+	bool csv;
+	bool mrc;
+};
+
+enum {
+	SIM_OPT_NS_PER_ACCESS = 0x1400,
+	SIM_OPT_SEED,
+	SIM_OPT_CSV,
+	SIM_OPT_MRC,
+};
+
+static struct argp_option options[] = {
+	{ "trace", 't', "FILE", 0, "Trace to replay" },
+	{ "cache_size", 'c', "PAGES", 0, "Cache size in pages, comma separated for a sweep" },
+	{ "shards", 's', "N", 0, "Split the trace into N shards by page (default: 1)" },
+	{ "jobs", 'j', "N", 0, "Simulations to run in parallel (default: online CPUs)" },
+	{ "batch", 'b', "N", 0, "Folios requested per evict_folios() call (default: 32)" },
+	{ "ns_per_access", SIM_OPT_NS_PER_ACCESS, "NS", 0,
+	  "Clock advance per reference for traces without timestamps (default: 1000)" },
+	{ "seed", SIM_OPT_SEED, "SEED", 0, "Seed for bpf_get_prandom_u32() and sampling" },
+	{ "csv", SIM_OPT_CSV, 0, 0, "Print results as CSV" },
+	{ "mrc", SIM_OPT_MRC, 0, 0, "Check the policy's miss ratio curve against the exact one" },
+	{ "verbose", 'v', 0, 0, "Print the policy's bpf_printk() output" },
+	{ 0 },
+};
+
+static u64 parse_u64(struct argp_state *state, const char *arg, const char *what) {
+	char *end;
+	u64 val;
+
+	errno = 0;
+	val = strtoull(arg, &end, 10);
+	if (errno || end == arg || *end != '\0')
+		argp_error(state, "Invalid %s: %s", what, arg);
+	return val;
+}
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+	struct cmdline_args *args = state->input;
+	char *tok, *save;
+
+	switch (key) {
+	case 't':
+		args->trace = arg;
+		break;
+	case 'c':
+		for (tok = strtok_r(arg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+			if (args->nr_sizes == SIM_MAX_SIZES)
+				argp_error(state, "Too many cache sizes");
+			args->sizes[args->nr_sizes] = parse_u64(state, tok, "cache size");
+			if (args->sizes[args->nr_sizes] == 0)
+				argp_error(state, "Cache size must be positive");
+			args->nr_sizes++;
+		}
+		break;
+	case 's':
+		args->shards = parse_u64(state, arg, "shard count");
+		if (args->shards == 0 || args->shards > SIM_MAX_SHARDS)
+			argp_error(state, "Shard count must be between 1 and %d", SIM_MAX_SHARDS);
+		break;
+	case 'j':
+		args->jobs = parse_u64(state, arg, "job count");
+		if (args->jobs == 0)
+			argp_error(state, "Job count must be positive");
+		break;
+	case 'b':
+		args->batch = parse_u64(state, arg, "batch");
+		if (args->batch == 0 || args->batch > CACHE_EXT_MAX_EVICT)
+			argp_error(state, "Batch must be between 1 and %d", CACHE_EXT_MAX_EVICT);
+		break;
+	case SIM_OPT_NS_PER_ACCESS:
+		args->ns_per_access = parse_u64(state, arg, "ns_per_access");
+		break;
+	case SIM_OPT_SEED:
+		args->seed = parse_u64(state, arg, "seed");
+		break;
+	case SIM_OPT_CSV:
+		args->csv = true;
+		break;
+	case SIM_OPT_MRC:
+		args->mrc = true;
+		break;
+	case 'v':
+		sim_verbose = true;
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static int parse_args(int argc, char **argv, struct cmdline_args *args) {
+	struct argp argp = { options, parse_opt, 0, 0 };
+	argp_parse(&argp, argc, argv, 0, 0, args);
+
+	if (args->trace == NULL) {
+		fprintf(stderr, "Missing required argument: trace\n");
+		return 1;
+	}
+
+	if (args->nr_sizes == 0) {
+		fprintf(stderr, "Missing required argument: cache_size\n");
+		return 1;
+	}
+
+#ifndef _CACHE_EXT_MRC_BPF_H
+	if (args->mrc) {
+		fprintf(stderr, "This policy has no miss ratio curve estimator\n");
+		return 1;
+	}
+#endif
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Trace //////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+struct sim_rec {
+	u64 key;	// File id << SIM_FILE_SHIFT | page index
+	u64 ts;		// ns
+	u32 tid;
+};
+
+struct sim_trace {
+	struct sim_rec *recs;
+	u64 nr;
+	u64 cap;
+	u64 *inodes;	// File id to inode number
+	u32 nr_files;
+	u64 nr_evicts;	// Skipped evict lines
+	bool timestamps;
+};
+
+// Open addressing u64 -> u32 map with linear probing
+struct sim_table {
+	u64 *keys;
+	u32 *vals;
+	u64 mask;
+	u64 nr;
+};
+
+static int sim_table_init(struct sim_table *t, u64 min_entries) {
+	u64 cap = 16;
+
+	while (cap < 2 * min_entries)
+		cap <<= 1;
+	t->keys = malloc(cap * sizeof(*t->keys));
+	t->vals = malloc(cap * sizeof(*t->vals));
+	if (!t->keys || !t->vals)
+		return -1;
+	memset(t->vals, 0xff, cap * sizeof(*t->vals));
+	t->mask = cap - 1;
+	t->nr = 0;
+	return 0;
+}
+
+static void sim_table_free(struct sim_table *t) {
+	free(t->keys);
+	free(t->vals);
+}
+
+static inline u64 sim_table_probe(const struct sim_table *t, u64 key) {
+	u64 i = sim_mix64(key) & t->mask;
+
+	while (t->vals[i] != SIM_TABLE_EMPTY && t->keys[i] != key)
+		i = (i + 1) & t->mask;
+	return i;
+}
+
+static inline u32 sim_table_get(const struct sim_table *t, u64 key) {
+	return t->vals[sim_table_probe(t, key)];
+}
+
+// Insert or overwrite. The table must have room, see sim_table_init().
+static inline void sim_table_put(struct sim_table *t, u64 key, u32 val) {
+	u64 i = sim_table_probe(t, key);
+
+	if (t->vals[i] == SIM_TABLE_EMPTY)
+		t->nr++;
+	t->keys[i] = key;
+	t->vals[i] = val;
+}
+
+// Backward shift deletion, keeps probe sequences intact without tombstones
+static inline void sim_table_del(struct sim_table *t, u64 key) {
+	u64 i = sim_table_probe(t, key), j = i;
+
+	if (t->vals[i] == SIM_TABLE_EMPTY)
+		return;
+
+	for (;;) {
+		u64 home;
+
+		j = (j + 1) & t->mask;
+		if (t->vals[j] == SIM_TABLE_EMPTY)
+			break;
+		home = sim_mix64(t->keys[j]) & t->mask;
+		// Can the entry at j move into the hole at i?
+		if (((j - home) & t->mask) >= ((j - i) & t->mask)) {
+			t->keys[i] = t->keys[j];
+			t->vals[i] = t->vals[j];
+			i = j;
+		}
+	}
+	t->vals[i] = SIM_TABLE_EMPTY;
+	t->nr--;
+}
+
+static int sim_table_grow(struct sim_table *t) {
+	struct sim_table bigger;
+
+	if (sim_table_init(&bigger, t->mask + 1))
+		return -1;
+	for (u64 i = 0; i <= t->mask; i++)
+		if (t->vals[i] != SIM_TABLE_EMPTY)
+			sim_table_put(&bigger, t->keys[i], t->vals[i]);
+	sim_table_free(t);
+	*t = bigger;
+	return 0;
+}
+
+static int sim_trace_file_id(struct sim_trace *trace, struct sim_table *files, u64 ino,
+			     u32 *id) {
+	u32 val = sim_table_get(files, ino);
+
+	if (val != SIM_TABLE_EMPTY) {
+		*id = val;
+		return 0;
+	}
+
+	if (trace->nr_files == (1U << (64 - SIM_FILE_SHIFT)) - 1) {
+		fprintf(stderr, "Too many files in trace\n");
+		return -1;
+	}
+	if (2 * (files->nr + 1) > files->mask + 1 && sim_table_grow(files))
+		return -1;
+	if ((trace->nr_files & (trace->nr_files - 1)) == 0) {
+		u64 *inodes = realloc(trace->inodes, 2 * (trace->nr_files + 1) * sizeof(*inodes));
+
+		if (!inodes)
+			return -1;
+		trace->inodes = inodes;
+	}
+
+	*id = trace->nr_files++;
+	trace->inodes[*id] = ino;
+	sim_table_put(files, ino, *id);
+	return 0;
+}
+
+static int sim_trace_append(struct sim_trace *trace, struct sim_table *files, u64 ino,
+			    u64 index, u64 ts, u32 tid) {
+	u32 file;
+
+	if (sim_trace_file_id(trace, files, ino, &file))
+		return -1;
+
+	if (trace->nr == trace->cap) {
+		u64 cap = trace->cap ? 2 * trace->cap : 1 << 16;
+		struct sim_rec *recs = realloc(trace->recs, cap * sizeof(*recs));
+
+		if (!recs) {
+			perror("Failed to allocate trace");
+			return -1;
+		}
+		trace->recs = recs;
+		trace->cap = cap;
+	}
+
+	trace->recs[trace->nr++] = (struct sim_rec){
+		.key = (u64)file << SIM_FILE_SHIFT | index,
+		.ts = ts,
+		.tid = tid,
+	};
+	return 0;
+}
+
+static int sim_trace_load_text(const char *path, struct sim_trace *trace,
+			       struct sim_table *files) {
+	char *line = NULL;
+	size_t line_cap = 0;
+	u64 lineno = 0;
+	int ret = -1;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	trace->timestamps = true;
+	while (getline(&line, &line_cap, f) != -1) {
+		char op[16];
+		unsigned long long ino, index, ts = 0, tid = 0;
+		int n;
+
+		lineno++;
+		if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+			continue;
+
+		n = sscanf(line, "%15s %llu %llu %llu %llu", op, &ino, &index, &ts, &tid);
+		if (n < 3 || index > SIM_INDEX_MASK) {
+			fprintf(stderr, "%s:%llu: Malformed record\n", path, lineno);
+			goto cleanup;
+		}
+		if (!strcmp(op, "evict")) {
+			trace->nr_evicts++;
+			continue;
+		}
+		if (strcmp(op, "add") && strcmp(op, "access")) {
+			fprintf(stderr, "%s:%llu: Unknown op %s\n", path, lineno, op);
+			goto cleanup;
+		}
+
+		trace->timestamps &= n >= 4;
+		if (sim_trace_append(trace, files, ino, index, ts, tid))
+			goto cleanup;
+	}
+
+	ret = 0;
+cleanup:
+	free(line);
+	fclose(f);
+	return ret;
+}
+
+// Recorded by --record, see cache_ext_trace_fmt.h
+static int sim_trace_load_binary(const char *path, struct sim_trace *trace,
+				 struct sim_table *files) {
+	struct cache_ext_trace_reader reader;
+	struct cache_ext_trace_rec rec;
+	int err;
+
+	if (cache_ext_trace_reader_open(&reader, path))
+		return -1;
+
+	trace->timestamps = true;
+	while ((err = cache_ext_trace_reader_next(&reader, &rec)) > 0) {
+		if (rec.op == CACHE_EXT_TRACE_EVICT) {
+			trace->nr_evicts++;
+			continue;
+		}
+		if (rec.index > SIM_INDEX_MASK) {
+			fprintf(stderr, "%s: Page index %llu out of range\n", path, rec.index);
+			err = -1;
+			break;
+		}
+		if (sim_trace_append(trace, files, rec.ino, rec.index, rec.ts, rec.tid)) {
+			err = -1;
+			break;
+		}
+	}
+	if (err == -EINVAL)
+		fprintf(stderr, "%s: Corrupt record after %llu references\n", path, trace->nr);
+
+	cache_ext_trace_reader_close(&reader);
+	return err;
+}
+
+static int sim_trace_load(const char *path, struct sim_trace *trace) {
+	struct sim_table files;
+	int ret;
+
+	if (sim_table_init(&files, 1024))
+		return -1;
+
+	if (cache_ext_trace_is_binary(path))
+		ret = sim_trace_load_binary(path, trace, &files);
+	else
+		ret = sim_trace_load_text(path, trace, &files);
+
+	sim_table_free(&files);
+	return ret;
+}
+
+static inline u32 sim_shard_of(u64 key, u32 shards) {
+	return sim_mix64(key ^ 0x5348415244ULL) % shards;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Simulation /////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+struct sim_result {
+	int err;
+	u64 refs;
+	u64 hits;
+	u64 misses;
+	u64 evictions;
+	u64 invalid;		// Proposed victims that weren't resident or were duplicates
+	u64 fallbacks;		// Evictions the policy left to the simulator
+	u64 evict_calls;
+	u64 evict_ns;
+	u64 nodes_visited;
+	u64 printks;
+	u64 wall_ns;
+};
+
+struct sim_file {
+	struct inode inode;
+	struct address_space mapping;
+};
+
+static struct super_block sim_sb = { .s_dev = 1 };
+static struct kernfs_node sim_cgroup_kn = { .id = 1 };
+static struct cgroup sim_cgroup = { .kn = &sim_cgroup_kn };
+static struct mem_cgroup sim_memcg = { .css.cgroup = &sim_cgroup };
+static struct sim_file *sim_files;
+static struct sim_table sim_page_table;	// Page key -> folio
+static u64 *sim_folio_keys;
+static u32 *sim_free_folios;
+static u32 sim_nr_free;
+static u32 *sim_evict_stamp;
+
+static inline u64 sim_clock_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int sim_register_maps(void) {
+	int ret = 0;
+
+#define SIM_SIZE(name, member) sizeof(*(name).member)
+#define SIM_MAP(name, key_size, value_size)					\
+	ret |= sim_map_register(&(name), #name, sizeof(*(name).type) / sizeof(int),	\
+				key_size, value_size,				\
+				sizeof(*(name).max_entries) / sizeof(int));
+#ifdef SIM_MAPS
+#include SIM_MAPS
+#endif
+#undef SIM_MAP
+#undef SIM_SIZE
+
+	return ret;
+}
+
+// Size the policy's tables for capacity pages, like its loader would
+static int sim_configure(struct sim_trace *trace, struct cmdline_args *args, u64 capacity) {
+	int ret = 0;
+
+	sim_memcg.memory.max = capacity;
+
+#ifdef _CACHE_EXT_FOLIO_STORE_BPF_H
+	{
+		u64 entries = 1ULL << 16;
+
+		while (entries < 2 * capacity && entries < (1ULL << 31))
+			entries <<= 1;
+		ret |= sim_map_resize(&folio_metadata_map, entries);
+		ret |= sim_set_rodata(folio_store_mask, entries - 1);
+	}
+#endif
+
+#ifdef _CACHE_EXT_GHOST_BPF_H
+	{
+		u64 buckets = 1ULL << 10;
+		u32 shift = 0;
+
+		while (buckets * GHOST_BUCKET_SLOTS < capacity + capacity / 2 &&
+		       buckets < (1ULL << 28))
+			buckets <<= 1;
+		while (((u64)GHOST_NR_EPOCHS << (shift + 1)) <= capacity)
+			shift++;
+		ret |= sim_map_resize(&ghost_map, buckets);
+		ret |= sim_set_rodata(ghost_bucket_mask, buckets - 1);
+		ret |= sim_set_rodata(ghost_epoch_shift, shift);
+	}
+#endif
+
+#ifdef _CACHE_EXT_SKETCH_BPF_H
+	{
+		u64 blocks = 1ULL << 10;
+
+		while (blocks * 4 < capacity && blocks < (1ULL << 28))
+			blocks <<= 1;
+		ret |= sim_map_resize(&sketch_map, blocks);
+		ret |= sim_set_rodata(sketch_block_mask, blocks - 1);
+		ret |= sim_set_rodata(sketch_sample_size, capacity * 10);
+	}
+#endif
+
+#ifdef _CACHE_EXT_MRC_BPF_H
+	{
+		u64 tracked = capacity * 4 > 4096 ? capacity * 4 : 4096;
+		u64 epoch_refs = capacity * 16 / MRC_NR_EPOCHS;
+
+		ret |= sim_map_resize(&mrc_last_ref, tracked);
+		ret |= sim_set_rodata(mrc_epoch_refs, epoch_refs ? epoch_refs : 1);
+		ret |= sim_set_rodata(mrc_enabled, args->mrc);
+	}
+#endif
+
+#ifdef __BPF_DIR_WATCHER_H
+	// Every traced file is in the watch dir
+	ret |= sim_map_resize(&inode_watchlist, trace->nr_files + 1);
+	for (u32 i = 0; i < trace->nr_files; i++) {
+		bool watched = true;
+
+		ret |= bpf_map_update_elem(&inode_watchlist, &trace->inodes[i], &watched, BPF_ANY) != 0;
+	}
+#endif
+
+	return ret ? -1 : 0;
+}
+
+/*
+ * Folios and inodes live at a fixed address, because policies hash their
+ * pointers (folio_store_home(), folio_key_hash()). That keeps runs
+ * reproducible under ASLR.
+ */
+#define SIM_ARENA_BASE 0x100000000000ULL
+
+static int sim_alloc_arena(struct sim_trace *trace, u64 capacity) {
+	size_t folios = capacity * sizeof(*sim_folios);
+	size_t size = folios + trace->nr_files * sizeof(*sim_files);
+	void *arena;
+
+	arena = mmap((void *)SIM_ARENA_BASE, size, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if (arena != MAP_FAILED) {
+		sim_folios = arena;
+		sim_files = (struct sim_file *)((u8 *)arena + folios);
+		return 0;
+	}
+
+	fprintf(stderr, "Failed to map folios at a fixed address, results may vary between runs\n");
+	sim_folios = calloc(capacity, sizeof(*sim_folios));
+	sim_files = calloc(trace->nr_files, sizeof(*sim_files));
+	return sim_folios && sim_files ? 0 : -1;
+}
+
+static int sim_alloc(struct sim_trace *trace, u64 capacity) {
+	sim_nr_folios = capacity;
+	if (sim_alloc_arena(trace, capacity)) {
+		perror("Failed to allocate cache");
+		return -1;
+	}
+	sim_nodes = calloc(capacity, sizeof(*sim_nodes));
+	sim_folio_keys = calloc(capacity, sizeof(*sim_folio_keys));
+	sim_free_folios = malloc(capacity * sizeof(*sim_free_folios));
+	sim_evict_stamp = calloc(capacity, sizeof(*sim_evict_stamp));
+	if (!sim_nodes || !sim_folio_keys || !sim_free_folios ||
+	    !sim_evict_stamp || sim_table_init(&sim_page_table, capacity)) {
+		perror("Failed to allocate cache");
+		return -1;
+	}
+
+	for (u32 i = 0; i < capacity; i++) {
+		sim_nodes[i].node.folio = &sim_folios[i];
+		sim_free_folios[i] = capacity - 1 - i;
+	}
+	sim_nr_free = capacity;
+
+	for (u32 i = 0; i < trace->nr_files; i++) {
+		sim_files[i].inode.i_ino = trace->inodes[i];
+		sim_files[i].inode.i_sb = &sim_sb;
+		sim_files[i].mapping.host = &sim_files[i].inode;
+	}
+	return 0;
+}
+
+static void sim_drop(u32 idx, struct sim_result *res) {
+	struct folio *folio = &sim_folios[idx];
+
+	SIM_OPS.folio_evicted(folio);
+	sim_list_unlink(&sim_nodes[idx]);
+	sim_table_del(&sim_page_table, sim_folio_keys[idx]);
+	memset(folio, 0, sizeof(*folio));
+	sim_free_folios[sim_nr_free++] = idx;
+	res->evictions++;
+}
+
+static void sim_evict(u32 batch, struct sim_result *res) {
+	struct cache_ext_eviction_ctx ctx = { .request_nr_folios_to_evict = batch };
+	u64 start, nodes = sim_nodes_visited;
+	u32 n, freed = 0;
+
+	sim_evict_round++;
+	start = sim_clock_ns();
+	SIM_OPS.evict_folios(&ctx, &sim_memcg);
+	res->evict_ns += sim_clock_ns() - start;
+	res->evict_calls++;
+	res->nodes_visited += sim_nodes_visited - nodes;
+
+	n = ctx.nr_folios_to_evict < CACHE_EXT_MAX_EVICT ? ctx.nr_folios_to_evict : CACHE_EXT_MAX_EVICT;
+	for (u32 i = 0; i < n; i++) {
+		struct folio *folio = ctx.folios_to_evict[i];
+		u64 idx = folio - sim_folios;
+
+		if (folio < sim_folios || idx >= sim_nr_folios || !folio->mapping ||
+		    sim_evict_stamp[idx] == sim_evict_round) {
+			res->invalid++;
+			continue;
+		}
+		sim_evict_stamp[idx] = sim_evict_round;
+		sim_drop(idx, res);
+		freed++;
+	}
+
+	if (freed == 0) {
+		u32 idx;
+
+		do
+			idx = sim_rand() % sim_nr_folios;
+		while (!sim_folios[idx].mapping);
+		sim_drop(idx, res);
+		res->fallbacks++;
+	}
+}
+
+#ifdef _CACHE_EXT_MRC_BPF_H
+// Smallest distance in bucket i. Keep in sync with cache_ext_mrc_bucket_start().
+static u64 sim_mrc_bucket_start(u32 i) {
+	if (i < 4)
+		return i;
+	return (u64)(4 + i % 4) << (i / 4 - 1);
+}
+
+/*
+ * Exact LRU stack distances of the shard's references: the distinct pages
+ * referenced since the page's previous reference, counted with a Fenwick
+ * tree over reference positions that marks each page's latest one. dists[d]
+ * counts the reuses at distance d, and the return value the first
+ * references, or -1 on failure.
+ */
+static s64 sim_stack_distances(struct sim_trace *trace, struct cmdline_args *args, u32 shard,
+			       u64 *dists, u64 *nr_refs) {
+	struct sim_table last;
+	u32 *tree, n = 0;
+	s64 cold = 0;
+
+	tree = calloc(trace->nr + 1, sizeof(*tree));
+	if (!tree || sim_table_init(&last, 1024)) {
+		free(tree);
+		return -1;
+	}
+
+	for (u64 i = 0; i < trace->nr; i++) {
+		u64 key = trace->recs[i].key;
+		u32 prev, pos;
+
+		if (args->shards > 1 && sim_shard_of(key, args->shards) != shard)
+			continue;
+		pos = ++n;
+
+		prev = sim_table_get(&last, key);
+		if (prev == SIM_TABLE_EMPTY) {
+			cold++;
+			if (2 * (last.nr + 1) > last.mask && sim_table_grow(&last)) {
+				cold = -1;
+				break;
+			}
+		} else {
+			u64 d = 0;
+
+			// Marks in (prev, pos): pages referenced since, each once
+			for (u32 j = pos - 1; j; j -= j & -j)
+				d += tree[j];
+			for (u32 j = prev; j; j -= j & -j)
+				d -= tree[j];
+			dists[d]++;
+			for (u32 j = prev; j <= trace->nr; j += j & -j)
+				tree[j]--;
+		}
+		for (u32 j = pos; j <= trace->nr; j += j & -j)
+			tree[j]++;
+		sim_table_put(&last, key, pos);
+	}
+
+	*nr_refs = n;
+	sim_table_free(&last);
+	free(tree);
+	return cold;
+}
+
+// Print the estimator's curve against the exact one, as a single write
+static void sim_mrc_check(struct sim_trace *trace, struct cmdline_args *args, u64 capacity,
+			  u32 shard) {
+	u64 key = (u64)&sim_memcg, nr_refs = 0, misses, *dists;
+	struct mrc_state *st = bpf_map_lookup_elem(&mrc_states, &key);
+	u64 est_misses, limit = capacity * 4 > 4096 ? capacity * 4 : 4096;
+	u64 from = (mrc_epoch_refs / 2) << mrc_rate_shift;
+	double err = 0;
+	u32 last = 0, nr_points = 0;
+	char *buf = NULL;
+	size_t len = 0;
+	s64 cold;
+	FILE *f;
+
+	if (!st || st->refs == 0 || trace->nr >= UINT32_MAX) {
+		fprintf(stderr, "MRC: no curve for cache_size %llu shard %u\n", capacity, shard);
+		return;
+	}
+
+	dists = calloc(trace->nr + 1, sizeof(*dists));
+	if (!dists)
+		return;
+	cold = sim_stack_distances(trace, args, shard, dists, &nr_refs);
+	f = open_memstream(&buf, &len);
+	if (cold < 0 || !f || nr_refs == 0)
+		goto out;
+
+	fprintf(f, "MRC for cache_size %llu shard %u (%llu sampled refs, %llu all):\n"
+		   "%12s %10s %10s\n", capacity, shard, st->refs, nr_refs, "pages",
+		"estimated", "exact");
+
+	for (u32 i = 0; i < MRC_NR_BUCKETS; i++)
+		if (st->hist[i])
+			last = i;
+
+	// Both in misses, shedding the hits below each point
+	est_misses = st->cold;
+	for (u32 i = 0; i < MRC_NR_BUCKETS; i++)
+		est_misses += st->hist[i];
+	misses = nr_refs;
+
+	for (u32 i = 1, d = 0; i <= last + 1 && i < MRC_NR_BUCKETS; i++) {
+		u64 pages = sim_mrc_bucket_start(i);
+		double est, exact;
+
+		est_misses -= st->hist[i - 1];
+		for (; d < pages && d < nr_refs; d++)
+			misses -= dists[d];
+
+		est = (double)est_misses / st->refs;
+		if (est > 1)
+			est = 1;
+		exact = (double)misses / nr_refs;
+		fprintf(f, "%12llu %10.4f %10.4f\n", pages << mrc_rate_shift, est, exact);
+		if (pages << mrc_rate_shift >= from && pages << mrc_rate_shift <= limit) {
+			err += est > exact ? est - exact : exact - est;
+			nr_points++;
+		}
+	}
+	fprintf(f, "Mean absolute error from %llu to %llu pages: %.4f over %u points\n", from,
+		limit, nr_points ? err / nr_points : 0, nr_points);
+
+out:
+	if (f) {
+		fclose(f);
+		fputs(buf, stderr);
+		free(buf);
+	}
+	free(dists);
+}
+#endif
+
+static int sim_run(struct sim_trace *trace, struct cmdline_args *args, u64 capacity,
+		   u32 shard, struct sim_result *res) {
+	u64 start = sim_clock_ns();
+
+	sim_seed(args->seed ^ sim_mix64(shard + 1));
+	if (sim_register_maps() || sim_alloc(trace, capacity) ||
+	    sim_configure(trace, args, capacity))
+		return -1;
+
+	if (SIM_OPS.init(&sim_memcg)) {
+		fprintf(stderr, "Policy init failed\n");
+		return -1;
+	}
+
+	for (u64 i = 0; i < trace->nr; i++) {
+		struct sim_rec *rec = &trace->recs[i];
+		struct folio *folio;
+		u32 idx;
+
+		if (args->shards > 1 && sim_shard_of(rec->key, args->shards) != shard)
+			continue;
+
+		sim_now = trace->timestamps ? rec->ts : i * args->ns_per_access;
+		sim_pid_tgid = (u64)rec->tid << 32 | rec->tid;
+		sim_timers_run();
+		res->refs++;
+
+		idx = sim_table_get(&sim_page_table, rec->key);
+		if (idx != SIM_TABLE_EMPTY) {
+			res->hits++;
+			SIM_OPS.folio_accessed(&sim_folios[idx]);
+			continue;
+		}
+
+		res->misses++;
+		if (sim_nr_free == 0)
+			sim_evict(args->batch, res);
+
+		idx = sim_free_folios[--sim_nr_free];
+		folio = &sim_folios[idx];
+		folio->flags = 1UL << PG_uptodate | 1UL << PG_lru;
+		folio->mapping = &sim_files[rec->key >> SIM_FILE_SHIFT].mapping;
+		folio->index = rec->key & SIM_INDEX_MASK;
+		folio->memcg_data = (unsigned long)&sim_memcg;
+		sim_folio_keys[idx] = rec->key;
+		sim_table_put(&sim_page_table, rec->key, idx);
+		SIM_OPS.folio_added(folio);
+	}
+
+	res->printks = sim_printks;
+	res->wall_ns = sim_clock_ns() - start;
+
+#ifdef _CACHE_EXT_MRC_BPF_H
+	if (args->mrc)
+		sim_mrc_check(trace, args, capacity, shard);
+#endif
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Jobs ///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+struct sim_job {
+	pid_t pid;
+	int fd;
+	u32 size;	// Index into args->sizes
+	u32 shard;
+};
+
+static pid_t sim_job_start(struct sim_trace *trace, struct cmdline_args *args,
+			   struct sim_job *job) {
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds)) {
+		perror("pipe");
+		return -1;
+	}
+
+	fflush(NULL);
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	if (pid == 0) {
+		struct sim_result res = { 0 };
+		u64 capacity = args->sizes[job->size] / args->shards;
+
+		close(fds[0]);
+		res.err = sim_run(trace, args, capacity ? capacity : 1, job->shard, &res);
+		if (write(fds[1], &res, sizeof(res)) != sizeof(res))
+			_exit(1);
+		_exit(0);
+	}
+
+	close(fds[1]);
+	job->pid = pid;
+	job->fd = fds[0];
+	return pid;
+}
+
+static int sim_job_finish(struct sim_job *job, struct sim_result *total) {
+	struct sim_result res = { .err = -1 };
+	int status;
+
+	if (read(job->fd, &res, sizeof(res)) != sizeof(res))
+		res.err = -1;
+	close(job->fd);
+	waitpid(job->pid, &status, 0);
+
+	if (res.err || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		fprintf(stderr, "Simulation of shard %u failed\n", job->shard);
+		return -1;
+	}
+
+	total->refs += res.refs;
+	total->hits += res.hits;
+	total->misses += res.misses;
+	total->evictions += res.evictions;
+	total->invalid += res.invalid;
+	total->fallbacks += res.fallbacks;
+	total->evict_calls += res.evict_calls;
+	total->evict_ns += res.evict_ns;
+	total->nodes_visited += res.nodes_visited;
+	total->printks += res.printks;
+	if (res.wall_ns > total->wall_ns)
+		total->wall_ns = res.wall_ns;
+	return 0;
+}
+
+static int sim_run_jobs(struct sim_trace *trace, struct cmdline_args *args,
+			struct sim_result *totals) {
+	u32 nr_jobs = args->nr_sizes * args->shards;
+	struct sim_job *jobs = calloc(nr_jobs, sizeof(*jobs));
+	u32 next = 0, done = 0, running = 0;
+	int ret = 0;
+
+	if (!jobs)
+		return -1;
+
+	while (done < nr_jobs) {
+		siginfo_t info;
+
+		while (next < nr_jobs && running < args->jobs) {
+			jobs[next].size = next / args->shards;
+			jobs[next].shard = next % args->shards;
+			if (sim_job_start(trace, args, &jobs[next]) < 0) {
+				ret = -1;
+				nr_jobs = next;
+				break;
+			}
+			next++;
+			running++;
+		}
+		if (running == 0)
+			break;
+
+		// Results are small enough to sit in the pipe until the child exits
+		if (waitid(P_ALL, 0, &info, WEXITED | WNOWAIT)) {
+			perror("waitid");
+			ret = -1;
+			break;
+		}
+		for (u32 i = 0; i < next; i++) {
+			if (jobs[i].pid != info.si_pid)
+				continue;
+			ret |= sim_job_finish(&jobs[i], &totals[jobs[i].size]);
+			jobs[i].pid = 0;
+			break;
+		}
+		running--;
+		done++;
+	}
+
+	free(jobs);
+	return ret;
+}
+
+static void sim_print(struct cmdline_args *args, struct sim_result *totals) {
+	if (args->csv)
+		printf("cache_size,refs,hits,misses,hit_ratio,evictions,invalid,fallbacks,"
+		       "evict_calls,nodes_per_eviction,ns_per_evict_call,printks,wall_ms\n");
+	else
+		printf("%12s %12s %8s %12s %12s %10s %12s %10s %12s %10s %8s\n",
+		       "cache_size", "refs", "hit%", "evictions", "invalid", "fallbacks",
+		       "evict_calls", "nodes/evict", "ns/call", "printks", "wall_ms");
+
+	for (u32 i = 0; i < args->nr_sizes; i++) {
+		struct sim_result *r = &totals[i];
+		double hit_ratio = r->refs ? (double)r->hits / r->refs : 0;
+		double nodes = r->evictions ? (double)r->nodes_visited / r->evictions : 0;
+		double ns = r->evict_calls ? (double)r->evict_ns / r->evict_calls : 0;
+
+		if (args->csv)
+			printf("%llu,%llu,%llu,%llu,%.6f,%llu,%llu,%llu,%llu,%.2f,%.0f,%llu,%.1f\n",
+			       args->sizes[i], r->refs, r->hits, r->misses, hit_ratio,
+			       r->evictions, r->invalid, r->fallbacks, r->evict_calls, nodes,
+			       ns, r->printks, r->wall_ns / 1e6);
+		else
+			printf("%12llu %12llu %8.2f %12llu %12llu %10llu %12llu %10.2f %12.0f %10llu %8.1f\n",
+			       args->sizes[i], r->refs, 100 * hit_ratio, r->evictions,
+			       r->invalid, r->fallbacks, r->evict_calls, nodes, ns,
+			       r->printks, r->wall_ns / 1e6);
+	}
+}
+
+int main(int argc, char **argv) {
+	struct cmdline_args args = {
+		.shards = 1,
+		.batch = 32,
+		.ns_per_access = 1000,
+	};
+	struct sim_trace trace = { 0 };
+	struct sim_result *totals = NULL;
+	int ret = 1;
+
+	args.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (parse_args(argc, argv, &args))
+		return 1;
+
+	if (sim_trace_load(args.trace, &trace))
+		goto cleanup;
+	fprintf(stderr, "Trace: %llu references to %u files (%llu evict records skipped)%s\n",
+		trace.nr, trace.nr_files, trace.nr_evicts,
+		trace.timestamps ? "" : ", no timestamps");
+
+	totals = calloc(args.nr_sizes, sizeof(*totals));
+	if (!totals)
+		goto cleanup;
+
+	if (sim_run_jobs(&trace, &args, totals))
+		goto cleanup;
+
+	sim_print(&args, totals);
+	ret = 0;
+
+cleanup:
+	free(totals);
+	free(trace.recs);
+	free(trace.inodes);
+	return ret;
+}
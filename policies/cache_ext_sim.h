@@ -0,0 +1,1046 @@
+#ifndef _CACHE_EXT_SIM_H
+#define _CACHE_EXT_SIM_H
+
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/*
+ * Userspace stand-in for vmlinux.h and the libbpf BPF headers, so a policy's
+ * .bpf.c compiles unmodified as plain C into the trace simulator (see
+ * cache_ext_sim.c, which includes this before the policy).
+ *
+ * It defines the include guards of vmlinux.h and bpf_{helpers,tracing,
+ * core_read}.h, so a generated vmlinux.h or installed libbpf headers are
+ * skipped; sim/ holds empty fallbacks for when they don't exist. Kernel
+ * structs only have the fields the policies use.
+ *
+ * Everything is single threaded, one simulated CPU:
+ *
+ *  - Maps are found by the address of their definition. The simulator
+ *    registers all of the policy's maps at startup with sim_map_register(),
+ *    from a list cache_ext_sim_maps.awk extracts from the preprocessed
+ *    source. Storage is allocated on first use, so sim_map_resize() must
+ *    come before that. Hash map values never move, like in the kernel, and
+ *    LRU hash maps recycle their oldest entry when full.
+ *  - bpf_ktime_get_ns() is the simulated clock, bpf_timer callbacks run
+ *    from sim_timers_run() once it passes their expiry.
+ *  - The list kfuncs follow the kernel's semantics. Iteration starts at the
+ *    head. list_iterate() leaves nodes in place and stops once the request
+ *    is met. list_iterate_extended() visits at most the nodes on the list
+ *    when it starts, moving each to the continue or evict position in opts.
+ *    list_sample() takes each victim as the lowest score of sample_size
+ *    random nodes. Every callback invocation counts in sim_nodes_visited.
+ *
+ * The simulator owns the folios: sim_folios is a dense array, like the
+ * vmemmap, so folio_store_home() spreads them the same way.
+ */
+
+#define __VMLINUX_H__
+#define __BPF_HELPERS__
+#define __BPF_TRACING_H__
+#define __BPF_CORE_READ_H__
+
+// vmlinux.h
+
+typedef unsigned char u8;
+typedef unsigned short u16;
+typedef unsigned int u32;
+typedef unsigned long long u64;
+typedef signed char s8;
+typedef short s16;
+typedef int s32;
+typedef long long s64;
+
+typedef u8 __u8;
+typedef u16 __u16;
+typedef u32 __u32;
+typedef u64 __u64;
+typedef s8 __s8;
+typedef s16 __s16;
+typedef s32 __s32;
+typedef s64 __s64;
+
+typedef unsigned int uint32_t;
+typedef unsigned long uintptr_t;
+
+#ifndef UINT32_MAX
+#define UINT32_MAX		(4294967295U)
+#endif
+
+#define UL(x) (x##UL)
+
+enum pageflags {
+	PG_locked,
+	PG_writeback,
+	PG_referenced,
+	PG_uptodate,
+	PG_dirty,
+	PG_lru,
+	PG_head,
+	PG_active,
+	PG_workingset,
+	PG_reclaim,
+	PG_unevictable,
+	PG_hugetlb = PG_active,  // Second page of a large folio
+};
+
+struct address_space;
+
+struct page {
+	unsigned long flags;
+	struct address_space *mapping;
+	unsigned long index;
+	unsigned long memcg_data;
+};
+
+/*
+ * Simulated folios are single pages, so _folio_nr_pages (in the first tail
+ * page in the kernel) is never read, and shares memcg_data's slot to keep
+ * folios the size of a page.
+ */
+struct folio {
+	union {
+		struct {
+			unsigned long flags;
+			struct address_space *mapping;
+			unsigned long index;
+			union {
+				unsigned long memcg_data;
+				unsigned int _folio_nr_pages;
+			};
+		};
+		struct page page;
+	};
+};
+
+struct super_block {
+	u32 s_dev;
+};
+
+struct inode {
+	unsigned long i_ino;
+	loff_t i_size;
+	struct super_block *i_sb;
+};
+
+struct address_space {
+	struct inode *host;
+};
+
+struct dentry {
+	struct dentry *d_parent;
+	struct inode *d_inode;
+	struct super_block *d_sb;
+};
+
+struct path {
+	struct dentry *dentry;
+};
+
+struct file {
+	unsigned int f_mode;
+	struct inode *f_inode;
+};
+
+struct readahead_control {
+	struct file *file;
+	struct address_space *mapping;
+	unsigned long _index;
+	unsigned int _nr_pages;
+};
+
+struct page_counter {
+	unsigned long max;
+};
+
+struct kernfs_node {
+	u64 id;
+};
+
+struct cgroup {
+	struct kernfs_node *kn;
+};
+
+struct cgroup_subsys_state {
+	struct cgroup *cgroup;
+};
+
+struct mem_cgroup {
+	struct cgroup_subsys_state css;
+	struct page_counter memory;
+};
+
+// include/linux/cache_ext.h
+
+#define CACHE_EXT_MAX_EVICT 32
+
+enum {
+	CACHE_EXT_CONTINUE_ITER = 0,
+	CACHE_EXT_EVICT_NODE,
+	CACHE_EXT_STOP_ITER,
+};
+
+enum {
+	CACHE_EXT_ITERATE_SELF = 0,  // As list: the iterated list. As mode: don't move.
+	CACHE_EXT_ITERATE_TAIL,
+	CACHE_EXT_ITERATE_HEAD,
+};
+
+struct cache_ext_list_node {
+	struct folio *folio;
+};
+
+struct cache_ext_eviction_ctx {
+	u64 request_nr_folios_to_evict;
+	u64 nr_folios_to_evict;
+	struct folio *folios_to_evict[CACHE_EXT_MAX_EVICT];
+	s64 scores[CACHE_EXT_MAX_EVICT];
+};
+
+struct cache_ext_iterate_opts {
+	u64 continue_list;
+	int continue_mode;
+	u64 evict_list;
+	int evict_mode;
+	u64 nr_folios_continue;  // Out
+	u64 nr_folios_evict;     // Out
+};
+
+struct sampling_options {
+	u32 sample_size;
+};
+
+struct cache_ext_ops {
+	s32 (*init)(struct mem_cgroup *memcg);
+	void (*evict_folios)(struct cache_ext_eviction_ctx *ctx, struct mem_cgroup *memcg);
+	void (*folio_accessed)(struct folio *folio);
+	void (*folio_evicted)(struct folio *folio);
+	void (*folio_added)(struct folio *folio);
+};
+
+// include/uapi/linux/bpf.h
+
+enum {
+	BPF_MAP_TYPE_HASH = 1,
+	BPF_MAP_TYPE_ARRAY = 2,
+	BPF_MAP_TYPE_PERCPU_HASH = 5,
+	BPF_MAP_TYPE_PERCPU_ARRAY = 6,
+	BPF_MAP_TYPE_LRU_HASH = 9,
+	BPF_MAP_TYPE_LRU_PERCPU_HASH = 10,
+	BPF_MAP_TYPE_QUEUE = 22,
+	BPF_MAP_TYPE_RINGBUF = 27,
+};
+
+enum {
+	BPF_ANY = 0,
+	BPF_NOEXIST = 1,
+	BPF_EXIST = 2,
+};
+
+#define BPF_F_MMAPABLE		(1U << 10)
+
+#define BPF_RB_NO_WAKEUP	(1ULL << 0)
+#define BPF_RB_FORCE_WAKEUP	(1ULL << 1)
+#define BPF_RB_AVAIL_DATA	0
+#define BPF_RB_RING_SIZE	1
+
+struct bpf_timer {
+	void *callback;
+	void *map;
+	u32 key;
+	bool armed;
+	u64 expires;
+};
+
+// bpf_helpers.h / bpf_tracing.h
+
+#define SEC(name) __attribute__((section(name), used))
+
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
+
+#define __ksym
+#define __weak __attribute__((weak))
+
+#define __uint(name, val) int (*name)[val]
+#define __type(name, val) typeof(val) *name
+#define __array(name, val) typeof(val) *name[]
+
+#define BPF_PROG(name, args...) name(args)
+
+#define bpf_for(i, start, end) for ((i) = (start); (i) < (end); (i)++)
+
+#define bpf_printk(fmt, ...) sim_printk(fmt, ##__VA_ARGS__)
+
+///////////////////////////////////////////////////////////////////////////////
+// Simulator state ////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#define SIM_ENOENT	2
+#define SIM_E2BIG	7
+#define SIM_EEXIST	17
+#define SIM_EINVAL	22
+
+u64 sim_now;			// Simulated ns, returned by bpf_ktime_get_ns()
+u64 sim_pid_tgid = 1;		// Task of the current access
+u64 sim_nodes_visited;		// List kfunc callback invocations
+u64 sim_printks;
+bool sim_verbose;
+static u64 sim_rand_state = 0x2545F4914F6CDD1DULL;
+
+int sim_printk(const char *fmt, ...) {
+	va_list ap;
+
+	sim_printks++;
+	if (!sim_verbose)
+		return 0;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	return 0;
+}
+
+void sim_seed(u64 seed) {
+	sim_rand_state = seed ? seed : 0x2545F4914F6CDD1DULL;
+}
+
+// xorshift64*
+u64 sim_rand(void) {
+	sim_rand_state ^= sim_rand_state >> 12;
+	sim_rand_state ^= sim_rand_state << 25;
+	sim_rand_state ^= sim_rand_state >> 27;
+	return sim_rand_state * 0x2545F4914F6CDD1DULL;
+}
+
+static inline u64 sim_mix64(u64 h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/*
+ * Write a rodata variable (const volatile in the policy) before the
+ * simulation starts, like a loader does through skel->rodata.
+ */
+int sim_poke(const volatile void *dst, const void *src, size_t size) {
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)dst & ~(page - 1);
+	uintptr_t end = ((uintptr_t)dst + size + page - 1) & ~(page - 1);
+
+	if (mprotect((void *)start, end - start, PROT_READ | PROT_WRITE)) {
+		perror("Failed to make rodata writable");
+		return -1;
+	}
+	memcpy((void *)dst, src, size);
+	return 0;
+}
+
+#define sim_set_rodata(var, val)				\
+({								\
+	__auto_type __v = (var);				\
+	__v = (val);						\
+	sim_poke(&(var), &__v, sizeof(__v));			\
+})
+
+///////////////////////////////////////////////////////////////////////////////
+// Maps ///////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#define SIM_MAX_MAPS		64
+#define SIM_HASH_EMPTY		0
+#define SIM_HASH_TOMBSTONE	UINT32_MAX
+
+struct sim_map {
+	const void *def;
+	const char *name;
+	u32 type;
+	u32 key_size;
+	u32 value_size;
+	u32 max_entries;
+	bool allocated;
+
+	u8 *values;		// Arrays and queues: the values. Hashes: key + value slabs.
+	u32 slab_size;
+
+	// Hashes: index of slab slot + 1, SIM_HASH_EMPTY or SIM_HASH_TOMBSTONE
+	u32 *index;
+	u32 index_mask;
+	u32 nr_tombstones;
+	u32 *free_slots;
+	u32 nr_free;
+	u32 lru_next;		// Next slot recycled by a full LRU hash
+	u64 *slab_hash;		// Hash of the key in each used slab slot
+
+	u32 head;		// Queues
+	u32 count;
+};
+
+static struct sim_map sim_maps[SIM_MAX_MAPS];
+static u32 sim_nr_maps;
+
+static inline bool sim_map_is_hash(const struct sim_map *m) {
+	return m->type == BPF_MAP_TYPE_HASH || m->type == BPF_MAP_TYPE_PERCPU_HASH ||
+	       m->type == BPF_MAP_TYPE_LRU_HASH || m->type == BPF_MAP_TYPE_LRU_PERCPU_HASH;
+}
+
+static inline bool sim_map_is_lru(const struct sim_map *m) {
+	return m->type == BPF_MAP_TYPE_LRU_HASH || m->type == BPF_MAP_TYPE_LRU_PERCPU_HASH;
+}
+
+int sim_map_register(const void *def, const char *name, u32 type, u32 key_size,
+		     u32 value_size, u32 max_entries) {
+	struct sim_map *m;
+
+	if (sim_nr_maps == SIM_MAX_MAPS) {
+		fprintf(stderr, "Too many maps, can't register %s\n", name);
+		return -1;
+	}
+
+	m = &sim_maps[sim_nr_maps++];
+	memset(m, 0, sizeof(*m));
+	m->def = def;
+	m->name = name;
+	m->type = type;
+	m->key_size = key_size;
+	m->value_size = value_size;
+	m->max_entries = max_entries;
+	return 0;
+}
+
+static struct sim_map *sim_map_find(const void *def) {
+	static struct sim_map *last;
+
+	if (last && last->def == def)
+		return last;
+
+	for (u32 i = 0; i < sim_nr_maps; i++) {
+		if (sim_maps[i].def == def) {
+			last = &sim_maps[i];
+			return last;
+		}
+	}
+
+	fprintf(stderr, "Map at %p was not registered\n", def);
+	abort();
+}
+
+// Change max_entries, before the map is first used
+int sim_map_resize(const void *def, u32 max_entries) {
+	struct sim_map *m = sim_map_find(def);
+
+	if (m->allocated) {
+		fprintf(stderr, "Can't resize map %s once it is in use\n", m->name);
+		return -1;
+	}
+	m->max_entries = max_entries;
+	return 0;
+}
+
+static int sim_map_alloc(struct sim_map *m) {
+	u64 cap = 2;
+
+	m->allocated = true;
+	if (!sim_map_is_hash(m)) {
+		m->values = calloc(m->max_entries ? m->max_entries : 1, m->value_size ? m->value_size : 1);
+		return m->values ? 0 : -1;
+	}
+
+	while (cap < 2ULL * m->max_entries)
+		cap <<= 1;
+	m->slab_size = (m->key_size + m->value_size + 7) & ~7U;
+	m->values = calloc(m->max_entries, m->slab_size);
+	m->slab_hash = calloc(m->max_entries, sizeof(*m->slab_hash));
+	m->index = calloc(cap, sizeof(*m->index));
+	m->free_slots = malloc(m->max_entries * sizeof(*m->free_slots));
+	m->index_mask = cap - 1;
+	if (!m->values || !m->slab_hash || !m->index || !m->free_slots)
+		return -1;
+
+	for (u32 i = 0; i < m->max_entries; i++)
+		m->free_slots[i] = m->max_entries - 1 - i;
+	m->nr_free = m->max_entries;
+	return 0;
+}
+
+static inline struct sim_map *sim_map_get(const void *def) {
+	struct sim_map *m = sim_map_find(def);
+
+	if (!m->allocated && sim_map_alloc(m)) {
+		fprintf(stderr, "Failed to allocate map %s\n", m->name);
+		abort();
+	}
+	return m;
+}
+
+static inline u64 sim_hash_key(const void *key, u32 size) {
+	const u8 *p = key;
+	u64 h = 0x9E3779B97F4A7C15ULL ^ size;
+
+	for (; size >= 8; p += 8, size -= 8) {
+		u64 w;
+		memcpy(&w, p, 8);
+		h = sim_mix64(h ^ w);
+	}
+	if (size) {
+		u64 w = 0;
+		memcpy(&w, p, size);
+		h = sim_mix64(h ^ w);
+	}
+	return h;
+}
+
+static inline u8 *sim_slab_key(struct sim_map *m, u32 slot) {
+	return m->values + (u64)slot * m->slab_size;
+}
+
+static inline u8 *sim_slab_value(struct sim_map *m, u32 slot) {
+	return sim_slab_key(m, slot) + m->key_size;
+}
+
+// Index position of key, or of the empty entry ending its probe sequence
+static u32 sim_hash_probe(struct sim_map *m, const void *key, u64 hash, bool *found) {
+	u32 i = hash & m->index_mask;
+
+	for (;; i = (i + 1) & m->index_mask) {
+		u32 e = m->index[i];
+
+		if (e == SIM_HASH_EMPTY) {
+			*found = false;
+			return i;
+		}
+		if (e != SIM_HASH_TOMBSTONE && m->slab_hash[e - 1] == hash &&
+		    !memcmp(sim_slab_key(m, e - 1), key, m->key_size)) {
+			*found = true;
+			return i;
+		}
+	}
+}
+
+// Rebuild the index without tombstones. Values stay where they are.
+static void sim_hash_rebuild(struct sim_map *m) {
+	memset(m->index, 0, (m->index_mask + 1ULL) * sizeof(*m->index));
+	m->nr_tombstones = 0;
+
+	for (u32 slot = 0; slot < m->max_entries; slot++) {
+		u32 i;
+
+		if (!m->slab_hash[slot])
+			continue;
+		for (i = m->slab_hash[slot] & m->index_mask; m->index[i] != SIM_HASH_EMPTY;
+		     i = (i + 1) & m->index_mask)
+			;
+		m->index[i] = slot + 1;
+	}
+}
+
+static void sim_hash_remove(struct sim_map *m, u32 pos) {
+	u32 slot = m->index[pos] - 1;
+
+	m->index[pos] = SIM_HASH_TOMBSTONE;
+	m->slab_hash[slot] = 0;
+	m->free_slots[m->nr_free++] = slot;
+	if (++m->nr_tombstones > (m->index_mask + 1) / 4)
+		sim_hash_rebuild(m);
+}
+
+// Recycle the oldest used slot of a full LRU hash
+static void sim_hash_recycle(struct sim_map *m) {
+	for (u32 n = 0; n < m->max_entries; n++) {
+		u32 slot = m->lru_next;
+		bool found;
+		u32 pos;
+
+		m->lru_next = (m->lru_next + 1) % m->max_entries;
+		if (!m->slab_hash[slot])
+			continue;
+		pos = sim_hash_probe(m, sim_slab_key(m, slot), m->slab_hash[slot], &found);
+		if (found) {
+			sim_hash_remove(m, pos);
+			return;
+		}
+	}
+}
+
+void *bpf_map_lookup_elem(void *def, const void *key) {
+	struct sim_map *m = sim_map_get(def);
+	bool found;
+	u32 pos;
+
+	if (!sim_map_is_hash(m)) {
+		u32 idx = *(const u32 *)key;
+
+		if (m->type == BPF_MAP_TYPE_QUEUE || idx >= m->max_entries)
+			return NULL;
+		return m->values + (u64)idx * m->value_size;
+	}
+
+	pos = sim_hash_probe(m, key, sim_hash_key(key, m->key_size) | 1, &found);
+	return found ? sim_slab_value(m, m->index[pos] - 1) : NULL;
+}
+
+long bpf_map_update_elem(void *def, const void *key, const void *value, u64 flags) {
+	struct sim_map *m = sim_map_get(def);
+	u64 hash;
+	bool found;
+	u32 pos, slot;
+
+	if (!sim_map_is_hash(m)) {
+		u32 idx = *(const u32 *)key;
+
+		if (m->type == BPF_MAP_TYPE_QUEUE || idx >= m->max_entries)
+			return -SIM_E2BIG;
+		if (flags == BPF_NOEXIST)
+			return -SIM_EEXIST;
+		memcpy(m->values + (u64)idx * m->value_size, value, m->value_size);
+		return 0;
+	}
+
+	// Zero marks a free slab slot, so keep bit 0 set
+	hash = sim_hash_key(key, m->key_size) | 1;
+	pos = sim_hash_probe(m, key, hash, &found);
+	if (found) {
+		if (flags == BPF_NOEXIST)
+			return -SIM_EEXIST;
+		memcpy(sim_slab_value(m, m->index[pos] - 1), value, m->value_size);
+		return 0;
+	}
+	if (flags == BPF_EXIST)
+		return -SIM_ENOENT;
+
+	if (!m->nr_free) {
+		if (!sim_map_is_lru(m))
+			return -SIM_E2BIG;
+		sim_hash_recycle(m);
+		pos = sim_hash_probe(m, key, hash, &found);
+	}
+
+	slot = m->free_slots[--m->nr_free];
+	memcpy(sim_slab_key(m, slot), key, m->key_size);
+	memcpy(sim_slab_value(m, slot), value, m->value_size);
+	m->slab_hash[slot] = hash;
+	m->index[pos] = slot + 1;
+	return 0;
+}
+
+long bpf_map_delete_elem(void *def, const void *key) {
+	struct sim_map *m = sim_map_get(def);
+	bool found;
+	u32 pos;
+
+	if (!sim_map_is_hash(m))
+		return -SIM_EINVAL;
+
+	pos = sim_hash_probe(m, key, sim_hash_key(key, m->key_size) | 1, &found);
+	if (!found)
+		return -SIM_ENOENT;
+	sim_hash_remove(m, pos);
+	return 0;
+}
+
+long bpf_map_push_elem(void *def, const void *value, u64 flags) {
+	struct sim_map *m = sim_map_get(def);
+
+	if (m->type != BPF_MAP_TYPE_QUEUE)
+		return -SIM_EINVAL;
+	if (m->count == m->max_entries) {
+		if (!(flags & BPF_EXIST))
+			return -SIM_E2BIG;
+		m->head = (m->head + 1) % m->max_entries;
+		m->count--;
+	}
+	memcpy(m->values + (u64)((m->head + m->count) % m->max_entries) * m->value_size,
+	       value, m->value_size);
+	m->count++;
+	return 0;
+}
+
+long bpf_map_pop_elem(void *def, void *value) {
+	struct sim_map *m = sim_map_get(def);
+
+	if (m->type != BPF_MAP_TYPE_QUEUE)
+		return -SIM_EINVAL;
+	if (!m->count)
+		return -SIM_ENOENT;
+	memcpy(value, m->values + (u64)m->head * m->value_size, m->value_size);
+	m->head = (m->head + 1) % m->max_entries;
+	m->count--;
+	return 0;
+}
+
+// Ring buffers drop everything, the simulator has no consumer
+static u8 sim_ringbuf_scratch[1 << 16];
+
+void *bpf_ringbuf_reserve(void *def, u64 size, u64 flags) {
+	return size <= sizeof(sim_ringbuf_scratch) ? sim_ringbuf_scratch : NULL;
+}
+
+void bpf_ringbuf_submit(void *data, u64 flags) {
+}
+
+void bpf_ringbuf_discard(void *data, u64 flags) {
+}
+
+long bpf_ringbuf_output(void *def, void *data, u64 size, u64 flags) {
+	return 0;
+}
+
+u64 bpf_ringbuf_query(void *def, u64 flags) {
+	return flags == BPF_RB_RING_SIZE ? sim_map_get(def)->max_entries : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Helpers and timers /////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+u64 bpf_ktime_get_ns(void) {
+	return sim_now;
+}
+
+u32 bpf_get_smp_processor_id(void) {
+	return 0;
+}
+
+u64 bpf_get_current_pid_tgid(void) {
+	return sim_pid_tgid;
+}
+
+u32 bpf_get_prandom_u32(void) {
+	return sim_rand() >> 32;
+}
+
+#define SIM_MAX_TIMERS		64
+#define SIM_MAX_TIMER_RUNS	1024	// Per sim_timers_run(), against self-rearming loops
+
+static struct bpf_timer *sim_timers[SIM_MAX_TIMERS];
+static u32 sim_nr_timers;
+
+long bpf_timer_init(struct bpf_timer *timer, void *def, u64 flags) {
+	struct sim_map *m = sim_map_get(def);
+	u64 off = (u8 *)timer - m->values;
+
+	// Timers are only supported in array values
+	if (m->type != BPF_MAP_TYPE_ARRAY || (u8 *)timer < m->values ||
+	    off >= (u64)m->max_entries * m->value_size || sim_nr_timers == SIM_MAX_TIMERS)
+		return -SIM_EINVAL;
+
+	timer->map = def;
+	timer->key = off / m->value_size;
+	timer->armed = false;
+	sim_timers[sim_nr_timers++] = timer;
+	return 0;
+}
+
+long bpf_timer_set_callback(struct bpf_timer *timer, void *callback) {
+	if (!timer->map)
+		return -SIM_EINVAL;
+	timer->callback = callback;
+	return 0;
+}
+
+long bpf_timer_start(struct bpf_timer *timer, u64 nsecs, u64 flags) {
+	if (!timer->map || !timer->callback)
+		return -SIM_EINVAL;
+	timer->expires = sim_now + nsecs;
+	timer->armed = true;
+	return 0;
+}
+
+long bpf_timer_cancel(struct bpf_timer *timer) {
+	bool was_armed = timer->armed;
+
+	timer->armed = false;
+	return was_armed;
+}
+
+// Run the callbacks of all timers that expired by sim_now
+void sim_timers_run(void) {
+	for (u32 runs = 0; runs < SIM_MAX_TIMER_RUNS;) {
+		bool ran = false;
+
+		for (u32 i = 0; i < sim_nr_timers; i++) {
+			struct bpf_timer *t = sim_timers[i];
+			struct sim_map *m;
+			u32 key;
+
+			if (!t->armed || t->expires > sim_now)
+				continue;
+
+			t->armed = false;
+			m = sim_map_get(t->map);
+			key = t->key;
+			((int (*)(void *, u32 *, void *))t->callback)(t->map, &key,
+				m->values + (u64)key * m->value_size);
+			ran = true;
+			runs++;
+		}
+		if (!ran)
+			break;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// cache_ext lists ////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+#define SIM_MAX_LISTS 64
+
+struct sim_list;
+
+struct sim_node {
+	struct cache_ext_list_node node;  // Passed to the policy's callbacks
+	struct sim_node *prev, *next;
+	struct sim_list *list;		  // NULL if on no list
+	u32 pos;			  // In list->vec
+	u32 mark;			  // Eviction round it was proposed in
+};
+
+struct sim_list {
+	struct sim_node head;
+	struct sim_node **vec;		  // All nodes, unordered, for sampling
+	u32 nr;
+	u32 cap;
+};
+
+struct folio *sim_folios;
+struct sim_node *sim_nodes;
+u32 sim_nr_folios;
+u32 sim_evict_round;
+
+static struct sim_list sim_lists[SIM_MAX_LISTS];
+static u32 sim_nr_lists;
+
+static inline struct sim_node *sim_folio_node(struct folio *folio) {
+	u64 idx = folio - sim_folios;
+
+	if (folio < sim_folios || idx >= sim_nr_folios)
+		return NULL;
+	return &sim_nodes[idx];
+}
+
+static inline struct sim_list *sim_list_get(u64 list) {
+	if (list == 0 || list > sim_nr_lists)
+		return NULL;
+	return &sim_lists[list - 1];
+}
+
+static inline u64 sim_list_id(struct sim_list *list) {
+	return list - sim_lists + 1;
+}
+
+static void sim_list_unlink(struct sim_node *n) {
+	struct sim_list *l = n->list;
+
+	if (!l)
+		return;
+
+	n->prev->next = n->next;
+	n->next->prev = n->prev;
+	l->vec[n->pos] = l->vec[--l->nr];
+	l->vec[n->pos]->pos = n->pos;
+	n->list = NULL;
+}
+
+static int sim_list_link(struct sim_list *l, struct sim_node *n, bool tail) {
+	struct sim_node *at = tail ? l->head.prev : &l->head;
+
+	if (l->nr == l->cap) {
+		u32 cap = l->cap ? 2 * l->cap : 1024;
+		struct sim_node **vec = realloc(l->vec, cap * sizeof(*vec));
+
+		if (!vec)
+			return -SIM_E2BIG;
+		l->vec = vec;
+		l->cap = cap;
+	}
+
+	n->prev = at;
+	n->next = at->next;
+	at->next->prev = n;
+	at->next = n;
+	n->list = l;
+	n->pos = l->nr;
+	l->vec[l->nr++] = n;
+	return 0;
+}
+
+u64 bpf_cache_ext_ds_registry_new_list(struct mem_cgroup *memcg) {
+	struct sim_list *l;
+
+	if (sim_nr_lists == SIM_MAX_LISTS)
+		return 0;
+
+	l = &sim_lists[sim_nr_lists++];
+	l->head.prev = l->head.next = &l->head;
+	return sim_list_id(l);
+}
+
+static int sim_list_add(u64 list, struct folio *folio, bool tail) {
+	struct sim_list *l = sim_list_get(list);
+	struct sim_node *n = sim_folio_node(folio);
+
+	if (!l || !n || n->list)
+		return -SIM_EINVAL;
+	return sim_list_link(l, n, tail);
+}
+
+int bpf_cache_ext_list_add(u64 list, struct folio *folio) {
+	return sim_list_add(list, folio, false);
+}
+
+int bpf_cache_ext_list_add_tail(u64 list, struct folio *folio) {
+	return sim_list_add(list, folio, true);
+}
+
+int bpf_cache_ext_list_del(struct folio *folio) {
+	struct sim_node *n = sim_folio_node(folio);
+
+	if (!n || !n->list)
+		return -SIM_EINVAL;
+	sim_list_unlink(n);
+	return 0;
+}
+
+int bpf_cache_ext_list_move(u64 list, struct folio *folio, bool tail) {
+	struct sim_list *l = sim_list_get(list);
+	struct sim_node *n = sim_folio_node(folio);
+
+	if (!l || !n || !n->list)
+		return -SIM_EINVAL;
+	sim_list_unlink(n);
+	return sim_list_link(l, n, tail);
+}
+
+static inline bool sim_ctx_full(struct cache_ext_eviction_ctx *ctx) {
+	return ctx->nr_folios_to_evict >= ctx->request_nr_folios_to_evict ||
+	       ctx->nr_folios_to_evict >= CACHE_EXT_MAX_EVICT;
+}
+
+static inline void sim_ctx_propose(struct cache_ext_eviction_ctx *ctx, struct sim_node *n,
+				   s64 score) {
+	ctx->folios_to_evict[ctx->nr_folios_to_evict] = n->node.folio;
+	ctx->scores[ctx->nr_folios_to_evict] = score;
+	ctx->nr_folios_to_evict++;
+	n->mark = sim_evict_round;
+}
+
+int bpf_cache_ext_list_iterate(struct mem_cgroup *memcg, u64 list,
+			       int(iter_fn)(int idx, struct cache_ext_list_node *node),
+			       struct cache_ext_eviction_ctx *ctx) {
+	struct sim_list *l = sim_list_get(list);
+	struct sim_node *n, *next;
+	int idx = 0;
+
+	if (!l)
+		return -SIM_EINVAL;
+
+	// Callbacks may move their own node, so fetch the next one first
+	for (n = l->head.next; n != &l->head && !sim_ctx_full(ctx); n = next) {
+		int ret;
+
+		next = n->next;
+		sim_nodes_visited++;
+		ret = iter_fn(idx++, &n->node);
+		if (ret == CACHE_EXT_STOP_ITER)
+			break;
+		if (ret == CACHE_EXT_EVICT_NODE)
+			sim_ctx_propose(ctx, n, 0);
+	}
+	return 0;
+}
+
+static void sim_iterate_place(struct sim_list *self, struct sim_node *n, u64 list, int mode) {
+	struct sim_list *l = list == CACHE_EXT_ITERATE_SELF ? self : sim_list_get(list);
+
+	if (!l || (l == self && mode == CACHE_EXT_ITERATE_SELF))
+		return;
+	sim_list_unlink(n);
+	sim_list_link(l, n, mode != CACHE_EXT_ITERATE_HEAD);
+}
+
+int bpf_cache_ext_list_iterate_extended(struct mem_cgroup *memcg, u64 list,
+					int(iter_fn)(int idx, struct cache_ext_list_node *node),
+					struct cache_ext_iterate_opts *opts,
+					struct cache_ext_eviction_ctx *ctx) {
+	struct sim_list *l = sim_list_get(list);
+	struct sim_node *n, *next;
+	u32 budget;
+	int idx = 0;
+
+	if (!l)
+		return -SIM_EINVAL;
+
+	opts->nr_folios_continue = 0;
+	opts->nr_folios_evict = 0;
+	budget = l->nr;
+
+	for (n = l->head.next; n != &l->head && budget-- && !sim_ctx_full(ctx); n = next) {
+		int ret;
+
+		next = n->next;
+		sim_nodes_visited++;
+		ret = iter_fn(idx++, &n->node);
+		if (ret == CACHE_EXT_STOP_ITER)
+			break;
+		if (ret == CACHE_EXT_EVICT_NODE) {
+			sim_ctx_propose(ctx, n, 0);
+			opts->nr_folios_evict++;
+			sim_iterate_place(l, n, opts->evict_list, opts->evict_mode);
+		} else {
+			opts->nr_folios_continue++;
+			sim_iterate_place(l, n, opts->continue_list, opts->continue_mode);
+		}
+	}
+	return 0;
+}
+
+int bpf_cache_ext_list_sample(struct mem_cgroup *memcg, u64 list,
+			      s64(score_fn)(struct cache_ext_list_node *a),
+			      struct sampling_options *opts,
+			      struct cache_ext_eviction_ctx *ctx) {
+	struct sim_list *l = sim_list_get(list);
+	u32 sample_size;
+
+	if (!l)
+		return -SIM_EINVAL;
+
+	sample_size = opts->sample_size ? opts->sample_size : 1;
+	while (!sim_ctx_full(ctx) && ctx->nr_folios_to_evict < l->nr) {
+		struct sim_node *best = NULL;
+		s64 best_score = 0;
+
+		for (u32 i = 0; i < sample_size && l->nr; i++) {
+			struct sim_node *n = l->vec[sim_rand() % l->nr];
+			s64 score;
+
+			if (n->mark == sim_evict_round)
+				continue;
+			sim_nodes_visited++;
+			score = score_fn(&n->node);
+			if (n->list != l)
+				continue;  // Moved away by score_fn
+			if (!best || score < best_score) {
+				best = n;
+				best_score = score;
+			}
+		}
+		if (best)
+			sim_ctx_propose(ctx, best, best_score);
+	}
+	return 0;
+}
+
+#endif /* _CACHE_EXT_SIM_H */
@@ -0,0 +1,28 @@
+# List the BPF maps defined in a policy, for cache_ext_sim.c.
+#
+# Input is the policy preprocessed against cache_ext_sim.h, where a map is
+#   struct { int (*type)[N]; typeof(K) *key; ... } name __attribute__((section(".maps"), used));
+# Output is one SIM_MAP(name, key_size, value_size) per map. Maps without a
+# key or value (queues, ring buffers) get 0 for it.
+
+/^#/ { next }
+
+{ src = src " " $0 }
+
+END {
+	while (match(src, /struct[ \t]*\{[^{}]*\}[ \t]*[A-Za-z_][A-Za-z_0-9]*[ \t]*__attribute__[ \t]*\(\([ \t]*section[ \t]*\([ \t]*"\.maps"/)) {
+		def = substr(src, RSTART, RLENGTH)
+		src = substr(src, RSTART + RLENGTH)
+
+		body = def
+		sub(/^struct[ \t]*\{/, "", body)
+		sub(/\}.*/, "", body)
+		name = def
+		sub(/^[^}]*\}[ \t]*/, "", name)
+		sub(/[ \t]*__attribute__.*/, "", name)
+
+		key = body ~ /\*[ \t]*key[ \t]*;/ ? "SIM_SIZE(" name ", key)" : "0"
+		value = body ~ /\*[ \t]*value[ \t]*;/ ? "SIM_SIZE(" name ", value)" : "0"
+		printf "SIM_MAP(%s, %s, %s)\n", name, key, value
+	}
+}
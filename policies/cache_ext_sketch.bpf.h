@@ -0,0 +1,184 @@
+#ifndef _CACHE_EXT_SKETCH_BPF_H
+#define _CACHE_EXT_SKETCH_BPF_H 1
+
+#include "cache_ext_lib.bpf.h"
+#include "cache_ext_state.bpf.h"
+
+/*
+ * Count-min sketch of page access frequencies, for TinyLFU admission.
+ *
+ * The sketch is keyed by folio_key_hash(), {address_space, offset}, so it
+ * keeps counting a page after it is evicted, and an evicted page that comes
+ * back is known to be popular without any per-page ghost entry. It is a
+ * BPF_MAP_TYPE_ARRAY of blocks that the loader sizes from the cgroup's pages
+ * (see cache_ext_sketch.h). A page hashes to one block, and to one 4-bit
+ * counter in each of the block's SKETCH_DEPTH words, one word per row. Its
+ * estimate is the smallest of those counters, so collisions can only make a
+ * page look more popular than it is.
+ *
+ * Counters saturate at 15. Every sketch_sample_size increments, the halving
+ * timer halves all counters, a batch of blocks per tick, so estimates follow
+ * recent popularity, as in the TinyLFU paper's reset. The sketch must be set
+ * up once from init with sketch_init().
+ *
+ * The increment clock is model state, so a policy that saves sketch_map with
+ * --state (see cache_ext_state.h) keeps its frequencies across a restart.
+ */
+
+#define SKETCH_DEPTH		4
+#define SKETCH_COUNTER_MAX	15
+#define SKETCH_DEFAULT_BLOCKS	(1 << 16)	// Must be power of two
+#define SKETCH_HALVE_BATCH	4096	// Blocks per halving tick
+#define SKETCH_HALVE_TICK_NS	100000ULL
+
+// Set from userspace
+const volatile u64 sketch_block_mask = SKETCH_DEFAULT_BLOCKS - 1;
+const volatile u64 sketch_sample_size = SKETCH_DEFAULT_BLOCKS * 4 * 10;
+
+struct sketch_block {
+	u64 rows[SKETCH_DEPTH];	// 16 counters each
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, u32);
+	__type(value, struct sketch_block);
+	__uint(max_entries, SKETCH_DEFAULT_BLOCKS);
+} sketch_map SEC(".maps");
+
+struct sketch_timer {
+	struct bpf_timer timer;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, u32);
+	__type(value, struct sketch_timer);
+	__uint(max_entries, 1);
+} sketch_timers SEC(".maps");
+
+// Increments since the last halving
+static u64 sketch_additions __model = 0;
+
+// Halving round in progress
+static u32 sketch_halving = 0;
+static u32 sketch_next_block = 0;
+static u32 sketch_timer_ready = 0;
+
+static inline struct sketch_block *sketch_get_block(u64 hash)
+{
+	u32 idx = hash & sketch_block_mask;
+	return bpf_map_lookup_elem(&sketch_map, &idx);
+}
+
+// Bit offset of the page's counter in row, from hash bits above the block index
+static __always_inline u32 sketch_counter_shift(u64 hash, int row)
+{
+	return ((hash >> (32 + 4 * row)) & 15) * 4;
+}
+
+static int sketch_halve_tick(void *map, int *key, struct sketch_timer *t)
+{
+	u32 first = sketch_next_block;
+	u32 i;
+
+	bpf_for(i, first, first + SKETCH_HALVE_BATCH) {
+		struct sketch_block *b;
+
+		if (i > sketch_block_mask)
+			break;
+		b = bpf_map_lookup_elem(&sketch_map, &i);
+		if (!b)
+			break;
+		// Racy with increments, which at worst lose one count
+		for (int row = 0; row < SKETCH_DEPTH; row++)
+			b->rows[row] = (b->rows[row] >> 1) & 0x7777777777777777ULL;
+	}
+
+	sketch_next_block = first + SKETCH_HALVE_BATCH;
+	if (sketch_next_block <= sketch_block_mask) {
+		bpf_timer_start(&t->timer, SKETCH_HALVE_TICK_NS, 0);
+		return 0;
+	}
+
+	__sync_fetch_and_sub(&sketch_additions, sketch_sample_size / 2);
+	sketch_next_block = 0;
+	WRITE_ONCE(sketch_halving, 0);
+	return 0;
+}
+
+// Start a halving round unless one is still in flight
+static inline void sketch_request_halving(void)
+{
+	struct sketch_timer *t;
+	u32 key = 0;
+
+	if (__sync_val_compare_and_swap(&sketch_halving, 0, 1) != 0)
+		return;
+
+	t = bpf_map_lookup_elem(&sketch_timers, &key);
+	if (!t || bpf_timer_start(&t->timer, 0, 0)) {
+		WRITE_ONCE(sketch_halving, 0);
+		bpf_printk("cache_ext: Failed to start sketch halving\n");
+	}
+}
+
+// Set up the halving timer. Call from init, once per cgroup is fine.
+static inline int sketch_init(void)
+{
+	struct sketch_timer *t;
+	u32 key = 0;
+
+	if (__sync_val_compare_and_swap(&sketch_timer_ready, 0, 1) != 0)
+		return 0;
+
+	t = bpf_map_lookup_elem(&sketch_timers, &key);
+	if (!t || bpf_timer_init(&t->timer, &sketch_timers, CLOCK_MONOTONIC) ||
+	    bpf_timer_set_callback(&t->timer, sketch_halve_tick)) {
+		bpf_printk("cache_ext: init: Failed to set up sketch timer\n");
+		return -1;
+	}
+	return 0;
+}
+
+// Count one access to folio's page
+static inline void sketch_increment(struct folio *folio)
+{
+	u64 hash = folio_key_hash(folio);
+	struct sketch_block *b = sketch_get_block(hash);
+
+	if (!b)
+		return;
+
+	for (int row = 0; row < SKETCH_DEPTH; row++) {
+		u32 shift = sketch_counter_shift(hash, row);
+
+		// A race past the check can carry into the next counter, rarely
+		if (((READ_ONCE(b->rows[row]) >> shift) & 15) < SKETCH_COUNTER_MAX)
+			__sync_fetch_and_add(&b->rows[row], 1ULL << shift);
+	}
+
+	if (__sync_fetch_and_add(&sketch_additions, 1) + 1 >= sketch_sample_size)
+		sketch_request_halving();
+}
+
+// Estimated recent accesses to folio's page, 0 to SKETCH_COUNTER_MAX
+static inline u32 sketch_estimate(struct folio *folio)
+{
+	u64 hash = folio_key_hash(folio);
+	struct sketch_block *b = sketch_get_block(hash);
+	u32 est = SKETCH_COUNTER_MAX;
+
+	if (!b)
+		return 0;
+
+	for (int row = 0; row < SKETCH_DEPTH; row++) {
+		u32 count = (READ_ONCE(b->rows[row]) >> sketch_counter_shift(hash, row)) & 15;
+
+		if (count < est)
+			est = count;
+	}
+	return est;
+}
+
+#endif /* _CACHE_EXT_SKETCH_BPF_H */
@@ -0,0 +1,44 @@
+#ifndef _CACHE_EXT_SKETCH_H
+#define _CACHE_EXT_SKETCH_H
+
+#include "cache_ext_folio_store.h"
+
+#define SKETCH_PAGES_PER_BLOCK		4	// 4 counters per row and page
+#define SKETCH_SAMPLE_FACTOR		10	// Halve every 10 cache sizes of accesses
+#define SKETCH_MIN_BLOCKS		(1ULL << 10)
+#define SKETCH_MAX_BLOCKS		(1ULL << 28)
+
+#define sketch_map(skel)		((skel)->maps.sketch_map)
+#define sketch_block_mask(skel)		((skel)->rodata->sketch_block_mask)
+#define sketch_sample_size(skel)	((skel)->rodata->sketch_sample_size)
+
+/*
+ * Size the frequency sketch for mem_bytes of page cache. Must be called
+ * between skel__open() and skel__load(). The table gets a block per
+ * SKETCH_PAGES_PER_BLOCK pages, rounded up to a power of two, which is 8
+ * bytes per page, and its counters are halved after SKETCH_SAMPLE_FACTOR
+ * times as many accesses as there are pages.
+ */
+int sketch_resize_bytes(struct bpf_map *map, __u64 *block_mask, __u64 *sample_size,
+			uint64_t mem_bytes) {
+	uint64_t page_size = sysconf(_SC_PAGESIZE);
+	uint64_t nr_pages = mem_bytes / page_size;
+	uint64_t blocks = SKETCH_MIN_BLOCKS;
+
+	while (blocks * SKETCH_PAGES_PER_BLOCK < nr_pages && blocks < SKETCH_MAX_BLOCKS)
+		blocks <<= 1;
+
+	if (bpf_map__set_max_entries(map, blocks)) {
+		perror("Failed to resize sketch_map");
+		return -1;
+	}
+	*block_mask = blocks - 1;
+	*sample_size = nr_pages * SKETCH_SAMPLE_FACTOR;
+
+	fprintf(stderr, "Frequency sketch: %lu blocks (%lu KiB), halved every %lu accesses\n",
+		blocks, blocks * bpf_map__value_size(map) >> 10, (uint64_t)*sample_size);
+
+	return 0;
+}
+
+#endif /* _CACHE_EXT_SKETCH_H */
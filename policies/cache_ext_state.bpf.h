@@ -0,0 +1,28 @@
+#ifndef _CACHE_EXT_STATE_BPF_H
+#define _CACHE_EXT_STATE_BPF_H 1
+
+#include "cache_ext_lib.bpf.h"
+
+/*
+ * Learned policy state that survives a loader restart (see cache_ext_state.h).
+ *
+ * Globals tagged __model go to the .data.model section instead of .bss.
+ * With --state, the loader saves that section at exit, along with whatever
+ * maps the policy lists, and loads it back as the section's initial value
+ * on the next start. Only put state there that does not refer to the
+ * previous instance's lists: hit statistics, densities, clocks, decisions.
+ *
+ * init must not clobber restored state, so it guards its model setup with
+ *
+ *	if (!model_valid) {
+ *		...cold start defaults...
+ *		model_valid = 1;
+ *	}
+ */
+
+#define __model SEC(".data.model")
+
+// Set once init has built the model, restored with it
+static u32 model_valid __model = 0;
+
+#endif /* _CACHE_EXT_STATE_BPF_H */
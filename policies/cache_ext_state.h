@@ -0,0 +1,588 @@
+#ifndef _CACHE_EXT_STATE_H
+#define _CACHE_EXT_STATE_H
+
+#include <argp.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <bpf/bpf.h>
+#include <bpf/btf.h>
+#include <bpf/libbpf.h>
+
+/*
+ * Warm restart: save a policy's learned state at exit and load it back on
+ * the next start (see cache_ext_state.bpf.h).
+ *
+ * --state FILE names the snapshot. A policy lists what makes up its model,
+ * the .data.model section plus any maps, and the loader calls
+ *
+ *	cache_ext_state_restore(&state, skel->obj, "lhd", lhd_state);	// before skel__load()
+ *	cache_ext_state_apply(&state);					// after skel__load()
+ *	...
+ *	cache_ext_state_save(&state);		// after bpf_link__destroy()
+ *	cache_ext_state_free(&state);
+ *
+ * The section is restored as its initial value, so init already sees it.
+ * Maps are written back after load, before the policy is attached.
+ *
+ * Every saved section records its map's type, key and value size, entry
+ * count and a hash of its BTF layout. A section that no longer matches, e.g.
+ * after the policy's metadata struct changed or the cgroup was resized, is
+ * dropped and that part of the policy starts cold. So is the whole file if
+ * it was saved by another policy. Array slots that are all zero are not
+ * saved. Sections flagged CACHE_EXT_STATE_FOLIO_STORE have every owner
+ * tagged on restore, and folio_store_lookup_restored() claims them back
+ * as their folios show up.
+ *
+ * The options are a child of cache_ext_stats_argp, like --profile.
+ */
+
+#define CACHE_EXT_STATE_MAGIC		"CXSTATE"
+#define CACHE_EXT_STATE_FORMAT		1
+#define CACHE_EXT_STATE_MODEL		".data.model"
+#define CACHE_EXT_STATE_NAME_LEN	32
+#define CACHE_EXT_STATE_CHUNK		4096	// Entries per batch syscall
+#define CACHE_EXT_STATE_FOLIO_STORE	(1U << 0)
+#define CACHE_EXT_STATE_RESTORED_BIT	1ULL	// Keep in sync with FOLIO_STORE_RESTORED
+
+struct cache_ext_state_map {
+	const char *name;	// Map name, or CACHE_EXT_STATE_MODEL
+	unsigned int flags;
+};
+
+struct cache_ext_state_hdr {
+	char magic[8];
+	__u32 format;
+	__u32 nr_sections;
+	char policy[CACHE_EXT_STATE_NAME_LEN];
+};
+
+/*
+ * Followed by chunks of { __u32 nr; keys[nr]; values[nr] }, the last one
+ * with nr = 0. Per-CPU values hold nr_cpus copies, each padded to 8 bytes.
+ */
+struct cache_ext_state_sec {
+	char name[CACHE_EXT_STATE_NAME_LEN];
+	__u32 map_type;
+	__u32 key_size;
+	__u32 value_size;
+	__u32 max_entries;
+	__u32 nr_cpus;		// 0 unless per-CPU
+	__u32 flags;
+	__u64 layout;		// Hash of the value's BTF type
+};
+
+struct cache_ext_state_args {
+	const char *path;	// NULL: no warm restart
+};
+
+struct cache_ext_state_args cache_ext_state_args = { 0 };
+
+struct cache_ext_state {
+	struct bpf_object *obj;
+	const char *policy;
+	const struct cache_ext_state_map *maps;
+	char *buf;		// Snapshot read by restore, NULL if none
+	size_t len;
+	bool loaded;		// Set by apply: the maps hold a live model worth saving
+};
+
+enum {
+	CACHE_EXT_STATE_OPT_STATE = 0x1700,
+};
+
+static struct argp_option cache_ext_state_options[] = {
+	{ "state", CACHE_EXT_STATE_OPT_STATE, "FILE", 0,
+	  "Resume from the policy state saved in FILE, and save it there at exit" },
+	{ 0 }
+};
+
+static error_t cache_ext_state_parse_opt(int key, char *arg, struct argp_state *state)
+{
+	switch (key) {
+	case CACHE_EXT_STATE_OPT_STATE:
+		cache_ext_state_args.path = arg;
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static struct argp cache_ext_state_argp = {
+	cache_ext_state_options, cache_ext_state_parse_opt, 0, 0
+};
+
+static __u64 cache_ext_state_hash(__u64 h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	// FNV-1a
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+static __u64 cache_ext_state_hash_str(__u64 h, const struct btf *btf, __u32 name_off)
+{
+	const char *name = btf__name_by_offset(btf, name_off);
+
+	return name ? cache_ext_state_hash(h, name, strlen(name) + 1) : h;
+}
+
+// Hash a BTF type by shape: kinds, names, sizes and offsets, not type ids
+static __u64 cache_ext_state_hash_type(__u64 h, const struct btf *btf, __u32 id, int depth)
+{
+	const struct btf_type *t = btf__type_by_id(btf, id);
+	__u32 kind, vlen;
+
+	if (t == NULL || depth > 8)
+		return h;
+
+	kind = btf_kind(t);
+	vlen = btf_vlen(t);
+	h = cache_ext_state_hash(h, &kind, sizeof(kind));
+	h = cache_ext_state_hash_str(h, btf, t->name_off);
+
+	switch (kind) {
+	case BTF_KIND_INT:
+	case BTF_KIND_ENUM:
+	case BTF_KIND_ENUM64:
+	case BTF_KIND_FLOAT:
+		h = cache_ext_state_hash(h, &t->size, sizeof(t->size));
+		break;
+	case BTF_KIND_STRUCT:
+	case BTF_KIND_UNION: {
+		const struct btf_member *m = btf_members(t);
+
+		h = cache_ext_state_hash(h, &t->size, sizeof(t->size));
+		for (__u32 i = 0; i < vlen; i++, m++) {
+			h = cache_ext_state_hash_str(h, btf, m->name_off);
+			h = cache_ext_state_hash(h, &m->offset, sizeof(m->offset));
+			h = cache_ext_state_hash_type(h, btf, m->type, depth + 1);
+		}
+		break;
+	}
+	case BTF_KIND_ARRAY: {
+		const struct btf_array *a = btf_array(t);
+
+		h = cache_ext_state_hash(h, &a->nelems, sizeof(a->nelems));
+		h = cache_ext_state_hash_type(h, btf, a->type, depth + 1);
+		break;
+	}
+	case BTF_KIND_DATASEC: {
+		const struct btf_var_secinfo *v = btf_var_secinfos(t);
+
+		for (__u32 i = 0; i < vlen; i++, v++) {
+			h = cache_ext_state_hash(h, &v->offset, sizeof(v->offset));
+			h = cache_ext_state_hash(h, &v->size, sizeof(v->size));
+			h = cache_ext_state_hash_type(h, btf, v->type, depth + 1);
+		}
+		break;
+	}
+	case BTF_KIND_VAR:
+	case BTF_KIND_TYPEDEF:
+	case BTF_KIND_VOLATILE:
+	case BTF_KIND_CONST:
+	case BTF_KIND_RESTRICT:
+	case BTF_KIND_TYPE_TAG:
+		h = cache_ext_state_hash_type(h, btf, t->type, depth + 1);
+		break;
+	default:
+		// Pointers only matter by size, their target is not saved
+		break;
+	}
+	return h;
+}
+
+static struct bpf_map *cache_ext_state_find(struct bpf_object *obj, const char *name)
+{
+	struct bpf_map *map;
+
+	// Internal maps are named after the object, match on the section suffix
+	bpf_object__for_each_map(map, obj) {
+		const char *n = bpf_map__name(map);
+		size_t len = strlen(n), want = strlen(name);
+
+		if (strcmp(n, name) == 0 ||
+		    (bpf_map__is_internal(map) && len >= want && strcmp(n + len - want, name) == 0))
+			return map;
+	}
+	return NULL;
+}
+
+static bool cache_ext_state_percpu(enum bpf_map_type type)
+{
+	return type == BPF_MAP_TYPE_PERCPU_ARRAY || type == BPF_MAP_TYPE_PERCPU_HASH;
+}
+
+static void cache_ext_state_describe(struct bpf_object *obj, struct bpf_map *map,
+				     const struct cache_ext_state_map *m,
+				     struct cache_ext_state_sec *sec)
+{
+	const struct btf *btf = bpf_object__btf(obj);
+
+	memset(sec, 0, sizeof(*sec));
+	snprintf(sec->name, sizeof(sec->name), "%s", m->name);
+	sec->map_type = bpf_map__type(map);
+	sec->key_size = bpf_map__key_size(map);
+	sec->value_size = bpf_map__value_size(map);
+	sec->max_entries = bpf_map__max_entries(map);
+	if (cache_ext_state_percpu(sec->map_type))
+		sec->nr_cpus = libbpf_num_possible_cpus();
+	sec->flags = m->flags;
+	sec->layout = 0xcbf29ce484222325ULL;
+	if (btf && bpf_map__btf_value_type_id(map))
+		sec->layout = cache_ext_state_hash_type(sec->layout, btf,
+							bpf_map__btf_value_type_id(map), 0);
+}
+
+// Size of one entry's value as the batch syscalls lay it out
+static size_t cache_ext_state_value_len(const struct cache_ext_state_sec *sec)
+{
+	if (sec->nr_cpus)
+		return (size_t)((sec->value_size + 7) & ~7U) * sec->nr_cpus;
+	return sec->value_size;
+}
+
+static bool cache_ext_state_is_zero(const char *p, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		if (p[i])
+			return false;
+	return true;
+}
+
+/*
+ * Read the snapshot and hand .data.model to libbpf as the section's initial
+ * value. Must be called between skel__open() and skel__load(), after any
+ * map resizing. A missing or unusable file means a cold start, not an
+ * error.
+ */
+int cache_ext_state_restore(struct cache_ext_state *st, struct bpf_object *obj,
+			    const char *policy, const struct cache_ext_state_map *maps) {
+	struct cache_ext_state_hdr *hdr;
+	size_t off;
+	FILE *f;
+	long len;
+
+	memset(st, 0, sizeof(*st));
+	st->obj = obj;
+	st->policy = policy;
+	st->maps = maps;
+
+	if (cache_ext_state_args.path == NULL)
+		return 0;
+
+	f = fopen(cache_ext_state_args.path, "r");
+	if (f == NULL) {
+		if (errno != ENOENT)
+			fprintf(stderr, "Failed to open %s: %s\n", cache_ext_state_args.path,
+				strerror(errno));
+		fprintf(stderr, "No saved state, starting cold\n");
+		return 0;
+	}
+	if (fseek(f, 0, SEEK_END) || (len = ftell(f)) < 0 || fseek(f, 0, SEEK_SET)) {
+		perror("Failed to size state file");
+		fclose(f);
+		return 0;
+	}
+	st->buf = malloc(len ? len : 1);
+	if (st->buf == NULL) {
+		perror("Failed to allocate state buffer");
+		fclose(f);
+		return -1;
+	}
+	if (fread(st->buf, 1, len, f) != (size_t)len) {
+		fprintf(stderr, "Failed to read %s\n", cache_ext_state_args.path);
+		fclose(f);
+		goto cold;
+	}
+	fclose(f);
+	st->len = len;
+
+	hdr = (struct cache_ext_state_hdr *)st->buf;
+	if (st->len < sizeof(*hdr) || memcmp(hdr->magic, CACHE_EXT_STATE_MAGIC, 8) ||
+	    hdr->format != CACHE_EXT_STATE_FORMAT) {
+		fprintf(stderr, "%s is not a state file of this version\n", cache_ext_state_args.path);
+		goto cold;
+	}
+	if (strncmp(hdr->policy, policy, sizeof(hdr->policy))) {
+		fprintf(stderr, "%s holds %.*s state, not %s\n", cache_ext_state_args.path,
+			(int)sizeof(hdr->policy), hdr->policy, policy);
+		goto cold;
+	}
+
+	// Only the model section is applied here, apply() does the maps
+	off = sizeof(*hdr);
+	for (__u32 i = 0; i < hdr->nr_sections; i++) {
+		struct cache_ext_state_sec sec, want;
+		const struct cache_ext_state_map *m;
+		struct bpf_map *map = NULL;
+		char *name = st->buf + off;	// Cleared to make apply() skip the section
+		size_t vlen, first = 0;
+		__u32 nr;
+
+		if (off + sizeof(sec) > st->len)
+			goto corrupt;
+		memcpy(&sec, st->buf + off, sizeof(sec));
+		off += sizeof(sec);
+		vlen = cache_ext_state_value_len(&sec);
+
+		for (m = maps; m->name; m++)
+			if (strncmp(m->name, sec.name, sizeof(sec.name)) == 0)
+				break;
+		if (m->name)
+			map = cache_ext_state_find(obj, m->name);
+		if (map)
+			cache_ext_state_describe(obj, map, m, &want);
+		if (map == NULL || memcmp(&want, &sec, sizeof(want))) {
+			fprintf(stderr, "Dropping saved %.*s, its layout changed\n",
+				(int)sizeof(sec.name), sec.name);
+			name[0] = '\0';
+		}
+
+		// Walk the chunks to find the next section
+		do {
+			if (off + sizeof(nr) > st->len)
+				goto corrupt;
+			memcpy(&nr, st->buf + off, sizeof(nr));
+			off += sizeof(nr);
+			if (nr > CACHE_EXT_STATE_CHUNK ||
+			    off + (size_t)nr * (sec.key_size + vlen) > st->len)
+				goto corrupt;
+			if (first == 0 && nr)
+				first = off + (size_t)nr * sec.key_size;
+			off += (size_t)nr * (sec.key_size + vlen);
+		} while (nr);
+
+		if (name[0] && bpf_map__is_internal(map)) {
+			if (first && bpf_map__set_initial_value(map, st->buf + first, sec.value_size)) {
+				fprintf(stderr, "Failed to restore %s: %s\n", m->name, strerror(errno));
+				goto cold;
+			}
+			name[0] = '\0';
+		}
+	}
+
+	fprintf(stderr, "Restoring %s state from %s\n", policy, cache_ext_state_args.path);
+	return 0;
+
+corrupt:
+	fprintf(stderr, "%s is truncated or corrupt\n", cache_ext_state_args.path);
+cold:
+	fprintf(stderr, "Starting cold\n");
+	free(st->buf);
+	st->buf = NULL;
+	st->len = 0;
+	return 0;
+}
+
+/*
+ * Write the saved maps back. Must be called after skel__load() and before
+ * the policy is attached.
+ */
+int cache_ext_state_apply(struct cache_ext_state *st) {
+	struct cache_ext_state_hdr *hdr = (struct cache_ext_state_hdr *)st->buf;
+	size_t off = sizeof(*hdr);
+
+	st->loaded = true;
+	if (st->buf == NULL)
+		return 0;
+
+	for (__u32 i = 0; i < hdr->nr_sections; i++) {
+		struct cache_ext_state_sec sec;
+		struct bpf_map *map = NULL;
+		__u64 restored = 0;
+		size_t vlen;
+		__u32 nr;
+
+		memcpy(&sec, st->buf + off, sizeof(sec));
+		off += sizeof(sec);
+		vlen = cache_ext_state_value_len(&sec);
+		if (sec.name[0])
+			map = cache_ext_state_find(st->obj, sec.name);
+
+		// restore() has checked the chunk bounds
+		for (;;) {
+			LIBBPF_OPTS(bpf_map_batch_opts, opts, .elem_flags = BPF_ANY);
+			char *keys, *values;
+			__u32 count;
+
+			memcpy(&nr, st->buf + off, sizeof(nr));
+			off += sizeof(nr);
+			keys = st->buf + off;
+			values = keys + (size_t)nr * sec.key_size;
+			off += (size_t)nr * (sec.key_size + vlen);
+			if (nr == 0)
+				break;
+			if (map == NULL)
+				continue;
+
+			// The owner is the first field of struct folio_store_slot
+			if (sec.flags & CACHE_EXT_STATE_FOLIO_STORE) {
+				for (__u32 j = 0; j < nr; j++) {
+					char *v = values + (size_t)j * vlen;
+					__u64 owner;
+
+					memcpy(&owner, v, sizeof(owner));
+					if (owner)
+						owner |= CACHE_EXT_STATE_RESTORED_BIT;
+					memcpy(v, &owner, sizeof(owner));
+				}
+			}
+
+			count = nr;
+			if (bpf_map_update_batch(bpf_map__fd(map), keys, values, &count, &opts)) {
+				fprintf(stderr, "Failed to restore %s: %s\n", sec.name, strerror(errno));
+				return -1;
+			}
+			restored += nr;
+		}
+		if (map)
+			fprintf(stderr, "Restored %llu %s entries\n", (unsigned long long)restored,
+				sec.name);
+	}
+
+	free(st->buf);
+	st->buf = NULL;
+	return 0;
+}
+
+static int cache_ext_state_write_map(FILE *f, struct bpf_map *map,
+				     const struct cache_ext_state_sec *sec) {
+	size_t vlen = cache_ext_state_value_len(sec);
+	bool skip_zero = sec->map_type == BPF_MAP_TYPE_ARRAY ||
+			 sec->map_type == BPF_MAP_TYPE_PERCPU_ARRAY;
+	char *keys = malloc((size_t)CACHE_EXT_STATE_CHUNK * sec->key_size);
+	char *values = malloc((size_t)CACHE_EXT_STATE_CHUNK * vlen);
+	__u64 batch = 0;
+	bool first = true, done = false;
+	__u32 nr = 0;
+	int ret = -1;
+
+	if (keys == NULL || values == NULL) {
+		perror("Failed to allocate state buffers");
+		goto out;
+	}
+
+	while (!done) {
+		LIBBPF_OPTS(bpf_map_batch_opts, opts);
+		__u32 count = CACHE_EXT_STATE_CHUNK;
+		int err;
+
+		// Array maps take a u32 batch cursor, hash maps a bucket index of the same size
+		err = bpf_map_lookup_batch(bpf_map__fd(map), first ? NULL : &batch, &batch,
+					   keys, values, &count, &opts);
+		if (err && errno != ENOENT) {
+			fprintf(stderr, "Failed to read %s: %s\n", sec->name, strerror(errno));
+			goto out;
+		}
+		done = err != 0;
+		first = false;
+
+		// Compact the batch in place, dropping empty array slots
+		nr = 0;
+		for (__u32 j = 0; j < count; j++) {
+			char *v = values + (size_t)j * vlen;
+
+			if (skip_zero && cache_ext_state_is_zero(v, vlen))
+				continue;
+			if (nr != j) {
+				memmove(keys + (size_t)nr * sec->key_size,
+					keys + (size_t)j * sec->key_size, sec->key_size);
+				memmove(values + (size_t)nr * vlen, v, vlen);
+			}
+			nr++;
+		}
+		if (nr == 0)
+			continue;
+		if (fwrite(&nr, sizeof(nr), 1, f) != 1 ||
+		    fwrite(keys, sec->key_size, nr, f) != nr ||
+		    fwrite(values, vlen, nr, f) != nr)
+			goto out;
+	}
+
+	nr = 0;
+	if (fwrite(&nr, sizeof(nr), 1, f) == 1)
+		ret = 0;
+out:
+	free(keys);
+	free(values);
+	return ret;
+}
+
+/*
+ * Save the model for the next start. Call once the policy is detached, so
+ * the snapshot is consistent. Does nothing unless the policy got loaded.
+ */
+int cache_ext_state_save(struct cache_ext_state *st) {
+	struct cache_ext_state_hdr hdr = { 0 };
+	const struct cache_ext_state_map *m;
+	char tmp[PATH_MAX];
+	FILE *f;
+
+	if (cache_ext_state_args.path == NULL || !st->loaded)
+		return 0;
+
+	memcpy(hdr.magic, CACHE_EXT_STATE_MAGIC, sizeof(CACHE_EXT_STATE_MAGIC));
+	hdr.format = CACHE_EXT_STATE_FORMAT;
+	snprintf(hdr.policy, sizeof(hdr.policy), "%s", st->policy);
+	for (m = st->maps; m->name; m++)
+		if (cache_ext_state_find(st->obj, m->name))
+			hdr.nr_sections++;
+
+	// Write aside and rename, so a crash never leaves a torn snapshot
+	snprintf(tmp, sizeof(tmp), "%s.tmp", cache_ext_state_args.path);
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Failed to create %s: %s\n", tmp, strerror(errno));
+		return -1;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		goto err;
+
+	for (m = st->maps; m->name; m++) {
+		struct bpf_map *map = cache_ext_state_find(st->obj, m->name);
+		struct cache_ext_state_sec sec;
+
+		if (map == NULL)
+			continue;
+		cache_ext_state_describe(st->obj, map, m, &sec);
+		if (fwrite(&sec, sizeof(sec), 1, f) != 1 || cache_ext_state_write_map(f, map, &sec))
+			goto err;
+	}
+
+	if (fclose(f)) {
+		f = NULL;
+		goto err;
+	}
+	if (rename(tmp, cache_ext_state_args.path)) {
+		fprintf(stderr, "Failed to replace %s: %s\n", cache_ext_state_args.path,
+			strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+	fprintf(stderr, "Saved %s state to %s\n", st->policy, cache_ext_state_args.path);
+	return 0;
+
+err:
+	fprintf(stderr, "Failed to write %s\n", tmp);
+	if (f)
+		fclose(f);
+	unlink(tmp);
+	return -1;
+}
+
+void cache_ext_state_free(struct cache_ext_state *st) {
+	free(st->buf);
+	st->buf = NULL;
+}
+
+#endif /* _CACHE_EXT_STATE_H */
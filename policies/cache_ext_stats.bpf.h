@@ -0,0 +1,64 @@
+#ifndef _CACHE_EXT_STATS_BPF_H
+#define _CACHE_EXT_STATS_BPF_H 1
+
+/*
+ * Always-on counters shared by all policies.
+ *
+ * Each CPU owns a cache line aligned slot of a BPF_F_MMAPABLE array, so the
+ * hot path is an uncontended add on a line no other CPU writes. Userspace
+ * maps the array and sums the slots without any syscalls, see
+ * cache_ext_stats.h. The counter ids must match enum cache_ext_stat there.
+ *
+ * Requires cache_ext_lib.bpf.h (MAX_CPUS). The loader shrinks the map to
+ * the number of possible CPUs with cache_ext_stats_resize().
+ */
+
+enum cache_ext_stat {
+	CACHE_EXT_STAT_HITS = 0,
+	CACHE_EXT_STAT_MISSES,
+	CACHE_EXT_STAT_EVICTIONS,
+	CACHE_EXT_STAT_SCANNED,		// Nodes visited by iterate/sample callbacks
+	CACHE_EXT_STAT_GHOST_HITS,
+	CACHE_EXT_STAT_POLICY_SWITCHES,
+	CACHE_EXT_STAT_EVENTS_DROPPED,	// Ring buffer records lost, see cache_ext_events.bpf.h
+	CACHE_EXT_STAT_RA_INSERTED,	// Prefetched pages put on probation, see cache_ext_readahead.bpf.h
+	CACHE_EXT_STAT_RA_USED,		// ... and accessed before eviction
+	CACHE_EXT_STAT_RA_WASTED,	// ... and evicted untouched
+	CACHE_EXT_STAT_DIRTY_PARKED,	// Folios parked for writeback, see cache_ext_dirty.bpf.h
+	CACHE_EXT_STAT_DIRTY_UNPARKED,	// ... and returned once clean
+	CACHE_EXT_STAT_HANDOFF_ADOPTED,	// Folios taken over on a live swap, see cache_ext_handoff.bpf.h
+	CACHE_EXT_STAT_COST_SAMPLES,	// Demand misses timed, see cache_ext_cost.bpf.h
+	CACHE_EXT_STAT_COST_WAIT_NS,	// ... and the time readers waited on them
+	NR_CACHE_EXT_STATS,
+};
+
+#define CACHE_EXT_STATS_SLOT_WORDS 16	// 128 bytes, two cache lines
+
+struct cache_ext_stats_slot {
+	u64 val[CACHE_EXT_STATS_SLOT_WORDS];
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(map_flags, BPF_F_MMAPABLE);
+	__type(key, u32);
+	__type(value, struct cache_ext_stats_slot);
+	__uint(max_entries, MAX_CPUS);
+} cache_ext_stats_map SEC(".maps");
+
+static __always_inline void cache_ext_stat_add(enum cache_ext_stat stat, u64 n)
+{
+	u32 cpu = bpf_get_smp_processor_id();
+	struct cache_ext_stats_slot *slot;
+
+	if (stat >= NR_CACHE_EXT_STATS)
+		return;
+
+	slot = bpf_map_lookup_elem(&cache_ext_stats_map, &cpu);
+	if (slot)
+		__sync_fetch_and_add(&slot->val[stat], n);
+}
+
+#define cache_ext_stat_inc(stat) cache_ext_stat_add(stat, 1)
+
+#endif /* _CACHE_EXT_STATS_BPF_H */
@@ -0,0 +1,388 @@
+#ifndef _CACHE_EXT_STATS_H
+#define _CACHE_EXT_STATS_H
+
+#include <argp.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "cache_ext_prof.h"
+#include "cache_ext_trace.h"
+#include "cache_ext_swap.h"
+#include "cache_ext_state.h"
+
+/*
+ * Userspace half of the shared stats region (see cache_ext_stats.bpf.h).
+ *
+ * The per-CPU slots are mmap()ed read-only and summed in place, so reading
+ * the counters costs no syscalls. An optional exporter thread dumps them in
+ * Prometheus text format or as JSON lines every --stats_interval ms, either
+ * to stdout or to --stats_file, which is replaced atomically so it can be
+ * scraped by node_exporter's textfile collector.
+ *
+ * Loaders add cache_ext_stats_argp as an argp child, call
+ * cache_ext_stats_resize() before skel__load() and cache_ext_exporter_start()
+ * after attaching.
+ */
+
+// Keep in sync with cache_ext_stats.bpf.h
+enum cache_ext_stat {
+	CACHE_EXT_STAT_HITS = 0,
+	CACHE_EXT_STAT_MISSES,
+	CACHE_EXT_STAT_EVICTIONS,
+	CACHE_EXT_STAT_SCANNED,
+	CACHE_EXT_STAT_GHOST_HITS,
+	CACHE_EXT_STAT_POLICY_SWITCHES,
+	CACHE_EXT_STAT_EVENTS_DROPPED,
+	CACHE_EXT_STAT_RA_INSERTED,
+	CACHE_EXT_STAT_RA_USED,
+	CACHE_EXT_STAT_RA_WASTED,
+	CACHE_EXT_STAT_DIRTY_PARKED,
+	CACHE_EXT_STAT_DIRTY_UNPARKED,
+	CACHE_EXT_STAT_HANDOFF_ADOPTED,
+	CACHE_EXT_STAT_COST_SAMPLES,
+	CACHE_EXT_STAT_COST_WAIT_NS,
+	NR_CACHE_EXT_STATS,
+};
+
+#define CACHE_EXT_STATS_SLOT_WORDS	16
+#define CACHE_EXT_STATS_FILE_INTERVAL	10000	// ms, if only --stats_file is given
+
+#define cache_ext_stats_map(skel)	((skel)->maps.cache_ext_stats_map)
+
+static const char *cache_ext_stat_names[NR_CACHE_EXT_STATS] = {
+	"hits", "misses", "evictions", "nodes_scanned", "ghost_hits", "policy_switches",
+	"events_dropped", "readahead_inserted", "readahead_used", "readahead_wasted",
+	"dirty_parked", "dirty_unparked", "handoff_adopted", "cost_samples", "cost_wait_ns",
+};
+
+static const char *cache_ext_stat_help[NR_CACHE_EXT_STATS] = {
+	"Accesses to pages already in the cache",
+	"Pages added to the cache",
+	"Pages evicted from the cache",
+	"List nodes visited while selecting eviction candidates",
+	"Misses on pages remembered by a ghost queue",
+	"Policy switches made by an adaptive policy",
+	"Ring buffer events lost because the ring was full",
+	"Prefetched pages put on readahead probation",
+	"Prefetched pages accessed while on probation",
+	"Prefetched pages evicted without ever being accessed",
+	"Dirty or writeback folios moved off the eviction lists",
+	"Parked folios returned to the eviction lists after writeback",
+	"Folios of a replaced policy adopted after a live swap",
+	"Demand misses timed for refault cost estimates",
+	"Nanoseconds readers waited on timed misses",
+};
+
+enum cache_ext_stats_format {
+	CACHE_EXT_STATS_PROMETHEUS,
+	CACHE_EXT_STATS_JSON,
+};
+
+struct cache_ext_stats_args {
+	unsigned long interval_ms;	// 0: exporter off
+	enum cache_ext_stats_format format;
+	char *file;			// NULL: stdout
+};
+
+struct cache_ext_stats_args cache_ext_stats_args = { 0 };
+
+enum {
+	CACHE_EXT_STATS_OPT_INTERVAL = 0x1000,
+	CACHE_EXT_STATS_OPT_FORMAT,
+	CACHE_EXT_STATS_OPT_FILE,
+};
+
+static struct argp_option cache_ext_stats_options[] = {
+	{ "stats_interval", CACHE_EXT_STATS_OPT_INTERVAL, "MS", 0,
+	  "Export cache_ext stats every MS milliseconds (default: off)" },
+	{ "stats_format", CACHE_EXT_STATS_OPT_FORMAT, "FMT", 0,
+	  "Stats format: prometheus or json (default: prometheus)" },
+	{ "stats_file", CACHE_EXT_STATS_OPT_FILE, "PATH", 0,
+	  "Write stats to PATH instead of stdout" },
+	{ 0 }
+};
+
+static error_t cache_ext_stats_parse_opt(int key, char *arg, struct argp_state *state)
+{
+	struct cache_ext_stats_args *args = &cache_ext_stats_args;
+	char *end;
+
+	switch (key) {
+	case CACHE_EXT_STATS_OPT_INTERVAL:
+		errno = 0;
+		args->interval_ms = strtoul(arg, &end, 10);
+		if (errno || *end != '\0')
+			argp_error(state, "Invalid stats interval: %s", arg);
+		break;
+	case CACHE_EXT_STATS_OPT_FORMAT:
+		if (strcmp(arg, "prometheus") == 0)
+			args->format = CACHE_EXT_STATS_PROMETHEUS;
+		else if (strcmp(arg, "json") == 0)
+			args->format = CACHE_EXT_STATS_JSON;
+		else
+			argp_error(state, "Unknown stats format: %s", arg);
+		break;
+	case CACHE_EXT_STATS_OPT_FILE:
+		args->file = arg;
+		break;
+	case ARGP_KEY_END:
+		if (args->file && args->interval_ms == 0)
+			args->interval_ms = CACHE_EXT_STATS_FILE_INTERVAL;
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+// --profile, --record, --swap and --state ride along wherever the stats options are offered
+static struct argp_child cache_ext_stats_extra_children[] = {
+	{ &cache_ext_prof_argp, 0, 0, 0 },
+	{ &cache_ext_trace_argp, 0, 0, 0 },
+	{ &cache_ext_swap_argp, 0, 0, 0 },
+	{ &cache_ext_state_argp, 0, 0, 0 },
+	{ 0 }
+};
+
+static struct argp cache_ext_stats_argp = {
+	cache_ext_stats_options, cache_ext_stats_parse_opt, 0, 0,
+	cache_ext_stats_extra_children
+};
+
+static struct argp_child cache_ext_stats_argp_children[] = {
+	{ &cache_ext_stats_argp, 0, "Stats export:", 0 },
+	{ 0 }
+};
+
+/*
+ * One slot per possible CPU. Must be called between skel__open() and
+ * skel__load().
+ */
+int cache_ext_stats_resize(struct bpf_map *map) {
+	int nr_cpus = libbpf_num_possible_cpus();
+
+	if (nr_cpus <= 0) {
+		fprintf(stderr, "Failed to get number of possible CPUs: %d\n", nr_cpus);
+		return -1;
+	}
+	if (bpf_map__set_max_entries(map, nr_cpus)) {
+		perror("Failed to resize cache_ext_stats_map");
+		return -1;
+	}
+	return 0;
+}
+
+struct cache_ext_stats_region {
+	const volatile __u64 *slots;
+	size_t len;
+	unsigned int nr_slots;
+	unsigned int slot_words;
+};
+
+int cache_ext_stats_mmap(struct cache_ext_stats_region *r, struct bpf_map *map) {
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t size = (size_t)bpf_map__value_size(map) * bpf_map__max_entries(map);
+	void *p;
+
+	r->len = (size + page_size - 1) / page_size * page_size;
+	p = mmap(NULL, r->len, PROT_READ, MAP_SHARED, bpf_map__fd(map), 0);
+	if (p == MAP_FAILED) {
+		perror("Failed to mmap cache_ext_stats_map");
+		r->slots = NULL;
+		return -1;
+	}
+	r->slots = p;
+	r->nr_slots = bpf_map__max_entries(map);
+	r->slot_words = bpf_map__value_size(map) / sizeof(__u64);
+	return 0;
+}
+
+void cache_ext_stats_munmap(struct cache_ext_stats_region *r) {
+	if (r->slots)
+		munmap((void *)r->slots, r->len);
+	r->slots = NULL;
+}
+
+// Sum the per-CPU slots. Plain loads from the mapping, no syscalls.
+void cache_ext_stats_read(const struct cache_ext_stats_region *r,
+			  __u64 out[NR_CACHE_EXT_STATS]) {
+	memset(out, 0, NR_CACHE_EXT_STATS * sizeof(__u64));
+	if (!r->slots)
+		return;
+
+	for (unsigned int cpu = 0; cpu < r->nr_slots; cpu++) {
+		const volatile __u64 *slot = r->slots + (size_t)cpu * r->slot_words;
+		for (int i = 0; i < NR_CACHE_EXT_STATS; i++)
+			out[i] += slot[i];
+	}
+}
+
+/*
+ * Extra per-snapshot output, e.g. the miss ratio curves of cache_ext_mrc.h.
+ * Called after the counters: with json, inside the object, so it adds
+ * ,"key":value members; otherwise with whole Prometheus lines.
+ */
+static void (*cache_ext_stats_extra_write)(FILE *f, const char *policy, bool json) = NULL;
+
+static void cache_ext_stats_write(FILE *f, const char *policy,
+				  enum cache_ext_stats_format format,
+				  const __u64 vals[NR_CACHE_EXT_STATS]) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	if (format == CACHE_EXT_STATS_JSON) {
+		fprintf(f, "{\"policy\":\"%s\",\"timestamp_ms\":%lld", policy,
+			(long long)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+		for (int i = 0; i < NR_CACHE_EXT_STATS; i++)
+			fprintf(f, ",\"%s\":%llu", cache_ext_stat_names[i],
+				(unsigned long long)vals[i]);
+		if (cache_ext_stats_extra_write)
+			cache_ext_stats_extra_write(f, policy, true);
+		fprintf(f, "}\n");
+		return;
+	}
+
+	for (int i = 0; i < NR_CACHE_EXT_STATS; i++) {
+		fprintf(f, "# HELP cache_ext_%s_total %s\n", cache_ext_stat_names[i],
+			cache_ext_stat_help[i]);
+		fprintf(f, "# TYPE cache_ext_%s_total counter\n", cache_ext_stat_names[i]);
+		fprintf(f, "cache_ext_%s_total{policy=\"%s\"} %llu\n",
+			cache_ext_stat_names[i], policy, (unsigned long long)vals[i]);
+	}
+	if (cache_ext_stats_extra_write)
+		cache_ext_stats_extra_write(f, policy, false);
+}
+
+struct cache_ext_exporter {
+	struct cache_ext_stats_region region;
+	const char *policy;
+	bool running;
+	bool stop;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+// Dump one snapshot to stdout, or replace --stats_file with it
+static void cache_ext_exporter_dump(struct cache_ext_exporter *e) {
+	struct cache_ext_stats_args *args = &cache_ext_stats_args;
+	__u64 vals[NR_CACHE_EXT_STATS];
+	char tmp[PATH_MAX];
+	FILE *f;
+
+	cache_ext_stats_read(&e->region, vals);
+
+	if (!args->file) {
+		cache_ext_stats_write(stdout, e->policy, args->format, vals);
+		fflush(stdout);
+		return;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", args->file);
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Failed to open %s: %s\n", tmp, strerror(errno));
+		return;
+	}
+	cache_ext_stats_write(f, e->policy, args->format, vals);
+	if (fclose(f) || rename(tmp, args->file))
+		fprintf(stderr, "Failed to write %s: %s\n", args->file, strerror(errno));
+}
+
+static void *cache_ext_exporter_thread(void *arg) {
+	struct cache_ext_exporter *e = arg;
+	unsigned long interval_ms = cache_ext_stats_args.interval_ms;
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+	pthread_mutex_lock(&e->lock);
+	while (!e->stop) {
+		deadline.tv_sec += interval_ms / 1000;
+		deadline.tv_nsec += (interval_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while (!e->stop &&
+		       pthread_cond_timedwait(&e->cond, &e->lock, &deadline) != ETIMEDOUT)
+			;
+		if (e->stop)
+			break;
+
+		pthread_mutex_unlock(&e->lock);
+		cache_ext_exporter_dump(e);
+		pthread_mutex_lock(&e->lock);
+	}
+	pthread_mutex_unlock(&e->lock);
+	return NULL;
+}
+
+/*
+ * Map the stats region and, if --stats_interval or --stats_file was given,
+ * start exporting it. Call after skel__load().
+ */
+int cache_ext_exporter_start(struct cache_ext_exporter *e, struct bpf_map *map,
+			     const char *policy) {
+	pthread_condattr_t attr;
+	int err;
+
+	memset(e, 0, sizeof(*e));
+	e->policy = policy;
+
+	if (cache_ext_stats_mmap(&e->region, map))
+		return -1;
+
+	if (cache_ext_stats_args.interval_ms == 0)
+		return 0;
+
+	pthread_mutex_init(&e->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&e->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	err = pthread_create(&e->thread, NULL, cache_ext_exporter_thread, e);
+	if (err) {
+		fprintf(stderr, "Failed to start stats exporter: %s\n", strerror(err));
+		pthread_cond_destroy(&e->cond);
+		pthread_mutex_destroy(&e->lock);
+		cache_ext_stats_munmap(&e->region);
+		return -1;
+	}
+	e->running = true;
+	return 0;
+}
+
+// Stop the exporter, writing a final snapshot if it was running
+void cache_ext_exporter_stop(struct cache_ext_exporter *e) {
+	if (e->running) {
+		pthread_mutex_lock(&e->lock);
+		e->stop = true;
+		pthread_cond_signal(&e->cond);
+		pthread_mutex_unlock(&e->lock);
+		pthread_join(e->thread, NULL);
+
+		cache_ext_exporter_dump(e);
+
+		pthread_cond_destroy(&e->cond);
+		pthread_mutex_destroy(&e->lock);
+		e->running = false;
+	}
+	cache_ext_stats_munmap(&e->region);
+}
+
+#endif /* _CACHE_EXT_STATS_H */
@@ -0,0 +1,421 @@
+#ifndef _CACHE_EXT_SWAP_H
+#define _CACHE_EXT_SWAP_H
+
+#include <argp.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+/*
+ * Live policy swap and loader readiness.
+ *
+ * --swappable pins the cgroup's struct_ops link, and the policy's handoff
+ * export if it has one (see cache_ext_handoff.bpf.h), under
+ * CACHE_EXT_SWAP_PIN_ROOT/cgroup_<id>. A second loader started with --swap
+ * on the same cgroup opens that link and points it at its own ops map with
+ * bpf_link_update(), so the cgroup never runs without a policy. Before
+ * that it copies the outgoing export into its handoff_adopt map, letting it
+ * adopt the resident folios in batches. Once the link is updated it sends
+ * SIGINT to the loaders still holding the link, which then exit without
+ * touching the pins. The incoming loader keeps them, so it can be replaced
+ * the same way. This needs a kernel whose cache_ext_ops implement link
+ * updates. Without that the update fails and the running policy stays.
+ *
+ * --ready_pipe PATH writes "ready <pid>\n" to the FIFO at PATH once the
+ * policy is attached, so callers don't have to guess how long loading takes.
+ *
+ *	link = cache_ext_swap_attach(&swap, skel->obj, skel->maps.fifo_ops, cgroup_fd);
+ *	...
+ *	cache_ext_ready();			// before waiting for exit
+ *	...
+ *	cache_ext_swap_release(&swap, link);	// before bpf_link__destroy()
+ *
+ * The options are a child of cache_ext_stats_argp, like --profile.
+ */
+
+#define CACHE_EXT_SWAP_PIN_ROOT		"/sys/fs/bpf/cache_ext"
+#define CACHE_EXT_SWAP_EXPORT_MAP	"cache_ext_handoff_export"
+#define CACHE_EXT_SWAP_ADOPT_MAP	"cache_ext_handoff_adopt"
+#define CACHE_EXT_SWAP_MAX_LISTS	8
+#define CACHE_EXT_SWAP_DIR_LEN		64	// Fits PIN_ROOT/cgroup_<u64>
+
+// Keep in sync with cache_ext_handoff.bpf.h
+struct cache_ext_handoff {
+	__u64 lists[CACHE_EXT_SWAP_MAX_LISTS];
+	__u32 nr_lists;
+	__u32 next;
+};
+
+struct cache_ext_swap_args {
+	bool swappable;
+	bool swap;
+	const char *ready_pipe;	// NULL: no readiness report
+};
+
+struct cache_ext_swap_args cache_ext_swap_args = { 0 };
+
+enum {
+	CACHE_EXT_SWAP_OPT_SWAPPABLE = 0x1600,
+	CACHE_EXT_SWAP_OPT_SWAP,
+	CACHE_EXT_SWAP_OPT_READY_PIPE,
+};
+
+static struct argp_option cache_ext_swap_options[] = {
+	{ "swappable", CACHE_EXT_SWAP_OPT_SWAPPABLE, 0, 0,
+	  "Pin the policy link so a later loader can --swap it out" },
+	{ "swap", CACHE_EXT_SWAP_OPT_SWAP, 0, 0,
+	  "Replace the cgroup's --swappable policy in place and adopt its folios" },
+	{ "ready_pipe", CACHE_EXT_SWAP_OPT_READY_PIPE, "PATH", 0,
+	  "Write \"ready <pid>\" to the FIFO at PATH once attached" },
+	{ 0 }
+};
+
+static error_t cache_ext_swap_parse_opt(int key, char *arg, struct argp_state *state)
+{
+	struct cache_ext_swap_args *args = &cache_ext_swap_args;
+
+	switch (key) {
+	case CACHE_EXT_SWAP_OPT_SWAPPABLE:
+		args->swappable = true;
+		break;
+	case CACHE_EXT_SWAP_OPT_SWAP:
+		args->swap = true;
+		break;
+	case CACHE_EXT_SWAP_OPT_READY_PIPE:
+		args->ready_pipe = arg;
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static struct argp cache_ext_swap_argp = {
+	cache_ext_swap_options, cache_ext_swap_parse_opt, 0, 0
+};
+
+struct cache_ext_swap {
+	char dir[CACHE_EXT_SWAP_DIR_LEN];	// Pin directory, empty if nothing is pinned
+	__u64 cgroup_id;			// Key of the handoff maps
+	int ops_map_fd;
+};
+
+static int cache_ext_swap_pin_path(const struct cache_ext_swap *s, const char *name,
+				   char *buf, size_t len) {
+	if (snprintf(buf, len, "%s/%s", s->dir, name) >= (int)len) {
+		fprintf(stderr, "Pin path too long: %s/%s\n", s->dir, name);
+		return -1;
+	}
+	return 0;
+}
+
+// One pin directory per cgroup, named after the cgroup id (its inode number)
+static int cache_ext_swap_init_dir(struct cache_ext_swap *s, int cgroup_fd) {
+	struct stat st;
+
+	if (fstat(cgroup_fd, &st)) {
+		perror("Failed to stat cgroup");
+		return -1;
+	}
+	s->cgroup_id = st.st_ino;
+	snprintf(s->dir, sizeof(s->dir), "%s/cgroup_%llu", CACHE_EXT_SWAP_PIN_ROOT,
+		 (unsigned long long)s->cgroup_id);
+	return 0;
+}
+
+static int cache_ext_swap_pin_export(struct cache_ext_swap *s, struct bpf_object *obj) {
+	struct bpf_map *map = bpf_object__find_map_by_name(obj, CACHE_EXT_SWAP_EXPORT_MAP);
+	char path[PATH_MAX];
+
+	if (cache_ext_swap_pin_path(s, "handoff", path, sizeof(path)))
+		return -1;
+
+	// The outgoing policy's export, if any, is of no use any more
+	if (unlink(path) && errno != ENOENT) {
+		perror("Failed to unpin handoff export");
+		return -1;
+	}
+	if (map == NULL)
+		return 0;
+
+	if (bpf_obj_pin(bpf_map__fd(map), path)) {
+		perror("Failed to pin handoff export");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Copy the outgoing policy's export for this cgroup into our adopt map.
+ * Either side may have been built without cache_ext_handoff.bpf.h, then
+ * there is nothing to do.
+ */
+static void cache_ext_swap_copy_handoff(struct cache_ext_swap *s, struct bpf_object *obj) {
+	struct bpf_map *adopt = bpf_object__find_map_by_name(obj, CACHE_EXT_SWAP_ADOPT_MAP);
+	struct cache_ext_handoff h;
+	char path[PATH_MAX];
+	__u64 key = s->cgroup_id;
+	int fd;
+
+	if (adopt == NULL || cache_ext_swap_pin_path(s, "handoff", path, sizeof(path)))
+		return;
+
+	fd = bpf_obj_get(path);
+	if (fd < 0) {
+		fprintf(stderr, "Outgoing policy has no handoff export, starting cold\n");
+		return;
+	}
+
+	if (bpf_map_lookup_elem(fd, &key, &h)) {
+		perror("Failed to read handoff export");
+		goto out;
+	}
+	if (h.nr_lists > CACHE_EXT_SWAP_MAX_LISTS)
+		h.nr_lists = CACHE_EXT_SWAP_MAX_LISTS;
+	h.next = 0;
+
+	if (bpf_map_update_elem(bpf_map__fd(adopt), &key, &h, BPF_ANY))
+		perror("Failed to set up handoff");
+	else
+		fprintf(stderr, "Adopting %u lists from the outgoing policy\n", h.nr_lists);
+out:
+	close(fd);
+}
+
+/*
+ * Find the processes other than us with an fd open on link_id, from
+ * /proc/<pid>/fdinfo. These are the outgoing loaders.
+ */
+static int cache_ext_swap_find_holders(__u32 link_id, pid_t *pids, int max) {
+	char path[PATH_MAX], line[128];
+	struct dirent *p, *fd;
+	DIR *proc, *fds;
+	int n = 0;
+
+	proc = opendir("/proc");
+	if (proc == NULL)
+		return 0;
+
+	while (n < max && (p = readdir(proc)) != NULL) {
+		pid_t pid = atoi(p->d_name);
+		bool holds = false;
+
+		if (pid <= 0 || pid == getpid())
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/fdinfo", pid);
+		fds = opendir(path);
+		if (fds == NULL)
+			continue;
+
+		while (!holds && (fd = readdir(fds)) != NULL) {
+			unsigned int id;
+			FILE *f;
+
+			if (fd->d_name[0] == '.')
+				continue;
+			snprintf(path, sizeof(path), "/proc/%d/fdinfo/%s", pid, fd->d_name);
+			f = fopen(path, "r");
+			if (f == NULL)
+				continue;
+			while (fgets(line, sizeof(line), f)) {
+				if (sscanf(line, "link_id: %u", &id) == 1) {
+					holds = id == link_id;
+					break;
+				}
+			}
+			fclose(f);
+		}
+		closedir(fds);
+
+		if (holds)
+			pids[n++] = pid;
+	}
+	closedir(proc);
+	return n;
+}
+
+static struct bpf_link *cache_ext_swap_take_over(struct cache_ext_swap *s, struct bpf_object *obj,
+						 struct bpf_map *ops, int cgroup_fd) {
+	struct bpf_link_info info;
+	__u32 info_len = sizeof(info);
+	struct bpf_link *link, *attached;
+	char path[PATH_MAX];
+	pid_t pids[16];
+	int err, n;
+
+	if (cache_ext_swap_pin_path(s, "link", path, sizeof(path)))
+		return NULL;
+
+	link = bpf_link__open(path);
+	if (link == NULL) {
+		fprintf(stderr, "No --swappable policy on this cgroup (%s): %s\n", path,
+			strerror(errno));
+		return NULL;
+	}
+
+	memset(&info, 0, sizeof(info));
+	if (bpf_link_get_info_by_fd(bpf_link__fd(link), &info, &info_len)) {
+		perror("Failed to get policy link info");
+		goto err;
+	}
+	n = cache_ext_swap_find_holders(info.id, pids, sizeof(pids) / sizeof(pids[0]));
+
+	cache_ext_swap_copy_handoff(s, obj);
+
+	/*
+	 * bpf_link__update_map() only works on links libbpf created itself, so
+	 * update the opened one by fd. The kernel wants ops to have its value
+	 * by then, and libbpf only writes it when attaching: the attach below
+	 * sets it, then fails because the running policy holds the cgroup.
+	 */
+	attached = bpf_map__attach_cache_ext_ops(ops, cgroup_fd);
+	if (attached) {
+		// The running policy went away in the meantime, nothing to replace
+		fprintf(stderr, "Policy on this cgroup exited, attached without swapping\n");
+		bpf_link__destroy(link);
+		unlink(path);
+		if (bpf_link__pin(attached, path))
+			fprintf(stderr, "Failed to pin policy link at %s: %s\n", path,
+				strerror(errno));
+		if (cache_ext_swap_pin_export(s, obj))
+			fprintf(stderr, "This policy can be swapped, but not handed off from\n");
+		return attached;
+	}
+
+	err = bpf_link_update(bpf_link__fd(link), bpf_map__fd(ops), NULL);
+	if (err) {
+		fprintf(stderr, "Failed to swap policy, keeping the running one: %s\n",
+			strerror(-err));
+		goto err;
+	}
+
+	if (cache_ext_swap_pin_export(s, obj))
+		fprintf(stderr, "This policy can be swapped, but not handed off from\n");
+
+	for (int i = 0; i < n; i++) {
+		fprintf(stderr, "Stopping outgoing loader %d\n", pids[i]);
+		kill(pids[i], SIGINT);
+	}
+	return link;
+
+err:
+	bpf_link__destroy(link);
+	errno = EINVAL;
+	return NULL;
+}
+
+/*
+ * Attach ops to the cgroup, or with --swap replace the policy running on it.
+ * Returns the link, or NULL with errno set like bpf_map__attach_cache_ext_ops().
+ */
+struct bpf_link *cache_ext_swap_attach(struct cache_ext_swap *s, struct bpf_object *obj,
+				       struct bpf_map *ops, int cgroup_fd) {
+	struct bpf_link *link;
+	char path[PATH_MAX];
+
+	memset(s, 0, sizeof(*s));
+	s->ops_map_fd = bpf_map__fd(ops);
+
+	if (!cache_ext_swap_args.swap && !cache_ext_swap_args.swappable)
+		return bpf_map__attach_cache_ext_ops(ops, cgroup_fd);
+
+	if (cache_ext_swap_init_dir(s, cgroup_fd))
+		goto err;
+
+	if (cache_ext_swap_args.swap) {
+		link = cache_ext_swap_take_over(s, obj, ops, cgroup_fd);
+		if (link == NULL)
+			s->dir[0] = '\0';
+		return link;
+	}
+
+	link = bpf_map__attach_cache_ext_ops(ops, cgroup_fd);
+	if (link == NULL)
+		goto err;
+
+	if ((mkdir(CACHE_EXT_SWAP_PIN_ROOT, 0700) && errno != EEXIST) ||
+	    (mkdir(s->dir, 0700) && errno != EEXIST)) {
+		perror("Failed to create pin directory");
+		goto err_link;
+	}
+	if (cache_ext_swap_pin_path(s, "link", path, sizeof(path)))
+		goto err_link;
+	if (bpf_link__pin(link, path)) {
+		fprintf(stderr, "Failed to pin policy link at %s: %s\n", path, strerror(errno));
+		goto err_link;
+	}
+	if (cache_ext_swap_pin_export(s, obj))
+		fprintf(stderr, "This policy can be swapped, but not handed off from\n");
+	return link;
+
+err_link:
+	bpf_link__destroy(link);
+err:
+	s->dir[0] = '\0';
+	errno = EINVAL;
+	return NULL;
+}
+
+/*
+ * Remove the pins if the link still runs our policy. If another loader has
+ * swapped us out, the pins are its to keep.
+ */
+void cache_ext_swap_release(struct cache_ext_swap *s, struct bpf_link *link) {
+	struct bpf_link_info info;
+	struct bpf_map_info map_info;
+	__u32 len = sizeof(info), map_len = sizeof(map_info);
+	char path[PATH_MAX];
+
+	if (link == NULL || s->dir[0] == '\0')
+		return;
+
+	memset(&info, 0, sizeof(info));
+	memset(&map_info, 0, sizeof(map_info));
+	if (bpf_link_get_info_by_fd(bpf_link__fd(link), &info, &len) ||
+	    bpf_map_get_info_by_fd(s->ops_map_fd, &map_info, &map_len)) {
+		perror("Failed to check policy link owner, leaving pins");
+		return;
+	}
+	if (info.struct_ops.map_id != map_info.id)
+		return;
+
+	if (cache_ext_swap_pin_path(s, "handoff", path, sizeof(path)) == 0)
+		unlink(path);
+	bpf_link__unpin(link);
+	rmdir(s->dir);
+}
+
+// Report readiness on --ready_pipe, if given
+void cache_ext_ready(void) {
+	char msg[32];
+	int fd, len;
+
+	if (cache_ext_swap_args.ready_pipe == NULL)
+		return;
+
+	// O_NONBLOCK: fail instead of hanging if nobody is listening any more
+	fd = open(cache_ext_swap_args.ready_pipe, O_WRONLY | O_NONBLOCK);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open ready pipe %s: %s\n",
+			cache_ext_swap_args.ready_pipe, strerror(errno));
+		return;
+	}
+	len = snprintf(msg, sizeof(msg), "ready %d\n", getpid());
+	if (write(fd, msg, len) != len)
+		perror("Failed to report readiness");
+	close(fd);
+}
+
+#endif /* _CACHE_EXT_SWAP_H */
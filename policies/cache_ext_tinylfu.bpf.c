@@ -0,0 +1,554 @@
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+#include <bpf/bpf_core_read.h>
+
+#include "cache_ext_lib.bpf.h"
+#include "dir_watcher.bpf.h"
+
+char _license[] SEC("license") = "GPL";
+
+/*
+ * W-TinyLFU (Einziger et al., "TinyLFU: A Highly Efficient Cache Admission
+ * Policy"), as in Caffeine.
+ *
+ * New folios enter a small LRU window. Folios leaving the window are only
+ * admitted to the main cache if the frequency sketch (cache_ext_sketch.bpf.h)
+ * says their page is more popular than the main cache's recent victims,
+ * otherwise they are evicted. The main cache is a segmented LRU: admitted
+ * folios are on probation, and a hit promotes them to the protected segment,
+ * which is capped at TINYLFU_PROTECTED_PERCENT of the main cache. Protected
+ * folios over the cap are demoted back to probation, and evictions from the
+ * main cache take probation folios in LRU order.
+ *
+ * The sketch counts pages, not resident folios, so frequencies outlive
+ * evictions and replace S3-FIFO's ghost queue in a table of fixed size.
+ */
+
+// Window and protected segment sizes, in percent. Overridable for cache_ext_sim sweeps.
+#ifndef TINYLFU_WINDOW_PERCENT
+#define TINYLFU_WINDOW_PERCENT 1
+#endif
+#ifndef TINYLFU_PROTECTED_PERCENT
+#define TINYLFU_PROTECTED_PERCENT 80
+#endif
+
+/*
+ * Set from userspace. In terms of number of pages. Only used while the
+ * cgroup has no memory.max, otherwise the live limit is used.
+ */
+const volatile size_t cache_size = 0;
+
+enum tinylfu_segment {
+	TINYLFU_WINDOW,
+	TINYLFU_PROBATION,
+	TINYLFU_PROTECTED,
+};
+
+struct folio_metadata {
+	u32 segment;	// enum tinylfu_segment, u32 for cmpxchg
+	u32 nr_pages;	// As accounted in the segment sizes
+};
+
+/*
+ * One instance per attached cgroup.
+ *
+ * Both main segments share main_list, kept in LRU order: the list kfuncs
+ * can't move a folio without proposing or walking past it, so demotion
+ * happens in the eviction walk over main_list, which passes protected
+ * folios over to the tail and demotes them on the way while the segment is
+ * over its cap. A demoted folio so lands at the MRU end of probation, like
+ * in an SLRU.
+ *
+ * The sizes are exact, in pages, like S3-FIFO's. segment in the folio's
+ * metadata says which counters it is accounted in, and nr_pages by how much.
+ */
+struct memcg_state {
+	u64 window_list;
+	u64 main_list;
+	u64 parked_list;	// Dirty folios, still accounted in main_size
+	s64 window_size;
+	s64 main_size;
+	s64 protected_size;	// Part of main_size
+	u32 victim_freq;	// Sketch estimate of the last folio evicted from main
+};
+
+#include "cache_ext_folio_store.bpf.h"
+#include "cache_ext_sketch.bpf.h"
+#include "cache_ext_stats.bpf.h"
+#include "cache_ext_prof.bpf.h"
+#include "cache_ext_trace.bpf.h"
+#include "cache_ext_memcg.bpf.h"
+#include "cache_ext_hints.bpf.h"
+#include "cache_ext_dirty.bpf.h"
+#include "cache_ext_handoff.bpf.h"
+#include "cache_ext_mrc.bpf.h"
+
+/*
+ * Inputs and results of the walk callbacks, which have no memcg.
+ * tinylfu_evict_folios() fills it in before the walks and moves the results
+ * to the memcg's state once they are done, on the same CPU.
+ */
+struct tinylfu_scan {
+	s64 main_room;		// Pages the main cache can take without admission
+	s64 demote_budget;	// Protected pages over the cap
+	s64 admitted;		// Pages moved from the window to main
+	s64 demoted;		// Pages moved from protected to probation
+	u32 victim_freq;
+	bool evicted_main;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, u32);
+	__type(value, struct tinylfu_scan);
+	__uint(max_entries, 1);
+} tinylfu_scans SEC(".maps");
+
+static __always_inline struct tinylfu_scan *tinylfu_scan_get(void)
+{
+	u32 key = 0;
+
+	return bpf_map_lookup_elem(&tinylfu_scans, &key);
+}
+
+// Add the folio's pages to (sign 1) or remove them from (sign -1) its segment sizes
+static inline void account_folio(struct memcg_state *st, struct folio_metadata *data, s64 sign)
+{
+	if (data->segment == TINYLFU_WINDOW) {
+		__sync_fetch_and_add(&st->window_size, sign * data->nr_pages);
+		return;
+	}
+
+	__sync_fetch_and_add(&st->main_size, sign * data->nr_pages);
+	if (data->segment == TINYLFU_PROTECTED)
+		__sync_fetch_and_add(&st->protected_size, sign * data->nr_pages);
+}
+
+// Cache size in pages, following the live memory.max
+static inline u64 tinylfu_cache_pages(struct mem_cgroup *memcg)
+{
+	u64 pages = memcg_max_pages(memcg);
+
+	return pages ? pages : cache_size;
+}
+
+static inline bool is_folio_relevant(struct folio *folio) {
+	if (!folio || !folio->mapping || !folio->mapping->host)
+		return false;
+
+	return inode_in_watchlist(folio->mapping->host->i_ino);
+}
+
+static inline struct folio_metadata *get_folio_metadata(struct folio *folio) {
+	return folio_store_lookup(folio);
+}
+
+static inline bool folio_evictable(struct folio *folio)
+{
+	return folio_test_uptodate(folio) && folio_test_lru(folio) &&
+	       !folio_test_dirty(folio) && !folio_test_writeback(folio);
+}
+
+s32 BPF_STRUCT_OPS_SLEEPABLE(tinylfu_init, struct mem_cgroup *memcg)
+{
+	struct memcg_state init = { 0 };
+
+	init.window_list = bpf_cache_ext_ds_registry_new_list(memcg);
+	if (init.window_list == 0) {
+		bpf_printk("cache_ext: init: Failed to create window_list\n");
+		return -1;
+	}
+	bpf_printk("cache_ext: Created window_list: %llu\n", init.window_list);
+
+	init.main_list = bpf_cache_ext_ds_registry_new_list(memcg);
+	if (init.main_list == 0) {
+		bpf_printk("cache_ext: init: Failed to create main_list\n");
+		return -1;
+	}
+	bpf_printk("cache_ext: Created main_list: %llu\n", init.main_list);
+
+	init.parked_list = bpf_cache_ext_ds_registry_new_list(memcg);
+	if (init.parked_list == 0) {
+		bpf_printk("cache_ext: init: Failed to create parked_list\n");
+		return -1;
+	}
+
+	if (sketch_init())
+		return -1;
+
+	if (!memcg_state_create(memcg, &init)) {
+		bpf_printk("cache_ext: init: Failed to create memcg state\n");
+		return -1;
+	}
+
+	if (mrc_init(memcg))
+		bpf_printk("cache_ext: init: Failed to create MRC state\n");
+
+	// main_list first, its head is the next victim
+	handoff_export(memcg, init.main_list);
+	handoff_export(memcg, init.window_list);
+	handoff_export(memcg, init.parked_list);
+	return 0;
+}
+
+// Adopted folios were resident for a while already, so they skip the window
+static void handoff_adopt(struct folio *folio)
+{
+	struct folio_metadata new_meta = {
+		.segment = TINYLFU_PROBATION,
+		.nr_pages = folio_nr_pages(folio),
+	};
+	struct memcg_state *st = folio_memcg_state(folio);
+
+	if (!st || !folio_store_insert(folio, &new_meta))
+		return;
+	account_folio(st, &new_meta, 1);
+}
+
+static inline void admit_to_main(struct tinylfu_scan *scan, struct folio_metadata *data)
+{
+	data->segment = TINYLFU_PROBATION;
+	scan->admitted += data->nr_pages;
+	scan->main_room -= data->nr_pages;
+}
+
+/*
+ * Candidates leaving the window. Admitted ones are moved to the MRU end of
+ * probation (continue_list), rejected ones are evicted. Until the main cache
+ * is full, everything is admitted. Ties are rejected, the victim has earned
+ * its place already.
+ */
+static int tinylfu_window_fn(int idx, struct cache_ext_list_node *a)
+{
+	struct tinylfu_scan *scan = tinylfu_scan_get();
+	struct folio_metadata *data;
+
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+
+	data = get_folio_metadata(a->folio);
+	if (!data || !scan) {
+		bpf_printk("cache_ext: window_fn: Failed to get metadata\n");
+		return CACHE_EXT_EVICT_NODE;
+	}
+
+	if (!folio_evictable(a->folio)) {
+		// Over budget: leave it in the window and end the walk
+		if (dirty_skip_exhausted())
+			return CACHE_EXT_STOP_ITER;
+		// Passed over to the main list's tail with the rest
+		admit_to_main(scan, data);
+		return CACHE_EXT_CONTINUE_ITER;
+	}
+
+	if (scan->main_room > 0 || sketch_estimate(a->folio) > scan->victim_freq) {
+		admit_to_main(scan, data);
+		return CACHE_EXT_CONTINUE_ITER;
+	}
+
+	return CACHE_EXT_EVICT_NODE;
+}
+
+/*
+ * Walk main_list from its LRU end. Protected folios are passed over to the
+ * tail, and demoted on the way while the segment is over its cap. Probation
+ * folios are evicted.
+ */
+static int tinylfu_main_fn(int idx, struct cache_ext_list_node *a)
+{
+	struct tinylfu_scan *scan = tinylfu_scan_get();
+	struct folio_metadata *data;
+
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+
+	if (!folio_evictable(a->folio))
+		return dirty_rotate();
+
+	data = get_folio_metadata(a->folio);
+	if (!data || !scan) {
+		bpf_printk("cache_ext: main_fn: Failed to get metadata\n");
+		return CACHE_EXT_EVICT_NODE;
+	}
+
+	if (data->segment == TINYLFU_PROTECTED) {
+		if (scan->demote_budget > 0 &&
+		    __sync_val_compare_and_swap(&data->segment, TINYLFU_PROTECTED,
+						TINYLFU_PROBATION) == TINYLFU_PROTECTED) {
+			scan->demote_budget -= data->nr_pages;
+			scan->demoted += data->nr_pages;
+		}
+		return CACHE_EXT_CONTINUE_ITER;
+	}
+
+	scan->victim_freq = sketch_estimate(a->folio);
+	scan->evicted_main = true;
+	return CACHE_EXT_EVICT_NODE;
+}
+
+// Last resort, when a walk couldn't meet the request: evict in list order
+static int tinylfu_any_fn(int idx, struct cache_ext_list_node *a)
+{
+	cache_ext_stat_inc(CACHE_EXT_STAT_SCANNED);
+
+	if (!folio_evictable(a->folio))
+		return dirty_rotate();
+	return CACHE_EXT_EVICT_NODE;
+}
+
+static void evict_window(struct cache_ext_eviction_ctx *eviction_ctx, struct mem_cgroup *memcg,
+			 struct memcg_state *st)
+{
+	struct cache_ext_iterate_opts opts = {
+		.continue_list = st->main_list,
+		.continue_mode = CACHE_EXT_ITERATE_TAIL,
+		.evict_list = CACHE_EXT_ITERATE_SELF,
+		.evict_mode = CACHE_EXT_ITERATE_TAIL,
+	};
+
+	if (bpf_cache_ext_list_iterate_extended(memcg, st->window_list, tinylfu_window_fn, &opts,
+						eviction_ctx) < 0)
+		bpf_printk("cache_ext: evict: Failed to iterate window_list\n");
+}
+
+static void evict_main(struct cache_ext_eviction_ctx *eviction_ctx, struct mem_cgroup *memcg,
+		       struct memcg_state *st)
+{
+	struct cache_ext_iterate_opts opts = {
+		.continue_list = CACHE_EXT_ITERATE_SELF,
+		.continue_mode = CACHE_EXT_ITERATE_TAIL,
+		.evict_list = CACHE_EXT_ITERATE_SELF,
+		.evict_mode = CACHE_EXT_ITERATE_TAIL,
+	};
+
+	if (bpf_cache_ext_list_iterate_extended(memcg, st->main_list, tinylfu_main_fn, &opts,
+						eviction_ctx) < 0)
+		bpf_printk("cache_ext: evict: Failed to iterate main_list\n");
+}
+
+// Everything left is protected and within its cap, or in the window
+static void evict_any(struct cache_ext_eviction_ctx *eviction_ctx, struct mem_cgroup *memcg,
+		      struct memcg_state *st)
+{
+	struct cache_ext_iterate_opts opts = {
+		.continue_list = CACHE_EXT_ITERATE_SELF,
+		.continue_mode = CACHE_EXT_ITERATE_TAIL,
+		.evict_list = CACHE_EXT_ITERATE_SELF,
+		.evict_mode = CACHE_EXT_ITERATE_TAIL,
+	};
+
+	if (bpf_cache_ext_list_iterate_extended(memcg, st->main_list, tinylfu_any_fn, &opts,
+						eviction_ctx) < 0) {
+		bpf_printk("cache_ext: evict: Failed to iterate main_list\n");
+		return;
+	}
+
+	if (eviction_ctx_done(eviction_ctx))
+		return;
+
+	if (bpf_cache_ext_list_iterate_extended(memcg, st->window_list, tinylfu_any_fn, &opts,
+						eviction_ctx) < 0)
+		bpf_printk("cache_ext: evict: Failed to iterate window_list\n");
+}
+
+// Move the walks' results to the memcg's counters
+static inline void account_scan(struct memcg_state *st, struct tinylfu_scan *scan)
+{
+	if (scan->admitted) {
+		__sync_fetch_and_sub(&st->window_size, scan->admitted);
+		__sync_fetch_and_add(&st->main_size, scan->admitted);
+	}
+	if (scan->demoted)
+		__sync_fetch_and_sub(&st->protected_size, scan->demoted);
+	if (scan->evicted_main)
+		WRITE_ONCE(st->victim_freq, scan->victim_freq);
+}
+
+void BPF_STRUCT_OPS(tinylfu_evict_folios, struct cache_ext_eviction_ctx *eviction_ctx,
+		    struct mem_cgroup *memcg)
+{
+	PROF_EVICT_SCOPE(eviction_ctx);
+	EVICTION_TARGET_SCOPE(eviction_ctx);
+	struct memcg_state *st = memcg_state_lookup(memcg);
+	struct tinylfu_scan *scan = tinylfu_scan_get();
+	u64 cache_pages = tinylfu_cache_pages(memcg);
+
+	if (!st || !scan) {
+		bpf_printk("cache_ext: evict: No state for memcg\n");
+		return;
+	}
+
+	s64 window_target = cache_pages * TINYLFU_WINDOW_PERCENT / 100;
+	s64 main_target = cache_pages - window_target;
+	s64 protected_target = main_target * TINYLFU_PROTECTED_PERCENT / 100;
+
+	struct tinylfu_scan init = {
+		.main_room = main_target - READ_ONCE(st->main_size),
+		.demote_budget = READ_ONCE(st->protected_size) - protected_target,
+		.victim_freq = READ_ONCE(st->victim_freq),
+	};
+	*scan = init;
+
+	dirty_scan_begin(st->parked_list, st->main_list);
+	dirty_unpark(eviction_ctx, memcg);
+
+	if (handoff_step(eviction_ctx, memcg, st->main_list, false) &&
+	    eviction_ctx_done(eviction_ctx))
+		return;
+
+	if (READ_ONCE(st->window_size) > window_target)
+		evict_window(eviction_ctx, memcg, st);
+
+	if (!eviction_ctx_done(eviction_ctx))
+		evict_main(eviction_ctx, memcg, st);
+
+	account_scan(st, scan);
+
+	if (!eviction_ctx_done(eviction_ctx))
+		evict_any(eviction_ctx, memcg, st);
+
+	dirty_evict_parked(eviction_ctx, memcg, st->parked_list);
+}
+
+/*
+ * A folio that stayed resident across a restart, with its metadata restored
+ * by --state. Queue it in the segment it was in.
+ */
+static inline void tinylfu_readmit(struct folio *folio, struct folio_metadata *data)
+{
+	struct memcg_state *st = folio_memcg_state(folio);
+	u64 list;
+
+	if (!st) {
+		folio_store_delete(folio);
+		return;
+	}
+
+	list = data->segment == TINYLFU_WINDOW ? st->window_list : st->main_list;
+	if (bpf_cache_ext_list_add_tail(list, folio)) {
+		folio_store_delete(folio);
+		return;
+	}
+
+	data->nr_pages = folio_nr_pages(folio);
+	account_folio(st, data, 1);
+}
+
+void BPF_STRUCT_OPS(tinylfu_folio_accessed, struct folio *folio) {
+	PROF_SCOPE(PROF_FOLIO_ACCESSED);
+	cache_ext_trace(CACHE_EXT_TRACE_ACCESS, folio);
+	if (!is_folio_relevant(folio))
+		return;
+
+	sketch_increment(folio);
+	mrc_access(folio);
+
+	bool restored;
+	struct folio_metadata *data = folio_store_lookup_restored(folio, &restored);
+	if (!data) {
+		bpf_printk("cache_ext: accessed: Failed to get metadata\n");
+		return;
+	}
+	cache_ext_stat_inc(CACHE_EXT_STAT_HITS);
+
+	if (restored) {
+		tinylfu_readmit(folio, data);
+		return;
+	}
+
+	struct memcg_state *st = folio_memcg_state(folio);
+	if (!st)
+		return;
+
+	if (data->segment == TINYLFU_WINDOW) {
+		bpf_cache_ext_list_move(st->window_list, folio, true);
+		return;
+	}
+
+	// A hit on probation promotes to protected
+	if (__sync_val_compare_and_swap(&data->segment, TINYLFU_PROBATION,
+					TINYLFU_PROTECTED) == TINYLFU_PROBATION)
+		__sync_fetch_and_add(&st->protected_size, data->nr_pages);
+	bpf_cache_ext_list_move(st->main_list, folio, true);
+}
+
+void BPF_STRUCT_OPS(tinylfu_folio_evicted, struct folio *folio) {
+	PROF_SCOPE(PROF_FOLIO_EVICTED);
+	cache_ext_trace(CACHE_EXT_TRACE_EVICT, folio);
+	cache_ext_stat_inc(CACHE_EXT_STAT_EVICTIONS);
+	dirty_evicted(folio);
+
+	struct folio_metadata *data = get_folio_metadata(folio);
+	if (!data)
+		return;
+
+	struct memcg_state *st = folio_memcg_state(folio);
+	if (st)
+		account_folio(st, data, -1);
+
+	folio_store_delete(folio);
+}
+
+/*
+ * Add to the window, or straight to probation if its file is tagged hot.
+ * A page the sketch remembers as popular still starts in the window, and
+ * its count gets it admitted when it leaves.
+ */
+void BPF_STRUCT_OPS(tinylfu_folio_added, struct folio *folio) {
+	PROF_SCOPE(PROF_FOLIO_ADDED);
+	cache_ext_trace(CACHE_EXT_TRACE_ADD, folio);
+	if (!is_folio_relevant(folio))
+		return;
+
+	struct memcg_state *st = folio_memcg_state(folio);
+	if (!st)
+		return;
+
+	sketch_increment(folio);
+	mrc_access(folio);
+
+	struct folio_metadata new_meta = {
+		.segment = TINYLFU_WINDOW,
+		.nr_pages = folio_nr_pages(folio),
+	};
+
+	// Re-added without folio_evicted: its old slot is reused, so unaccount it
+	struct folio_metadata *old = get_folio_metadata(folio);
+	struct folio_metadata was = { 0 };
+	bool was_tracked = old != NULL;
+
+	if (old)
+		was = *old;
+
+	u64 list_to_add = st->window_list;
+	if (folio_inode_class(folio) >= INODE_CLASS_HOT) {
+		list_to_add = st->main_list;
+		new_meta.segment = TINYLFU_PROBATION;
+	}
+
+	if (bpf_cache_ext_list_add_tail(list_to_add, folio)) {
+		bpf_printk("cache_ext: added: Failed to add folio to list\n");
+		return;
+	}
+
+	if (!folio_store_insert(folio, &new_meta)) {
+		bpf_cache_ext_list_del(folio);
+		bpf_printk("cache_ext: added: Failed to create folio metadata\n");
+		return;
+	}
+
+	// Only account the folio once it is on a list and has metadata
+	if (was_tracked)
+		account_folio(st, &was, -1);
+	account_folio(st, &new_meta, 1);
+	cache_ext_stat_inc(CACHE_EXT_STAT_MISSES);
+}
+
+
+SEC(".struct_ops.link")
+struct cache_ext_ops tinylfu_ops = {
+	.init = (void *)tinylfu_init,
+	.evict_folios = (void *)tinylfu_evict_folios,
+	.folio_accessed = (void *)tinylfu_folio_accessed,
+	.folio_evicted = (void *)tinylfu_folio_evicted,
+	.folio_added = (void *)tinylfu_folio_added,
+};
@@ -0,0 +1,276 @@
+#include <argp.h>
+#include <bpf/bpf.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "dir_watcher.h"
+#include "cache_ext_stats.h"
+#include "cache_ext_hints.h"
+#include "cache_ext_folio_store.h"
+#include "cache_ext_sketch.h"
+#include "cache_ext_mrc.h"
+#include "cache_ext_memcg.h"
+#include "cache_ext_tinylfu.skel.h"
+
+char *USAGE = "Usage: ./cache_ext_tinylfu --watch_dir <dir> [--cgroup_size <size>] --cgroup_path <path> [--cgroup_path <path> ...]\n";
+struct cmdline_args {
+	char *watch_dir;
+        uint64_t cgroup_size;
+        struct cache_ext_cgroups cgroups;
+};
+
+static struct argp_option options[] = {
+	{ "watch_dir", 'w', "DIR", 0, "Directory to watch" },
+        {"cgroup_size", 's', "SIZE", 0, "Size of the cgroup if memory.max is unlimited (default: memory.max)"},
+        {"cgroup_path", 'c', "PATH", 0, "Path to cgroup (e.g., /sys/fs/cgroup/cache_ext_test), repeat for more cgroups"},
+	{ 0 },
+};
+
+static const uint64_t page_size = 4096;
+
+/*
+ * Segments of resident folios and the frequency sketch, plus the sketch's
+ * increment clock in .data.model
+ */
+static const struct cache_ext_state_map tinylfu_state[] = {
+	{ CACHE_EXT_STATE_MODEL },
+	{ "sketch_map" },
+	{ "folio_metadata_map", CACHE_EXT_STATE_FOLIO_STORE },
+	{ 0 },
+};
+
+static volatile sig_atomic_t exiting;
+
+static void sig_handler(int signo) {
+	exiting = 1;
+}
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+	struct cmdline_args *args = state->input;
+	switch (key) {
+	case 'w':
+		args->watch_dir = arg;
+		break;
+	case 's':
+		errno = 0;
+		args->cgroup_size = strtoull(arg, NULL, 10);
+		if (errno)
+			args->cgroup_size = 0;
+		break;
+	case 'c':
+		if (cache_ext_cgroups_add(&args->cgroups, arg))
+			argp_error(state, "Too many cgroups");
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static int parse_args(int argc, char **argv, struct cmdline_args *args) {
+	struct argp argp = { options, parse_opt, 0, 0, cache_ext_mrc_argp_children };
+	argp_parse(&argp, argc, argv, 0, 0, args);
+
+	if (args->watch_dir == NULL) {
+		fprintf(stderr, "Missing required argument: watch_dir\n");
+		return 1;
+	}
+
+	if (args->cgroups.nr == 0) {
+		fprintf(stderr, "Missing required argument: cgroup_path\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Validate watch_dir
+ *
+ * watch_dir_full_path must be able to hold PATH_MAX bytes.
+ */
+static int validate_watch_dir(const char *watch_dir, char *watch_dir_full_path) {
+	// Does watch_dir exist?
+	if (access(watch_dir, F_OK) == -1) {
+		fprintf(stderr, "Directory does not exist: %s\n", watch_dir);
+		return 1;
+	}
+
+	// Get full path of watch_dir
+	if (realpath(watch_dir, watch_dir_full_path) == NULL) {
+		perror("realpath");
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	struct cmdline_args args = { 0 };
+	struct cache_ext_tinylfu_bpf *skel = NULL;
+	struct cache_ext_exporter exporter = { 0 };
+	struct cache_ext_profiler prof = { 0 };
+	struct cache_ext_recorder rec = { 0 };
+	struct cache_ext_state state = { 0 };
+	struct sigaction sa;
+	char watch_dir_path[PATH_MAX];
+	struct cache_ext_cgroups *cgroups = &args.cgroups;
+	uint64_t total_memory;
+	int ret = 1;
+
+	libbpf_set_strict_mode(LIBBPF_STRICT_ALL);
+
+	if (parse_args(argc, argv, &args))
+		return 1;
+
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = sig_handler;
+
+	// Install signal handler
+	if (sigaction(SIGINT, &sa, NULL)) {
+		perror("Failed to set up signal handling");
+		return 1;
+	}
+
+	if (validate_watch_dir(args.watch_dir, watch_dir_path))
+		return 1;
+
+	// Open cgroup directories early
+	if (cache_ext_cgroups_open(cgroups))
+		goto cleanup;
+	total_memory = cache_ext_cgroups_memory_max(cgroups);
+
+	skel = cache_ext_tinylfu_bpf__open();
+	if (!skel) {
+		perror("Failed to open BPF skeleton");
+		goto cleanup;
+	}
+
+	/*
+	 * Set cache size in terms of number of pages. Assumes uniform page size.
+	 * The BPF side follows the live memory.max and only falls back to this
+	 * when the cgroup is unlimited, for every cgroup alike.
+	 */
+	if (args.cgroup_size == 0)
+		args.cgroup_size = read_cgroup_memory_max(cgroups->paths[0]);
+	skel->rodata->cache_size = args.cgroup_size / page_size;
+	fprintf(stderr, "Cgroup size: %lu bytes\n", args.cgroup_size);
+	fprintf(stderr, "Cache size: %lu pages\n", skel->rodata->cache_size);
+
+	// Frequency sketch and folio store are shared by all cgroups
+	if (sketch_resize_bytes(sketch_map(skel), &sketch_block_mask(skel), &sketch_sample_size(skel),
+				total_memory)) {
+		ret = 1;
+		goto cleanup;
+	}
+
+	if (folio_store_resize_bytes(folio_store_map(skel), &folio_store_mask(skel), total_memory)) {
+		ret = 1;
+		goto cleanup;
+	}
+
+	// One policy state per cgroup, created by tinylfu_init
+	if (memcg_state_resize(memcg_state_map(skel), cgroups))
+		goto cleanup;
+
+	// Set watch_dir
+	if (set_watch_dir_root(watch_dir_path, &watch_dir_ino_map(skel), &watch_dir_dev_map(skel))) {
+		ret = 1;
+		goto cleanup;
+	}
+
+	// Size inode_watchlist for the watch dir
+	if (resize_watch_dir_map(inode_watchlist_map(skel), watch_dir_path, true)) {
+		ret = 1;
+		goto cleanup;
+	}
+
+	// Hook profiling, if enabled
+	cache_ext_prof_setup(skel);
+
+	// Page access recording, if enabled
+	if (cache_ext_recorder_setup(skel))
+		goto cleanup;
+
+	// One stats slot per CPU
+	if (cache_ext_stats_resize(cache_ext_stats_map(skel)))
+		goto cleanup;
+
+	// Per-cgroup miss ratio curves, if enabled
+	if (cache_ext_mrc_setup(skel, total_memory))
+		goto cleanup;
+
+	// Share the pinned file class map with cache_ext_hint
+	if (cache_ext_hints_pin(inode_class_map(skel)))
+		goto cleanup;
+
+	// Resume from the state saved by --state, if there is one. Needs the final map sizes.
+	if (cache_ext_state_restore(&state, skel->obj, "tinylfu", tinylfu_state))
+		goto cleanup;
+
+	if (cache_ext_tinylfu_bpf__load(skel)) {
+		perror("Failed to load BPF skeleton");
+		ret = 1;
+		goto cleanup;
+	}
+
+	if (initialize_watch_dir_map(watch_dir_path, bpf_map__fd(inode_watchlist_map(skel)), true)) {
+		perror("Failed to initialize watch_dir map");
+		ret = 1;
+		goto cleanup;
+	}
+
+	if (cache_ext_state_apply(&state))
+		goto cleanup;
+
+	if (cache_ext_cgroups_attach(cgroups, skel->obj, skel->maps.tinylfu_ops)) {
+		ret = 1;
+		goto cleanup;
+	}
+
+	// Map the stats region and start the exporter, if enabled
+	if (cache_ext_exporter_start(&exporter, cache_ext_stats_map(skel), "tinylfu"))
+		goto cleanup;
+
+	// Dump hook profiles on SIGUSR1 and at exit, if enabled
+	if (cache_ext_prof_start(&prof, cache_ext_prof_map(skel), "tinylfu"))
+		goto cleanup;
+
+	// Stream page accesses to the --record file, if enabled
+	if (cache_ext_recorder_start(&rec, cache_ext_trace_ring(skel)))
+		goto cleanup;
+
+	// This is necessary for the dir_watcher functionality
+	if (cache_ext_tinylfu_bpf__attach(skel)) {
+		perror("Failed to attach BPF skeleton");
+		ret = 1;
+		goto cleanup;
+	}
+
+	// Tell whoever started us that the policy is live
+	cache_ext_ready();
+
+	// Wait for keyboard input
+	printf("Press any key to exit...\n");
+	getchar();
+	ret = 0;
+
+cleanup:
+	cache_ext_recorder_stop(&rec);
+	cache_ext_prof_stop(&prof);
+	cache_ext_exporter_stop(&exporter);
+	cache_ext_cgroups_close(cgroups);
+	cache_ext_state_save(&state);
+	cache_ext_state_free(&state);
+	cache_ext_tinylfu_bpf__destroy(skel);
+	return ret;
+}
@@ -0,0 +1,74 @@
+#ifndef _CACHE_EXT_TRACE_BPF_H
+#define _CACHE_EXT_TRACE_BPF_H 1
+
+#include "cache_ext_lib.bpf.h"
+#include "dir_watcher.bpf.h"
+#include "cache_ext_events.bpf.h"
+
+/*
+ * Opt-in page access recording.
+ *
+ * Policies call cache_ext_trace() at the top of their folio_added,
+ * folio_accessed and folio_evicted hooks. With --record, every event on a
+ * file in inode_watchlist becomes a fixed size record in
+ * cache_ext_trace_ring, submitted through the low-wakeup path of
+ * cache_ext_events.bpf.h. A writer thread in the loader compresses them into
+ * a chunked trace file, see cache_ext_trace.h and cache_ext_trace_fmt.h,
+ * which cache_ext_sim.c replays.
+ *
+ * Otherwise recording_enabled stays false and the verifier prunes the calls.
+ * Records lost to a full ring count in CACHE_EXT_STAT_EVENTS_DROPPED.
+ */
+
+enum cache_ext_trace_op {
+	CACHE_EXT_TRACE_ADD = 0,
+	CACHE_EXT_TRACE_ACCESS,
+	CACHE_EXT_TRACE_EVICT,
+};
+
+// Keep in sync with cache_ext_trace_fmt.h
+struct cache_ext_trace_rec {
+	u64 ts;		// ns, bpf_ktime_get_ns()
+	u64 ino;
+	u64 index;	// Page offset in the file
+	u32 tid;
+	u32 op;
+};
+
+#define CACHE_EXT_TRACE_RING_BYTES (16 << 20)  // Default, --record_ring_kb
+
+// Set from userspace
+const volatile bool recording_enabled = false;
+
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, CACHE_EXT_TRACE_RING_BYTES);
+} cache_ext_trace_ring SEC(".maps");
+
+static __always_inline void cache_ext_trace(u32 op, struct folio *folio)
+{
+	struct cache_ext_trace_rec *rec;
+	u64 ino;
+
+	if (!recording_enabled)
+		return;
+
+	if (!folio || !folio->mapping || !folio->mapping->host)
+		return;
+	ino = folio->mapping->host->i_ino;
+	if (!inode_in_watchlist(ino))
+		return;
+
+	rec = events_reserve(&cache_ext_trace_ring, sizeof(*rec));
+	if (!rec)
+		return;
+
+	rec->ts = bpf_ktime_get_ns();
+	rec->ino = ino;
+	rec->index = folio->index;
+	rec->tid = (u32)bpf_get_current_pid_tgid();
+	rec->op = op;
+	events_submit(&cache_ext_trace_ring, rec);
+}
+
+#endif /* _CACHE_EXT_TRACE_BPF_H */
@@ -0,0 +1,195 @@
+#ifndef _CACHE_EXT_TRACE_H
+#define _CACHE_EXT_TRACE_H
+
+#include <argp.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "cache_ext_trace_fmt.h"
+
+/*
+ * Userspace half of page access recording (see cache_ext_trace.bpf.h).
+ *
+ * --record FILE turns the BPF side on. A writer thread drains
+ * cache_ext_trace_ring every CACHE_EXT_TRACE_POLL_MS, or earlier once the
+ * ring passes the events wakeup watermark, and appends the records to FILE
+ * in the format of cache_ext_trace_fmt.h. Encoding happens off the fault
+ * path, the BPF side only copies 32 bytes per event.
+ *
+ *	cache_ext_recorder_setup(skel);			// before skel__load()
+ *	cache_ext_recorder_start(&rec, cache_ext_trace_ring(skel));
+ *	cache_ext_recorder_stop(&rec);			// writes the index
+ *
+ * The options are a child of cache_ext_stats_argp, like --profile.
+ */
+
+#define CACHE_EXT_TRACE_POLL_MS		100
+#define CACHE_EXT_TRACE_MIN_RING_BYTES	4096
+
+#define cache_ext_trace_ring(skel)	((skel)->maps.cache_ext_trace_ring)
+#define cache_ext_recorder_setup(skel)	\
+	cache_ext_recorder_prepare(cache_ext_trace_ring(skel), &(skel)->rodata->recording_enabled)
+
+struct cache_ext_trace_args {
+	const char *path;		// NULL: recording off
+	unsigned long ring_kb;		// 0: keep the default size
+};
+
+struct cache_ext_trace_args cache_ext_trace_args = { 0 };
+
+enum {
+	CACHE_EXT_TRACE_OPT_RECORD = 0x1500,
+	CACHE_EXT_TRACE_OPT_RING_KB,
+};
+
+static struct argp_option cache_ext_trace_options[] = {
+	{ "record", CACHE_EXT_TRACE_OPT_RECORD, "FILE", 0,
+	  "Record page accesses to watched files into FILE, for cache_ext_sim" },
+	{ "record_ring_kb", CACHE_EXT_TRACE_OPT_RING_KB, "KB", 0,
+	  "Size of the recording ring buffer (default: 16384)" },
+	{ 0 }
+};
+
+static error_t cache_ext_trace_parse_opt(int key, char *arg, struct argp_state *state)
+{
+	struct cache_ext_trace_args *args = &cache_ext_trace_args;
+	char *end;
+
+	switch (key) {
+	case CACHE_EXT_TRACE_OPT_RECORD:
+		args->path = arg;
+		break;
+	case CACHE_EXT_TRACE_OPT_RING_KB:
+		errno = 0;
+		args->ring_kb = strtoul(arg, &end, 10);
+		if (errno || *end != '\0' || args->ring_kb == 0)
+			argp_error(state, "Invalid ring size: %s", arg);
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static struct argp cache_ext_trace_argp = {
+	cache_ext_trace_options, cache_ext_trace_parse_opt, 0, 0
+};
+
+struct cache_ext_recorder {
+	struct ring_buffer *rb;
+	struct cache_ext_trace_writer writer;
+	int err;			// First write error, stops recording
+	bool running;
+	volatile bool stop;
+	pthread_t thread;
+};
+
+/*
+ * Enable recording if --record was given, and apply --record_ring_kb. Ring
+ * sizes must be a power of two multiple of the page size, so round up. Must
+ * be called between skel__open() and skel__load().
+ */
+int cache_ext_recorder_prepare(struct bpf_map *ring, bool *enabled) {
+	unsigned long bytes = cache_ext_trace_args.ring_kb * 1024;
+	unsigned long size = sysconf(_SC_PAGESIZE);
+
+	*enabled = cache_ext_trace_args.path != NULL;
+	if (!*enabled || bytes == 0)
+		return 0;
+
+	if (size < CACHE_EXT_TRACE_MIN_RING_BYTES)
+		size = CACHE_EXT_TRACE_MIN_RING_BYTES;
+	while (size < bytes)
+		size <<= 1;
+
+	if (bpf_map__set_max_entries(ring, size)) {
+		fprintf(stderr, "Failed to resize ring buffer %s\n", bpf_map__name(ring));
+		return -1;
+	}
+	return 0;
+}
+
+static int cache_ext_recorder_handle(void *ctx, void *data, size_t size) {
+	struct cache_ext_recorder *r = ctx;
+
+	if (r->err || size < sizeof(struct cache_ext_trace_rec))
+		return 0;
+
+	r->err = cache_ext_trace_writer_append(&r->writer, data);
+	if (r->err)
+		fprintf(stderr, "Recording stopped: %s\n", strerror(-r->err));
+	return 0;
+}
+
+static void *cache_ext_recorder_thread(void *arg) {
+	struct cache_ext_recorder *r = arg;
+
+	while (!r->stop) {
+		int err = ring_buffer__poll(r->rb, CACHE_EXT_TRACE_POLL_MS);
+
+		// Below the watermark nothing wakes us, read the ring on the timeout
+		if (err == 0)
+			err = ring_buffer__consume(r->rb);
+		if (err < 0 && err != -EINTR) {
+			fprintf(stderr, "Failed to poll recording ring: %s\n", strerror(-err));
+			break;
+		}
+	}
+	return NULL;
+}
+
+// Start the writer thread, if --record was given. Call after skel__load().
+int cache_ext_recorder_start(struct cache_ext_recorder *r, struct bpf_map *ring) {
+	int err;
+
+	memset(r, 0, sizeof(*r));
+	if (cache_ext_trace_args.path == NULL)
+		return 0;
+
+	if (cache_ext_trace_writer_open(&r->writer, cache_ext_trace_args.path))
+		return -1;
+
+	r->rb = ring_buffer__new(bpf_map__fd(ring), cache_ext_recorder_handle, r, NULL);
+	if (r->rb == NULL) {
+		perror("Failed to create recording ring buffer");
+		cache_ext_trace_writer_close(&r->writer);
+		return -1;
+	}
+
+	err = pthread_create(&r->thread, NULL, cache_ext_recorder_thread, r);
+	if (err) {
+		fprintf(stderr, "Failed to start recorder: %s\n", strerror(err));
+		ring_buffer__free(r->rb);
+		cache_ext_trace_writer_close(&r->writer);
+		return -1;
+	}
+	r->running = true;
+	return 0;
+}
+
+// Drain the ring, write the index and close the trace
+void cache_ext_recorder_stop(struct cache_ext_recorder *r) {
+	if (!r->running)
+		return;
+
+	r->stop = true;
+	pthread_join(r->thread, NULL);
+	ring_buffer__consume(r->rb);
+	ring_buffer__free(r->rb);
+	r->running = false;
+
+	if (cache_ext_trace_writer_close(&r->writer) == 0)
+		fprintf(stderr, "Recorded %llu page accesses in %llu chunks to %s\n",
+			(unsigned long long)r->writer.nr_records,
+			(unsigned long long)r->writer.nr_chunks, cache_ext_trace_args.path);
+}
+
+#endif /* _CACHE_EXT_TRACE_H */
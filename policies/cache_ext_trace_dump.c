@@ -0,0 +1,126 @@
+#include <argp.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "cache_ext_trace_fmt.h"
+
+/*
+ * Print a trace recorded with --record (see cache_ext_trace_fmt.h) as the
+ * text format cache_ext_sim also reads, or summarize it:
+ *
+ *	cache_ext_trace_dump trace.bin > trace.txt
+ *	cache_ext_trace_dump --from 3600000000000 trace.bin | head
+ *	cache_ext_trace_dump --summary trace.bin
+ */
+
+struct cmdline_args {
+	const char *path;
+	unsigned long long from_ns;
+	bool seek;
+	bool summary;
+};
+
+static struct argp_option options[] = {
+	{ "from", 'f', "NS", 0, "Start at the first chunk with records at or after NS" },
+	{ "summary", 's', 0, 0, "Print record counts and encoding density instead" },
+	{ 0 },
+};
+
+static const char *op_names[] = {
+	[CACHE_EXT_TRACE_ADD] = "add",
+	[CACHE_EXT_TRACE_ACCESS] = "access",
+	[CACHE_EXT_TRACE_EVICT] = "evict",
+};
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+	struct cmdline_args *args = state->input;
+	char *end;
+
+	switch (key) {
+	case 'f':
+		errno = 0;
+		args->from_ns = strtoull(arg, &end, 10);
+		if (errno || *end != '\0')
+			argp_error(state, "Invalid timestamp: %s", arg);
+		args->seek = true;
+		break;
+	case 's':
+		args->summary = true;
+		break;
+	case ARGP_KEY_ARG:
+		if (args->path)
+			argp_error(state, "Only one trace at a time");
+		args->path = arg;
+		break;
+	case ARGP_KEY_END:
+		if (args->path == NULL)
+			argp_usage(state);
+		break;
+	default:
+		return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct argp argp = { options, parse_opt, "TRACE", 0 };
+	struct cmdline_args args = { 0 };
+	struct cache_ext_trace_reader reader;
+	struct cache_ext_trace_rec rec;
+	unsigned long long counts[3] = { 0 }, nr = 0, first_ts = 0, last_ts = 0;
+	struct stat st;
+	int err;
+
+	argp_parse(&argp, argc, argv, 0, 0, &args);
+
+	if (cache_ext_trace_reader_open(&reader, args.path))
+		return 1;
+
+	if (args.seek && cache_ext_trace_reader_seek(&reader, args.from_ns)) {
+		fprintf(stderr, "%s has no index, it was not closed cleanly\n", args.path);
+		cache_ext_trace_reader_close(&reader);
+		return 1;
+	}
+
+	while ((err = cache_ext_trace_reader_next(&reader, &rec)) > 0) {
+		if (args.seek && rec.ts < args.from_ns)
+			continue;
+
+		if (nr == 0 || rec.ts < first_ts)
+			first_ts = rec.ts;
+		if (rec.ts > last_ts)
+			last_ts = rec.ts;
+		nr++;
+
+		if (args.summary) {
+			if (rec.op <= CACHE_EXT_TRACE_EVICT)
+				counts[rec.op]++;
+			continue;
+		}
+		if (printf("%s %llu %llu %llu %u\n", rec.op <= CACHE_EXT_TRACE_EVICT ? op_names[rec.op] : "?",
+			   (unsigned long long)rec.ino, (unsigned long long)rec.index,
+			   (unsigned long long)rec.ts, rec.tid) < 0)
+			break;
+	}
+	if (err < 0)
+		fprintf(stderr, "%s: Corrupt record after %llu records\n", args.path, nr);
+
+	if (args.summary && stat(args.path, &st) == 0) {
+		printf("records:    %llu (%llu add, %llu access, %llu evict)\n", nr,
+		       counts[CACHE_EXT_TRACE_ADD], counts[CACHE_EXT_TRACE_ACCESS],
+		       counts[CACHE_EXT_TRACE_EVICT]);
+		printf("chunks:     %llu%s\n", (unsigned long long)reader.nr_chunks,
+		       reader.index ? "" : " (no index, unfinished trace)");
+		printf("duration:   %.3f s\n", nr ? (last_ts - first_ts) / 1e9 : 0.0);
+		printf("size:       %lld bytes, %.2f per record\n", (long long)st.st_size,
+		       nr ? (double)st.st_size / nr : 0.0);
+	}
+
+	cache_ext_trace_reader_close(&reader);
+	return err < 0;
+}
@@ -0,0 +1,509 @@
+#ifndef _CACHE_EXT_TRACE_FMT_H
+#define _CACHE_EXT_TRACE_FMT_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/types.h>
+
+/*
+ * On-disk format of recorded page access traces (see cache_ext_trace.h).
+ * Plain C without libbpf, so cache_ext_sim.c and cache_ext_trace_dump.c can
+ * read traces anywhere.
+ *
+ *	file header
+ *	chunk header, records ...	CACHE_EXT_TRACE_CHUNK_RECORDS per chunk
+ *	...
+ *	index entry ...			one per chunk
+ *	trailer
+ *
+ * Every chunk restarts the delta state, so it decodes on its own, and the
+ * index gives each chunk's offset and time range for seeking. A record is
+ * a tag byte followed by up to four LEB128 varints:
+ *
+ *	tag	op | TRACE_TAG_SAME_INO | TRACE_TAG_SAME_TID
+ *	ino	zigzag delta to the previous record's, unless SAME_INO
+ *	index	zigzag delta to the previous record's index + 1
+ *	ts	zigzag delta to the previous record's
+ *	tid	unless SAME_TID
+ *
+ * so a sequential read by one thread costs 3 or 4 bytes. Deltas are signed
+ * because records from different CPUs interleave slightly out of order.
+ *
+ * A trace whose recorder died has no index and trailer. The reader then
+ * walks the chunks from the start, and stops at the first torn one.
+ */
+
+// Keep in sync with cache_ext_trace.bpf.h, which cache_ext_sim.c includes too
+#ifndef _CACHE_EXT_TRACE_BPF_H
+enum cache_ext_trace_op {
+	CACHE_EXT_TRACE_ADD = 0,
+	CACHE_EXT_TRACE_ACCESS,
+	CACHE_EXT_TRACE_EVICT,
+};
+
+struct cache_ext_trace_rec {
+	__u64 ts;
+	__u64 ino;
+	__u64 index;
+	__u32 tid;
+	__u32 op;
+};
+#endif
+
+#define CACHE_EXT_TRACE_MAGIC		"CXTRACE1"
+#define CACHE_EXT_TRACE_VERSION		1
+#define CACHE_EXT_TRACE_CHUNK_MAGIC	0x4b4e4843U	// "CHNK"
+#define CACHE_EXT_TRACE_INDEX_MAGIC	0x58444e49U	// "INDX"
+#define CACHE_EXT_TRACE_CHUNK_RECORDS	65536
+#define CACHE_EXT_TRACE_MAX_REC_BYTES	(1 + 4 * 10)
+#define CACHE_EXT_TRACE_CHUNK_BYTES	(CACHE_EXT_TRACE_CHUNK_RECORDS * CACHE_EXT_TRACE_MAX_REC_BYTES)
+
+#define TRACE_TAG_OP_MASK	0x3
+#define TRACE_TAG_SAME_INO	0x4
+#define TRACE_TAG_SAME_TID	0x8
+
+struct cache_ext_trace_header {
+	char magic[8];
+	__u32 version;
+	__u32 chunk_records;
+};
+
+struct cache_ext_trace_chunk {
+	__u32 magic;
+	__u32 nr_records;
+	__u32 bytes;		// Of encoded records following this header
+	__u32 pad;
+	__u64 first_ts;
+	__u64 last_ts;
+};
+
+struct cache_ext_trace_index_entry {
+	__u64 offset;		// Of the chunk header
+	__u64 first_ts;
+	__u64 last_ts;
+	__u64 first_record;
+};
+
+struct cache_ext_trace_trailer {
+	__u64 index_offset;
+	__u64 nr_chunks;
+	__u64 nr_records;
+	__u32 magic;
+	__u32 pad;
+};
+
+// Delta state, reset at every chunk
+struct cache_ext_trace_delta {
+	__u64 ts;
+	__u64 ino;
+	__u64 index;
+	__u32 tid;
+};
+
+static inline __u64 trace_zigzag(__s64 v) {
+	return ((__u64)v << 1) ^ (__u64)(v >> 63);
+}
+
+static inline __s64 trace_unzigzag(__u64 v) {
+	return (__s64)(v >> 1) ^ -(__s64)(v & 1);
+}
+
+static inline unsigned char *trace_put_varint(unsigned char *p, __u64 v) {
+	while (v >= 0x80) {
+		*p++ = (unsigned char)v | 0x80;
+		v >>= 7;
+	}
+	*p++ = (unsigned char)v;
+	return p;
+}
+
+// NULL if the varint runs past end
+static inline const unsigned char *trace_get_varint(const unsigned char *p,
+						    const unsigned char *end, __u64 *v) {
+	__u64 val = 0;
+
+	for (unsigned int shift = 0; p < end && shift < 64; shift += 7) {
+		unsigned char b = *p++;
+
+		val |= (__u64)(b & 0x7f) << shift;
+		if (!(b & 0x80)) {
+			*v = val;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+// Encode rec at p, which must have CACHE_EXT_TRACE_MAX_REC_BYTES of room
+static inline unsigned char *cache_ext_trace_encode(struct cache_ext_trace_delta *d,
+						    const struct cache_ext_trace_rec *rec,
+						    unsigned char *p) {
+	unsigned char *tag = p++;
+
+	*tag = rec->op & TRACE_TAG_OP_MASK;
+	if (rec->ino == d->ino)
+		*tag |= TRACE_TAG_SAME_INO;
+	else
+		p = trace_put_varint(p, trace_zigzag(rec->ino - d->ino));
+	p = trace_put_varint(p, trace_zigzag(rec->index - (d->index + 1)));
+	p = trace_put_varint(p, trace_zigzag(rec->ts - d->ts));
+	if (rec->tid == d->tid)
+		*tag |= TRACE_TAG_SAME_TID;
+	else
+		p = trace_put_varint(p, rec->tid);
+
+	d->ts = rec->ts;
+	d->ino = rec->ino;
+	d->index = rec->index;
+	d->tid = rec->tid;
+	return p;
+}
+
+// NULL if the record is truncated
+static inline const unsigned char *cache_ext_trace_decode(struct cache_ext_trace_delta *d,
+							  const unsigned char *p,
+							  const unsigned char *end,
+							  struct cache_ext_trace_rec *rec) {
+	unsigned char tag;
+	__u64 v;
+
+	if (p >= end)
+		return NULL;
+	tag = *p++;
+
+	rec->op = tag & TRACE_TAG_OP_MASK;
+	rec->ino = d->ino;
+	if (!(tag & TRACE_TAG_SAME_INO)) {
+		if (!(p = trace_get_varint(p, end, &v)))
+			return NULL;
+		rec->ino += trace_unzigzag(v);
+	}
+	if (!(p = trace_get_varint(p, end, &v)))
+		return NULL;
+	rec->index = d->index + 1 + trace_unzigzag(v);
+	if (!(p = trace_get_varint(p, end, &v)))
+		return NULL;
+	rec->ts = d->ts + trace_unzigzag(v);
+	rec->tid = d->tid;
+	if (!(tag & TRACE_TAG_SAME_TID)) {
+		if (!(p = trace_get_varint(p, end, &v)))
+			return NULL;
+		rec->tid = v;
+	}
+
+	d->ts = rec->ts;
+	d->ino = rec->ino;
+	d->index = rec->index;
+	d->tid = rec->tid;
+	return p;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Writer /////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+struct cache_ext_trace_writer {
+	FILE *f;
+	unsigned char *buf;	// Encoded records of the open chunk
+	unsigned char *pos;
+	struct cache_ext_trace_chunk chunk;
+	struct cache_ext_trace_delta delta;
+	struct cache_ext_trace_index_entry *index;
+	__u64 nr_chunks;
+	__u64 index_cap;
+	__u64 offset;		// Bytes written so far
+	__u64 nr_records;
+};
+
+int cache_ext_trace_writer_open(struct cache_ext_trace_writer *w, const char *path) {
+	struct cache_ext_trace_header hdr = {
+		.magic = CACHE_EXT_TRACE_MAGIC,
+		.version = CACHE_EXT_TRACE_VERSION,
+		.chunk_records = CACHE_EXT_TRACE_CHUNK_RECORDS,
+	};
+
+	memset(w, 0, sizeof(*w));
+	w->buf = malloc(CACHE_EXT_TRACE_CHUNK_BYTES);
+	if (w->buf == NULL)
+		return -ENOMEM;
+	w->pos = w->buf;
+
+	w->f = fopen(path, "w");
+	if (w->f == NULL) {
+		int err = -errno;
+
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		free(w->buf);
+		return err;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, w->f) != 1) {
+		perror("Failed to write trace header");
+		fclose(w->f);
+		free(w->buf);
+		w->f = NULL;
+		return -EIO;
+	}
+	w->offset = sizeof(hdr);
+	return 0;
+}
+
+static int cache_ext_trace_writer_flush(struct cache_ext_trace_writer *w) {
+	struct cache_ext_trace_index_entry *e;
+
+	if (w->chunk.nr_records == 0)
+		return 0;
+
+	if (w->nr_chunks == w->index_cap) {
+		__u64 cap = w->index_cap ? 2 * w->index_cap : 256;
+		void *index = realloc(w->index, cap * sizeof(*w->index));
+
+		if (index == NULL)
+			return -ENOMEM;
+		w->index = index;
+		w->index_cap = cap;
+	}
+	e = &w->index[w->nr_chunks++];
+	e->offset = w->offset;
+	e->first_ts = w->chunk.first_ts;
+	e->last_ts = w->chunk.last_ts;
+	e->first_record = w->nr_records - w->chunk.nr_records;
+
+	w->chunk.magic = CACHE_EXT_TRACE_CHUNK_MAGIC;
+	w->chunk.bytes = w->pos - w->buf;
+	if (fwrite(&w->chunk, sizeof(w->chunk), 1, w->f) != 1 ||
+	    fwrite(w->buf, 1, w->chunk.bytes, w->f) != w->chunk.bytes) {
+		perror("Failed to write trace chunk");
+		return -EIO;
+	}
+	w->offset += sizeof(w->chunk) + w->chunk.bytes;
+
+	memset(&w->chunk, 0, sizeof(w->chunk));
+	memset(&w->delta, 0, sizeof(w->delta));
+	w->pos = w->buf;
+	return 0;
+}
+
+int cache_ext_trace_writer_append(struct cache_ext_trace_writer *w,
+				  const struct cache_ext_trace_rec *rec) {
+	if (w->chunk.nr_records == 0)
+		w->chunk.first_ts = rec->ts;
+	if (w->chunk.nr_records == 0 || rec->ts > w->chunk.last_ts)
+		w->chunk.last_ts = rec->ts;
+	if (rec->ts < w->chunk.first_ts)
+		w->chunk.first_ts = rec->ts;
+
+	w->pos = cache_ext_trace_encode(&w->delta, rec, w->pos);
+	w->chunk.nr_records++;
+	w->nr_records++;
+
+	if (w->chunk.nr_records == CACHE_EXT_TRACE_CHUNK_RECORDS)
+		return cache_ext_trace_writer_flush(w);
+	return 0;
+}
+
+// Flush the last chunk, write the index and close the file
+int cache_ext_trace_writer_close(struct cache_ext_trace_writer *w) {
+	struct cache_ext_trace_trailer trailer = { 0 };
+	int err;
+
+	if (w->f == NULL)
+		return 0;
+
+	err = cache_ext_trace_writer_flush(w);
+	if (!err) {
+		trailer.index_offset = w->offset;
+		trailer.nr_chunks = w->nr_chunks;
+		trailer.nr_records = w->nr_records;
+		trailer.magic = CACHE_EXT_TRACE_INDEX_MAGIC;
+		if ((w->nr_chunks &&
+		     fwrite(w->index, sizeof(*w->index), w->nr_chunks, w->f) != w->nr_chunks) ||
+		    fwrite(&trailer, sizeof(trailer), 1, w->f) != 1) {
+			perror("Failed to write trace index");
+			err = -EIO;
+		}
+	}
+
+	if (fclose(w->f) && !err) {
+		perror("Failed to close trace");
+		err = -EIO;
+	}
+	w->f = NULL;
+	free(w->buf);
+	free(w->index);
+	return err;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Reader /////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+struct cache_ext_trace_reader {
+	FILE *f;
+	unsigned char *buf;
+	const unsigned char *pos;
+	const unsigned char *end;
+	struct cache_ext_trace_delta delta;
+	struct cache_ext_trace_index_entry *index;	// NULL if the trace has none
+	__u64 nr_chunks;
+	__u64 nr_records;
+	__u64 data_end;		// Offset of the index, or of the end of file
+	__u32 left;		// Records left in the current chunk
+};
+
+// Is the file at path a recorded trace?
+bool cache_ext_trace_is_binary(const char *path) {
+	char magic[8];
+	bool ret = false;
+	FILE *f = fopen(path, "r");
+
+	if (f == NULL)
+		return false;
+	if (fread(magic, sizeof(magic), 1, f) == 1)
+		ret = !memcmp(magic, CACHE_EXT_TRACE_MAGIC, sizeof(magic));
+	fclose(f);
+	return ret;
+}
+
+static int cache_ext_trace_reader_load_index(struct cache_ext_trace_reader *r) {
+	struct cache_ext_trace_trailer trailer;
+	long size;
+
+	if (fseek(r->f, 0, SEEK_END) || (size = ftell(r->f)) < 0)
+		return -EIO;
+	r->data_end = size;
+
+	if (size < (long)(sizeof(struct cache_ext_trace_header) + sizeof(trailer)) ||
+	    fseek(r->f, size - sizeof(trailer), SEEK_SET) ||
+	    fread(&trailer, sizeof(trailer), 1, r->f) != 1 ||
+	    trailer.magic != CACHE_EXT_TRACE_INDEX_MAGIC ||
+	    trailer.index_offset + trailer.nr_chunks * sizeof(*r->index) + sizeof(trailer) != (__u64)size)
+		return 0;  // Unfinished trace, walk the chunks
+
+	r->index = calloc(trailer.nr_chunks ? trailer.nr_chunks : 1, sizeof(*r->index));
+	if (r->index == NULL)
+		return -ENOMEM;
+	if (fseek(r->f, trailer.index_offset, SEEK_SET) ||
+	    fread(r->index, sizeof(*r->index), trailer.nr_chunks, r->f) != trailer.nr_chunks)
+		return -EIO;
+
+	r->nr_chunks = trailer.nr_chunks;
+	r->nr_records = trailer.nr_records;
+	r->data_end = trailer.index_offset;
+	return 0;
+}
+
+int cache_ext_trace_reader_open(struct cache_ext_trace_reader *r, const char *path) {
+	struct cache_ext_trace_header hdr;
+	int err;
+
+	memset(r, 0, sizeof(*r));
+	r->f = fopen(path, "r");
+	if (r->f == NULL) {
+		err = -errno;
+		fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+		return err;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, r->f) != 1 ||
+	    memcmp(hdr.magic, CACHE_EXT_TRACE_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != CACHE_EXT_TRACE_VERSION) {
+		fprintf(stderr, "%s is not a version %d trace\n", path, CACHE_EXT_TRACE_VERSION);
+		err = -EINVAL;
+		goto err;
+	}
+
+	r->buf = malloc(CACHE_EXT_TRACE_CHUNK_BYTES);
+	if (r->buf == NULL) {
+		err = -ENOMEM;
+		goto err;
+	}
+
+	err = cache_ext_trace_reader_load_index(r);
+	if (err || fseek(r->f, sizeof(hdr), SEEK_SET)) {
+		fprintf(stderr, "Failed to read index of %s\n", path);
+		err = err ? err : -EIO;
+		goto err;
+	}
+	return 0;
+
+err:
+	fclose(r->f);
+	free(r->buf);
+	free(r->index);
+	r->f = NULL;
+	return err;
+}
+
+void cache_ext_trace_reader_close(struct cache_ext_trace_reader *r) {
+	if (r->f)
+		fclose(r->f);
+	free(r->buf);
+	free(r->index);
+	r->f = NULL;
+}
+
+// Read the chunk at the current file position. 0 at the end of the trace.
+static int cache_ext_trace_reader_chunk(struct cache_ext_trace_reader *r) {
+	struct cache_ext_trace_chunk chunk;
+	long off = ftell(r->f);
+
+	if (off < 0 || (__u64)off + sizeof(chunk) > r->data_end ||
+	    fread(&chunk, sizeof(chunk), 1, r->f) != 1 ||
+	    chunk.magic != CACHE_EXT_TRACE_CHUNK_MAGIC ||
+	    chunk.bytes > CACHE_EXT_TRACE_CHUNK_BYTES ||
+	    (__u64)off + sizeof(chunk) + chunk.bytes > r->data_end ||
+	    fread(r->buf, 1, chunk.bytes, r->f) != chunk.bytes)
+		return 0;  // End of trace, or a torn chunk of an unfinished one
+
+	memset(&r->delta, 0, sizeof(r->delta));
+	r->pos = r->buf;
+	r->end = r->buf + chunk.bytes;
+	r->left = chunk.nr_records;
+	return 1;
+}
+
+// 1 and the next record in *rec, 0 at the end of the trace, -EINVAL if corrupt
+int cache_ext_trace_reader_next(struct cache_ext_trace_reader *r, struct cache_ext_trace_rec *rec) {
+	while (r->left == 0)
+		if (!cache_ext_trace_reader_chunk(r))
+			return 0;
+
+	r->pos = cache_ext_trace_decode(&r->delta, r->pos, r->end, rec);
+	if (r->pos == NULL)
+		return -EINVAL;
+	r->left--;
+	return 1;
+}
+
+/*
+ * Continue reading at the first chunk that may hold records at or after ts.
+ * Needs the index, -ENOENT for unfinished traces.
+ */
+int cache_ext_trace_reader_seek(struct cache_ext_trace_reader *r, __u64 ts) {
+	__u64 lo = 0, hi = r->nr_chunks;
+
+	if (r->index == NULL)
+		return -ENOENT;
+
+	// First chunk whose last record isn't before ts
+	while (lo < hi) {
+		__u64 mid = lo + (hi - lo) / 2;
+
+		if (r->index[mid].last_ts < ts)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	r->left = 0;
+	if (fseek(r->f, lo < r->nr_chunks ? (long)r->index[lo].offset : (long)r->data_end, SEEK_SET))
+		return -EIO;
+	return 0;
+}
+
+#endif /* _CACHE_EXT_TRACE_FMT_H */
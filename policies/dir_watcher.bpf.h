@@ -14,11 +14,16 @@
 #endif
 
 #define FMODE_CREATED 0x100000 /* linux: include/linux/fs.h */
-#define BPF_PATH_MAX 128
+#define WATCH_DIR_MAX_DEPTH 64  // Max directory levels between a file and the watch dir
 
-// Read-only variable, filled by loader
-const volatile char watch_dir_path[BPF_PATH_MAX] = {0};
-const volatile size_t watch_dir_path_len = 0;
+/*
+ * Read-only variables, filled by loader. The watch dir is identified by its
+ * inode number and the s_dev (kernel dev_t encoding) of its superblock rather
+ * than by path, so created files can be matched by walking up their dentry
+ * chain instead of formatting the path with bpf_d_path().
+ */
+const volatile u64 watch_dir_ino = 0;
+const volatile u32 watch_dir_dev = 0;
 
 struct {
     __uint(type, BPF_MAP_TYPE_HASH);
@@ -27,27 +32,69 @@ struct {
     __uint(max_entries, 200000);
 } inode_watchlist SEC(".maps");
 
+/*
+ * inode_in_watchlist() runs first in every hook, so remember the last lookup
+ * per CPU. Consecutive folio events on the same file then skip the hash
+ * lookup. watchlist_gen is bumped whenever vfs_open_exit changes the
+ * watchlist, which invalidates all cached results.
+ */
+struct watchlist_cache {
+    u64 inode_no;
+    u64 gen;
+    bool hit;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, u32);
+    __type(value, struct watchlist_cache);
+    __uint(max_entries, 1);
+} watchlist_cache_map SEC(".maps");
+
+u64 watchlist_gen = 0;
+
 static inline bool inode_in_watchlist(u64 inode_no) {
-    // Start simple. Return true if file page and not executable.
-    // TODO: Fill me
-    u8 *ret = bpf_map_lookup_elem(&inode_watchlist, &inode_no);
-    if (ret != NULL) {
-        return true;
+    u32 key = 0;
+    u64 gen = *(volatile u64 *)&watchlist_gen;
+    struct watchlist_cache *cache = bpf_map_lookup_elem(&watchlist_cache_map, &key);
+
+    if (cache && cache->inode_no == inode_no && cache->gen == gen)
+        return cache->hit;
+
+    bool hit = bpf_map_lookup_elem(&inode_watchlist, &inode_no) != NULL;
+    if (cache) {
+        cache->inode_no = inode_no;
+        cache->gen = gen;
+        cache->hit = hit;
     }
-    return false;
+    return hit;
 };
 
-static inline int strncmp(const char *s1, const volatile char *s2, int n) {
-	while (n && *s1 && (*s1 == *s2)) {
-		++s1;
-		++s2;
-		--n;
-	}
+// Is dentry somewhere below the watch dir?
+static inline bool dentry_under_watch_dir(struct dentry *dentry) {
+    struct dentry *d = dentry->d_parent;
+
+    if (unlikely(!watch_dir_ino)) {
+        bpf_printk("watch_dir_ino is 0!!\n");
+        return false;
+    }
 
-	if (n == 0)
-		return 0;
+    // Dentries don't cross mounts, so one superblock check is enough
+    if (dentry->d_sb->s_dev != watch_dir_dev)
+        return false;
 
-	return *s1 - *s2;
+    for (int i = 0; i < WATCH_DIR_MAX_DEPTH; i++) {
+        struct inode *inode = d->d_inode;
+        if (inode && inode->i_ino == watch_dir_ino)
+            return true;
+
+        struct dentry *parent = d->d_parent;
+        if (parent == d)  // Reached filesystem root
+            return false;
+        d = parent;
+    }
+
+    return false;
 }
 
 // Use a fexit probe to track file opens
@@ -59,15 +106,8 @@ int BPF_PROG(vfs_open_exit, struct path *path, struct file *file, long ret) {
     // If file was not created, return
     if (!(file->f_mode & FMODE_CREATED)) return 0;
 
-    // {0} required due to verifier bug in Linux 6.6.8 compared to 6.6.14
-    char filepath[BPF_PATH_MAX] = {0};
-    long err;
-    if ((err = bpf_d_path(path, filepath, sizeof(filepath))) < 0) {
-        bpf_printk("Failed to get file path: %ld\n", err);
-        return 0;
-    }
-
     u64 inode_no = file->f_inode->i_ino;
+    long err;
 
     // Check if inode was previously inode_watchlisted - means it was previously
     // deleted
@@ -75,6 +115,7 @@ int BPF_PROG(vfs_open_exit, struct path *path, struct file *file, long ret) {
     u8 *ret2 = bpf_map_lookup_elem(&inode_watchlist, &inode_no);
     if (ret2 != NULL) {  // Remove inode from inode_watchlist
         err = bpf_map_delete_elem(&inode_watchlist, &inode_no);
+        __sync_fetch_and_add(&watchlist_gen, 1);
         if (err != 0) {
             bpf_printk("Failed to delete inode from inode_watchlist: %ld\n",
                        err);
@@ -83,15 +124,12 @@ int BPF_PROG(vfs_open_exit, struct path *path, struct file *file, long ret) {
     }
 
     // Check if file is in our desired directory tree
-    if (unlikely(!watch_dir_path_len)) {
-        bpf_printk("watch_dir_path_len is 0!!\n");
-        return 0;
-    }
-    if (strncmp(filepath, watch_dir_path, watch_dir_path_len) != 0) return 0;
+    if (!dentry_under_watch_dir(path->dentry)) return 0;
 
     // Add inode to inode_watchlist
     u8 zero = 0;
     err = bpf_map_update_elem(&inode_watchlist, &inode_no, &zero, BPF_ANY);
+    __sync_fetch_and_add(&watchlist_gen, 1);
     if (err != 0) {
         bpf_printk("Failed to add inode to inode_watchlist: %ld\n", err);
         return 0;
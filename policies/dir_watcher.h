@@ -4,81 +4,429 @@
 #include <argp.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <bpf/bpf.h>
 #include <bpf/libbpf.h>
 
 #define inode_watchlist_map(skel) 		((skel)->maps.inode_watchlist)
-#define watch_dir_path_map(skel)		((skel)->rodata->watch_dir_path)
-#define watch_dir_path_len_map(skel)	((skel)->rodata->watch_dir_path_len)
+#define watch_dir_ino_map(skel)		((skel)->rodata->watch_dir_ino)
+#define watch_dir_dev_map(skel)		((skel)->rodata->watch_dir_dev)
 
-int initialize_watch_dir_map(const char *path, int watch_dir_map_fd, bool recursive) {
-	int ret;
-	DIR *dir;
+#define WATCH_DIR_MIN_ENTRIES		200000	// Default inode_watchlist size
+#define WATCH_DIR_MAX_THREADS		16
+#define WATCH_DIR_MAX_QUEUED		256	// Deeper dirs are walked inline
+#define WATCH_DIR_BATCH_SIZE		65536	// Keys per bpf_map_update_batch()
+
+#ifndef ENOTSUPP
+#define ENOTSUPP 524  // Kernel-internal, returned by some BPF map ops
+#endif
+
+/*
+ * The watch dir is walked with openat()/fdopendir() by a small thread pool.
+ * Each worker pops a directory fd off a shared queue, collects the inodes of
+ * its entries into a worker-local array and pushes subdirectories back onto
+ * the queue (or walks them inline once the queue is full, which bounds the
+ * number of open fds). The collected inodes are then inserted into
+ * inode_watchlist with bpf_map_update_batch().
+ */
+
+struct watch_dir_inodes {
+	__u64 *inodes;
+	size_t nr;
+	size_t cap;
+};
+
+struct watch_dir_walk {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int queue[WATCH_DIR_MAX_QUEUED];
+	int nr_queued;
+	int nr_busy;		// Workers currently walking a directory
+	int err;
+	bool recursive;
+};
+
+struct watch_dir_worker {
+	pthread_t thread;
+	struct watch_dir_walk *walk;
+	struct watch_dir_inodes inodes;
+};
+
+// Result of the last resize_watch_dir_map() scan, reused by initialize_watch_dir_map()
+static struct {
+	char path[PATH_MAX];
+	bool recursive;
+	bool valid;
+	double scan_secs;
+	struct watch_dir_inodes inodes;
+} watch_dir_scan_cache;
+
+/*
+ * Look up the inode number and device of the watch dir for the BPF side's
+ * ancestor check. The device is converted to the kernel's internal dev_t
+ * encoding (MKDEV), which is what sb->s_dev holds. Must be called between
+ * skel__open() and skel__load().
+ */
+int set_watch_dir_root(const char *path, __u64 *ino, __u32 *dev) {
+	struct stat sb;
+
+	if (stat(path, &sb) == -1) {
+		fprintf(stderr, "stat: %s: %s\n", strerror(errno), path);
+		return -1;
+	}
+	if (!S_ISDIR(sb.st_mode)) {
+		fprintf(stderr, "Not a directory: %s\n", path);
+		return -1;
+	}
+
+	*ino = sb.st_ino;
+	*dev = (major(sb.st_dev) << 20) | minor(sb.st_dev);
+
+	return 0;
+}
+
+static double watch_dir_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void watch_dir_inodes_free(struct watch_dir_inodes *v) {
+	free(v->inodes);
+	memset(v, 0, sizeof(*v));
+}
+
+static int watch_dir_inodes_push(struct watch_dir_inodes *v, __u64 ino) {
+	if (v->nr == v->cap) {
+		size_t cap = v->cap ? 2 * v->cap : 4096;
+		__u64 *inodes = realloc(v->inodes, cap * sizeof(*inodes));
+		if (inodes == NULL)
+			return -ENOMEM;
+		v->inodes = inodes;
+		v->cap = cap;
+	}
+	v->inodes[v->nr++] = ino;
+	return 0;
+}
+
+static int watch_dir_inodes_append(struct watch_dir_inodes *dst,
+				   struct watch_dir_inodes *src) {
+	for (size_t i = 0; i < src->nr; i++) {
+		if (watch_dir_inodes_push(dst, src->inodes[i]))
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+// Returns true if the subdirectory fd was handed to another worker
+static bool watch_dir_try_enqueue(struct watch_dir_walk *walk, int fd) {
+	bool queued = false;
+
+	pthread_mutex_lock(&walk->lock);
+	if (walk->nr_queued < WATCH_DIR_MAX_QUEUED) {
+		walk->queue[walk->nr_queued++] = fd;
+		pthread_cond_signal(&walk->cond);
+		queued = true;
+	}
+	pthread_mutex_unlock(&walk->lock);
+
+	return queued;
+}
+
+static void watch_dir_set_err(struct watch_dir_walk *walk, int err) {
+	pthread_mutex_lock(&walk->lock);
+	if (!walk->err)
+		walk->err = err;
+	pthread_cond_broadcast(&walk->cond);
+	pthread_mutex_unlock(&walk->lock);
+}
+
+// Walk the directory referred to by fd. Takes ownership of fd.
+static int watch_dir_walk_fd(struct watch_dir_worker *w, int fd) {
+	struct watch_dir_walk *walk = w->walk;
 	struct dirent *ent;
+	int ret = 0;
+	DIR *dir;
 
-	dir = opendir(path);
+	dir = fdopendir(fd);
 	if (dir == NULL) {
 		perror("Error opening directory");
-		return errno;
+		close(fd);
+		return -1;
 	}
 
 	while ((ent = readdir(dir)) != NULL) {
+		if (__atomic_load_n(&walk->err, __ATOMIC_RELAXED)) {
+			ret = -1;
+			break;
+		}
+
 		if (strncmp(ent->d_name, ".", 1) == 0 || strncmp(ent->d_name, "..", 2) == 0)
 			continue;
 
 		if (strcmp(ent->d_name, ".git") == 0)
 			continue;
 
-		char *filename = ent->d_name;
-		char *filepath = (char *)malloc(strlen(path) + strlen(filename) + 2);
-		sprintf(filepath, "%s/%s", path, filename);
-
-		// Check if dir
-		struct stat sb;
-		if (stat(filepath, &sb) == -1) {
-			fprintf(stderr, "stat: %s: %s\n", strerror(errno), filepath);
-			free(filepath);
-			return -1;
+		// Only fall back to stat for filesystems without d_type and
+		// for symlinks, which may point to directories
+		bool is_dir = ent->d_type == DT_DIR;
+		if (ent->d_type == DT_UNKNOWN || ent->d_type == DT_LNK) {
+			struct stat sb;
+			if (fstatat(dirfd(dir), ent->d_name, &sb, 0) == -1) {
+				fprintf(stderr, "stat: %s: %s\n", strerror(errno), ent->d_name);
+				ret = -1;
+				break;
+			}
+			is_dir = S_ISDIR(sb.st_mode);
 		}
-		if (S_ISDIR(sb.st_mode)) {
-			if (!recursive) {
-				free(filepath);
+
+		if (is_dir) {
+			if (!walk->recursive)
 				continue;
+
+			int subfd = openat(dirfd(dir), ent->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (subfd < 0) {
+				fprintf(stderr, "open: %s: %s\n", strerror(errno), ent->d_name);
+				ret = -1;
+				break;
 			}
 
-			// Recurse for nested directories
-			ret = initialize_watch_dir_map(filepath, watch_dir_map_fd, recursive);
-			if (ret < 0) {
-				closedir(dir);
-				free(filepath);
-				return ret;
+			if (!watch_dir_try_enqueue(walk, subfd)) {
+				ret = watch_dir_walk_fd(w, subfd);
+				if (ret < 0)
+					break;
 			}
 		}
-		free(filepath);
 
-		__u8 zero = 0;
+		if (watch_dir_inodes_push(&w->inodes, ent->d_ino)) {
+			fprintf(stderr, "Out of memory collecting inodes\n");
+			ret = -1;
+			break;
+		}
+	}
+
+	closedir(dir);
+
+	return ret;
+}
+
+static void *watch_dir_worker_fn(void *arg) {
+	struct watch_dir_worker *w = arg;
+	struct watch_dir_walk *walk = w->walk;
+
+	pthread_mutex_lock(&walk->lock);
+	for (;;) {
+		while (!walk->err && walk->nr_queued == 0 && walk->nr_busy > 0)
+			pthread_cond_wait(&walk->cond, &walk->lock);
+
+		if (walk->err || walk->nr_queued == 0)
+			break;
 
-		// fprintf(stderr, "Adding inode %lu to watch_dir map\n", ent->d_ino);
-		ret = bpf_map_update_elem(watch_dir_map_fd, &ent->d_ino, &zero, 0);
+		int fd = walk->queue[--walk->nr_queued];
+		walk->nr_busy++;
+		pthread_mutex_unlock(&walk->lock);
+
+		int ret = watch_dir_walk_fd(w, fd);
+
+		pthread_mutex_lock(&walk->lock);
+		walk->nr_busy--;
+		if (ret < 0 && !walk->err)
+			walk->err = -1;
+		// Wake up idle workers so they can exit once all work is done
+		if (walk->err || (walk->nr_queued == 0 && walk->nr_busy == 0))
+			pthread_cond_broadcast(&walk->cond);
+	}
+	pthread_mutex_unlock(&walk->lock);
+
+	return NULL;
+}
+
+/*
+ * Collect the inodes of all entries under path (excluding dotfiles and path
+ * itself) into *out. Subdirectories are only descended into and included if
+ * recursive is set.
+ */
+int scan_watch_dir(const char *path, bool recursive, struct watch_dir_inodes *out) {
+	struct watch_dir_worker workers[WATCH_DIR_MAX_THREADS] = { 0 };
+	struct watch_dir_walk walk = { 0 };
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int nr_threads = 1;
+	int started = 0;
+	int ret = 0;
+	int fd;
+
+	if (recursive)
+		nr_threads = nr_cpus < 1 ? 1 :
+			     nr_cpus > WATCH_DIR_MAX_THREADS ? WATCH_DIR_MAX_THREADS : nr_cpus;
+
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		perror("Error opening directory");
+		return errno;
+	}
+
+	pthread_mutex_init(&walk.lock, NULL);
+	pthread_cond_init(&walk.cond, NULL);
+	walk.recursive = recursive;
+	walk.queue[walk.nr_queued++] = fd;
+
+	for (int i = 0; i < nr_threads; i++) {
+		workers[i].walk = &walk;
+		if (pthread_create(&workers[i].thread, NULL, watch_dir_worker_fn, &workers[i])) {
+			perror("Failed to create watch_dir worker");
+			watch_dir_set_err(&walk, -1);
+			break;
+		}
+		started++;
+	}
+
+	for (int i = 0; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	// Close anything left in the queue after an error
+	for (int i = 0; i < walk.nr_queued; i++)
+		close(walk.queue[i]);
+
+	if (walk.err || started == 0)
+		ret = -1;
+
+	for (int i = 0; i < nr_threads; i++) {
+		if (!ret && watch_dir_inodes_append(out, &workers[i].inodes)) {
+			fprintf(stderr, "Out of memory collecting inodes\n");
+			ret = -1;
+		}
+		watch_dir_inodes_free(&workers[i].inodes);
+	}
+
+	pthread_cond_destroy(&walk.cond);
+	pthread_mutex_destroy(&walk.lock);
+
+	return ret;
+}
+
+/*
+ * Insert all inodes into the watchlist map, WATCH_DIR_BATCH_SIZE keys per
+ * syscall. Falls back to per-element updates if the kernel doesn't support
+ * batch operations on the map.
+ */
+int populate_watch_dir_map(int watch_dir_map_fd, const struct watch_dir_inodes *inodes) {
+	LIBBPF_OPTS(bpf_map_batch_opts, opts, .elem_flags = BPF_ANY);
+	static __u8 zeros[WATCH_DIR_BATCH_SIZE];
+	size_t done = 0;
+	int ret;
+
+	while (done < inodes->nr) {
+		__u32 count = inodes->nr - done;
+		if (count > WATCH_DIR_BATCH_SIZE)
+			count = WATCH_DIR_BATCH_SIZE;
+
+		ret = bpf_map_update_batch(watch_dir_map_fd, &inodes->inodes[done], zeros,
+					   &count, &opts);
+		if (ret == -EOPNOTSUPP || ret == -ENOTSUPP || ret == -EINVAL)
+			break;
 		if (ret) {
+			errno = -ret;
 			perror("Failed to update watch_dir map");
-			closedir(dir);
 			return -1;
 		}
+		done += count;
 	}
 
-	closedir(dir);
+	for (; done < inodes->nr; done++) {
+		__u8 zero = 0;
+		ret = bpf_map_update_elem(watch_dir_map_fd, &inodes->inodes[done], &zero, 0);
+		if (ret) {
+			perror("Failed to update watch_dir map");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Size inode_watchlist to fit the watch dir. Must be called between
+ * skel__open() and skel__load(). The scan is kept around so that the
+ * following initialize_watch_dir_map() call for the same path doesn't have
+ * to walk the tree again. Leaves twice the scanned number of entries (and at
+ * least WATCH_DIR_MIN_ENTRIES) so files created at runtime still fit.
+ */
+int resize_watch_dir_map(struct bpf_map *map, const char *path, bool recursive) {
+	struct watch_dir_inodes inodes = { 0 };
+	double start = watch_dir_now();
+	size_t entries;
+
+	if (scan_watch_dir(path, recursive, &inodes)) {
+		watch_dir_inodes_free(&inodes);
+		return -1;
+	}
+
+	entries = 2 * inodes.nr;
+	if (entries < WATCH_DIR_MIN_ENTRIES)
+		entries = WATCH_DIR_MIN_ENTRIES;
+	if (entries > UINT32_MAX)
+		entries = UINT32_MAX;
+
+	if (bpf_map__set_max_entries(map, entries)) {
+		perror("Failed to resize inode_watchlist");
+		watch_dir_inodes_free(&inodes);
+		return -1;
+	}
+
+	watch_dir_inodes_free(&watch_dir_scan_cache.inodes);
+	snprintf(watch_dir_scan_cache.path, sizeof(watch_dir_scan_cache.path), "%s", path);
+	watch_dir_scan_cache.recursive = recursive;
+	watch_dir_scan_cache.scan_secs = watch_dir_now() - start;
+	watch_dir_scan_cache.inodes = inodes;
+	watch_dir_scan_cache.valid = true;
 
 	return 0;
 }
 
+int initialize_watch_dir_map(const char *path, int watch_dir_map_fd, bool recursive) {
+	struct watch_dir_inodes inodes = { 0 };
+	double start = watch_dir_now();
+	double scan_secs;
+	int ret;
+
+	if (watch_dir_scan_cache.valid && watch_dir_scan_cache.recursive == recursive &&
+	    strcmp(watch_dir_scan_cache.path, path) == 0) {
+		inodes = watch_dir_scan_cache.inodes;
+		scan_secs = watch_dir_scan_cache.scan_secs;
+		memset(&watch_dir_scan_cache, 0, sizeof(watch_dir_scan_cache));
+	} else {
+		ret = scan_watch_dir(path, recursive, &inodes);
+		if (ret) {
+			watch_dir_inodes_free(&inodes);
+			return ret;
+		}
+		scan_secs = watch_dir_now() - start;
+		start = watch_dir_now();
+	}
+
+	ret = populate_watch_dir_map(watch_dir_map_fd, &inodes);
+	if (!ret)
+		fprintf(stderr, "Watch dir: %zu inodes in %.2fs (scan %.2fs, map update %.2fs)\n",
+			inodes.nr, scan_secs + watch_dir_now() - start, scan_secs,
+			watch_dir_now() - start);
+
+	watch_dir_inodes_free(&inodes);
+
+	return ret;
+}
+
 #endif /* _DIR_WATCHER_H */
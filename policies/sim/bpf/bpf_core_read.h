@@ -0,0 +1 @@
+/* Empty, cache_ext_sim.h provides the definitions. See cache_ext_sim.c. */